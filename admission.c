@@ -0,0 +1,254 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "admission.h"
+#include "sockets.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t isqrt(uint64_t value) {
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+/*!
+ * @brief when the shed after one made at t is due
+ */
+static uint64_t control_law(admission_t *admission, uint64_t t) {
+    return t + admission->interval / isqrt(admission->count);
+}
+
+/*!
+ * @brief tracks whether the delay has stayed above the target for an interval
+ */
+static bool above_target(admission_t *admission, uint64_t delay, uint64_t now) {
+    if (delay < admission->target) {
+        admission->first_above = 0;
+        return false;
+    }
+    if (admission->first_above == 0) {
+        admission->first_above = now + admission->interval;
+        return false;
+    }
+    return now >= admission->first_above;
+}
+
+/*!
+ * @brief decides whether the connection served now is shed
+ */
+static bool should_shed(admission_t *admission, uint64_t delay, uint64_t now) {
+    bool above = above_target(admission, delay, now);
+    if (admission->dropping) {
+        if (above == false) {
+            admission->dropping = false;
+            return false;
+        }
+        if (now < admission->drop_next) {
+            return false;
+        }
+        admission->count += 1;
+        admission->drop_next = control_law(admission, admission->drop_next);
+        return true;
+    }
+    if (above == false) {
+        return false;
+    }
+    admission->dropping = true;
+    // overload that comes straight back resumes close to the rate it stopped at
+    uint32_t delta = admission->count - admission->last_count;
+    admission->count = 1;
+    // drop_next may still be in the future, which counts as recent too
+    if (delta > 1 && (int64_t)(now - admission->drop_next) <
+                         (int64_t)(16 * admission->interval)) {
+        admission->count = delta;
+    }
+    admission->last_count = admission->count;
+    admission->drop_next = control_law(admission, now);
+    return true;
+}
+
+static void admission_resume(reactor_t *reactor, reactor_timer_t *timer, void *arg) {
+    (void)timer;
+    admission_t *admission = arg;
+    admission->paused = false;
+    want_read_reactor_t(reactor, admission->fd, true);
+}
+
+/*!
+ * @brief stops accepting until the next shed is due
+ */
+static void pause_accept(admission_t *admission) {
+    reactor_t *reactor = admission->reactor;
+    uint64_t now = now_reactor_t(reactor);
+    uint64_t wait = admission->drop_next > now ? admission->drop_next - now : 0;
+    uint64_t wait_ms = (wait + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+    admission->paused = true;
+    // whatever waits in the backlog meanwhile is timed from the resume
+    admission->ready_since = 0;
+    admission->stats.pauses += 1;
+    want_read_reactor_t(reactor, admission->fd, false);
+    start_timer_reactor_t(reactor, &admission->resume_timer,
+                          wait_ms > 0 ? wait_ms : 1, 0, admission_resume, admission);
+}
+
+static int admission_readable(reactor_t *reactor, int fd, void *arg) {
+    admission_t *admission = arg;
+    uint64_t since = admission->ready_since != 0 ? admission->ready_since
+                                                 : polled_reactor_t(reactor);
+    for (int i = 0; i < ADMISSION_ACCEPT_BATCH; i++) {
+        uint64_t now = monotonic_ns();
+        uint64_t delay = now > since ? now - since : 0;
+        int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGF_ERROR(admission->thl, 0, "failed to accept connection %s",
+                           strerror(errno));
+                return 0;
+            }
+            // the backlog is empty
+            admission->ready_since = 0;
+            return 0;
+        }
+        // only connections that were really waiting are measured, an empty
+        // backlog says nothing about the delay
+        if (admission->observed > delay) {
+            delay = admission->observed;
+        }
+        admission->observed = 0;
+        if (delay > admission->stats.max_delay) {
+            admission->stats.max_delay = delay;
+        }
+        bool shed = should_shed(admission, delay, now);
+        if (shed && admission->mode == ADMISSION_SHED_CLOSE) {
+            admission->stats.shed += 1;
+            close(client);
+            continue;
+        }
+        admission->stats.accepted += 1;
+        admission->on_accept(admission, client, admission->arg);
+        if (shed) {
+            pause_accept(admission);
+            return 0;
+        }
+    }
+    // whatever is still queued was ready by this poll at the latest
+    admission->ready_since = polled_reactor_t(reactor);
+    return 0;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new admission_t object
+ * @details registers fd with the reactor and accepts on it from then on
+ * @param fd a listening socket, made non-blocking here
+ * @param target_ms 0 for ADMISSION_TARGET_MS
+ * @param interval_ms 0 for ADMISSION_INTERVAL_MS
+ * @return Success: pointer to instance of admission_t
+ * @return Failure: NULL ptr
+ */
+admission_t *new_admission_t(reactor_t *reactor, int fd, ADMISSION_SHED mode,
+                             uint64_t target_ms, uint64_t interval_ms,
+                             admission_accept_fn on_accept, void *arg) {
+    if (on_accept == NULL) {
+        LOG_ERROR(reactor->thl, 0, "admission_t needs an accept callback");
+        return NULL;
+    }
+    admission_t *admission = calloc(1, sizeof(admission_t));
+    if (admission == NULL) {
+        LOG_ERROR(reactor->thl, 0, "failed to calloc admission_t");
+        return NULL;
+    }
+    admission->reactor = reactor;
+    admission->fd = fd;
+    admission->mode = mode;
+    admission->target =
+        (target_ms != 0 ? target_ms : ADMISSION_TARGET_MS) * NSEC_PER_MSEC;
+    admission->interval =
+        (interval_ms != 0 ? interval_ms : ADMISSION_INTERVAL_MS) * NSEC_PER_MSEC;
+    admission->on_accept = on_accept;
+    admission->arg = arg;
+    admission->thl = reactor->thl;
+    init_timer_reactor_t(&admission->resume_timer);
+    if (set_socket_blocking_status(fd, false) == false) {
+        LOGF_ERROR(reactor->thl, 0, "failed to make listener non-blocking %s",
+                   strerror(errno));
+        goto ERROR;
+    }
+    if (add_fd_reactor_t(reactor, fd, admission_readable, NULL, NULL,
+                         admission) == -1) {
+        goto ERROR;
+    }
+    return admission;
+
+ERROR:
+    free(admission);
+    return NULL;
+}
+
+/*!
+ * @brief feeds in a delay measured outside the accept path
+ * @details the worst delay fed in since the last accept counts as that
+ * accept's delay if it is longer than the one measured at the listener
+ */
+void observe_admission_t(admission_t *admission, uint64_t delay_ns) {
+    if (delay_ns > admission->observed) {
+        admission->observed = delay_ns;
+    }
+}
+
+/*!
+ * @brief whether the controller is currently shedding connections
+ */
+bool shedding_admission_t(admission_t *admission) {
+    return admission->dropping;
+}
+
+/*!
+ * @brief unregisters the listener and frees up all resources allocated for the
+ * admission_t struct
+ * @note the listening socket is not closed
+ */
+void free_admission_t(admission_t *admission) {
+    stop_timer_reactor_t(admission->reactor, &admission->resume_timer);
+    remove_fd_reactor_t(admission->reactor, admission->fd);
+    free(admission);
+}
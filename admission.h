@@ -0,0 +1,136 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file admission.h
+ * @brief CoDel style admission control for a listening socket on a reactor_t
+ * @details an admission_t accepts connections on a listener registered with a
+ * reactor and measures how long each one waited between the listener being
+ * found ready and it being accepted, a lower bound on its time in the backlog.
+ * as long as that delay stays under the target everything is admitted. once it
+ * has stayed above the target for a whole interval the controller starts
+ * shedding, like CoDel drops packets: one connection at first, then more often,
+ * the gap between sheds shrinking with the square root of how many were shed,
+ * until a connection is served under the target again. shedding either accepts
+ * and closes the connection straight away, so the client fails fast instead of
+ * timing out, or stops accepting until the next shed is due and leaves the
+ * kernel backlog to push back. delays measured elsewhere, like how long
+ * admitted requests queue for a worker, can be fed in too so the listener backs
+ * off before the loop itself is late
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include "reactor.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*! @brief default delay connections may wait, 5ms like CoDel */
+#ifndef ADMISSION_TARGET_MS
+#define ADMISSION_TARGET_MS 5
+#endif
+
+/*! @brief default time the delay must stay above the target before shedding */
+#ifndef ADMISSION_INTERVAL_MS
+#define ADMISSION_INTERVAL_MS 100
+#endif
+
+/*! @brief most connections accepted per reactor turn */
+#ifndef ADMISSION_ACCEPT_BATCH
+#define ADMISSION_ACCEPT_BATCH 64
+#endif
+
+/*!
+ * @brief how connections are shed
+ */
+typedef enum {
+    ADMISSION_SHED_CLOSE = 0, /*! @brief accept and close the connection */
+    ADMISSION_SHED_PAUSE,     /*! @brief admit the connection, then stop accepting
+                                 until the next shed is due */
+} ADMISSION_SHED;
+
+struct admission;
+
+/*! @typedef admission_accept_fn
+ * @brief called with every admitted connection, the callee owns fd
+ */
+typedef void (*admission_accept_fn)(struct admission *admission, int fd, void *arg);
+
+/*!
+ * @brief counters kept by an admission_t
+ */
+typedef struct admission_stats {
+    uint64_t accepted; /*! @brief connections handed to on_accept */
+    uint64_t shed;     /*! @brief connections accepted and closed */
+    uint64_t pauses;   /*! @brief times accepting was paused */
+    uint64_t max_delay; /*! @brief longest delay of an accepted connection, in
+                           nanoseconds */
+} admission_stats_t;
+
+/*! @typedef admission
+ * @struct admission
+ * @brief a listening socket with admission control
+ */
+typedef struct admission {
+    reactor_t *reactor;
+    int fd;
+    ADMISSION_SHED mode;
+    uint64_t target;   /*! @brief nanoseconds */
+    uint64_t interval; /*! @brief nanoseconds */
+    uint64_t ready_since; /*! @brief when connections left in the backlog were
+                             ready */
+    uint64_t observed; /*! @brief worst delay fed in since the last accept */
+    uint64_t first_above; /*! @brief when shedding may start, 0 while under target */
+    uint64_t drop_next;   /*! @brief when the next connection is shed */
+    uint32_t count;       /*! @brief connections shed since shedding started */
+    uint32_t last_count;  /*! @brief count when shedding last started */
+    bool dropping;
+    bool paused;
+    reactor_timer_t resume_timer;
+    admission_accept_fn on_accept;
+    void *arg;
+    admission_stats_t stats;
+    thread_logger *thl;
+} admission_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new admission_t object
+ * @details registers fd with the reactor and accepts on it from then on
+ * @param fd a listening socket, made non-blocking here
+ * @param target_ms 0 for ADMISSION_TARGET_MS
+ * @param interval_ms 0 for ADMISSION_INTERVAL_MS
+ * @return Success: pointer to instance of admission_t
+ * @return Failure: NULL ptr
+ */
+admission_t *new_admission_t(reactor_t *reactor, int fd, ADMISSION_SHED mode,
+                             uint64_t target_ms, uint64_t interval_ms,
+                             admission_accept_fn on_accept, void *arg);
+
+/*!
+ * @brief feeds in a delay measured outside the accept path
+ * @details the worst delay fed in since the last accept counts as that
+ * accept's delay if it is longer than the one measured at the listener
+ */
+void observe_admission_t(admission_t *admission, uint64_t delay_ns);
+
+/*!
+ * @brief whether the controller is currently shedding connections
+ */
+bool shedding_admission_t(admission_t *admission);
+
+/*!
+ * @brief unregisters the listener and frees up all resources allocated for the
+ * admission_t struct
+ * @note the listening socket is not closed
+ */
+void free_admission_t(admission_t *admission);
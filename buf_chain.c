@@ -0,0 +1,420 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "buf_chain.h"
+#include "buffer_pool.h"
+#include "iov_queue.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*! @brief smallest block append_bytes_buf_chain_t allocates */
+#define BUF_CHAIN_MIN_BLOCK 4096
+
+/*!
+ * @brief allocates size bytes from the pool, or malloc without one
+ * @param free_fn set to the matching release function
+ */
+static void *chain_alloc(buffer_pool_t *pool, size_t size, iov_release_fn *free_fn) {
+    if (pool != NULL) {
+        *free_fn = put_buffer_pool_t;
+        return get_buffer_pool_t(pool, size);
+    }
+    *free_fn = free;
+    return malloc(size);
+}
+
+static buf_slice_t *new_slice(buf_chain_t *chain, buf_block_t *block, size_t offset,
+                              size_t len) {
+    iov_release_fn free_fn;
+    buf_slice_t *slice = chain_alloc(chain->pool, sizeof(buf_slice_t), &free_fn);
+    if (slice == NULL) {
+        return NULL;
+    }
+    ref_buf_block_t(block);
+    slice->block = block;
+    slice->data = block->data + offset;
+    slice->len = len;
+    slice->next = NULL;
+    return slice;
+}
+
+/*!
+ * @brief frees a slice node, the block reference is handled by the caller
+ */
+static void free_slice(buf_chain_t *chain, buf_slice_t *slice) {
+    if (chain->pool != NULL) {
+        put_buffer_pool_t(slice);
+    } else {
+        free(slice);
+    }
+}
+
+/*!
+ * @brief allocates a block with size bytes of storage and one reference
+ * @param pool optional, the block and its storage come from the pool
+ * @return Success: pointer to instance of buf_block_t
+ * @return Failure: NULL ptr
+ */
+buf_block_t *new_buf_block_t(buffer_pool_t *pool, size_t size) {
+    iov_release_fn free_fn;
+    // the storage follows the block header in the same allocation
+    buf_block_t *block = chain_alloc(pool, sizeof(buf_block_t) + size, &free_fn);
+    if (block == NULL) {
+        return NULL;
+    }
+    atomic_init(&block->refs, 1);
+    block->capacity = size;
+    block->used = 0;
+    block->data = (char *)(block + 1);
+    block->release = NULL;
+    block->release_arg = NULL;
+    block->free_block = free_fn;
+    return block;
+}
+
+/*!
+ * @brief wraps memory owned elsewhere in a block with one reference
+ * @param release optional, called with release_arg once the last reference is
+ * dropped
+ * @return Success: pointer to instance of buf_block_t
+ * @return Failure: NULL ptr
+ */
+buf_block_t *wrap_buf_block_t(buffer_pool_t *pool, void *data, size_t len,
+                              iov_release_fn release, void *release_arg) {
+    iov_release_fn free_fn;
+    buf_block_t *block = chain_alloc(pool, sizeof(buf_block_t), &free_fn);
+    if (block == NULL) {
+        return NULL;
+    }
+    atomic_init(&block->refs, 1);
+    block->capacity = len;
+    // wrapped memory is never appended to
+    block->used = len;
+    block->data = data;
+    block->release = release;
+    block->release_arg = release_arg;
+    block->free_block = free_fn;
+    return block;
+}
+
+/*!
+ * @brief adds a reference to a block
+ */
+void ref_buf_block_t(buf_block_t *block) {
+    atomic_fetch_add_explicit(&block->refs, 1, memory_order_relaxed);
+}
+
+/*!
+ * @brief drops a reference to a block, releasing it with the last one
+ * @details takes a void pointer so it can be used as an iov_release_fn
+ */
+void unref_buf_block_t(void *data) {
+    buf_block_t *block = data;
+    if (atomic_fetch_sub_explicit(&block->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (block->release != NULL) {
+        block->release(block->release_arg);
+    }
+    block->free_block(block);
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new buf_chain_t object
+ * @param pool optional, used for slices and for blocks the chain allocates
+ * @return Success: pointer to instance of buf_chain_t
+ * @return Failure: NULL ptr
+ */
+buf_chain_t *new_buf_chain_t(buffer_pool_t *pool) {
+    buf_chain_t *chain = calloc(1, sizeof(buf_chain_t));
+    if (chain == NULL) {
+        return NULL;
+    }
+    chain->pool = pool;
+    return chain;
+}
+
+/*!
+ * @brief appends len bytes of block starting at offset, adding a reference
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int append_buf_chain_t(buf_chain_t *chain, buf_block_t *block, size_t offset,
+                       size_t len) {
+    if (offset + len > block->capacity) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    buf_slice_t *slice = new_slice(chain, block, offset, len);
+    if (slice == NULL) {
+        return -1;
+    }
+    if (chain->tail != NULL) {
+        chain->tail->next = slice;
+    } else {
+        chain->head = slice;
+    }
+    chain->tail = slice;
+    chain->length += len;
+    chain->num_slices += 1;
+    return 0;
+}
+
+/*!
+ * @brief prepends len bytes of block starting at offset, adding a reference
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int prepend_buf_chain_t(buf_chain_t *chain, buf_block_t *block, size_t offset,
+                        size_t len) {
+    if (offset + len > block->capacity) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    buf_slice_t *slice = new_slice(chain, block, offset, len);
+    if (slice == NULL) {
+        return -1;
+    }
+    slice->next = chain->head;
+    chain->head = slice;
+    if (chain->tail == NULL) {
+        chain->tail = slice;
+    }
+    chain->length += len;
+    chain->num_slices += 1;
+    return 0;
+}
+
+/*!
+ * @brief copies bytes onto the end of the chain
+ * @details fills the free space of the last block when the chain is its only
+ * user, otherwise allocates a new block
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int append_bytes_buf_chain_t(buf_chain_t *chain, const void *data, size_t len) {
+    const char *bytes = data;
+    buf_slice_t *tail = chain->tail;
+    // the tail block can only grow in place if the slice ends where the block's
+    // written bytes end and nobody else can see the block
+    if (tail != NULL && tail->block->release == NULL &&
+        atomic_load_explicit(&tail->block->refs, memory_order_acquire) == 1 &&
+        tail->data + tail->len == tail->block->data + tail->block->used) {
+        size_t room = tail->block->capacity - tail->block->used;
+        size_t take = room < len ? room : len;
+        memcpy(tail->data + tail->len, bytes, take);
+        tail->block->used += take;
+        tail->len += take;
+        chain->length += take;
+        bytes += take;
+        len -= take;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    size_t size = len > BUF_CHAIN_MIN_BLOCK ? len : BUF_CHAIN_MIN_BLOCK;
+    buf_block_t *block = new_buf_block_t(chain->pool, size);
+    if (block == NULL) {
+        return -1;
+    }
+    memcpy(block->data, bytes, len);
+    block->used = len;
+    int rc = append_buf_chain_t(chain, block, 0, len);
+    // the chain holds the only reference now
+    unref_buf_block_t(block);
+    return rc;
+}
+
+/*!
+ * @brief copies a header in front of the chain, the payload is not touched
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int prepend_bytes_buf_chain_t(buf_chain_t *chain, const void *data, size_t len) {
+    buf_block_t *block = new_buf_block_t(chain->pool, len);
+    if (block == NULL) {
+        return -1;
+    }
+    memcpy(block->data, data, len);
+    block->used = len;
+    int rc = prepend_buf_chain_t(chain, block, 0, len);
+    unref_buf_block_t(block);
+    return rc;
+}
+
+/*!
+ * @brief a new chain viewing len bytes of chain starting at offset
+ * @details shares every block with chain, nothing is copied
+ * @return Success: pointer to instance of buf_chain_t
+ * @return Failure: NULL ptr
+ */
+buf_chain_t *slice_buf_chain_t(buf_chain_t *chain, size_t offset, size_t len) {
+    if (offset + len > chain->length) {
+        errno = EINVAL;
+        return NULL;
+    }
+    buf_chain_t *slice = new_buf_chain_t(chain->pool);
+    if (slice == NULL) {
+        return NULL;
+    }
+    for (buf_slice_t *s = chain->head; s != NULL && len > 0; s = s->next) {
+        if (offset >= s->len) {
+            offset -= s->len;
+            continue;
+        }
+        size_t take = s->len - offset;
+        if (take > len) {
+            take = len;
+        }
+        size_t block_offset = (size_t)(s->data - s->block->data) + offset;
+        if (append_buf_chain_t(slice, s->block, block_offset, take) == -1) {
+            free_buf_chain_t(slice);
+            return NULL;
+        }
+        offset = 0;
+        len -= take;
+    }
+    return slice;
+}
+
+/*!
+ * @brief drops len bytes from the front of the chain
+ */
+void consume_buf_chain_t(buf_chain_t *chain, size_t len) {
+    while (len > 0 && chain->head != NULL) {
+        buf_slice_t *head = chain->head;
+        if (len < head->len) {
+            head->data += len;
+            head->len -= len;
+            chain->length -= len;
+            return;
+        }
+        len -= head->len;
+        chain->length -= head->len;
+        chain->head = head->next;
+        chain->num_slices -= 1;
+        unref_buf_block_t(head->block);
+        free_slice(chain, head);
+    }
+    if (chain->head == NULL) {
+        chain->tail = NULL;
+    }
+}
+
+/*!
+ * @brief copies up to max_iovs iovecs describing the chain into iovs
+ * @return number of iovecs written into iovs
+ */
+int fill_iov_buf_chain_t(buf_chain_t *chain, struct iovec *iovs, int max_iovs) {
+    int count = 0;
+    for (buf_slice_t *s = chain->head; s != NULL && count < max_iovs; s = s->next) {
+        iovs[count].iov_base = s->data;
+        iovs[count].iov_len = s->len;
+        count += 1;
+    }
+    return count;
+}
+
+/*!
+ * @brief writes as much of the chain as fd accepts and consumes it
+ * @details sockets are written with sendmsg and MSG_NOSIGNAL so a peer that went
+ * away is an EPIPE rather than a SIGPIPE, anything else falls back to writev
+ * @return Success: bytes written, 0 if fd would block
+ * @return Failure: -1 with errno set, whatever was written before the error is
+ * already consumed from the chain
+ */
+ssize_t write_buf_chain_t(buf_chain_t *chain, int fd) {
+    ssize_t total = 0;
+    bool is_socket = true;
+    while (chain->length > 0) {
+        struct iovec iovs[IOV_QUEUE_BATCH];
+        int num_iovs = fill_iov_buf_chain_t(chain, iovs, IOV_QUEUE_BATCH);
+        size_t offered = 0;
+        for (int i = 0; i < num_iovs; i++) {
+            offered += iovs[i].iov_len;
+        }
+        ssize_t rc;
+        if (is_socket) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iovs;
+            msg.msg_iovlen = (size_t)num_iovs;
+            rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (rc == -1 && errno == ENOTSOCK) {
+                is_socket = false;
+                continue;
+            }
+        } else {
+            rc = writev(fd, iovs, num_iovs);
+        }
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        consume_buf_chain_t(chain, (size_t)rc);
+        total += rc;
+        if ((size_t)rc < offered) {
+            break;
+        }
+    }
+    return total;
+}
+
+/*!
+ * @brief moves every slice of the chain onto an iov_queue_t, leaving it empty
+ * @details each segment holds a block reference that the queue drops once the
+ * segment has been written. queue a slice_buf_chain_t copy per connection to
+ * fan one payload out
+ * @return Success: 0
+ * @return Failure: -1, slices that were not queued stay in the chain
+ */
+int queue_buf_chain_t(buf_chain_t *chain, iov_queue_t *queue) {
+    while (chain->head != NULL) {
+        buf_slice_t *head = chain->head;
+        if (push_iov_queue_t(queue, head->data, head->len, unref_buf_block_t,
+                             head->block) == -1) {
+            return -1;
+        }
+        // the block reference now belongs to the queued segment
+        chain->head = head->next;
+        chain->length -= head->len;
+        chain->num_slices -= 1;
+        free_slice(chain, head);
+    }
+    chain->tail = NULL;
+    return 0;
+}
+
+/*!
+ * @brief drops every slice and frees the buf_chain_t
+ */
+void free_buf_chain_t(buf_chain_t *chain) {
+    consume_buf_chain_t(chain, chain->length);
+    free(chain);
+}
@@ -0,0 +1,181 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file buf_chain.h
+ * @brief refcounted buffer chains for zero copy fan-out and forwarding
+ * @details a buf_block_t owns a piece of memory and counts the references to
+ * it. a buf_chain_t is a list of slices, each pointing into a block. slicing,
+ * cloning and prepending headers only add references, so one payload can be
+ * queued on any number of connections without being copied. the block is
+ * released once the last slice, or the last iov_queue_t segment, that points at
+ * it is gone
+ */
+
+#pragma once
+
+#include "buffer_pool.h"
+#include "iov_queue.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*! @typedef buf_block
+ * @struct buf_block
+ * @brief refcounted storage shared by any number of slices
+ */
+typedef struct buf_block {
+    _Atomic uint32_t refs;
+    size_t capacity;
+    size_t used;             /*! @brief bytes written through
+                                append_bytes_buf_chain_t */
+    char *data;
+    iov_release_fn release;  /*! @brief releases wrapped data, NULL for owned data */
+    void *release_arg;
+    iov_release_fn free_block; /*! @brief frees the block itself */
+} buf_block_t;
+
+/*!
+ * @brief a view of part of a block
+ */
+typedef struct buf_slice {
+    buf_block_t *block;
+    char *data;
+    size_t len;
+    struct buf_slice *next;
+} buf_slice_t;
+
+/*! @typedef buf_chain
+ * @struct buf_chain
+ * @brief an ordered list of slices, read as one byte stream
+ */
+typedef struct buf_chain {
+    buffer_pool_t *pool; /*! @brief optional, backs blocks and slices */
+    buf_slice_t *head;
+    buf_slice_t *tail;
+    size_t length;       /*! @brief total bytes across all slices */
+    size_t num_slices;
+} buf_chain_t;
+
+/*!
+ * @brief allocates a block with size bytes of storage and one reference
+ * @param pool optional, the block and its storage come from the pool
+ * @return Success: pointer to instance of buf_block_t
+ * @return Failure: NULL ptr
+ */
+buf_block_t *new_buf_block_t(buffer_pool_t *pool, size_t size);
+
+/*!
+ * @brief wraps memory owned elsewhere in a block with one reference
+ * @param release optional, called with release_arg once the last reference is
+ * dropped
+ * @return Success: pointer to instance of buf_block_t
+ * @return Failure: NULL ptr
+ */
+buf_block_t *wrap_buf_block_t(buffer_pool_t *pool, void *data, size_t len,
+                              iov_release_fn release, void *release_arg);
+
+/*!
+ * @brief adds a reference to a block
+ */
+void ref_buf_block_t(buf_block_t *block);
+
+/*!
+ * @brief drops a reference to a block, releasing it with the last one
+ * @details takes a void pointer so it can be used as an iov_release_fn
+ */
+void unref_buf_block_t(void *block);
+
+/*!
+ * @brief allocates memory for, and initializes a new buf_chain_t object
+ * @param pool optional, used for slices and for blocks the chain allocates
+ * @return Success: pointer to instance of buf_chain_t
+ * @return Failure: NULL ptr
+ */
+buf_chain_t *new_buf_chain_t(buffer_pool_t *pool);
+
+/*!
+ * @brief appends len bytes of block starting at offset, adding a reference
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int append_buf_chain_t(buf_chain_t *chain, buf_block_t *block, size_t offset,
+                       size_t len);
+
+/*!
+ * @brief prepends len bytes of block starting at offset, adding a reference
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int prepend_buf_chain_t(buf_chain_t *chain, buf_block_t *block, size_t offset,
+                        size_t len);
+
+/*!
+ * @brief copies bytes onto the end of the chain
+ * @details fills the free space of the last block when the chain is its only
+ * user, otherwise allocates a new block
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int append_bytes_buf_chain_t(buf_chain_t *chain, const void *data, size_t len);
+
+/*!
+ * @brief copies a header in front of the chain, the payload is not touched
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int prepend_bytes_buf_chain_t(buf_chain_t *chain, const void *data, size_t len);
+
+/*!
+ * @brief a new chain viewing len bytes of chain starting at offset
+ * @details shares every block with chain, nothing is copied
+ * @return Success: pointer to instance of buf_chain_t
+ * @return Failure: NULL ptr
+ */
+buf_chain_t *slice_buf_chain_t(buf_chain_t *chain, size_t offset, size_t len);
+
+/*!
+ * @brief drops len bytes from the front of the chain
+ */
+void consume_buf_chain_t(buf_chain_t *chain, size_t len);
+
+/*!
+ * @brief copies up to max_iovs iovecs describing the chain into iovs
+ * @return number of iovecs written into iovs
+ */
+int fill_iov_buf_chain_t(buf_chain_t *chain, struct iovec *iovs, int max_iovs);
+
+/*!
+ * @brief writes as much of the chain as fd accepts and consumes it
+ * @details sockets are written with sendmsg and MSG_NOSIGNAL so a peer that went
+ * away is an EPIPE rather than a SIGPIPE, anything else falls back to writev
+ * @return Success: bytes written, 0 if fd would block
+ * @return Failure: -1 with errno set, whatever was written before the error is
+ * already consumed from the chain
+ */
+ssize_t write_buf_chain_t(buf_chain_t *chain, int fd);
+
+/*!
+ * @brief moves every slice of the chain onto an iov_queue_t, leaving it empty
+ * @details each segment holds a block reference that the queue drops once the
+ * segment has been written. queue a slice_buf_chain_t copy per connection to
+ * fan one payload out
+ * @return Success: 0
+ * @return Failure: -1, slices that were not queued stay in the chain
+ */
+int queue_buf_chain_t(buf_chain_t *chain, iov_queue_t *queue);
+
+/*!
+ * @brief drops every slice and frees the buf_chain_t
+ */
+void free_buf_chain_t(buf_chain_t *chain);
@@ -0,0 +1,374 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "buffer_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*! @brief size class of buffers that were malloc'd because they are too large */
+#define BUFFER_CLASS_LARGE UINT32_MAX
+
+/*! @brief "bufp" in ascii, catches buffers that did not come from a pool */
+#define BUFFER_MAGIC 0x62756670
+
+/*!
+ * @brief sits right in front of every buffer, keeps buffers 16 byte aligned
+ */
+typedef struct buffer_header {
+    union {
+        buffer_pool_t *pool; /*! @brief owner of a slab buffer */
+        size_t large_size;   /*! @brief size of a malloc'd buffer */
+    };
+    uint32_t size_class;
+    uint32_t magic;
+} buffer_header_t;
+
+/*!
+ * @brief one thread's cache of free buffers for a single size class
+ */
+typedef struct buffer_magazine {
+    size_t count;
+    void *buffers[BUFFER_POOL_MAGAZINE_SIZE];
+} buffer_magazine_t;
+
+/*!
+ * @brief every magazine one thread holds for a pool
+ * @details the counters are only written by the owning thread, they are atomic
+ * so stats_buffer_pool_t can read them from another thread
+ */
+typedef struct buffer_magazine_set {
+    buffer_pool_t *pool;
+    struct buffer_magazine_set *next;
+    _Atomic uint64_t gets;
+    _Atomic uint64_t puts;
+    buffer_magazine_t magazines[BUFFER_POOL_CLASSES];
+} buffer_magazine_set_t;
+
+static inline buffer_header_t *header_of(void *buffer) {
+    return (buffer_header_t *)((char *)buffer - sizeof(buffer_header_t));
+}
+
+static inline size_t class_size(size_t size_class) {
+    return (size_t)1 << (BUFFER_POOL_MIN_SHIFT + size_class);
+}
+
+static inline size_t class_of(size_t size) {
+    size_t size_class = 0;
+    while (class_size(size_class) < size) {
+        size_class += 1;
+    }
+    return size_class;
+}
+
+/*! @brief bumps a counter only ever written by the calling thread */
+static inline void count_local(_Atomic uint64_t *counter) {
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+/*!
+ * @brief maps a new slab for a size class
+ * @note pool->mutex must be held
+ */
+static bool map_slab(buffer_pool_t *pool, buffer_class_t *cls) {
+    if (pool->num_slabs == pool->slab_capacity) {
+        size_t capacity = pool->slab_capacity == 0 ? 16 : pool->slab_capacity * 2;
+        void **slabs = realloc(pool->slabs, capacity * sizeof(void *));
+        if (slabs == NULL) {
+            return false;
+        }
+        pool->slabs = slabs;
+        pool->slab_capacity = capacity;
+    }
+
+    void *slab = MAP_FAILED;
+    if (pool->hugepages) {
+        slab = mmap(NULL, BUFFER_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED) {
+            pool->hugepage_slabs += 1;
+        }
+    }
+    if (slab == MAP_FAILED) {
+        slab = mmap(NULL, BUFFER_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            return false;
+        }
+        if (pool->hugepages) {
+            // no reserved huge pages, let the kernel promote the slab if it can
+            madvise(slab, BUFFER_POOL_SLAB_SIZE, MADV_HUGEPAGE);
+        }
+    }
+
+    pool->slabs[pool->num_slabs++] = slab;
+    cls->slab_cursor = slab;
+    cls->slab_end = (char *)slab + BUFFER_POOL_SLAB_SIZE;
+    return true;
+}
+
+/*!
+ * @brief moves up to want buffers from the central list (or fresh slabs) into a
+ * magazine
+ * @return number of buffers moved
+ */
+static size_t refill_magazine(buffer_pool_t *pool, size_t size_class,
+                              buffer_magazine_t *mag, size_t want) {
+    buffer_class_t *cls = &pool->classes[size_class];
+    size_t stride = sizeof(buffer_header_t) + class_size(size_class);
+    size_t moved = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->refills += 1;
+    while (moved < want && cls->free_list != NULL) {
+        void *buffer = cls->free_list;
+        cls->free_list = *(void **)buffer;
+        cls->free_count -= 1;
+        mag->buffers[mag->count++] = buffer;
+        moved += 1;
+    }
+    while (moved < want) {
+        if ((size_t)(cls->slab_end - cls->slab_cursor) < stride &&
+            map_slab(pool, cls) == false) {
+            break;
+        }
+        buffer_header_t *header = (buffer_header_t *)cls->slab_cursor;
+        cls->slab_cursor += stride;
+        header->pool = pool;
+        header->size_class = (uint32_t)size_class;
+        header->magic = BUFFER_MAGIC;
+        cls->carved += 1;
+        mag->buffers[mag->count++] = (char *)header + sizeof(buffer_header_t);
+        moved += 1;
+    }
+    cls->in_use += moved;
+    pthread_mutex_unlock(&pool->mutex);
+    return moved;
+}
+
+/*!
+ * @brief moves the oldest count buffers of a magazine to the central list
+ */
+static void spill_magazine(buffer_pool_t *pool, size_t size_class,
+                           buffer_magazine_t *mag, size_t count) {
+    buffer_class_t *cls = &pool->classes[size_class];
+    pthread_mutex_lock(&pool->mutex);
+    pool->spills += 1;
+    for (size_t i = 0; i < count; i++) {
+        void *buffer = mag->buffers[i];
+        *(void **)buffer = cls->free_list;
+        cls->free_list = buffer;
+    }
+    cls->free_count += count;
+    cls->in_use -= count;
+    pthread_mutex_unlock(&pool->mutex);
+    memmove(mag->buffers, mag->buffers + count,
+            (mag->count - count) * sizeof(void *));
+    mag->count -= count;
+}
+
+/*!
+ * @brief runs when a thread exits, hands its cached buffers back to the pool
+ */
+static void release_magazine_set(void *data) {
+    buffer_magazine_set_t *set = data;
+    buffer_pool_t *pool = set->pool;
+    for (size_t i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        if (set->magazines[i].count > 0) {
+            spill_magazine(pool, i, &set->magazines[i], set->magazines[i].count);
+        }
+    }
+    pthread_mutex_lock(&pool->mutex);
+    buffer_magazine_set_t **link = &pool->magazines;
+    while (*link != set) {
+        link = &(*link)->next;
+    }
+    *link = set->next;
+    pool->retired_gets += atomic_load(&set->gets);
+    pool->retired_puts += atomic_load(&set->puts);
+    pthread_mutex_unlock(&pool->mutex);
+    free(set);
+}
+
+/*!
+ * @brief the calling thread's magazines, created on first use
+ */
+static buffer_magazine_set_t *thread_magazines(buffer_pool_t *pool) {
+    buffer_magazine_set_t *set = pthread_getspecific(pool->key);
+    if (set != NULL) {
+        return set;
+    }
+    set = calloc(1, sizeof(buffer_magazine_set_t));
+    if (set == NULL) {
+        return NULL;
+    }
+    set->pool = pool;
+    pthread_mutex_lock(&pool->mutex);
+    set->next = pool->magazines;
+    pool->magazines = set;
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_setspecific(pool->key, set);
+    return set;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new buffer_pool_t object
+ * @param hugepages back slabs with MAP_HUGETLB when huge pages are available,
+ * falling back to transparent huge pages
+ * @return Success: pointer to instance of buffer_pool_t
+ * @return Failure: NULL ptr
+ */
+buffer_pool_t *new_buffer_pool_t(bool hugepages) {
+    buffer_pool_t *pool = calloc(1, sizeof(buffer_pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    if (pthread_key_create(&pool->key, release_magazine_set) != 0) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->hugepages = hugepages;
+    return pool;
+}
+
+/*!
+ * @brief gets a buffer of at least size bytes
+ * @details the contents are not zeroed
+ * @return Success: pointer to the buffer
+ * @return Failure: NULL ptr
+ */
+void *get_buffer_pool_t(buffer_pool_t *pool, size_t size) {
+    if (size > BUFFER_POOL_MAX_SIZE) {
+        atomic_fetch_add_explicit(&pool->large_gets, 1, memory_order_relaxed);
+        buffer_header_t *header = malloc(sizeof(buffer_header_t) + size);
+        if (header == NULL) {
+            return NULL;
+        }
+        header->large_size = size;
+        header->size_class = BUFFER_CLASS_LARGE;
+        header->magic = BUFFER_MAGIC;
+        return (char *)header + sizeof(buffer_header_t);
+    }
+
+    buffer_magazine_set_t *set = thread_magazines(pool);
+    if (set == NULL) {
+        return NULL;
+    }
+    size_t size_class = class_of(size);
+    buffer_magazine_t *mag = &set->magazines[size_class];
+    if (mag->count == 0 &&
+        refill_magazine(pool, size_class, mag, BUFFER_POOL_MAGAZINE_SIZE / 2) == 0) {
+        return NULL;
+    }
+    count_local(&set->gets);
+    return mag->buffers[--mag->count];
+}
+
+/*!
+ * @brief returns a buffer to the pool it came from
+ * @details the buffer remembers its pool, so this can be used directly as an
+ * iov_release_fn with the buffer as its argument. NULL is ignored
+ */
+void put_buffer_pool_t(void *buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+    buffer_header_t *header = header_of(buffer);
+    if (header->magic != BUFFER_MAGIC) {
+        // not ours, leaking it beats corrupting a free list
+        return;
+    }
+    if (header->size_class == BUFFER_CLASS_LARGE) {
+        free(header);
+        return;
+    }
+
+    buffer_pool_t *pool = header->pool;
+    buffer_magazine_set_t *set = thread_magazines(pool);
+    size_t size_class = header->size_class;
+    if (set == NULL) {
+        buffer_magazine_t single = {1, {buffer}};
+        spill_magazine(pool, size_class, &single, 1);
+        return;
+    }
+    buffer_magazine_t *mag = &set->magazines[size_class];
+    if (mag->count == BUFFER_POOL_MAGAZINE_SIZE) {
+        spill_magazine(pool, size_class, mag, BUFFER_POOL_MAGAZINE_SIZE / 2);
+    }
+    mag->buffers[mag->count++] = buffer;
+    count_local(&set->puts);
+}
+
+/*!
+ * @brief the usable size of a buffer, at least what was asked for
+ */
+size_t size_buffer_pool_t(void *buffer) {
+    buffer_header_t *header = header_of(buffer);
+    if (header->size_class == BUFFER_CLASS_LARGE) {
+        return header->large_size;
+    }
+    return class_size(header->size_class);
+}
+
+/*!
+ * @brief takes a snapshot of the pool's counters
+ */
+void stats_buffer_pool_t(buffer_pool_t *pool, buffer_pool_stats_t *stats) {
+    memset(stats, 0, sizeof(buffer_pool_stats_t));
+    pthread_mutex_lock(&pool->mutex);
+    stats->slabs = pool->num_slabs;
+    stats->hugepage_slabs = pool->hugepage_slabs;
+    stats->mapped_bytes = pool->num_slabs * BUFFER_POOL_SLAB_SIZE;
+    stats->gets = pool->retired_gets;
+    stats->puts = pool->retired_puts;
+    stats->refills = pool->refills;
+    stats->spills = pool->spills;
+    for (size_t i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        stats->in_use[i] = pool->classes[i].in_use;
+        stats->carved[i] = pool->classes[i].carved;
+    }
+    for (buffer_magazine_set_t *set = pool->magazines; set != NULL;
+         set = set->next) {
+        stats->threads += 1;
+        stats->gets += atomic_load_explicit(&set->gets, memory_order_relaxed);
+        stats->puts += atomic_load_explicit(&set->puts, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    stats->large_gets =
+        atomic_load_explicit(&pool->large_gets, memory_order_relaxed);
+}
+
+/*!
+ * @brief unmaps every slab and frees all resources of the buffer_pool_t
+ * @warning no thread may use the pool or any of its buffers afterwards
+ */
+void free_buffer_pool_t(buffer_pool_t *pool) {
+    // deleting the key first means exiting threads no longer touch the pool
+    pthread_key_delete(pool->key);
+    buffer_magazine_set_t *set = pool->magazines;
+    while (set != NULL) {
+        buffer_magazine_set_t *next = set->next;
+        free(set);
+        set = next;
+    }
+    for (size_t i = 0; i < pool->num_slabs; i++) {
+        munmap(pool->slabs[i], BUFFER_POOL_SLAB_SIZE);
+    }
+    free(pool->slabs);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
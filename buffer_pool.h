@@ -0,0 +1,142 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file buffer_pool.h
+ * @brief size classed slab allocator for connection I/O buffers
+ * @details buffers are carved out of large mmap'd slabs, one power of two size
+ * class at a time. every thread keeps a small magazine of free buffers per size
+ * class, so getting and putting a buffer normally takes no lock and makes no
+ * syscall. magazines are refilled from, and spill into, a mutex protected central
+ * free list in batches. once traffic reaches a steady state no malloc or free
+ * happens at all
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*! @brief smallest size class, 256 bytes */
+#define BUFFER_POOL_MIN_SHIFT 8
+
+/*! @brief number of size classes, the largest is 64KB */
+#define BUFFER_POOL_CLASSES 9
+
+/*! @brief the largest buffer served from slabs, bigger ones use malloc */
+#define BUFFER_POOL_MAX_SIZE \
+    ((size_t)1 << (BUFFER_POOL_MIN_SHIFT + BUFFER_POOL_CLASSES - 1))
+
+/*! @brief size of each slab, one 2MB huge page */
+#ifndef BUFFER_POOL_SLAB_SIZE
+#define BUFFER_POOL_SLAB_SIZE (2UL * 1024 * 1024)
+#endif
+
+/*! @brief free buffers each thread caches per size class */
+#ifndef BUFFER_POOL_MAGAZINE_SIZE
+#define BUFFER_POOL_MAGAZINE_SIZE 64
+#endif
+
+/*!
+ * @brief a size class, buffers are bump allocated from the current slab once the
+ * free list runs dry
+ */
+typedef struct buffer_class {
+    void *free_list;
+    size_t free_count;
+    char *slab_cursor;
+    char *slab_end;
+    size_t in_use;   /*! @brief buffers handed out to magazines or callers */
+    size_t carved;   /*! @brief buffers ever cut from slabs */
+} buffer_class_t;
+
+/*!
+ * @brief counters describing a buffer pool
+ */
+typedef struct buffer_pool_stats {
+    size_t slabs;          /*! @brief slabs mapped */
+    size_t hugepage_slabs; /*! @brief slabs backed by MAP_HUGETLB */
+    size_t mapped_bytes;
+    size_t threads;        /*! @brief threads with a live magazine */
+    uint64_t gets;
+    uint64_t puts;
+    uint64_t refills;      /*! @brief magazine refills from the central list */
+    uint64_t spills;       /*! @brief magazine spills to the central list */
+    uint64_t large_gets;   /*! @brief requests above BUFFER_POOL_MAX_SIZE */
+    size_t in_use[BUFFER_POOL_CLASSES];
+    size_t carved[BUFFER_POOL_CLASSES];
+} buffer_pool_stats_t;
+
+struct buffer_magazine_set;
+
+/*! @typedef buffer_pool
+ * @struct buffer_pool
+ * @brief a thread safe pool of size classed buffers
+ */
+typedef struct buffer_pool {
+    pthread_mutex_t mutex;
+    pthread_key_t key;
+    bool hugepages;
+    buffer_class_t classes[BUFFER_POOL_CLASSES];
+    void **slabs;
+    size_t num_slabs;
+    size_t slab_capacity;
+    size_t hugepage_slabs;
+    struct buffer_magazine_set *magazines; /*! @brief every thread's magazines */
+    uint64_t retired_gets;                 /*! @brief counters of exited threads */
+    uint64_t retired_puts;
+    uint64_t refills;
+    uint64_t spills;
+    _Atomic uint64_t large_gets;
+} buffer_pool_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new buffer_pool_t object
+ * @param hugepages back slabs with MAP_HUGETLB when huge pages are available,
+ * falling back to transparent huge pages
+ * @return Success: pointer to instance of buffer_pool_t
+ * @return Failure: NULL ptr
+ */
+buffer_pool_t *new_buffer_pool_t(bool hugepages);
+
+/*!
+ * @brief gets a buffer of at least size bytes
+ * @details the contents are not zeroed
+ * @return Success: pointer to the buffer
+ * @return Failure: NULL ptr
+ */
+void *get_buffer_pool_t(buffer_pool_t *pool, size_t size);
+
+/*!
+ * @brief returns a buffer to the pool it came from
+ * @details the buffer remembers its pool, so this can be used directly as an
+ * iov_release_fn with the buffer as its argument. NULL is ignored
+ */
+void put_buffer_pool_t(void *buffer);
+
+/*!
+ * @brief the usable size of a buffer, at least what was asked for
+ */
+size_t size_buffer_pool_t(void *buffer);
+
+/*!
+ * @brief takes a snapshot of the pool's counters
+ */
+void stats_buffer_pool_t(buffer_pool_t *pool, buffer_pool_stats_t *stats);
+
+/*!
+ * @brief unmaps every slab and frees all resources of the buffer_pool_t
+ * @warning no thread may use the pool or any of its buffers afterwards
+ */
+void free_buffer_pool_t(buffer_pool_t *pool);
@@ -0,0 +1,492 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "channel.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! @brief rotates where select_channel_t starts looking */
+static _Atomic unsigned select_rotation;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*!
+ * @brief milliseconds left until deadline for poll, -1 if there is none
+ */
+static int remaining_ms(uint64_t deadline, int timeout_ms) {
+    if (timeout_ms < 0) {
+        return -1;
+    }
+    uint64_t now = now_ms();
+    return now >= deadline ? 0 : (int)(deadline - now);
+}
+
+static void signal_fd(int fd) {
+    uint64_t one = 1;
+    ssize_t rc = write(fd, &one, sizeof(one));
+    (void)rc; // EAGAIN only means the counter is already set
+}
+
+/*!
+ * @brief writes a wakeup into the eventfd of a direction unless one is pending
+ */
+static void signal_waiters(channel_t *channel, bool send) {
+    _Atomic bool *signalled =
+        send ? &channel->send_signalled : &channel->recv_signalled;
+    if (atomic_load_explicit(signalled, memory_order_relaxed) == false &&
+        atomic_exchange(signalled, true) == false) {
+        signal_fd(send ? channel->writable_fd : channel->readable_fd);
+    }
+}
+
+static void drain_fd(int fd) {
+    uint64_t value;
+    ssize_t rc = read(fd, &value, sizeof(value));
+    (void)rc;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new channel_t object
+ * @param capacity rounded up to a power of two, at least 2
+ * @return Success: pointer to instance of channel_t
+ * @return Failure: NULL ptr
+ */
+channel_t *new_channel_t(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    channel_t *channel = aligned_alloc(CHANNEL_CACHE_LINE, sizeof(channel_t));
+    if (channel == NULL) {
+        return NULL;
+    }
+
+    channel->cells = calloc(size, sizeof(channel_cell_t));
+    channel->readable_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->writable_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channel->cells == NULL || channel->readable_fd == -1 ||
+        channel->writable_fd == -1) {
+        goto ERROR;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&channel->cells[i].sequence, i);
+    }
+    channel->mask = size - 1;
+    atomic_init(&channel->enqueue_pos, 0);
+    atomic_init(&channel->dequeue_pos, 0);
+    atomic_init(&channel->recv_waiters, 0);
+    atomic_init(&channel->send_waiters, 0);
+    atomic_init(&channel->recv_signalled, false);
+    atomic_init(&channel->send_signalled, false);
+    atomic_init(&channel->closed, false);
+
+    return channel;
+
+ERROR:
+    if (channel->readable_fd != -1) {
+        close(channel->readable_fd);
+    }
+    if (channel->writable_fd != -1) {
+        close(channel->writable_fd);
+    }
+    free(channel->cells);
+    free(channel);
+    return NULL;
+}
+
+/*!
+ * @brief wakes a waiter of the other side if there is one
+ * @details the fence pairs with the one in prepare_wait_channel_t, either the
+ * waiter sees the value or slot on its retry or we see it registered
+ */
+static void wake_other_side(channel_t *channel, bool sent) {
+    atomic_thread_fence(memory_order_seq_cst);
+    _Atomic int *waiters = sent ? &channel->recv_waiters : &channel->send_waiters;
+    if (atomic_load_explicit(waiters, memory_order_relaxed) > 0) {
+        signal_waiters(channel, sent == false);
+    }
+}
+
+/*!
+ * @brief sends value if there is room, never blocks
+ * @return true if the value was sent, false if the channel is full or closed
+ */
+bool try_send_channel_t(channel_t *channel, void *value) {
+    if (atomic_load_explicit(&channel->closed, memory_order_relaxed)) {
+        return false;
+    }
+
+    size_t pos = atomic_load_explicit(&channel->enqueue_pos, memory_order_relaxed);
+    channel_cell_t *cell;
+    for (;;) {
+        cell = &channel->cells[pos & channel->mask];
+        size_t sequence =
+            atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &channel->enqueue_pos, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false; // the slot still holds a value from a lap ago
+        } else {
+            pos = atomic_load_explicit(&channel->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->value = value;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    wake_other_side(channel, true);
+    return true;
+}
+
+/*!
+ * @brief receives a value if there is one, never blocks
+ * @return true if a value was received, false if the channel is empty
+ */
+bool try_recv_channel_t(channel_t *channel, void **value) {
+    size_t pos = atomic_load_explicit(&channel->dequeue_pos, memory_order_relaxed);
+    channel_cell_t *cell;
+    for (;;) {
+        cell = &channel->cells[pos & channel->mask];
+        size_t sequence =
+            atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &channel->dequeue_pos, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false; // not filled yet
+        } else {
+            pos = atomic_load_explicit(&channel->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *value = cell->value;
+    atomic_store_explicit(&cell->sequence, pos + channel->mask + 1,
+                          memory_order_release);
+    wake_other_side(channel, false);
+    return true;
+}
+
+/*!
+ * @brief registers the caller as waiting to send or receive
+ * @details for waiting on a channel from an event loop or a coroutine: after
+ * this retry the non-blocking call once, and only if that still fails wait for
+ * the returned fd to become readable. call finish_wait_channel_t afterwards
+ * either way
+ * @return the eventfd to wait on
+ */
+int prepare_wait_channel_t(channel_t *channel, bool send) {
+    atomic_fetch_add(send ? &channel->send_waiters : &channel->recv_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return send ? channel->writable_fd : channel->readable_fd;
+}
+
+/*!
+ * @brief unregisters a waiter registered with prepare_wait_channel_t
+ * @details the wakeup consumed here is passed on to the next waiter if the
+ * channel still has values, or room, so none is lost when several wait
+ */
+void finish_wait_channel_t(channel_t *channel, bool send) {
+    _Atomic int *waiters = send ? &channel->send_waiters : &channel->recv_waiters;
+    int fd = send ? channel->writable_fd : channel->readable_fd;
+    atomic_fetch_sub(waiters, 1);
+    // once closed the eventfds stay readable so every waiter sees it
+    if (atomic_load(&channel->closed)) {
+        return;
+    }
+    // drain before clearing the flag, a wakeup that lands in between is
+    // skipped by its waker but then seen by the check below
+    _Atomic bool *signalled =
+        send ? &channel->send_signalled : &channel->recv_signalled;
+    if (atomic_load(signalled)) {
+        drain_fd(fd);
+        atomic_store(signalled, false);
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed) == 0) {
+        return;
+    }
+    size_t len = len_channel_t(channel);
+    if (send ? len <= channel->mask : len > 0) {
+        signal_waiters(channel, send);
+    }
+}
+
+/*!
+ * @brief waits for fd to become readable
+ * @return false if the timeout passed first
+ */
+static bool wait_readable(int fd, int timeout_ms) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int rc = poll(&pfd, 1, timeout_ms);
+    return rc != 0;
+}
+
+/*!
+ * @brief sends value, waiting for room for at most timeout_ms
+ * @param timeout_ms -1 to wait forever
+ * @return Success: 0
+ * @return Failure: -1 with errno set to ETIMEDOUT, or EPIPE if the channel is closed
+ */
+int timed_send_channel_t(channel_t *channel, void *value, int timeout_ms) {
+    uint64_t deadline = timeout_ms < 0 ? 0 : now_ms() + (uint64_t)timeout_ms;
+    for (;;) {
+        if (try_send_channel_t(channel, value)) {
+            return 0;
+        }
+        if (atomic_load(&channel->closed)) {
+            errno = EPIPE;
+            return -1;
+        }
+
+        int fd = prepare_wait_channel_t(channel, true);
+        bool ready = true;
+        if (try_send_channel_t(channel, value)) {
+            finish_wait_channel_t(channel, true);
+            return 0;
+        }
+        if (atomic_load(&channel->closed) == false) {
+            ready = wait_readable(fd, remaining_ms(deadline, timeout_ms));
+        }
+        finish_wait_channel_t(channel, true);
+
+        if (ready == false) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+/*!
+ * @brief receives a value, waiting for one for at most timeout_ms
+ * @details values sent before the channel was closed are still received
+ * @param timeout_ms -1 to wait forever
+ * @return Success: 0
+ * @return Failure: -1 with errno set to ETIMEDOUT, or EPIPE once the channel is
+ * closed and drained
+ */
+int timed_recv_channel_t(channel_t *channel, void **value, int timeout_ms) {
+    uint64_t deadline = timeout_ms < 0 ? 0 : now_ms() + (uint64_t)timeout_ms;
+    for (;;) {
+        if (try_recv_channel_t(channel, value)) {
+            return 0;
+        }
+
+        int fd = prepare_wait_channel_t(channel, false);
+        bool ready = true;
+        if (try_recv_channel_t(channel, value)) {
+            finish_wait_channel_t(channel, false);
+            return 0;
+        }
+        // closed is checked after the retry so values sent before close are not lost
+        if (atomic_load(&channel->closed)) {
+            finish_wait_channel_t(channel, false);
+            errno = EPIPE;
+            return -1;
+        }
+        ready = wait_readable(fd, remaining_ms(deadline, timeout_ms));
+        finish_wait_channel_t(channel, false);
+
+        if (ready == false) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+/*!
+ * @brief sends value, waiting for room as long as it takes
+ * @return Success: 0
+ * @return Failure: -1 with errno set to EPIPE if the channel is closed
+ */
+int send_channel_t(channel_t *channel, void *value) {
+    return timed_send_channel_t(channel, value, -1);
+}
+
+/*!
+ * @brief receives a value, waiting for one as long as it takes
+ * @return Success: 0
+ * @return Failure: -1 with errno set to EPIPE once the channel is closed and drained
+ */
+int recv_channel_t(channel_t *channel, void **value) {
+    return timed_recv_channel_t(channel, value, -1);
+}
+
+/*!
+ * @brief tries every channel case once without blocking, starting at start
+ * @return index of the case that completed, -1 if none could
+ */
+static int try_cases(channel_case_t *cases, size_t num_cases, size_t start) {
+    for (size_t n = 0; n < num_cases; n++) {
+        size_t i = (start + n) % num_cases;
+        channel_case_t *c = &cases[i];
+        switch (c->op) {
+            case CHANNEL_CASE_SEND:
+                if (try_send_channel_t(c->channel, c->value)) {
+                    c->closed = false;
+                    return (int)i;
+                }
+                if (atomic_load(&c->channel->closed)) {
+                    c->closed = true;
+                    return (int)i;
+                }
+                break;
+            case CHANNEL_CASE_RECV:
+                if (try_recv_channel_t(c->channel, &c->value)) {
+                    c->closed = false;
+                    return (int)i;
+                }
+                if (atomic_load(&c->channel->closed) &&
+                    try_recv_channel_t(c->channel, &c->value) == false) {
+                    c->value = NULL;
+                    c->closed = true;
+                    return (int)i;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return -1;
+}
+
+/*!
+ * @brief waits until one of the cases can proceed and completes it
+ * @details cases that are ready at the same time are picked from in rotating
+ * order so a busy case can not starve the others. fd cases only report
+ * readiness, the caller does the i/o
+ * @param timeout_ms -1 to wait forever
+ * @return Success: index of the case that completed
+ * @return Failure: -1 with errno set to ETIMEDOUT, or EINVAL for too many cases
+ */
+int select_channel_t(channel_case_t *cases, size_t num_cases, int timeout_ms) {
+    if (num_cases == 0 || num_cases > CHANNEL_SELECT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t deadline = timeout_ms < 0 ? 0 : now_ms() + (uint64_t)timeout_ms;
+    size_t start =
+        atomic_fetch_add_explicit(&select_rotation, 1, memory_order_relaxed) %
+        num_cases;
+    struct pollfd pfds[CHANNEL_SELECT_MAX];
+
+    for (;;) {
+        int index = try_cases(cases, num_cases, start);
+        if (index >= 0) {
+            return index;
+        }
+
+        for (size_t i = 0; i < num_cases; i++) {
+            pfds[i].revents = 0;
+            switch (cases[i].op) {
+                case CHANNEL_CASE_SEND:
+                case CHANNEL_CASE_RECV:
+                    pfds[i].fd = prepare_wait_channel_t(
+                        cases[i].channel, cases[i].op == CHANNEL_CASE_SEND);
+                    pfds[i].events = POLLIN;
+                    break;
+                case CHANNEL_CASE_READABLE:
+                    pfds[i].fd = cases[i].fd;
+                    pfds[i].events = POLLIN;
+                    break;
+                case CHANNEL_CASE_WRITABLE:
+                    pfds[i].fd = cases[i].fd;
+                    pfds[i].events = POLLOUT;
+                    break;
+            }
+        }
+
+        int rc = 0;
+        index = try_cases(cases, num_cases, start);
+        if (index < 0) {
+            rc = poll(pfds, num_cases, remaining_ms(deadline, timeout_ms));
+        }
+
+        for (size_t n = 0; n < num_cases; n++) {
+            size_t i = (start + n) % num_cases;
+            if (cases[i].op == CHANNEL_CASE_SEND ||
+                cases[i].op == CHANNEL_CASE_RECV) {
+                finish_wait_channel_t(cases[i].channel,
+                                      cases[i].op == CHANNEL_CASE_SEND);
+            } else if (index < 0 && rc > 0 && pfds[i].revents != 0) {
+                index = (int)i;
+            }
+        }
+
+        if (index >= 0) {
+            return index;
+        }
+        if (rc == 0 && remaining_ms(deadline, timeout_ms) == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        start = (start + 1) % num_cases;
+    }
+}
+
+/*!
+ * @brief closes the channel, waking everyone waiting on it
+ * @details sends fail from now on, receives fail once the channel is drained
+ */
+void close_channel_t(channel_t *channel) {
+    if (atomic_exchange(&channel->closed, true)) {
+        return;
+    }
+    signal_fd(channel->readable_fd);
+    signal_fd(channel->writable_fd);
+}
+
+/*!
+ * @brief the number of values in the channel, only a snapshot under concurrency
+ */
+size_t len_channel_t(channel_t *channel) {
+    size_t dequeue =
+        atomic_load_explicit(&channel->dequeue_pos, memory_order_relaxed);
+    size_t enqueue =
+        atomic_load_explicit(&channel->enqueue_pos, memory_order_relaxed);
+    return enqueue > dequeue ? enqueue - dequeue : 0;
+}
+
+/*!
+ * @brief free up all resources allocated for the channel_t struct
+ * @note values still in the channel are not freed
+ */
+void free_channel_t(channel_t *channel) {
+    if (channel == NULL) {
+        return;
+    }
+    close(channel->readable_fd);
+    close(channel->writable_fd);
+    free(channel->cells);
+    free(channel);
+}
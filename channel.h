@@ -0,0 +1,190 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file channel.h
+ * @brief bounded multi-producer multi-consumer channels, in the spirit of go's
+ * @details values are pointers passed through a lock-free ring where every slot
+ * carries a sequence number, a producer claims a slot by advancing the enqueue
+ * position with a single compare and swap and publishes it by bumping the
+ * slot's sequence, consumers do the same on the dequeue position. the fast path
+ * never takes a lock or makes a syscall. blocking is built on an eventfd per
+ * direction that is only written while someone is waiting on it, so a full or
+ * empty channel can also be waited on by a reactor_t, a coroutine or
+ * select_channel_t alongside sockets
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*! @brief most cases a single select_channel_t call takes */
+#ifndef CHANNEL_SELECT_MAX
+#define CHANNEL_SELECT_MAX 64
+#endif
+
+#define CHANNEL_CACHE_LINE 64
+
+/*!
+ * @brief a slot of the ring
+ * @details sequence equals the position a producer may fill it at, and the
+ * position plus one once it holds a value for a consumer
+ */
+typedef struct channel_cell {
+    _Atomic size_t sequence;
+    void *value;
+} channel_cell_t;
+
+/*! @typedef channel
+ * @struct channel
+ * @brief a bounded channel of pointers
+ */
+typedef struct channel {
+    channel_cell_t *cells;
+    size_t mask;
+    /*! @brief the positions are kept on their own cache lines so producers and
+     * consumers do not contend on the same line */
+    _Alignas(CHANNEL_CACHE_LINE) _Atomic size_t enqueue_pos;
+    _Alignas(CHANNEL_CACHE_LINE) _Atomic size_t dequeue_pos;
+    _Alignas(CHANNEL_CACHE_LINE) _Atomic int recv_waiters;
+    _Atomic int send_waiters;
+    /*! @brief set while an eventfd holds a wakeup nobody consumed yet, so a
+     * busy channel writes it once rather than once per value */
+    _Atomic bool recv_signalled;
+    _Atomic bool send_signalled;
+    _Atomic bool closed;
+    int readable_fd; /*! @brief eventfd written when a waiting receiver may
+                        proceed */
+    int writable_fd; /*! @brief eventfd written when a waiting sender may proceed */
+} channel_t;
+
+/*!
+ * @brief what a select case waits for
+ */
+typedef enum {
+    CHANNEL_CASE_RECV = 0,
+    CHANNEL_CASE_SEND,
+    CHANNEL_CASE_READABLE, /*! @brief fd is readable */
+    CHANNEL_CASE_WRITABLE, /*! @brief fd is writable */
+} CHANNEL_CASE;
+
+/*!
+ * @brief a single case of select_channel_t
+ */
+typedef struct channel_case {
+    CHANNEL_CASE op;
+    channel_t *channel; /*! @brief for CHANNEL_CASE_RECV and CHANNEL_CASE_SEND */
+    int fd;             /*! @brief for CHANNEL_CASE_READABLE and
+                           CHANNEL_CASE_WRITABLE */
+    void *value;        /*! @brief sent by a send case, set by a recv case */
+    bool closed;        /*! @brief set if the case completed because the channel
+                           is closed */
+} channel_case_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new channel_t object
+ * @param capacity rounded up to a power of two, at least 2
+ * @return Success: pointer to instance of channel_t
+ * @return Failure: NULL ptr
+ */
+channel_t *new_channel_t(size_t capacity);
+
+/*!
+ * @brief sends value if there is room, never blocks
+ * @return true if the value was sent, false if the channel is full or closed
+ */
+bool try_send_channel_t(channel_t *channel, void *value);
+
+/*!
+ * @brief receives a value if there is one, never blocks
+ * @return true if a value was received, false if the channel is empty
+ */
+bool try_recv_channel_t(channel_t *channel, void **value);
+
+/*!
+ * @brief sends value, waiting for room for at most timeout_ms
+ * @param timeout_ms -1 to wait forever
+ * @return Success: 0
+ * @return Failure: -1 with errno set to ETIMEDOUT, or EPIPE if the channel is closed
+ */
+int timed_send_channel_t(channel_t *channel, void *value, int timeout_ms);
+
+/*!
+ * @brief receives a value, waiting for one for at most timeout_ms
+ * @details values sent before the channel was closed are still received
+ * @param timeout_ms -1 to wait forever
+ * @return Success: 0
+ * @return Failure: -1 with errno set to ETIMEDOUT, or EPIPE once the channel is
+ * closed and drained
+ */
+int timed_recv_channel_t(channel_t *channel, void **value, int timeout_ms);
+
+/*!
+ * @brief sends value, waiting for room as long as it takes
+ * @return Success: 0
+ * @return Failure: -1 with errno set to EPIPE if the channel is closed
+ */
+int send_channel_t(channel_t *channel, void *value);
+
+/*!
+ * @brief receives a value, waiting for one as long as it takes
+ * @return Success: 0
+ * @return Failure: -1 with errno set to EPIPE once the channel is closed and drained
+ */
+int recv_channel_t(channel_t *channel, void **value);
+
+/*!
+ * @brief waits until one of the cases can proceed and completes it
+ * @details cases that are ready at the same time are picked from in rotating
+ * order so a busy case can not starve the others. fd cases only report
+ * readiness, the caller does the i/o
+ * @param timeout_ms -1 to wait forever
+ * @return Success: index of the case that completed
+ * @return Failure: -1 with errno set to ETIMEDOUT, or EINVAL for too many cases
+ */
+int select_channel_t(channel_case_t *cases, size_t num_cases, int timeout_ms);
+
+/*!
+ * @brief registers the caller as waiting to send or receive
+ * @details for waiting on a channel from an event loop or a coroutine: after
+ * this retry the non-blocking call once, and only if that still fails wait for
+ * the returned fd to become readable. call finish_wait_channel_t afterwards
+ * either way
+ * @return the eventfd to wait on
+ */
+int prepare_wait_channel_t(channel_t *channel, bool send);
+
+/*!
+ * @brief unregisters a waiter registered with prepare_wait_channel_t
+ * @details the wakeup consumed here is passed on to the next waiter if the
+ * channel still has values, or room, so none is lost when several wait
+ */
+void finish_wait_channel_t(channel_t *channel, bool send);
+
+/*!
+ * @brief closes the channel, waking everyone waiting on it
+ * @details sends fail from now on, receives fail once the channel is drained
+ */
+void close_channel_t(channel_t *channel);
+
+/*!
+ * @brief the number of values in the channel, only a snapshot under concurrency
+ */
+size_t len_channel_t(channel_t *channel);
+
+/*!
+ * @brief free up all resources allocated for the channel_t struct
+ * @note values still in the channel are not freed
+ */
+void free_channel_t(channel_t *channel);
@@ -0,0 +1,688 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file cnet_bench.c
+ * @brief micro benchmarks for cnet, run `cnet-bench` for all of them or
+ * `cnet-bench <name>` for a single one
+ */
+
+#include "buffer_pool.h"
+#include "channel.h"
+#include "conn_buffer.h"
+#include "coro.h"
+#include "deps/ulog/logger.h"
+#include "reactor.h"
+#include "sockets.h"
+#include "timer_wheel.h"
+#include "zerocopy.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! @brief total bytes moved by each throughput measurement */
+#define BENCH_TOTAL_BYTES (512UL * 1024 * 1024)
+
+typedef struct bench_sender_args {
+    char *ip;
+    char *port;
+    size_t write_len;
+    size_t total;
+} bench_sender_args_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*!
+ * @brief folds a buffer into a checksum so every received byte is touched
+ */
+static uint64_t checksum_bytes(const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+static void *bench_sender(void *data) {
+    bench_sender_args_t *args = data;
+    thread_logger *thl = new_thread_logger(false);
+    socket_client_t *client =
+        new_client_socket(thl, args->ip, args->port, true, true);
+    if (client == NULL) {
+        printf("bench sender failed to connect\n");
+        clear_thread_logger(thl);
+        return NULL;
+    }
+    char *buffer = calloc(1, args->write_len);
+    size_t sent = 0;
+    while (buffer != NULL && sent < args->total) {
+        size_t want = args->total - sent;
+        if (want > args->write_len) {
+            want = args->write_len;
+        }
+        ssize_t n = send(client->socket_number, buffer, want, 0);
+        if (n <= 0) {
+            break;
+        }
+        sent += (size_t)n;
+    }
+    free(buffer);
+    free_socket_client_t(client);
+    clear_thread_logger(thl);
+    return NULL;
+}
+
+/*!
+ * @brief receives BENCH_TOTAL_BYTES over loopback, with read or zerocopy receive
+ * @return throughput in MB/s, or -1 on failure
+ */
+static double bench_receive(thread_logger *thl, char *port, size_t chunk,
+                            bool zerocopy, double *mapped_pct) {
+    int listen_fd = listen_socket(thl, "127.0.0.1", port, true, true,
+                                  default_sock_opts, default_socket_opts_count);
+    if (listen_fd == -1) {
+        return -1;
+    }
+
+    bench_sender_args_t args = {"127.0.0.1", port, chunk, BENCH_TOTAL_BYTES};
+    pthread_t sender;
+    pthread_create(&sender, NULL, bench_sender, &args);
+
+    int fd = accept_socket(thl, listen_fd);
+    if (fd == -1) {
+        close(listen_fd);
+        pthread_join(sender, NULL);
+        return -1;
+    }
+
+    size_t received = 0;
+    uint64_t sum = 0;
+    double start = now_seconds();
+    if (zerocopy) {
+        zerocopy_rx_t *zrx = new_zerocopy_rx_t(thl, fd, chunk);
+        zerocopy_view_t view;
+        for (;;) {
+            ssize_t n = recv_zerocopy_rx_t(zrx, &view);
+            if (n <= 0) {
+                break;
+            }
+            sum += checksum_bytes(view.mapped, view.mapped_len);
+            sum += checksum_bytes(view.copied, view.copied_len);
+            received += (size_t)n;
+        }
+        *mapped_pct = received > 0 ? 100.0 * (double)zrx->mapped_bytes /
+                                         (double)received
+                                   : 0;
+        free_zerocopy_rx_t(zrx);
+    } else {
+        char *buffer = malloc(chunk);
+        for (;;) {
+            ssize_t n = read(fd, buffer, chunk);
+            if (n <= 0) {
+                break;
+            }
+            sum += checksum_bytes(buffer, (size_t)n);
+            received += (size_t)n;
+        }
+        free(buffer);
+        *mapped_pct = 0;
+    }
+    double elapsed = now_seconds() - start;
+
+    pthread_join(sender, NULL);
+    close(fd);
+    close(listen_fd);
+    if (received != BENCH_TOTAL_BYTES || sum != 0) {
+        printf("bench receive got %zu of %lu bytes\n", received, BENCH_TOTAL_BYTES);
+        return -1;
+    }
+    return (double)received / (1024 * 1024) / elapsed;
+}
+
+/*!
+ * @brief read(2) vs TCP_ZEROCOPY_RECEIVE over loopback at 64KB -> 16MB chunks
+ */
+static void bench_zerocopy(thread_logger *thl) {
+    size_t chunks[] = {65536, 262144, 1048576, 4194304, 16777216};
+    printf("%-12s %14s %14s %10s\n", "chunk", "read MB/s", "zerocopy MB/s",
+           "mapped %");
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        double mapped_pct = 0;
+        double read_rate = bench_receive(thl, "5101", chunks[i], false, &mapped_pct);
+        double zc_rate = bench_receive(thl, "5102", chunks[i], true, &mapped_pct);
+        printf("%-12zu %14.1f %14.1f %10.1f\n", chunks[i], read_rate, zc_rate,
+               mapped_pct);
+    }
+}
+
+/*! @brief round trips measured by the latency benchmarks */
+#define BENCH_ROUND_TRIPS 100000
+
+/*! @brief size of a latency benchmark message */
+#define BENCH_MESSAGE_LEN 64
+
+/*!
+ * @brief accepts one connection and echoes (or sinks) everything it receives
+ */
+typedef struct bench_peer_args {
+    int listen_fd;
+    bool echo;
+} bench_peer_args_t;
+
+static void *bench_peer(void *data) {
+    bench_peer_args_t *args = data;
+    thread_logger *thl = new_thread_logger(false);
+    int fd = accept_socket(thl, args->listen_fd);
+    char *buffer = malloc(65536);
+    for (;;) {
+        ssize_t n = read(fd, buffer, 65536);
+        if (n <= 0) {
+            break;
+        }
+        if (args->echo && send(fd, buffer, (size_t)n, 0) != n) {
+            break;
+        }
+    }
+    free(buffer);
+    close(fd);
+    clear_thread_logger(thl);
+    return NULL;
+}
+
+/*!
+ * @brief measures echo latency and one way throughput for a single transport
+ * @param unix_path if not NULL use a unix socket at this path, otherwise tcp
+ * loopback on port
+ */
+static void bench_transport(thread_logger *thl, char *name, char *unix_path,
+                            char *port) {
+    double round_trip_us = -1;
+    double rate = -1;
+    for (int echo = 1; echo >= 0; echo--) {
+        int listen_fd;
+        if (unix_path != NULL) {
+            listen_fd = listen_unix_socket(thl, unix_path, false, default_sock_opts,
+                                           default_socket_opts_count);
+        } else {
+            listen_fd = listen_socket(thl, "127.0.0.1", port, true, true,
+                                      default_sock_opts, default_socket_opts_count);
+        }
+        if (listen_fd == -1) {
+            return;
+        }
+
+        bench_peer_args_t args = {listen_fd, echo == 1};
+        pthread_t peer;
+        pthread_create(&peer, NULL, bench_peer, &args);
+
+        socket_client_t *client;
+        if (unix_path != NULL) {
+            client = new_unix_client_socket(thl, unix_path, false);
+        } else {
+            client = new_client_socket(thl, "127.0.0.1", port, true, true);
+        }
+        if (client == NULL) {
+            close(listen_fd);
+            pthread_join(peer, NULL);
+            return;
+        }
+
+        char *buffer = calloc(1, 65536);
+        double start = now_seconds();
+        if (echo == 1) {
+            for (int i = 0; i < BENCH_ROUND_TRIPS; i++) {
+                send(client->socket_number, buffer, BENCH_MESSAGE_LEN, 0);
+                size_t got = 0;
+                while (got < BENCH_MESSAGE_LEN) {
+                    ssize_t n = read(client->socket_number, buffer + got,
+                                     BENCH_MESSAGE_LEN - got);
+                    if (n <= 0) {
+                        break;
+                    }
+                    got += (size_t)n;
+                }
+            }
+            round_trip_us = (now_seconds() - start) * 1e6 / BENCH_ROUND_TRIPS;
+        } else {
+            for (size_t sent = 0; sent < BENCH_TOTAL_BYTES;) {
+                ssize_t n = send(client->socket_number, buffer, 65536, 0);
+                if (n <= 0) {
+                    break;
+                }
+                sent += (size_t)n;
+            }
+            shutdown(client->socket_number, SHUT_WR);
+            pthread_join(peer, NULL);
+            rate = (double)BENCH_TOTAL_BYTES / (1024 * 1024) /
+                   (now_seconds() - start);
+        }
+        free(buffer);
+        free_socket_client_t(client);
+        if (echo == 1) {
+            pthread_join(peer, NULL);
+        }
+        close(listen_fd);
+    }
+    printf("%-16s %16.2f %14.1f\n", name, round_trip_us, rate);
+}
+
+/*!
+ * @brief tcp loopback vs unix domain stream sockets
+ */
+static void bench_unix(thread_logger *thl) {
+    printf("%-16s %16s %14s\n", "transport", "round trip us", "stream MB/s");
+    bench_transport(thl, "tcp loopback", NULL, "5103");
+    bench_transport(thl, "unix stream", "/tmp/cnet-bench.sock", NULL);
+    bench_transport(thl, "unix abstract", "@cnet-bench", NULL);
+    unlink("/tmp/cnet-bench.sock");
+}
+
+/*! @brief connections opened by the idle memory benchmark */
+#define BENCH_IDLE_CONNECTIONS 4096
+
+/*! @brief the fixed per-connection buffer the idle benchmark compares against */
+#define BENCH_FIXED_BUFFER 16384
+
+/*!
+ * @brief memory held by mostly idle connections, fixed buffers vs conn_buffer_t
+ * @details every connection gets one small message, a quarter of them also get
+ * one large message, then all of them go quiet
+ */
+static void bench_idle(thread_logger *thl) {
+    (void)thl;
+    static int pairs[BENCH_IDLE_CONNECTIONS][2];
+    static conn_buffer_t *buffers[BENCH_IDLE_CONNECTIONS];
+    buffer_pool_t *pool = new_buffer_pool_t(false);
+    char *large = calloc(1, 40000);
+    size_t opened = 0;
+    for (; opened < BENCH_IDLE_CONNECTIONS; opened++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[opened]) == -1) {
+            break;
+        }
+        buffers[opened] = new_conn_buffer_t(pool);
+    }
+
+    for (size_t i = 0; i < opened; i++) {
+        send(pairs[i][1], large, 200, 0);
+        if (i % 4 == 0) {
+            send(pairs[i][1], large, 40000, 0);
+        }
+    }
+
+    size_t peak_held = 0;
+    for (size_t i = 0; i < opened; i++) {
+        set_socket_blocking_status(pairs[i][0], false);
+        // read until the socket would block, the buffer goes back to the pool then
+        while (read_conn_buffer_t(buffers[i], pairs[i][0]) > 0) {
+            if (buffers[i]->capacity > peak_held) {
+                peak_held = buffers[i]->capacity;
+            }
+            size_t len;
+            peek_conn_buffer_t(buffers[i], &len);
+            consume_conn_buffer_t(buffers[i], len);
+        }
+    }
+
+    conn_buffer_report_t report;
+    report_conn_buffers(buffers, opened, &report);
+    buffer_pool_stats_t stats;
+    stats_buffer_pool_t(pool, &stats);
+
+    printf("%-28s %14s %14s\n", "", "fixed", "conn_buffer_t");
+    printf("%-28s %14zu %14zu\n", "connections", opened, report.connections);
+    printf("%-28s %14zu %14zu\n", "idle connections", opened, report.idle);
+    printf("%-28s %14.1f %14.1f\n", "bytes per idle connection",
+           (double)BENCH_FIXED_BUFFER, report.bytes_per_idle);
+    printf("%-28s %14zu %14zu\n", "total bytes held",
+           opened * BENCH_FIXED_BUFFER, report.total_bytes);
+    printf("%-28s %14d %14zu\n", "largest buffer used", BENCH_FIXED_BUFFER,
+           peak_held);
+    printf("%-28s %14s %14zu\n", "pool bytes mapped", "-", stats.mapped_bytes);
+
+    for (size_t i = 0; i < opened; i++) {
+        free_conn_buffer_t(buffers[i]);
+        close(pairs[i][0]);
+        close(pairs[i][1]);
+    }
+    free(large);
+    free_buffer_pool_t(pool);
+}
+
+#define BENCH_TIMERS 1000000
+#define BENCH_TIMER_SPREAD_MS 60000
+
+/*!
+ * @brief arm, cancel and expire costs of a timer_wheel_t holding 1M timers
+ * @details deadlines are spread over a minute, like idle timeouts across a large
+ * number of connections. expiry sleeps until next_timer_wheel_t each time, the
+ * way the reactor does
+ */
+static void bench_timers(thread_logger *thl) {
+    (void)thl;
+    static timer_wheel_t wheel;
+    wheel_timer_t *timers = calloc(BENCH_TIMERS, sizeof(wheel_timer_t));
+    uint64_t *deadlines = calloc(BENCH_TIMERS, sizeof(uint64_t));
+    if (timers == NULL || deadlines == NULL) {
+        printf("failed to allocate timers\n");
+        free(timers);
+        free(deadlines);
+        return;
+    }
+    uint64_t start = 1000000000ULL;
+    init_timer_wheel_t(&wheel, start);
+    srand(1);
+    for (size_t i = 0; i < BENCH_TIMERS; i++) {
+        deadlines[i] =
+            start + (uint64_t)(rand() % (BENCH_TIMER_SPREAD_MS * 1000)) * 1000ULL;
+    }
+
+    double began = now_seconds();
+    for (size_t i = 0; i < BENCH_TIMERS; i++) {
+        add_timer_wheel_t(&wheel, &timers[i], deadlines[i]);
+    }
+    double arm = now_seconds() - began;
+
+    // connections that saw traffic push their timeout back out
+    began = now_seconds();
+    for (size_t i = 0; i < BENCH_TIMERS; i += 2) {
+        add_timer_wheel_t(&wheel, &timers[i], deadlines[i] + 30000000000ULL);
+    }
+    double rearm = now_seconds() - began;
+
+    // and connections that closed cancel theirs
+    began = now_seconds();
+    for (size_t i = 1; i < BENCH_TIMERS; i += 4) {
+        remove_timer_wheel_t(&wheel, &timers[i]);
+    }
+    double cancel = now_seconds() - began;
+    size_t armed = wheel.count;
+
+    size_t wakeups = 0;
+    size_t expired = 0;
+    began = now_seconds();
+    while (wheel.count > 0) {
+        advance_timer_wheel_t(&wheel, next_timer_wheel_t(&wheel));
+        wakeups += 1;
+        while (pop_expired_timer_wheel_t(&wheel) != NULL) {
+            expired += 1;
+        }
+    }
+    double expire = now_seconds() - began;
+
+    printf("%-28s %14d\n", "timers armed", BENCH_TIMERS);
+    printf("%-28s %14.1f\n", "ns per arm", arm * 1e9 / BENCH_TIMERS);
+    printf("%-28s %14.1f\n", "ns per re-arm", rearm * 1e9 / (BENCH_TIMERS / 2));
+    printf("%-28s %14.1f\n", "ns per cancel", cancel * 1e9 / (BENCH_TIMERS / 4));
+    printf("%-28s %14.1f\n", "ns per expiry", expire * 1e9 / (double)expired);
+    printf("%-28s %14zu\n", "timers expired", expired);
+    printf("%-28s %14zu\n", "wakeups", wakeups);
+    printf("%-28s %14zu\n", "bytes per timer", sizeof(wheel_timer_t));
+    printf("%-28s %14zu\n", "bytes per wheel", sizeof(timer_wheel_t));
+    if (expired != armed) {
+        printf("expired %zu timers but %zu were armed\n", expired, armed);
+    }
+    free(timers);
+    free(deadlines);
+}
+
+/*! @brief coroutines alive at once in the coroutine benchmark */
+#define BENCH_COROUTINES 100000
+#define BENCH_CORO_YIELDS 10
+
+static void bench_yielder(coro_sched_t *sched, void *arg) {
+    (void)arg;
+    for (int i = 0; i < BENCH_CORO_YIELDS; i++) {
+        yield_coro_sched_t(sched);
+    }
+}
+
+/*!
+ * @brief resident memory of the process in bytes
+ */
+static size_t resident_bytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return 0;
+    }
+    unsigned long size = 0, resident = 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/*!
+ * @brief spawn cost, switch cost and memory of 100k coroutines on one thread
+ * @details stacks are allocated without guard pages, with them every stack is two
+ * mappings and 100k of them go past the default vm.max_map_count
+ */
+static void bench_coroutines(thread_logger *thl) {
+    reactor_t *reactor = new_reactor_t(thl);
+    coro_sched_t *sched =
+        reactor != NULL ? new_coro_sched_t(reactor, 0, false) : NULL;
+    if (sched == NULL) {
+        printf("failed to create scheduler\n");
+        if (reactor != NULL) {
+            free_reactor_t(reactor);
+        }
+        return;
+    }
+    size_t resident = resident_bytes();
+    double began = now_seconds();
+    size_t spawned = 0;
+    for (; spawned < BENCH_COROUTINES; spawned++) {
+        if (spawn_coro_sched_t(sched, bench_yielder, NULL) == -1) {
+            break;
+        }
+    }
+    double spawn = now_seconds() - began;
+
+    // the first pass starts every coroutine and leaves them all parked
+    run_once_reactor_t(reactor, 0);
+    size_t parked = resident_bytes() - resident;
+    began = now_seconds();
+    while (sched->stats.live > 0) {
+        run_once_reactor_t(reactor, 0);
+    }
+    double switching = now_seconds() - began;
+    uint64_t yields = spawned * BENCH_CORO_YIELDS;
+
+    printf("%-28s %14zu\n", "coroutines", spawned);
+    printf("%-28s %14.1f\n", "ns per spawn", spawn * 1e9 / (double)spawned);
+    printf("%-28s %14.1f\n", "ns per yield", switching * 1e9 / (double)yields);
+    printf("%-28s %14zu\n", "stack bytes", sched->stack_size);
+    printf("%-28s %14zu\n", "resident bytes per coro", parked / spawned);
+    free_coro_sched_t(sched);
+    free_reactor_t(reactor);
+}
+
+/*! @brief messages moved by each run of the channel benchmark */
+#define BENCH_CHANNEL_MESSAGES 2000000
+#define BENCH_CHANNEL_CAPACITY 1024
+
+/*!
+ * @brief the bounded queue channels replace, a ring behind a mutex and two condvars
+ */
+typedef struct bench_locked_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void *values[BENCH_CHANNEL_CAPACITY];
+    size_t head;
+    size_t count;
+} bench_locked_queue_t;
+
+static void send_locked_queue(bench_locked_queue_t *queue, void *value) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == BENCH_CHANNEL_CAPACITY) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->values[(queue->head + queue->count) % BENCH_CHANNEL_CAPACITY] = value;
+    queue->count += 1;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void *recv_locked_queue(bench_locked_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    void *value = queue->values[queue->head];
+    queue->head = (queue->head + 1) % BENCH_CHANNEL_CAPACITY;
+    queue->count -= 1;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return value;
+}
+
+typedef struct bench_channel_args {
+    channel_t *channel;
+    bench_locked_queue_t *queue; /*! @brief used instead of channel when set */
+    size_t messages;
+    uint64_t sum;
+} bench_channel_args_t;
+
+static void *bench_channel_producer(void *arg) {
+    bench_channel_args_t *args = arg;
+    for (uintptr_t i = 1; i <= args->messages; i++) {
+        if (args->queue != NULL) {
+            send_locked_queue(args->queue, (void *)i);
+        } else if (send_channel_t(args->channel, (void *)i) == -1) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *bench_channel_consumer(void *arg) {
+    bench_channel_args_t *args = arg;
+    for (size_t i = 0; i < args->messages; i++) {
+        void *value = NULL;
+        if (args->queue != NULL) {
+            value = recv_locked_queue(args->queue);
+        } else if (recv_channel_t(args->channel, &value) == -1) {
+            break;
+        }
+        args->sum += (uintptr_t)value;
+    }
+    return NULL;
+}
+
+/*!
+ * @brief moves BENCH_CHANNEL_MESSAGES through either queue with the given threads
+ * @return messages per second, 0 if a message went missing
+ */
+static double run_channel_bench(channel_t *channel, bench_locked_queue_t *queue,
+                                size_t producers, size_t consumers) {
+    pthread_t threads[16];
+    bench_channel_args_t args[16];
+    size_t threads_used = producers + consumers;
+    double began = now_seconds();
+    for (size_t i = 0; i < threads_used; i++) {
+        bool producer = i < producers;
+        args[i] = (bench_channel_args_t){
+            .channel = channel,
+            .queue = queue,
+            .messages = BENCH_CHANNEL_MESSAGES / (producer ? producers : consumers),
+        };
+        pthread_create(&threads[i], NULL,
+                       producer ? bench_channel_producer : bench_channel_consumer,
+                       &args[i]);
+    }
+    uint64_t sent = 0, received = 0;
+    for (size_t i = 0; i < threads_used; i++) {
+        pthread_join(threads[i], NULL);
+        if (i < producers) {
+            sent += (uint64_t)args[i].messages * (args[i].messages + 1) / 2;
+        } else {
+            received += args[i].sum;
+        }
+    }
+    double elapsed = now_seconds() - began;
+    return sent == received ? BENCH_CHANNEL_MESSAGES / elapsed : 0;
+}
+
+/*!
+ * @brief channel_t against a mutex and condvar queue, from one producer and
+ * consumer up to eight of each
+ */
+static void bench_channels(thread_logger *thl) {
+    (void)thl;
+    size_t configs[][2] = {{1, 1}, {4, 4}, {8, 8}};
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        size_t producers = configs[i][0];
+        size_t consumers = configs[i][1];
+        channel_t *channel = new_channel_t(BENCH_CHANNEL_CAPACITY);
+        if (channel == NULL) {
+            printf("failed to create channel\n");
+            return;
+        }
+        double lock_free = run_channel_bench(channel, NULL, producers, consumers);
+        free_channel_t(channel);
+
+        bench_locked_queue_t *queue = calloc(1, sizeof(bench_locked_queue_t));
+        if (queue == NULL) {
+            return;
+        }
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->not_empty, NULL);
+        pthread_cond_init(&queue->not_full, NULL);
+        double locked = run_channel_bench(NULL, queue, producers, consumers);
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->not_empty);
+        pthread_cond_destroy(&queue->not_full);
+        free(queue);
+
+        char label[64];
+        snprintf(label, sizeof(label), "%zux%zu channel msgs/s", producers,
+                 consumers);
+        printf("%-28s %14.1f\n", label, lock_free);
+        snprintf(label, sizeof(label), "%zux%zu mutex msgs/s", producers, consumers);
+        printf("%-28s %14.1f\n", label, locked);
+    }
+}
+
+typedef struct bench {
+    char *name;
+    void (*run)(thread_logger *thl);
+} bench_t;
+
+int main(int argc, char *argv[]) {
+    bench_t benches[] = {
+        {"zerocopy", bench_zerocopy},
+        {"unix", bench_unix},
+        {"idle", bench_idle},
+        {"timers", bench_timers},
+        {"coroutines", bench_coroutines},
+        {"channels", bench_channels},
+    };
+    thread_logger *thl = new_thread_logger(false);
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (argc > 1 && strcmp(argv[1], benches[i].name) != 0) {
+            continue;
+        }
+        printf("== %s ==\n", benches[i].name);
+        benches[i].run(thl);
+    }
+    clear_thread_logger(thl);
+    return 0;
+}
@@ -6,8 +6,30 @@
 #include <cmocka.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include "admission.h"
+#include "buf_chain.h"
+#include "buffer_pool.h"
+#include "channel.h"
+#include "conn.h"
+#include "coro.h"
+#include "coro_pool.h"
+#include "conn_buffer.h"
 #include "fd_pool.h"
+#include "forward.h"
+#include "handoff.h"
+#include "handover.h"
+#include "iov_queue.h"
+#include "mem_budget.h"
+#include "mirror_ring.h"
+#include "prefork.h"
+#include "reactor.h"
+#include "shm_ring.h"
 #include "sockets.h"
+#include "timer_wheel.h"
+#include "work_pool.h"
+#include "zerocopy.h"
 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
@@ -313,11 +335,2465 @@ void test_listen_accept(void **state) {
     pthread_join(thread, NULL);
 }
 
+void test_forwarder(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+
+    // client <-> [fwd_client, fwd_backend] <-> backend
+    int client_pair[2], backend_pair[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, client_pair);
+    assert(rc == 0);
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, backend_pair);
+    assert(rc == 0);
+
+    int sent = send(client_pair[0], "hello", 5, 0);
+    assert(sent == 5);
+    sent = send(backend_pair[1], "world", 5, 0);
+    assert(sent == 5);
+    // half-close both ends so the forwarder sees EOF in each direction
+    shutdown(client_pair[0], SHUT_WR);
+    shutdown(backend_pair[1], SHUT_WR);
+
+    rc = run_forwarder_t(thl, client_pair[1], backend_pair[0]);
+    assert(rc == 0);
+
+    char buffer[16];
+    memset(buffer, 0, sizeof(buffer));
+    rc = recv(backend_pair[1], buffer, sizeof(buffer), 0);
+    assert(rc == 5);
+    assert(memcmp(buffer, "hello", 5) == 0);
+    // the shutdown was propagated to the backend
+    rc = recv(backend_pair[1], buffer, sizeof(buffer), 0);
+    assert(rc == 0);
+
+    memset(buffer, 0, sizeof(buffer));
+    rc = recv(client_pair[0], buffer, sizeof(buffer), 0);
+    assert(rc == 5);
+    assert(memcmp(buffer, "world", 5) == 0);
+    rc = recv(client_pair[0], buffer, sizeof(buffer), 0);
+    assert(rc == 0);
+
+    for (int i = 0; i < 2; i++) {
+        close(client_pair[i]);
+        close(backend_pair[i]);
+    }
+    clear_thread_logger(thl);
+}
+
+void count_release(void *arg) {
+    *(int *)arg += 1;
+}
+
+void test_iov_queue(void **state) {
+    int pair[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+
+    iov_queue_t *queue = new_iov_queue_t(2);
+    assert(queue != NULL);
+
+    int released = 0;
+    char header[4] = {'h', 'd', 'r', ':'};
+    rc = push_iov_queue_t(queue, header, sizeof(header), count_release, &released);
+    assert(rc == 0);
+    rc = push_iov_queue_t(queue, "hello ", 6, count_release, &released);
+    assert(rc == 0);
+    // forces the ring to grow past its initial capacity
+    rc = push_iov_queue_t(queue, "world", 5, count_release, &released);
+    assert(rc == 0);
+    assert(pending_iov_queue_t(queue) == 15);
+
+    ssize_t written = flush_iov_queue_t(queue, pair[0]);
+    assert(written == 15);
+    assert(released == 3);
+    assert(pending_iov_queue_t(queue) == 0);
+
+    char hdr[4], body[32];
+    memset(body, 0, sizeof(body));
+    ssize_t got = readv_header_body(pair[1], hdr, sizeof(hdr), body, sizeof(body));
+    assert(got == 15);
+    assert(memcmp(hdr, "hdr:", 4) == 0);
+    assert(memcmp(body, "hello world", 11) == 0);
+
+    // partial writes: a payload larger than the socket buffer on a non-blocking
+    // socket has to be resumed across several flushes
+    size_t big_len = 4 * 1024 * 1024;
+    char *big = malloc(big_len);
+    assert(big != NULL);
+    for (size_t i = 0; i < big_len; i++) {
+        big[i] = (char)(i % 251);
+    }
+    set_socket_blocking_status(pair[0], false);
+    rc = push_iov_queue_t(queue, big, big_len / 2, count_release, &released);
+    assert(rc == 0);
+    rc = push_iov_queue_t(queue, big + big_len / 2, big_len / 2, count_release,
+                          &released);
+    assert(rc == 0);
+
+    char *recv_buf = malloc(big_len);
+    assert(recv_buf != NULL);
+    size_t received = 0;
+    int flushes = 0;
+    while (received < big_len) {
+        written = flush_iov_queue_t(queue, pair[0]);
+        assert(written >= 0);
+        flushes += 1;
+        got = read(pair[1], recv_buf + received, big_len - received);
+        assert(got > 0);
+        received += (size_t)got;
+    }
+    assert(flushes > 1);
+    assert(released == 5);
+    assert(memcmp(big, recv_buf, big_len) == 0);
+
+    free(big);
+    free(recv_buf);
+    free_iov_queue_t(queue);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+void *zerocopy_sender(void *data) {
+    socket_client_t *sock_client = (socket_client_t *)data;
+    char buffer[65536];
+    for (int i = 0; i < 64; i++) {
+        memset(buffer, 'a' + (i % 26), sizeof(buffer));
+        int sent = send(sock_client->socket_number, buffer, sizeof(buffer), 0);
+        assert(sent == sizeof(buffer));
+    }
+    free_socket_client_t(sock_client);
+    pthread_exit(NULL);
+}
+
+void test_zerocopy_rx(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+
+    int fd = listen_socket(thl, "127.0.0.1", "5003", true, true, default_sock_opts, default_socket_opts_count);
+    assert(fd > 0);
+
+    socket_client_t *sock_client = new_client_socket(thl, "127.0.0.1", "5003", true, true);
+    assert(sock_client != NULL);
+
+    int conn_fd = accept_socket(thl, fd);
+    assert(conn_fd > 0);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, zerocopy_sender, sock_client);
+
+    zerocopy_rx_t *zrx = new_zerocopy_rx_t(thl, conn_fd, 0);
+    assert(zrx != NULL);
+
+    // mapped or copied, every byte must arrive in order
+    size_t received = 0;
+    zerocopy_view_t view;
+    for (;;) {
+        ssize_t n = recv_zerocopy_rx_t(zrx, &view);
+        assert(n >= 0);
+        if (n == 0) {
+            break;
+        }
+        assert((size_t)n == view.mapped_len + view.copied_len);
+        char *parts[2] = {view.mapped, view.copied};
+        size_t lens[2] = {view.mapped_len, view.copied_len};
+        for (int p = 0; p < 2; p++) {
+            for (size_t i = 0; i < lens[p]; i++) {
+                assert(parts[p][i] == 'a' + (int)(((received + i) / 65536) % 26));
+            }
+            received += lens[p];
+        }
+    }
+    assert(received == 64 * 65536);
+    assert(zrx->mapped_bytes + zrx->copied_bytes == received);
+    LOGF_DEBUG(thl, 0, "zerocopy mapped %zu bytes, copied %zu bytes", zrx->mapped_bytes, zrx->copied_bytes);
+
+    pthread_join(thread, NULL);
+    free_zerocopy_rx_t(zrx);
+    close(conn_fd);
+    close(fd);
+    clear_thread_logger(thl);
+}
+
+void test_unix_socket(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+
+    typedef struct args {
+        char *path;
+        bool seqpacket;
+    } args_t;
+
+    args_t tests[3];
+    tests[0].path = "/tmp/cnet-test.sock";
+    tests[0].seqpacket = false;
+    tests[1].path = "@cnet-test";
+    tests[1].seqpacket = false;
+    tests[2].path = "@cnet-test-seqpacket";
+    tests[2].seqpacket = true;
+
+    fd_pool_t *fpool = new_fd_pool_t();
+    assert(fpool != NULL);
+
+    for (int i = 0; i < 3; i++) {
+        int fd = listen_unix_socket(thl, tests[i].path, tests[i].seqpacket, default_sock_opts, default_socket_opts_count);
+        assert(fd > 0);
+        set_fd_pool_t(fpool, fd, true);
+
+        socket_client_t *sock_client = new_unix_client_socket(thl, tests[i].path, tests[i].seqpacket);
+        assert(sock_client != NULL);
+        assert(sock_client->peer_address == NULL);
+
+        fd_set active_set;
+        int num_active = get_active_fd_pool_t(fpool, &active_set, true, true);
+        assert(num_active == 1);
+        assert(FD_ISSET(fd, &active_set));
+
+        int conn_fd = accept_socket(thl, fd);
+        assert(conn_fd > 0);
+
+        int sent = send(sock_client->socket_number, "hello", 5, 0);
+        assert(sent == 5);
+        sent = send(sock_client->socket_number, "world", 5, 0);
+        assert(sent == 5);
+
+        char buffer[16];
+        memset(buffer, 0, sizeof(buffer));
+        if (tests[i].seqpacket) {
+            // message boundaries are preserved
+            int rc = recv(conn_fd, buffer, sizeof(buffer), 0);
+            assert(rc == 5);
+            assert(memcmp(buffer, "hello", 5) == 0);
+            rc = recv(conn_fd, buffer, sizeof(buffer), 0);
+            assert(rc == 5);
+            assert(memcmp(buffer, "world", 5) == 0);
+        } else {
+            size_t got = 0;
+            while (got < 10) {
+                int rc = recv(conn_fd, buffer + got, sizeof(buffer) - got, 0);
+                assert(rc > 0);
+                got += rc;
+            }
+            assert(memcmp(buffer, "helloworld", 10) == 0);
+        }
+
+        clear_fd_pool_t(fpool, fd, true);
+        assert(fpool->num_tcp_fds == 0);
+        close(conn_fd);
+        free_socket_client_t(sock_client);
+        close(fd);
+    }
+    unlink("/tmp/cnet-test.sock");
+
+    free_fd_pool_t(fpool);
+    clear_thread_logger(thl);
+}
+
+typedef struct shm_server_args {
+    int listen_fd;
+    size_t received;
+    bool valid;
+} shm_server_args_t;
+
+void *shm_server(void *data) {
+    shm_server_args_t *args = (shm_server_args_t *)data;
+    thread_logger *thl = new_thread_logger(true);
+    shm_client_t *conn = accept_shm_socket(thl, args->listen_fd, 8192);
+    assert(conn != NULL);
+    args->valid = true;
+    char buffer[3000];
+    for (;;) {
+        ssize_t n = recv_shm_client_t(conn, buffer, sizeof(buffer), 0);
+        assert(n >= 0);
+        if (n == 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            if (buffer[i] != (char)((args->received + i) % 251)) {
+                args->valid = false;
+            }
+        }
+        args->received += n;
+        if (args->received == 1000000) {
+            ssize_t sent = send_shm_client_t(conn, "done", 4, 0);
+            assert(sent == 4);
+        }
+    }
+    free_shm_client_t(conn);
+    clear_thread_logger(thl);
+    pthread_exit(NULL);
+}
+
+void test_shm_ring(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+
+    int fd = listen_shm_socket(thl, "@cnet-test-shm");
+    assert(fd > 0);
+
+    shm_server_args_t args;
+    memset(&args, 0, sizeof(args));
+    args.listen_fd = fd;
+    pthread_t thread;
+    pthread_create(&thread, NULL, shm_server, &args);
+
+    shm_client_t *client = new_shm_client_socket(thl, "@cnet-test-shm");
+    assert(client != NULL);
+    assert(client->capacity == 8192);
+
+    // nothing to read yet, so waiting on the eventfd is allowed
+    char reply[8];
+    ssize_t n = recv_shm_client_t(client, reply, sizeof(reply), MSG_DONTWAIT);
+    assert(n == -1 && errno == EAGAIN);
+    bool armed = arm_shm_client_t(client);
+    assert(armed == true);
+
+    // far more than the ring holds, so the sender blocks and the ring wraps
+    char buffer[1000];
+    size_t sent = 0;
+    while (sent < 1000000) {
+        for (size_t i = 0; i < sizeof(buffer); i++) {
+            buffer[i] = (char)((sent + i) % 251);
+        }
+        n = send_shm_client_t(client, buffer, sizeof(buffer), 0);
+        assert(n == sizeof(buffer));
+        sent += n;
+    }
+
+    fd_pool_t *fpool = new_fd_pool_t();
+    set_fd_pool_t(fpool, client->event_fd, true);
+    fd_set active_set;
+    int num_active = get_active_fd_pool_t(fpool, &active_set, true, true);
+    assert(num_active == 1);
+
+    memset(reply, 0, sizeof(reply));
+    n = recv_shm_client_t(client, reply, sizeof(reply), 0);
+    assert(n == 4);
+    assert(memcmp(reply, "done", 4) == 0);
+    // taking data ends the arm, sends no longer write the eventfd
+    assert(atomic_load(&client->rx.hdr->consumer_waiting) == 0);
+
+    free_shm_client_t(client);
+    pthread_join(thread, NULL);
+    assert(args.received == 1000000);
+    assert(args.valid == true);
+
+    free_fd_pool_t(fpool);
+    close(fd);
+    clear_thread_logger(thl);
+}
+
+typedef struct shm_bad_server_args {
+    int listen_fd;
+    uint64_t capacities[2];
+} shm_bad_server_args_t;
+
+/*!
+ * @brief answers two clients with handshakes a well behaved server never sends
+ */
+void *shm_bad_server(void *data) {
+    shm_bad_server_args_t *args = data;
+    for (int round = 0; round < 2; round++) {
+        int conn = accept(args->listen_fd, NULL, NULL);
+        assert(conn != -1);
+        // laid out like the handshake in shm_ring.c, with a single page
+        // standing in for the memfd
+        struct {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t capacity;
+        } handshake = {0x636e6574, 1, args->capacities[round]};
+        FILE *page = tmpfile();
+        assert(page != NULL);
+        int rc = ftruncate(fileno(page), 4096);
+        assert(rc == 0);
+        int fds[5];
+        fds[0] = dup(fileno(page));
+        assert(fds[0] != -1);
+        fclose(page);
+        for (int i = 1; i < 5; i++) {
+            fds[i] = eventfd(0, 0);
+            assert(fds[i] != -1);
+        }
+        rc = send_fds_socket(conn, fds, 5, &handshake, sizeof(handshake));
+        assert(rc == (int)sizeof(handshake));
+        for (int i = 0; i < 5; i++) {
+            close(fds[i]);
+        }
+        close(conn);
+    }
+    return NULL;
+}
+
+void test_shm_ring_handshake(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+    int fd = listen_shm_socket(thl, "@cnet-test-shm-bad");
+    assert(fd > 0);
+
+    // a capacity that is not a power of two, then one the memfd can not hold
+    shm_bad_server_args_t args = {.listen_fd = fd, .capacities = {3, 8192}};
+    pthread_t thread;
+    pthread_create(&thread, NULL, shm_bad_server, &args);
+    for (int round = 0; round < 2; round++) {
+        shm_client_t *client = new_shm_client_socket(thl, "@cnet-test-shm-bad");
+        assert(client == NULL);
+    }
+    pthread_join(thread, NULL);
+
+    close(fd);
+    clear_thread_logger(thl);
+}
+
+void test_handoff(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+
+    int fd = listen_socket(thl, "127.0.0.1", "5004", true, true, default_sock_opts, default_socket_opts_count);
+    assert(fd > 0);
+
+    socket_client_t *clients[3];
+    for (int i = 0; i < 3; i++) {
+        clients[i] = new_client_socket(thl, "127.0.0.1", "5004", true, true);
+        assert(clients[i] != NULL);
+    }
+
+    int channels[2][2];
+    int rc = new_handoff_channel(channels[0]);
+    assert(rc == 0);
+    rc = new_handoff_channel(channels[1]);
+    assert(rc == 0);
+
+    int acceptor_side[2] = {channels[0][0], channels[1][0]};
+    handoff_dispatcher_t *dispatcher = new_handoff_dispatcher_t(acceptor_side, 2);
+    assert(dispatcher != NULL);
+
+    // all three connections are already queued so they are accepted as one
+    // batch, which is split across both workers
+    int handed = dispatch_handoff_dispatcher_t(dispatcher, thl, fd);
+    assert(handed == 3);
+    assert(dispatcher->handed_off[0] == 2);
+    assert(dispatcher->handed_off[1] == 1);
+
+    // worker side
+    fd_pool_t *fpool = new_fd_pool_t();
+    assert(fpool != NULL);
+    int fds[2 * HANDOFF_MAX_BATCH];
+    handoff_meta_t meta[2 * HANDOFF_MAX_BATCH];
+    int received = recv_handoff(thl, channels[0][1], fpool, fds, meta);
+    assert(received == 2);
+    received = recv_handoff(thl, channels[1][1], fpool, &fds[2], &meta[2]);
+    assert(received == 1);
+    assert(fpool->num_tcp_fds == 3);
+
+    for (int i = 0; i < 3; i++) {
+        assert(meta[i].accepted_at > 0);
+        assert(meta[i].peer.ss_family == AF_INET);
+        int sent = send(clients[i]->socket_number, "hello", 5, 0);
+        assert(sent == 5);
+        char buffer[8];
+        int got = read(fds[i], buffer, sizeof(buffer));
+        assert(got == 5);
+        assert(is_set_fd_pool_t(fpool, fds[i], true));
+        close(fds[i]);
+        free_socket_client_t(clients[i]);
+    }
+
+    // the acceptor going away shows up as an empty batch
+    close(channels[0][0]);
+    received = recv_handoff(thl, channels[0][1], NULL, fds, meta);
+    assert(received == 0);
+
+    close(channels[0][1]);
+    close(channels[1][0]);
+    close(channels[1][1]);
+    free_handoff_dispatcher_t(dispatcher);
+    free_fd_pool_t(fpool);
+    close(fd);
+    clear_thread_logger(thl);
+}
+
+void *handover_replacement(void *data) {
+    char *path = data;
+    thread_logger *thl = new_thread_logger(true);
+    int fds[HANDOVER_MAX_FDS];
+    int ready_fd = -1;
+    int num_fds = recv_handover(thl, path, fds, HANDOVER_MAX_FDS, &ready_fd);
+    assert(num_fds == 1);
+    assert(ready_fd >= 0);
+
+    // the client connected before this accept, the old process never accepted it
+    int conn = accept_socket(thl, fds[0]);
+    assert(conn > 0);
+    char buffer[8];
+    int got = read(conn, buffer, sizeof(buffer));
+    assert(got == 5);
+    int rc = confirm_handover(ready_fd);
+    assert(rc == 0);
+
+    close(conn);
+    close(fds[0]);
+    clear_thread_logger(thl);
+    return NULL;
+}
+
+void test_handover(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+
+    int fd = listen_socket(thl, "127.0.0.1", "5005", true, true, default_sock_opts, default_socket_opts_count);
+    assert(fd > 0);
+
+    // LISTEN_FDS: the child sees the listening socket at fd 3
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        int fds[HANDOVER_MAX_FDS];
+        int ready_fd = 0;
+        if (export_listen_fds(&fd, 1, -1) != 0) {
+            _exit(1);
+        }
+        int num_fds = inherit_listen_fds(thl, fds, HANDOVER_MAX_FDS, &ready_fd);
+        int type = 0;
+        socklen_t type_len = sizeof(type);
+        getsockopt(LISTEN_FDS_START, SOL_SOCKET, SO_TYPE, &type, &type_len);
+        bool ok = num_fds == 1 && fds[0] == LISTEN_FDS_START && ready_fd == -1 &&
+                  type == SOCK_STREAM && getenv("LISTEN_FDS") == NULL;
+        _exit(ok ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // control socket
+    int control_fd = listen_unix_socket(thl, "@cnet-test-handover", false, default_sock_opts, default_socket_opts_count);
+    assert(control_fd > 0);
+
+    pthread_t replacement;
+    pthread_create(&replacement, NULL, handover_replacement, "@cnet-test-handover");
+
+    int conn = accept_socket(thl, control_fd);
+    assert(conn > 0);
+    int rc = send_handover(thl, conn, &fd, 1);
+    assert(rc == 0);
+
+    socket_client_t *client = new_client_socket(thl, "127.0.0.1", "5005", true, true);
+    assert(client != NULL);
+    int sent = send(client->socket_number, "hello", 5, 0);
+    assert(sent == 5);
+
+    rc = wait_handover(thl, conn, HANDOVER_TIMEOUT_MS);
+    assert(rc == 0);
+    pthread_join(replacement, NULL);
+
+    free_socket_client_t(client);
+    close(control_fd);
+    close(fd);
+    clear_thread_logger(thl);
+}
+
+void prefork_test_worker(prefork_t *prefork, size_t worker_id, void *arg) {
+    int report_fd = *(int *)arg;
+    thread_logger *thl = new_thread_logger(false);
+    SOCKET_OPTS opts[] = {REUSEADDR, REUSEPORT, BLOCK};
+    int fd = listen_socket(thl, "127.0.0.1", "5006", true, true, opts, 3);
+    // report which worker came up and whether it could share the port
+    char report = fd > 0 ? (char)('a' + worker_id) : 'x';
+    if (write(report_fd, &report, 1) != 1) {
+        _exit(2);
+    }
+    if (worker_id == 0 && prefork->restarts[0] == 0) {
+        // the first incarnation of worker 0 crashes
+        abort();
+    }
+    pause();
+}
+
+void test_prefork(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+
+    int report[2];
+    int rc = pipe(report);
+    assert(rc == 0);
+
+    prefork_t *prefork = new_prefork_t(thl, 2, prefork_test_worker, &report[1]);
+    assert(prefork != NULL);
+    rc = start_prefork_t(prefork);
+    assert(rc == 0);
+    assert(running_prefork_t(prefork) == 2);
+
+    char reports[3];
+    int got = read(report[0], &reports[0], 1);
+    assert(got == 1);
+    got = read(report[0], &reports[1], 1);
+    assert(got == 1);
+
+    // worker 0 crashes and is brought back
+    rc = reap_prefork_t(prefork, true);
+    assert(rc == 1);
+    assert(prefork->restarts[0] == 1);
+    assert(prefork->restarts[1] == 0);
+    assert(running_prefork_t(prefork) == 2);
+    got = read(report[0], &reports[2], 1);
+    assert(got == 1);
+
+    int seen_a = 0, seen_b = 0;
+    for (int i = 0; i < 3; i++) {
+        assert(reports[i] == 'a' || reports[i] == 'b');
+        seen_a += reports[i] == 'a';
+        seen_b += reports[i] == 'b';
+    }
+    assert(seen_a == 2 && seen_b == 1);
+
+    stop_prefork_t(prefork);
+    assert(running_prefork_t(prefork) == 0);
+    rc = reap_prefork_t(prefork, false);
+    assert(rc == -1 || rc == 0);
+
+    free_prefork_t(prefork);
+    close(report[0]);
+    close(report[1]);
+    clear_thread_logger(thl);
+}
+
+void *buffer_pool_thread(void *data) {
+    buffer_pool_t *pool = data;
+    void *held[32];
+    for (int round = 0; round < 1000; round++) {
+        for (int i = 0; i < 32; i++) {
+            held[i] = get_buffer_pool_t(pool, (size_t)(64 << (i % 8)));
+            assert(held[i] != NULL);
+            memset(held[i], i, (size_t)(64 << (i % 8)));
+        }
+        for (int i = 0; i < 32; i++) {
+            put_buffer_pool_t(held[i]);
+        }
+    }
+    return NULL;
+}
+
+void test_buffer_pool(void **state) {
+    buffer_pool_t *pool = new_buffer_pool_t(false);
+    assert(pool != NULL);
+
+    void *small = get_buffer_pool_t(pool, 100);
+    assert(small != NULL);
+    assert(size_buffer_pool_t(small) == 256);
+    assert(((uintptr_t)small & 15) == 0);
+    void *medium = get_buffer_pool_t(pool, 1025);
+    assert(size_buffer_pool_t(medium) == 2048);
+    void *large = get_buffer_pool_t(pool, BUFFER_POOL_MAX_SIZE + 1);
+    assert(large != NULL);
+    assert(size_buffer_pool_t(large) == BUFFER_POOL_MAX_SIZE + 1);
+
+    // a freed buffer is handed straight back out by the thread's magazine
+    put_buffer_pool_t(small);
+    void *again = get_buffer_pool_t(pool, 200);
+    assert(again == small);
+    put_buffer_pool_t(again);
+    put_buffer_pool_t(medium);
+    put_buffer_pool_t(large);
+
+    buffer_pool_stats_t stats;
+    stats_buffer_pool_t(pool, &stats);
+    assert(stats.gets == 3);
+    assert(stats.puts == 3);
+    assert(stats.large_gets == 1);
+    assert(stats.slabs == 2);
+    assert(stats.threads == 1);
+
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&threads[i], NULL, buffer_pool_thread, pool);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // exited threads hand their magazines back, only ours is left
+    stats_buffer_pool_t(pool, &stats);
+    assert(stats.threads == 1);
+    assert(stats.gets == stats.puts);
+    assert(stats.gets == 3 + 4 * 1000 * 32);
+    size_t cached = 0;
+    for (size_t i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        cached += stats.in_use[i];
+    }
+    // whatever is still counted in use sits in this thread's magazines
+    assert(cached <= BUFFER_POOL_CLASSES * BUFFER_POOL_MAGAZINE_SIZE);
+
+    // pool buffers can be released by an iov_queue once they are written
+    iov_queue_t *queue = new_iov_queue_t(4);
+    assert(queue != NULL);
+    int pair[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+    char *out = get_buffer_pool_t(pool, 5);
+    memcpy(out, "hello", 5);
+    rc = push_iov_queue_t(queue, out, 5, put_buffer_pool_t, out);
+    assert(rc == 0);
+    ssize_t flushed = flush_iov_queue_t(queue, pair[0]);
+    assert(flushed == 5);
+    stats_buffer_pool_t(pool, &stats);
+    assert(stats.gets == stats.puts);
+
+    free_iov_queue_t(queue);
+    close(pair[0]);
+    close(pair[1]);
+    free_buffer_pool_t(pool);
+}
+
+void test_mirror_ring(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+
+    mirror_ring_t *ring = new_mirror_ring_t(thl, 100);
+    assert(ring != NULL);
+    size_t capacity = ring->capacity;
+    assert(capacity >= 100 && capacity % 4096 == 0);
+
+    // both mappings are the same memory
+    ring->base[10] = 'x';
+    assert(ring->base[capacity + 10] == 'x');
+
+    int pair[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+
+    // move the ring position close to the end
+    size_t len;
+    write_span_mirror_ring_t(ring, &len);
+    assert(len == capacity);
+    produce_mirror_ring_t(ring, capacity - 3);
+    consume_mirror_ring_t(ring, capacity - 3);
+
+    // a length prefixed frame that wraps around the end of the ring
+    char frame[12] = {0, 0, 0, 8, 'w', 'r', 'a', 'p', 'p', 'e', 'd', '!'};
+    int sent = send(pair[1], frame, sizeof(frame), 0);
+    assert(sent == sizeof(frame));
+    ssize_t got = fill_mirror_ring_t(ring, pair[0]);
+    assert(got == sizeof(frame));
+
+    char *span = read_span_mirror_ring_t(ring, &len);
+    assert(len == sizeof(frame));
+    assert(span + len > ring->base + capacity);
+    uint32_t frame_len = ((uint32_t)(unsigned char)span[2] << 8) | (unsigned char)span[3];
+    assert(frame_len == 8);
+    assert(memcmp(span + 4, "wrapped!", 8) == 0);
+    consume_mirror_ring_t(ring, 4 + frame_len);
+
+    // a full ring refuses to read
+    produce_mirror_ring_t(ring, capacity);
+    got = fill_mirror_ring_t(ring, pair[0]);
+    assert(got == -1 && errno == ENOBUFS);
+    consume_mirror_ring_t(ring, capacity);
+
+    // drain writes the readable span in one go
+    memcpy(write_span_mirror_ring_t(ring, &len), "hello", 5);
+    produce_mirror_ring_t(ring, 5);
+    got = drain_mirror_ring_t(ring, pair[0]);
+    assert(got == 5);
+    char buffer[8];
+    got = read(pair[1], buffer, sizeof(buffer));
+    assert(got == 5);
+    read_span_mirror_ring_t(ring, &len);
+    assert(len == 0);
+
+    close(pair[0]);
+    close(pair[1]);
+    free_mirror_ring_t(ring);
+    clear_thread_logger(thl);
+}
+
+int wrapped_releases = 0;
+void count_wrapped_release(void *arg) {
+    wrapped_releases += 1;
+}
+
+void test_buf_chain(void **state) {
+    buffer_pool_t *pool = new_buffer_pool_t(false);
+    assert(pool != NULL);
+
+    // one payload, wrapped without copying
+    char payload[] = "broadcast payload";
+    buf_block_t *block = wrap_buf_block_t(pool, payload, strlen(payload),
+                                          count_wrapped_release, NULL);
+    assert(block != NULL);
+
+    buf_chain_t *chain = new_buf_chain_t(pool);
+    assert(chain != NULL);
+    int rc = append_buf_chain_t(chain, block, 0, strlen(payload));
+    assert(rc == 0);
+    // the chain holds its own reference
+    unref_buf_block_t(block);
+    assert(wrapped_releases == 0);
+
+    rc = prepend_bytes_buf_chain_t(chain, "HDR:", 4);
+    assert(rc == 0);
+    rc = append_bytes_buf_chain_t(chain, "\n", 1);
+    assert(rc == 0);
+    rc = append_bytes_buf_chain_t(chain, "\n", 1);
+    assert(rc == 0);
+    // the second append grew the trailer block in place
+    assert(chain->num_slices == 3);
+    assert(chain->length == 4 + strlen(payload) + 2);
+
+    struct iovec iovs[8];
+    int num_iovs = fill_iov_buf_chain_t(chain, iovs, 8);
+    assert(num_iovs == 3);
+    assert(iovs[1].iov_base == payload);
+
+    // slicing shares the blocks
+    buf_chain_t *word = slice_buf_chain_t(chain, 2, 9);
+    assert(word != NULL);
+    assert(word->length == 9);
+    char flat[32];
+    size_t off = 0;
+    num_iovs = fill_iov_buf_chain_t(word, iovs, 8);
+    for (int i = 0; i < num_iovs; i++) {
+        memcpy(flat + off, iovs[i].iov_base, iovs[i].iov_len);
+        off += iovs[i].iov_len;
+    }
+    assert(memcmp(flat, "R:broadca", 9) == 0);
+    free_buf_chain_t(word);
+
+    // fan the same chain out to three connections through their write queues
+    int pairs[3][2];
+    iov_queue_t *queues[3];
+    for (int i = 0; i < 3; i++) {
+        rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]);
+        assert(rc == 0);
+        queues[i] = new_iov_queue_t(4);
+        assert(queues[i] != NULL);
+        buf_chain_t *copy = slice_buf_chain_t(chain, 0, chain->length);
+        assert(copy != NULL);
+        rc = queue_buf_chain_t(copy, queues[i]);
+        assert(rc == 0);
+        assert(copy->length == 0);
+        free_buf_chain_t(copy);
+    }
+    size_t total = chain->length;
+    free_buf_chain_t(chain);
+    assert(wrapped_releases == 0);
+
+    for (int i = 0; i < 3; i++) {
+        ssize_t flushed = flush_iov_queue_t(queues[i], pairs[i][0]);
+        assert(flushed == (ssize_t)total);
+        char buffer[64];
+        ssize_t got = read(pairs[i][1], buffer, sizeof(buffer));
+        assert(got == (ssize_t)total);
+        assert(memcmp(buffer, "HDR:broadcast payload\n\n", total) == 0);
+        free_iov_queue_t(queues[i]);
+    }
+    // the last writer dropped the last reference
+    assert(wrapped_releases == 1);
+
+    // partial writes through writev leave the rest of the chain in place
+    chain = new_buf_chain_t(NULL);
+    assert(chain != NULL);
+    rc = append_bytes_buf_chain_t(chain, "0123456789", 10);
+    assert(rc == 0);
+    consume_buf_chain_t(chain, 4);
+    int pair[2];
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+    ssize_t written = write_buf_chain_t(chain, pair[0]);
+    assert(written == 6);
+    assert(chain->length == 0 && chain->head == NULL);
+    char buffer[16];
+    ssize_t got = read(pair[1], buffer, sizeof(buffer));
+    assert(got == 6);
+    assert(memcmp(buffer, "456789", 6) == 0);
+    // a peer that went away is an error, not a SIGPIPE
+    close(pair[1]);
+    rc = append_bytes_buf_chain_t(chain, "gone", 4);
+    assert(rc == 0);
+    written = write_buf_chain_t(chain, pair[0]);
+    assert(written == -1 && errno == EPIPE);
+    assert(chain->length == 4);
+    free_buf_chain_t(chain);
+    close(pair[0]);
+
+    // pipes are not sockets and go through writev
+    rc = pipe(pair);
+    assert(rc == 0);
+    chain = new_buf_chain_t(NULL);
+    assert(chain != NULL);
+    rc = append_bytes_buf_chain_t(chain, "piped", 5);
+    assert(rc == 0);
+    written = write_buf_chain_t(chain, pair[1]);
+    assert(written == 5);
+    got = read(pair[0], buffer, sizeof(buffer));
+    assert(got == 5);
+    assert(memcmp(buffer, "piped", 5) == 0);
+    free_buf_chain_t(chain);
+    close(pair[0]);
+    close(pair[1]);
+
+    buffer_pool_stats_t stats;
+    stats_buffer_pool_t(pool, &stats);
+    assert(stats.gets == stats.puts);
+    for (int i = 0; i < 3; i++) {
+        close(pairs[i][0]);
+        close(pairs[i][1]);
+    }
+    free_buffer_pool_t(pool);
+}
+
+void test_conn_buffer(void **state) {
+    buffer_pool_t *pool = new_buffer_pool_t(false);
+    assert(pool != NULL);
+    conn_buffer_t *buffer = new_conn_buffer_t(pool);
+    assert(buffer != NULL);
+    // nothing is borrowed before data arrives
+    assert(buffer->data == NULL);
+    assert(footprint_conn_buffer_t(buffer) == sizeof(conn_buffer_t));
+
+    int pair[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+    set_socket_blocking_status(pair[0], false);
+
+    char message[8192];
+    memset(message, 'm', sizeof(message));
+
+    // a message larger than the buffer grows it while it is being read
+    int sent = send(pair[1], message, 3000, 0);
+    assert(sent == 3000);
+    ssize_t got = read_conn_buffer_t(buffer, pair[0]);
+    assert(got == CONN_BUFFER_MIN);
+    got = read_conn_buffer_t(buffer, pair[0]);
+    assert(got > 0);
+    got = read_conn_buffer_t(buffer, pair[0]);
+    assert(got > 0);
+    size_t len;
+    char *data = peek_conn_buffer_t(buffer, &len);
+    assert(len == 3000);
+    assert(data[2999] == 'm');
+    assert(buffer->capacity >= 4096);
+
+    // once everything is consumed the connection is idle again
+    consume_conn_buffer_t(buffer, 1000);
+    assert(buffer->data != NULL);
+    consume_conn_buffer_t(buffer, 2000);
+    assert(buffer->data == NULL);
+    got = read_conn_buffer_t(buffer, pair[0]);
+    assert(got == -1 && errno == EAGAIN);
+    assert(buffer->data == NULL);
+
+    // a run of small reads shrinks what is borrowed
+    size_t grown = buffer->target;
+    assert(grown > CONN_BUFFER_MIN);
+    for (int i = 0; i < CONN_BUFFER_SHRINK_READS * 4; i++) {
+        sent = send(pair[1], message, 10, 0);
+        assert(sent == 10);
+        got = read_conn_buffer_t(buffer, pair[0]);
+        assert(got == 10);
+        consume_conn_buffer_t(buffer, 10);
+    }
+    assert(buffer->target < grown);
+    assert(buffer->target >= CONN_BUFFER_MIN);
+
+    conn_buffer_t *busy = new_conn_buffer_t(pool);
+    assert(busy != NULL);
+    sent = send(pair[1], message, 100, 0);
+    assert(sent == 100);
+    got = read_conn_buffer_t(busy, pair[0]);
+    assert(got == 100);
+
+    conn_buffer_t *all[2] = {buffer, busy};
+    conn_buffer_report_t report;
+    report_conn_buffers(all, 2, &report);
+    assert(report.connections == 2);
+    assert(report.idle == 1);
+    assert(report.bytes_per_idle == (double)sizeof(conn_buffer_t));
+    assert(report.held_bytes == busy->capacity);
+
+    free_conn_buffer_t(busy);
+    free_conn_buffer_t(buffer);
+    buffer_pool_stats_t stats;
+    stats_buffer_pool_t(pool, &stats);
+    assert(stats.gets == stats.puts);
+    close(pair[0]);
+    close(pair[1]);
+    free_buffer_pool_t(pool);
+}
+
+void test_mem_budget(void **state) {
+    fd_pool_t *read_pool = new_fd_pool_t();
+    assert(read_pool != NULL);
+    mem_budget_t *budget = new_mem_budget_t(16384, 4096, read_pool, true);
+    assert(budget != NULL);
+
+    int pair[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+    set_socket_blocking_status(pair[0], false);
+    set_fd_pool_t(read_pool, pair[0], true);
+    int listener = pair[1];
+    set_fd_pool_t(read_pool, listener, true);
+    rc = watch_listener_mem_budget_t(budget, listener);
+    assert(rc == 0);
+
+    // a connection reading past its own cap stops being polled for reads
+    buffer_pool_t *pool = new_buffer_pool_t(false);
+    assert(pool != NULL);
+    conn_buffer_t *buffer = new_conn_buffer_t(pool);
+    assert(buffer != NULL);
+    buffer->account = new_mem_account_t(budget, pair[0]);
+    assert(buffer->account != NULL);
+    char message[8192];
+    memset(message, 'b', sizeof(message));
+    int sent = send(pair[1], message, sizeof(message), 0);
+    assert(sent == (int)sizeof(message));
+    while (paused_mem_account_t(buffer->account) == false) {
+        ssize_t got = read_conn_buffer_t(buffer, pair[0]);
+        assert(got > 0);
+    }
+    assert(is_set_fd_pool_t(read_pool, pair[0], true) == false);
+    assert(is_set_fd_pool_t(read_pool, listener, true) == true);
+    mem_budget_gauges_t gauges;
+    gauges_mem_budget_t(budget, &gauges);
+    assert(gauges.used == buffer->capacity);
+    assert(gauges.paused_connections == 1);
+    assert(gauges.pauses == 1);
+
+    // consuming what was read resumes it
+    consume_conn_buffer_t(buffer, buffer->len);
+    assert(paused_mem_account_t(buffer->account) == false);
+    assert(is_set_fd_pool_t(read_pool, pair[0], true) == true);
+    gauges_mem_budget_t(budget, &gauges);
+    assert(gauges.used == 0);
+    assert(gauges.peak >= 4096);
+
+    // write queues count too, and the global cap pauses accepting
+    iov_queue_t *queue = new_iov_queue_t(0);
+    assert(queue != NULL);
+    queue->account = new_mem_account_t(budget, pair[1]);
+    assert(queue->account != NULL);
+    for (int i = 0; i < 3; i++) {
+        rc = push_iov_queue_t(queue, message, 1000, NULL, NULL);
+        assert(rc == 0);
+    }
+    mem_account_t *others[4];
+    for (int i = 0; i < 4; i++) {
+        others[i] = new_mem_account_t(budget, 1000 + i);
+        assert(others[i] != NULL);
+    }
+    for (int i = 0; i < 3; i++) {
+        bool ok = charge_mem_account_t(others[i], 3500);
+        assert(ok == true);
+    }
+    assert(admit_mem_budget_t(budget) == true);
+    bool ok = charge_mem_account_t(others[3], 3500);
+    assert(ok == false);
+    assert(admit_mem_budget_t(budget) == false);
+    gauges_mem_budget_t(budget, &gauges);
+    assert(gauges.used == 3000 + 4 * 3500);
+    assert(gauges.accept_paused == true);
+    assert(gauges.refused == 1);
+    assert(is_set_fd_pool_t(read_pool, listener, true) == false);
+
+    // freeing the accounts gives everything back
+    for (int i = 0; i < 4; i++) {
+        free_mem_account_t(others[i]);
+    }
+    gauges_mem_budget_t(budget, &gauges);
+    assert(gauges.accept_paused == false);
+    assert(admit_mem_budget_t(budget) == true);
+    assert(is_set_fd_pool_t(read_pool, listener, true) == true);
+    mem_account_t *queue_account = queue->account;
+    free_iov_queue_t(queue);
+    free_mem_account_t(queue_account);
+    gauges_mem_budget_t(budget, &gauges);
+    assert(gauges.used == 0);
+    assert(gauges.paused_connections == 0);
+
+    mem_account_t *account = buffer->account;
+    free_conn_buffer_t(buffer);
+    free_mem_account_t(account);
+    free_mem_budget_t(budget);
+
+    // a connection paused for its own cap resumes once it drains, even while
+    // the global usage stays between the resume mark and the cap
+    budget = new_mem_budget_t(100000, 4096, read_pool, true);
+    assert(budget != NULL);
+    mem_account_t *busy[20];
+    for (int i = 0; i < 20; i++) {
+        busy[i] = new_mem_account_t(budget, 2000 + i);
+        assert(busy[i] != NULL);
+        ok = charge_mem_account_t(busy[i], 4000);
+        assert(ok == true);
+    }
+    account = new_mem_account_t(budget, pair[0]);
+    assert(account != NULL);
+    ok = charge_mem_account_t(account, 5000);
+    assert(ok == false);
+    assert(is_set_fd_pool_t(read_pool, pair[0], true) == false);
+    credit_mem_account_t(account, 5000);
+    gauges_mem_budget_t(budget, &gauges);
+    assert(gauges.used == 80000);
+    assert(gauges.paused_connections == 0);
+    assert(paused_mem_account_t(account) == false);
+    assert(is_set_fd_pool_t(read_pool, pair[0], true) == true);
+    free_mem_account_t(account);
+    for (int i = 0; i < 20; i++) {
+        free_mem_account_t(busy[i]);
+    }
+    free_mem_budget_t(budget);
+    free_buffer_pool_t(pool);
+    free_fd_pool_t(read_pool);
+    close(pair[0]);
+    close(pair[1]);
+}
+
+typedef struct reactor_test_state {
+    int reads;
+    int writes;
+    int errors;
+    int error;
+    int one_shots;
+    int periodic;
+    int tasks;
+    reactor_timer_t periodic_timer;
+} reactor_test_state_t;
+
+int reactor_test_read(reactor_t *reactor, int fd, void *arg) {
+    reactor_test_state_t *state = arg;
+    char buffer[64];
+    ssize_t rc = read(fd, buffer, sizeof(buffer));
+    if (rc <= 0) {
+        errno = rc == 0 ? ECONNRESET : errno;
+        return -1;
+    }
+    state->reads += 1;
+    return 0;
+}
+
+int reactor_test_write(reactor_t *reactor, int fd, void *arg) {
+    reactor_test_state_t *state = arg;
+    ssize_t rc = write(fd, "ping", 4);
+    if (rc != 4) {
+        return -1;
+    }
+    state->writes += 1;
+    // nothing more to send, stop asking for write readiness
+    want_write_reactor_t(reactor, fd, false);
+    return 0;
+}
+
+void reactor_test_error(reactor_t *reactor, int fd, int error, void *arg) {
+    reactor_test_state_t *state = arg;
+    state->errors += 1;
+    state->error = error;
+}
+
+void reactor_test_one_shot(reactor_t *reactor, reactor_timer_t *timer, void *arg) {
+    reactor_test_state_t *state = arg;
+    state->one_shots += 1;
+}
+
+void reactor_test_periodic(reactor_t *reactor, reactor_timer_t *timer, void *arg) {
+    reactor_test_state_t *state = arg;
+    state->periodic += 1;
+    if (state->periodic == 3) {
+        stop_timer_reactor_t(reactor, timer);
+    }
+}
+
+void reactor_test_task(reactor_t *reactor, void *arg) {
+    reactor_test_state_t *state = arg;
+    state->tasks += 1;
+    if (state->tasks < 3) {
+        // deferred again, this runs on the next iteration rather than this one
+        int rc = defer_reactor_t(reactor, reactor_test_task, state);
+        assert(rc == 0);
+    }
+}
+
+void *reactor_stopper(void *data) {
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 50000000};
+    nanosleep(&delay, NULL);
+    stop_reactor_t((reactor_t *)data);
+    return NULL;
+}
+
+void test_reactor(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+    reactor_t *reactor = new_reactor_t(thl);
+    assert(reactor != NULL);
+    reactor_test_state_t test_state;
+    memset(&test_state, 0, sizeof(test_state));
+
+    int pair[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+    set_socket_blocking_status(pair[0], false);
+    set_socket_blocking_status(pair[1], false);
+    rc = add_fd_reactor_t(reactor, pair[0], reactor_test_read, NULL, reactor_test_error,
+                          &test_state);
+    assert(rc == 0);
+    rc = add_fd_reactor_t(reactor, pair[1], NULL, reactor_test_write, reactor_test_error,
+                          &test_state);
+    assert(rc == 0);
+
+    // the writable end and the readable end are dispatched as they become ready
+    rc = run_once_reactor_t(reactor, 1000);
+    assert(rc == 1);
+    assert(test_state.writes == 1);
+    rc = run_once_reactor_t(reactor, 1000);
+    assert(rc == 1);
+    assert(test_state.reads == 1);
+    // write interest was dropped, so nothing else is ready
+    rc = run_once_reactor_t(reactor, 0);
+    assert(rc == 0);
+
+    // timers fire in deadline order and the loop only sleeps until the next one
+    reactor_timer_t one_shot;
+    init_timer_reactor_t(&one_shot);
+    init_timer_reactor_t(&test_state.periodic_timer);
+    rc = start_timer_reactor_t(reactor, &one_shot, 20, 0, reactor_test_one_shot, &test_state);
+    assert(rc == 0);
+    rc = start_timer_reactor_t(reactor, &test_state.periodic_timer, 5, 5,
+                               reactor_test_periodic, &test_state);
+    assert(rc == 0);
+    uint64_t started = now_reactor_t(reactor);
+    while (armed_timer_reactor_t(&one_shot) || armed_timer_reactor_t(&test_state.periodic_timer)) {
+        rc = run_once_reactor_t(reactor, -1);
+        assert(rc >= 0);
+    }
+    assert(test_state.one_shots == 1);
+    assert(test_state.periodic == 3);
+    assert(now_reactor_t(reactor) - started >= 20000000);
+    assert(reactor->stats.timers_fired == 4);
+
+    // a cancelled timer never fires
+    rc = start_timer_reactor_t(reactor, &one_shot, 1, 0, reactor_test_one_shot, &test_state);
+    assert(rc == 0);
+    stop_timer_reactor_t(reactor, &one_shot);
+    rc = run_once_reactor_t(reactor, 5);
+    assert(rc == 0);
+    assert(test_state.one_shots == 1);
+
+    // deferred tasks run once per iteration without blocking the poll
+    rc = defer_reactor_t(reactor, reactor_test_task, &test_state);
+    assert(rc == 0);
+    for (int i = 1; i <= 3; i++) {
+        rc = run_once_reactor_t(reactor, -1);
+        assert(rc == 1);
+        assert(test_state.tasks == i);
+    }
+
+    // a failing callback hands the error over and unregisters the fd
+    close(pair[1]);
+    rc = run_once_reactor_t(reactor, 1000);
+    assert(rc == 1);
+    assert(test_state.errors == 1);
+    assert(test_state.error == ECONNRESET);
+    assert(reactor->handlers[pair[0]].active == false);
+    remove_fd_reactor_t(reactor, pair[1]);
+
+    // stop wakes a blocked loop from another thread
+    pthread_t thread;
+    pthread_create(&thread, NULL, reactor_stopper, reactor);
+    rc = run_reactor_t(reactor);
+    assert(rc == 0);
+    pthread_join(thread, NULL);
+
+    close(pair[0]);
+    free_reactor_t(reactor);
+    clear_thread_logger(thl);
+}
+
+#define PRIORITY_TEST_FDS 12
+
+typedef struct reactor_priority_state {
+    int dispatches[FD_SETSIZE];
+    int order[64];
+    int ordered;
+} reactor_priority_state_t;
+
+int reactor_priority_write(reactor_t *reactor, int fd, void *arg) {
+    reactor_priority_state_t *state = arg;
+    // the fd stays writable, so it is ready again every iteration
+    state->dispatches[fd] += 1;
+    return 0;
+}
+
+typedef struct reactor_priority_task {
+    reactor_priority_state_t *state;
+    int priority;
+} reactor_priority_task_t;
+
+void reactor_priority_run(reactor_t *reactor, void *arg) {
+    reactor_priority_task_t *task = arg;
+    task->state->order[task->state->ordered++] = task->priority;
+}
+
+void test_reactor_priority(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+    reactor_t *reactor = new_reactor_t(thl);
+    assert(reactor != NULL);
+    static reactor_priority_state_t test_state;
+    memset(&test_state, 0, sizeof(test_state));
+
+    // a dozen always writable fds in every class
+    int pairs[REACTOR_PRIORITIES][PRIORITY_TEST_FDS][2];
+    for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+        for (int i = 0; i < PRIORITY_TEST_FDS; i++) {
+            int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[p][i]);
+            assert(rc == 0);
+            rc = add_fd_reactor_t(reactor, pairs[p][i][0], NULL, reactor_priority_write, NULL,
+                                  &test_state);
+            assert(rc == 0);
+            assert(reactor->handlers[pairs[p][i][0]].priority == REACTOR_PRIORITY_NORMAL);
+            set_priority_reactor_t(reactor, pairs[p][i][0], (REACTOR_PRIORITY)p);
+        }
+    }
+
+    // without a limit everything ready is dispatched
+    int rc = run_once_reactor_t(reactor, 0);
+    assert(rc == REACTOR_PRIORITIES * PRIORITY_TEST_FDS);
+    assert(reactor->stats.left_over == 0);
+
+    // a limit below the sum of the weights is raised to it
+    set_dispatch_limit_reactor_t(reactor, 1);
+    assert(reactor->dispatch_limit ==
+           REACTOR_WEIGHT_HIGH + REACTOR_WEIGHT_NORMAL + REACTOR_WEIGHT_LOW);
+
+    // every class gets its weight, the rest waits for the next poll
+    rc = run_once_reactor_t(reactor, 0);
+    assert(rc == 13);
+    assert(reactor->stats.dispatched[REACTOR_PRIORITY_HIGH] == PRIORITY_TEST_FDS + 8);
+    assert(reactor->stats.dispatched[REACTOR_PRIORITY_NORMAL] == PRIORITY_TEST_FDS + 4);
+    assert(reactor->stats.dispatched[REACTOR_PRIORITY_LOW] == PRIORITY_TEST_FDS + 1);
+    assert(reactor->stats.left_over == 3 * PRIORITY_TEST_FDS - 13);
+
+    // the low class is never starved, and its fds take turns
+    for (int i = 1; i < PRIORITY_TEST_FDS; i++) {
+        rc = run_once_reactor_t(reactor, 0);
+        assert(rc == 13);
+    }
+    for (int i = 0; i < PRIORITY_TEST_FDS; i++) {
+        assert(test_state.dispatches[pairs[REACTOR_PRIORITY_LOW][i][0]] == 2);
+        assert(test_state.dispatches[pairs[REACTOR_PRIORITY_NORMAL][i][0]] == 1 + 4);
+        assert(test_state.dispatches[pairs[REACTOR_PRIORITY_HIGH][i][0]] == 1 + 8);
+    }
+
+    // tasks deferred low first still run high first
+    for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+        for (int i = 0; i < PRIORITY_TEST_FDS; i++) {
+            remove_fd_reactor_t(reactor, pairs[p][i][0]);
+            close(pairs[p][i][0]);
+            close(pairs[p][i][1]);
+        }
+    }
+    reactor_priority_task_t tasks[3 * PRIORITY_TEST_FDS];
+    for (int i = 0; i < 3 * PRIORITY_TEST_FDS; i++) {
+        tasks[i].state = &test_state;
+        tasks[i].priority = REACTOR_PRIORITY_LOW - i / PRIORITY_TEST_FDS;
+        rc = defer_priority_reactor_t(reactor, (REACTOR_PRIORITY)tasks[i].priority,
+                                      reactor_priority_run, &tasks[i]);
+        assert(rc == 0);
+    }
+    rc = run_once_reactor_t(reactor, 0);
+    assert(rc == 3 * PRIORITY_TEST_FDS);
+    assert(test_state.ordered == 3 * PRIORITY_TEST_FDS);
+    for (int i = 0; i < 8; i++) {
+        assert(test_state.order[i] == REACTOR_PRIORITY_HIGH);
+    }
+    for (int i = 8; i < 12; i++) {
+        assert(test_state.order[i] == REACTOR_PRIORITY_NORMAL);
+    }
+    assert(test_state.order[12] == REACTOR_PRIORITY_LOW);
+    assert(test_state.order[13] == REACTOR_PRIORITY_HIGH);
+
+    free_reactor_t(reactor);
+    clear_thread_logger(thl);
+}
+
+#define ADMISSION_TEST_CLIENTS 64
+
+typedef struct admission_test_state {
+    int accepted[ADMISSION_TEST_CLIENTS];
+    int num_accepted;
+} admission_test_state_t;
+
+void admission_test_accept(admission_t *admission, int fd, void *arg) {
+    admission_test_state_t *state = arg;
+    assert(state->num_accepted < ADMISSION_TEST_CLIENTS);
+    state->accepted[state->num_accepted++] = fd;
+}
+
+int admission_test_busy(reactor_t *reactor, int fd, void *arg) {
+    // stands in for a loop that has more work than it can keep up with
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 10000000};
+    nanosleep(&delay, NULL);
+    return 0;
+}
+
+void test_admission(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+    reactor_t *reactor = new_reactor_t(thl);
+    assert(reactor != NULL);
+    static admission_test_state_t test_state;
+    memset(&test_state, 0, sizeof(test_state));
+    socket_client_t *clients[ADMISSION_TEST_CLIENTS];
+    int num_clients = 0;
+
+    int listen_fd = listen_socket(thl, "127.0.0.1", "5007", true, true, default_sock_opts,
+                                  default_socket_opts_count);
+    assert(listen_fd > 0);
+    admission_t *admission = new_admission_t(reactor, listen_fd, ADMISSION_SHED_CLOSE, 5, 20,
+                                             admission_test_accept, &test_state);
+    assert(admission != NULL);
+    // busy fds go first, so the listener sees the whole delay they cause
+    set_priority_reactor_t(reactor, listen_fd, REACTOR_PRIORITY_LOW);
+
+    // an idle loop admits everything
+    for (int i = 0; i < 4; i++) {
+        clients[num_clients] = new_client_socket(thl, "127.0.0.1", "5007", true, true);
+        assert(clients[num_clients] != NULL);
+        num_clients += 1;
+    }
+    while (admission->stats.accepted < 4) {
+        int rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(admission->stats.shed == 0);
+    assert(shedding_admission_t(admission) == false);
+
+    // a loop running late sheds once the delay stayed above target for an interval
+    int busy = eventfd(1, EFD_NONBLOCK);
+    assert(busy != -1);
+    int rc = add_fd_reactor_t(reactor, busy, admission_test_busy, NULL, NULL, NULL);
+    assert(rc == 0);
+    set_priority_reactor_t(reactor, busy, REACTOR_PRIORITY_HIGH);
+    for (int i = 0; i < 20; i++) {
+        clients[num_clients] = new_client_socket(thl, "127.0.0.1", "5007", true, true);
+        assert(clients[num_clients] != NULL);
+        num_clients += 1;
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(shedding_admission_t(admission));
+    assert(admission->stats.shed > 0);
+    assert(admission->stats.accepted > 4);
+    assert(admission->stats.accepted + admission->stats.shed == (uint64_t)num_clients);
+    assert(admission->stats.max_delay >= 5000000ULL);
+
+    // shed clients see the connection closed rather than waiting on it
+    uint64_t closed = 0;
+    for (int i = 0; i < num_clients; i++) {
+        char byte;
+        if (recv(clients[i]->socket_number, &byte, 1, MSG_DONTWAIT) == 0) {
+            closed += 1;
+        }
+    }
+    assert(closed == admission->stats.shed);
+
+    // once the loop catches up connections are admitted again
+    remove_fd_reactor_t(reactor, busy);
+    close(busy);
+    uint64_t accepted = admission->stats.accepted;
+    clients[num_clients] = new_client_socket(thl, "127.0.0.1", "5007", true, true);
+    assert(clients[num_clients] != NULL);
+    num_clients += 1;
+    while (admission->stats.accepted == accepted) {
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(shedding_admission_t(admission) == false);
+    free_admission_t(admission);
+    assert(reactor->handlers[listen_fd].active == false);
+
+    // pausing leaves the connections queued in the backlog instead
+    admission = new_admission_t(reactor, listen_fd, ADMISSION_SHED_PAUSE, 5, 20,
+                                admission_test_accept, &test_state);
+    assert(admission != NULL);
+    set_priority_reactor_t(reactor, listen_fd, REACTOR_PRIORITY_LOW);
+    observe_admission_t(admission, 50000000ULL);
+    clients[num_clients] = new_client_socket(thl, "127.0.0.1", "5007", true, true);
+    assert(clients[num_clients] != NULL);
+    num_clients += 1;
+    accepted = admission->stats.accepted;
+    while (admission->stats.accepted == accepted) {
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    // the delay fed in starts the interval, the next slow accept after it is
+    // admitted and then pauses accepting
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = 25000000};
+    nanosleep(&wait, NULL);
+    observe_admission_t(admission, 50000000ULL);
+    clients[num_clients] = new_client_socket(thl, "127.0.0.1", "5007", true, true);
+    assert(clients[num_clients] != NULL);
+    num_clients += 1;
+    while (admission->stats.pauses == 0) {
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(admission->paused);
+    assert(admission->stats.shed == 0);
+    assert(is_set_fd_pool_t(reactor->read_pool, listen_fd, true) == false);
+    // the resume timer turns accepting back on and the queued client gets in
+    clients[num_clients] = new_client_socket(thl, "127.0.0.1", "5007", true, true);
+    assert(clients[num_clients] != NULL);
+    num_clients += 1;
+    accepted = admission->stats.accepted;
+    while (admission->stats.accepted == accepted) {
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(admission->paused == false);
+    assert(shedding_admission_t(admission) == false);
+
+    free_admission_t(admission);
+    for (int i = 0; i < test_state.num_accepted; i++) {
+        close(test_state.accepted[i]);
+    }
+    for (int i = 0; i < num_clients; i++) {
+        free_socket_client_t(clients[i]);
+    }
+    close(listen_fd);
+    free_reactor_t(reactor);
+    clear_thread_logger(thl);
+}
+
+typedef struct test_wheel_timer {
+    wheel_timer_t node;
+    uint64_t deadline;
+    bool fired;
+} test_wheel_timer_t;
+
+#define TEST_WHEEL_TIMERS 4096
+
+void test_timer_wheel(void **state) {
+    static timer_wheel_t wheel;
+    static test_wheel_timer_t timers[TEST_WHEEL_TIMERS];
+    uint64_t start = 1000000000ULL;
+    init_timer_wheel_t(&wheel, start);
+    assert(next_timer_wheel_t(&wheel) == UINT64_MAX);
+
+    // deadlines spread over every level, plus a few past the end of the wheel
+    srand(42);
+    memset(timers, 0, sizeof(timers));
+    for (size_t i = 0; i < TEST_WHEEL_TIMERS; i++) {
+        uint64_t delay;
+        switch (i % 4) {
+            case 0:
+                delay = (uint64_t)(rand() % 64) * 1000000ULL;
+                break;
+            case 1:
+                delay = (uint64_t)(rand() % 4096) * 1000000ULL + (uint64_t)(rand() % 1000000);
+                break;
+            case 2:
+                delay = (uint64_t)(rand() % 300000) * 1000000ULL;
+                break;
+            default:
+                delay = (uint64_t)(rand() % 40000000) * 1000000ULL;
+                break;
+        }
+        timers[i].deadline = start + delay;
+        add_timer_wheel_t(&wheel, &timers[i].node, timers[i].deadline);
+    }
+    assert(wheel.count == TEST_WHEEL_TIMERS);
+
+    // cancelling is immediate, and re-arming moves the timer
+    for (size_t i = 0; i < TEST_WHEEL_TIMERS; i += 7) {
+        remove_timer_wheel_t(&wheel, &timers[i].node);
+        assert(timers[i].node.armed == false);
+    }
+    remove_timer_wheel_t(&wheel, &timers[0].node);
+    timers[1].deadline = start + 12345678ULL;
+    add_timer_wheel_t(&wheel, &timers[1].node, timers[1].deadline);
+
+    // sleeping until next_timer_wheel_t fires every timer on time, never early
+    size_t fired = 0;
+    size_t wakeups = 0;
+    while (wheel.count > 0) {
+        uint64_t now = next_timer_wheel_t(&wheel);
+        assert(now != UINT64_MAX);
+        advance_timer_wheel_t(&wheel, now);
+        wakeups += 1;
+        wheel_timer_t *node;
+        while ((node = pop_expired_timer_wheel_t(&wheel)) != NULL) {
+            test_wheel_timer_t *timer = (test_wheel_timer_t *)node;
+            assert(timer->fired == false);
+            assert(now >= timer->deadline);
+            assert(now - timer->deadline < TIMER_WHEEL_TICK_NS);
+            timer->fired = true;
+            fired += 1;
+        }
+    }
+    for (size_t i = 0; i < TEST_WHEEL_TIMERS; i++) {
+        assert(timers[i].fired == (i % 7 != 0));
+    }
+    assert(fired == TEST_WHEEL_TIMERS - (TEST_WHEEL_TIMERS + 6) / 7);
+    // wakeups that fire nothing are cascades, and there are few of them
+    assert(wakeups < 2 * fired);
+    assert(next_timer_wheel_t(&wheel) == UINT64_MAX);
+
+    // removing a timer that expired but was not popped yet still works
+    test_wheel_timer_t a, b;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    uint64_t now = start + 50000000000000ULL;
+    advance_timer_wheel_t(&wheel, now);
+    add_timer_wheel_t(&wheel, &a.node, now);
+    add_timer_wheel_t(&wheel, &b.node, now);
+    size_t expired = advance_timer_wheel_t(&wheel, now + 2 * TIMER_WHEEL_TICK_NS);
+    assert(expired == 2);
+    assert(next_timer_wheel_t(&wheel) == 0);
+    remove_timer_wheel_t(&wheel, &b.node);
+    assert(pop_expired_timer_wheel_t(&wheel) == &a.node);
+    assert(pop_expired_timer_wheel_t(&wheel) == NULL);
+    assert(wheel.count == 0);
+}
+
+typedef struct conn_test_state {
+    size_t received;
+    int errors;
+    int error;
+    bool close_on_error;
+    int pauses;
+    int resumes;
+    size_t pending_at_resume;
+} conn_test_state_t;
+
+void conn_test_data(conn_t *conn, void *arg) {
+    conn_test_state_t *state = arg;
+    size_t len;
+    peek_conn_buffer_t(conn->input, &len);
+    state->received += len;
+    consume_conn_t(conn, len);
+}
+
+void conn_test_error(conn_t *conn, int error, void *arg) {
+    conn_test_state_t *state = arg;
+    state->errors += 1;
+    state->error = error;
+    if (state->close_on_error) {
+        close_conn_t(conn);
+    }
+}
+
+void conn_test_watermark(conn_t *conn, bool above, void *arg) {
+    conn_test_state_t *state = arg;
+    if (above) {
+        state->pauses += 1;
+    } else {
+        state->resumes += 1;
+        state->pending_at_resume = pending_conn_t(conn);
+    }
+}
+
+void test_conn(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+    reactor_t *reactor = new_reactor_t(thl);
+    assert(reactor != NULL);
+    buffer_pool_t *pool = new_buffer_pool_t(false);
+    assert(pool != NULL);
+    conn_test_state_t test_state;
+    memset(&test_state, 0, sizeof(test_state));
+
+    int pair[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+    conn_t *conn = new_conn_t(reactor, pool, pair[0], conn_test_data, conn_test_error,
+                              &test_state);
+    assert(conn != NULL);
+
+    // a read deadline with nothing arriving fails the read side with a timeout
+    uint64_t started = now_reactor_t(reactor);
+    set_read_deadline_conn_t(conn, started + 20000000ULL);
+    while (test_state.errors == 0) {
+        rc = run_once_reactor_t(reactor, -1);
+        assert(rc >= 0);
+    }
+    assert(is_timeout_conn_t(test_state.error));
+    assert(test_state.error != ETIMEDOUT);
+    assert(now_reactor_t(reactor) - started >= 20000000ULL);
+    assert(conn->input->data == NULL);
+    assert(is_set_fd_pool_t(reactor->read_pool, pair[0], true) == false);
+
+    // moving the deadline out makes the connection readable again
+    set_read_deadline_conn_t(conn, now_reactor_t(reactor) + 5000000000ULL);
+    assert(conn->read_error == 0);
+    int sent = send(pair[1], "hello", 5, 0);
+    assert(sent == 5);
+    while (test_state.received < 5) {
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(test_state.errors == 1);
+    set_read_deadline_conn_t(conn, 0);
+    assert(armed_timer_reactor_t(&conn->read_timer) == false);
+
+    // a peer that stops reading leaves writes queued, until the write deadline
+    // drops them and gives the buffers back
+    char chunk[65536];
+    memset(chunk, 'w', sizeof(chunk));
+    while (pending_iov_queue_t(conn->output) == 0) {
+        ssize_t wrote = write_conn_t(conn, chunk, sizeof(chunk));
+        assert(wrote == (ssize_t)sizeof(chunk));
+    }
+    assert(is_set_fd_pool_t(reactor->write_pool, pair[0], true) == true);
+    set_write_deadline_conn_t(conn, now_reactor_t(reactor) + 10000000ULL);
+    while (test_state.errors == 1) {
+        rc = run_once_reactor_t(reactor, -1);
+        assert(rc >= 0);
+    }
+    assert(is_timeout_conn_t(test_state.error));
+    assert(pending_iov_queue_t(conn->output) == 0);
+    assert(is_set_fd_pool_t(reactor->write_pool, pair[0], true) == false);
+    ssize_t wrote = write_conn_t(conn, "x", 1);
+    assert(wrote == -1 && errno == CONN_ETIMEOUT);
+    set_write_deadline_conn_t(conn, 0);
+    wrote = write_conn_t(conn, "x", 1);
+    assert(wrote == 1);
+
+    // producers are paused over the high watermark and resumed at the low one
+    set_watermarks_conn_t(conn, 16384, 65536, conn_test_watermark);
+    for (int i = 0; i < 4; i++) {
+        wrote = write_conn_t(conn, chunk, sizeof(chunk));
+        assert(wrote == (ssize_t)sizeof(chunk));
+    }
+    assert(test_state.pauses == 1 && writable_conn_t(conn) == false);
+    assert(pending_conn_t(conn) > 65536);
+    while (test_state.resumes == 0 || pending_conn_t(conn) > 0) {
+        while (recv(pair[1], chunk, sizeof(chunk), MSG_DONTWAIT) > 0) {
+        }
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(test_state.pauses == 1 && test_state.resumes == 1 && writable_conn_t(conn));
+    assert(test_state.pending_at_resume <= 16384);
+
+    // eof is reported as error 0, and closing from the callback is safe
+    // unread data would turn the close into a reset, drain the peer first
+    test_state.close_on_error = true;
+    while (recv(pair[1], chunk, sizeof(chunk), MSG_DONTWAIT) > 0) {
+    }
+    close(pair[1]);
+    while (test_state.errors == 2) {
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(test_state.error == 0);
+    rc = run_once_reactor_t(reactor, 0);
+    assert(rc >= 0);
+    assert(reactor->handlers[pair[0]].active == false);
+
+    // small writes made during one iteration leave in a single syscall
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+    conn = new_conn_t(reactor, pool, pair[0], conn_test_data, conn_test_error, &test_state);
+    assert(conn != NULL);
+    for (int i = 0; i < 3; i++) {
+        wrote = write_conn_t(conn, "header", 6);
+        assert(wrote == 6);
+        wrote = write_conn_t(conn, chunk, 100);
+        assert(wrote == 100);
+    }
+    assert(conn->stats.syscalls == 0 && pending_conn_t(conn) == 318);
+    rc = run_once_reactor_t(reactor, 0);
+    assert(rc >= 0);
+    assert(pending_conn_t(conn) == 0);
+    assert(conn->stats.writes == 6 && conn->stats.syscalls == 1 && conn->stats.coalesced == 5);
+    ssize_t got = recv(pair[1], chunk, sizeof(chunk), 0);
+    assert(got == 318);
+    // what is still queued at close gets a last flush
+    wrote = write_conn_t(conn, "bye", 3);
+    assert(wrote == 3);
+    close_conn_t(conn);
+    got = recv(pair[1], chunk, sizeof(chunk), 0);
+    assert(got == 3 && memcmp(chunk, "bye", 3) == 0);
+    close(pair[1]);
+    rc = run_once_reactor_t(reactor, 0);
+    assert(rc >= 0);
+
+    // a connection with more to do than its budget picks up again next turn
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(rc == 0);
+    conn = new_conn_t(reactor, pool, pair[0], conn_test_data, conn_test_error, &test_state);
+    assert(conn != NULL);
+    set_budgets_conn_t(conn, 4096, 8192);
+    memset(chunk, 'r', sizeof(chunk));
+    got = send(pair[1], chunk, sizeof(chunk), 0);
+    assert(got == (ssize_t)sizeof(chunk));
+    size_t before = test_state.received;
+    rc = run_once_reactor_t(reactor, 1000);
+    assert(rc >= 0);
+    assert(test_state.received - before < sizeof(chunk));
+    assert(conn->stats.read_budget_hits == 1);
+    while (test_state.received - before < sizeof(chunk)) {
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(conn->stats.read_budget_hits > 1);
+    uint64_t big_turns = 0;
+    for (int i = 13; i < CONN_TURN_BUCKETS; i++) {
+        big_turns += conn->stats.read_turns[i];
+    }
+    assert(big_turns >= conn->stats.read_budget_hits);
+
+    for (int i = 0; i < 3; i++) {
+        wrote = write_conn_t(conn, chunk, 10240);
+        assert(wrote == 10240);
+    }
+    rc = run_once_reactor_t(reactor, 0);
+    assert(rc >= 0);
+    assert(pending_conn_t(conn) == 3 * 10240 - 8192);
+    assert(conn->stats.write_budget_hits == 1 && conn->stats.write_turns[14] == 1);
+    while (pending_conn_t(conn) > 0) {
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    size_t drained = 0;
+    while ((got = recv(pair[1], chunk, sizeof(chunk), MSG_DONTWAIT)) > 0) {
+        drained += (size_t)got;
+    }
+    assert(drained == 3 * 10240);
+    close_conn_t(conn);
+    close(pair[1]);
+    rc = run_once_reactor_t(reactor, 0);
+    assert(rc >= 0);
+
+    free_reactor_t(reactor);
+    buffer_pool_stats_t stats;
+    stats_buffer_pool_t(pool, &stats);
+    assert(stats.gets == stats.puts);
+    free_buffer_pool_t(pool);
+    clear_thread_logger(thl);
+}
+
+typedef struct coro_test_pair {
+    int server;
+    int client;
+    size_t echoed;
+    bool verified;
+} coro_test_pair_t;
+
+#define CORO_TEST_PAYLOAD (256 * 1024)
+
+size_t coro_test_slept = 0;
+
+void coro_test_sleeper(coro_sched_t *sched, void *arg) {
+    sleep_coro_sched_t(sched, (uint64_t)(uintptr_t)arg);
+    coro_test_slept += 1;
+}
+
+void coro_test_echo_server(coro_sched_t *sched, void *arg) {
+    coro_test_pair_t *pair = arg;
+    char buffer[4096];
+    for (;;) {
+        ssize_t rc = read_coro_sched_t(sched, pair->server, buffer, sizeof(buffer));
+        if (rc <= 0) {
+            break;
+        }
+        if (write_coro_sched_t(sched, pair->server, buffer, (size_t)rc) != rc) {
+            break;
+        }
+        pair->echoed += (size_t)rc;
+    }
+    close_coro_sched_t(sched, pair->server);
+}
+
+void coro_test_echo_writer(coro_sched_t *sched, void *arg) {
+    coro_test_pair_t *pair = arg;
+    char *payload = malloc(CORO_TEST_PAYLOAD);
+    for (size_t i = 0; i < CORO_TEST_PAYLOAD; i++) {
+        payload[i] = (char)(i % 251);
+    }
+    // bigger than the socket buffers, so this parks until the echo drains them
+    ssize_t rc = write_coro_sched_t(sched, pair->client, payload, CORO_TEST_PAYLOAD);
+    assert(rc == CORO_TEST_PAYLOAD);
+    shutdown(pair->client, SHUT_WR);
+    free(payload);
+}
+
+void coro_test_echo_reader(coro_sched_t *sched, void *arg) {
+    coro_test_pair_t *pair = arg;
+    char buffer[8192];
+    size_t received = 0;
+    bool intact = true;
+    for (;;) {
+        ssize_t rc = read_coro_sched_t(sched, pair->client, buffer, sizeof(buffer));
+        if (rc <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < rc; i++) {
+            if (buffer[i] != (char)((received + (size_t)i) % 251)) {
+                intact = false;
+            }
+        }
+        received += (size_t)rc;
+    }
+    pair->verified = intact && received == CORO_TEST_PAYLOAD;
+    close_coro_sched_t(sched, pair->client);
+}
+
+void coro_test_acceptor(coro_sched_t *sched, void *arg) {
+    int listen_fd = *(int *)arg;
+    int fd = accept_coro_sched_t(sched, listen_fd);
+    assert(fd >= 0);
+    ssize_t rc = write_coro_sched_t(sched, fd, "hi", 2);
+    assert(rc == 2);
+    close_coro_sched_t(sched, fd);
+}
+
+void coro_test_connector(coro_sched_t *sched, void *arg) {
+    struct sockaddr_un storage;
+    addr_info addr = new_unix_addr_info("@cnet-test-coro", false, &storage);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(fd >= 0);
+    int rc = connect_coro_sched_t(sched, fd, addr.ai_addr, addr.ai_addrlen);
+    assert(rc == 0);
+    char buffer[4];
+    ssize_t got = read_coro_sched_t(sched, fd, buffer, sizeof(buffer));
+    assert(got == 2 && memcmp(buffer, "hi", 2) == 0);
+    close_coro_sched_t(sched, fd);
+    *(bool *)arg = true;
+}
+
+void coro_test_waiter(coro_sched_t *sched, void *arg) {
+    int *fds = arg;
+    // nothing is ever written, so this has to time out
+    int rc = wait_fd_coro_sched_t(sched, fds[0], false, 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    // parked again, this time until another coroutine closes the fd
+    char buffer[1];
+    ssize_t got = read_coro_sched_t(sched, fds[0], buffer, sizeof(buffer));
+    assert(got == -1 && errno == EBADF);
+    fds[2] = 1;
+}
+
+void coro_test_closer(coro_sched_t *sched, void *arg) {
+    int *fds = arg;
+    sleep_coro_sched_t(sched, 30);
+    close_coro_sched_t(sched, fds[0]);
+}
+
+void test_coro(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+    reactor_t *reactor = new_reactor_t(thl);
+    assert(reactor != NULL);
+    coro_sched_t *sched = new_coro_sched_t(reactor, 0, true);
+    assert(sched != NULL);
+    assert(current_coro_sched_t(sched) == NULL);
+
+    // thousands of parked coroutines on guard-paged stacks
+    for (uintptr_t i = 0; i < 4000; i++) {
+        int rc = spawn_coro_sched_t(sched, coro_test_sleeper, (void *)(i % 20));
+        assert(rc == 0);
+    }
+    while (sched->stats.live > 0) {
+        int rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(coro_test_slept == 4000);
+    assert(sched->stats.peak_live == 4000);
+    assert(sched->num_cached == 1024);
+
+    // full duplex echo, a reader and a writer coroutine share each client fd
+    coro_test_pair_t pairs[16];
+    for (int i = 0; i < 16; i++) {
+        int fds[2];
+        int rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+        assert(rc == 0);
+        pairs[i] = (coro_test_pair_t){.server = fds[0], .client = fds[1]};
+        spawn_coro_sched_t(sched, coro_test_echo_server, &pairs[i]);
+        spawn_coro_sched_t(sched, coro_test_echo_writer, &pairs[i]);
+        spawn_coro_sched_t(sched, coro_test_echo_reader, &pairs[i]);
+    }
+    uint64_t parks = sched->stats.parks;
+    while (sched->stats.live > 0) {
+        int rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    for (int i = 0; i < 16; i++) {
+        assert(pairs[i].echoed == CORO_TEST_PAYLOAD);
+        assert(pairs[i].verified);
+    }
+    assert(sched->stats.parks > parks);
+
+    // accept and connect park until the other side shows up
+    int listen_fd = listen_unix_socket(thl, "@cnet-test-coro", false, default_sock_opts,
+                                       default_socket_opts_count);
+    assert(listen_fd >= 0);
+    assert(set_socket_blocking_status(listen_fd, false));
+    bool connected = false;
+    spawn_coro_sched_t(sched, coro_test_acceptor, &listen_fd);
+    spawn_coro_sched_t(sched, coro_test_connector, &connected);
+    while (sched->stats.live > 0) {
+        int rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(connected);
+    close_coro_sched_t(sched, listen_fd);
+
+    // timeouts and closing an fd another coroutine is parked on
+    int fds[3] = {-1, -1, 0};
+    int rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(rc == 0);
+    spawn_coro_sched_t(sched, coro_test_waiter, fds);
+    spawn_coro_sched_t(sched, coro_test_closer, fds);
+    while (sched->stats.live > 0) {
+        rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(fds[2] == 1);
+    close(fds[1]);
+
+    // outside of a coroutine there is nothing to park
+    rc = wait_fd_coro_sched_t(sched, 0, false, -1);
+    assert(rc == -1 && errno == EPERM);
+
+    free_coro_sched_t(sched);
+    free_reactor_t(reactor);
+    clear_thread_logger(thl);
+}
+
+_Atomic size_t coro_pool_test_done = 0;
+
+void coro_pool_test_busy(coro_pool_t *pool, void *arg) {
+    // burn a couple of milliseconds so the other workers have to steal
+    for (int i = 0; i < 4; i++) {
+        struct timespec began, now;
+        clock_gettime(CLOCK_MONOTONIC, &began);
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while ((now.tv_sec - began.tv_sec) * 1000000000L + (now.tv_nsec - began.tv_nsec) <
+                 500000L);
+        yield_coro_pool_t(pool);
+    }
+    coro_pool_test_done += 1;
+}
+
+void coro_pool_test_spawner(coro_pool_t *pool, void *arg) {
+    assert(current_worker_coro_pool_t(pool) != NULL);
+    for (int i = 0; i < 256; i++) {
+        int rc = spawn_coro_pool_t(pool, coro_pool_test_busy, NULL);
+        assert(rc == 0);
+    }
+}
+
+void coro_pool_test_sleeper(coro_pool_t *pool, void *arg) {
+    sleep_coro_pool_t(pool, (uint64_t)(uintptr_t)arg);
+    coro_pool_test_done += 1;
+}
+
+void coro_pool_test_echo_server(coro_pool_t *pool, void *arg) {
+    coro_test_pair_t *pair = arg;
+    char buffer[4096];
+    for (;;) {
+        ssize_t rc = read_coro_pool_t(pool, pair->server, buffer, sizeof(buffer));
+        if (rc <= 0) {
+            break;
+        }
+        if (write_coro_pool_t(pool, pair->server, buffer, (size_t)rc) != rc) {
+            break;
+        }
+        pair->echoed += (size_t)rc;
+    }
+    close_coro_pool_t(pool, pair->server);
+}
+
+void coro_pool_test_echo_writer(coro_pool_t *pool, void *arg) {
+    coro_test_pair_t *pair = arg;
+    char *payload = malloc(CORO_TEST_PAYLOAD);
+    for (size_t i = 0; i < CORO_TEST_PAYLOAD; i++) {
+        payload[i] = (char)(i % 251);
+    }
+    ssize_t rc = write_coro_pool_t(pool, pair->client, payload, CORO_TEST_PAYLOAD);
+    assert(rc == CORO_TEST_PAYLOAD);
+    shutdown(pair->client, SHUT_WR);
+    free(payload);
+}
+
+void coro_pool_test_echo_reader(coro_pool_t *pool, void *arg) {
+    coro_test_pair_t *pair = arg;
+    char buffer[8192];
+    size_t received = 0;
+    bool intact = true;
+    for (;;) {
+        ssize_t rc = read_coro_pool_t(pool, pair->client, buffer, sizeof(buffer));
+        if (rc <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < rc; i++) {
+            if (buffer[i] != (char)((received + (size_t)i) % 251)) {
+                intact = false;
+            }
+        }
+        received += (size_t)rc;
+    }
+    pair->verified = intact && received == CORO_TEST_PAYLOAD;
+}
+
+void coro_pool_test_waiter(coro_pool_t *pool, void *arg) {
+    int *fds = arg;
+    int rc = wait_fd_coro_pool_t(pool, fds[0], false, 10);
+    assert(rc == -1 && error_coro_pool_t(pool) == ETIMEDOUT);
+    char buffer[1];
+    ssize_t got = read_coro_pool_t(pool, fds[0], buffer, sizeof(buffer));
+    assert(got == -1 && error_coro_pool_t(pool) == EBADF);
+    fds[2] = 1;
+}
+
+void coro_pool_test_closer(coro_pool_t *pool, void *arg) {
+    int *fds = arg;
+    sleep_coro_pool_t(pool, 40);
+    close_coro_pool_t(pool, fds[0]);
+}
+
+void test_coro_pool(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+    coro_pool_t *pool = new_coro_pool_t(thl, 4, 0, true);
+    assert(pool != NULL);
+    assert(pool->num_workers == 4);
+    assert(current_worker_coro_pool_t(pool) == NULL);
+
+    // everything lands on the spawner's worker, the others have to steal it
+    int rc = spawn_coro_pool_t(pool, coro_pool_test_spawner, NULL);
+    assert(rc == 0);
+    wait_coro_pool_t(pool);
+    assert(coro_pool_test_done == 256);
+    coro_pool_stats_t stats;
+    stats_coro_pool_t(pool, &stats);
+    assert(stats.spawned == 257 && stats.finished == 257 && stats.live == 0);
+    assert(stats.steals > 0 && stats.stolen >= stats.steals);
+    assert(stats.workers_used > 1);
+
+    // sleeps are timers on the shared netpoller
+    coro_pool_test_done = 0;
+    for (uintptr_t i = 0; i < 1000; i++) {
+        rc = spawn_coro_pool_t(pool, coro_pool_test_sleeper, (void *)(i % 10));
+        assert(rc == 0);
+    }
+    wait_coro_pool_t(pool);
+    assert(coro_pool_test_done == 1000);
+
+    // full duplex echo across workers
+    coro_test_pair_t pairs[16];
+    for (int i = 0; i < 16; i++) {
+        int fds[2];
+        rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+        assert(rc == 0);
+        pairs[i] = (coro_test_pair_t){.server = fds[0], .client = fds[1]};
+        spawn_coro_pool_t(pool, coro_pool_test_echo_server, &pairs[i]);
+        spawn_coro_pool_t(pool, coro_pool_test_echo_writer, &pairs[i]);
+        spawn_coro_pool_t(pool, coro_pool_test_echo_reader, &pairs[i]);
+    }
+    wait_coro_pool_t(pool);
+    for (int i = 0; i < 16; i++) {
+        assert(pairs[i].echoed == CORO_TEST_PAYLOAD);
+        assert(pairs[i].verified);
+        close(pairs[i].client);
+    }
+
+    // timeouts and closing an fd another coroutine is parked on
+    int fds[3] = {-1, -1, 0};
+    rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(rc == 0);
+    spawn_coro_pool_t(pool, coro_pool_test_waiter, fds);
+    spawn_coro_pool_t(pool, coro_pool_test_closer, fds);
+    wait_coro_pool_t(pool);
+    assert(fds[2] == 1);
+    close(fds[1]);
+
+    rc = wait_fd_coro_pool_t(pool, 0, false, -1);
+    assert(rc == -1 && errno == EPERM);
+
+    stats_coro_pool_t(pool, &stats);
+    assert(stats.polls > 0);
+    free_coro_pool_t(pool);
+    clear_thread_logger(thl);
+}
+
+#define CHANNEL_TEST_PRODUCERS 4
+#define CHANNEL_TEST_CONSUMERS 4
+#define CHANNEL_TEST_VALUES 50000
+
+typedef struct channel_test_consumer {
+    channel_t *channel;
+    size_t received;
+    uint64_t sum;
+} channel_test_consumer_t;
+
+void *channel_test_producer(void *arg) {
+    channel_t *channel = arg;
+    for (uintptr_t i = 1; i <= CHANNEL_TEST_VALUES; i++) {
+        int rc = send_channel_t(channel, (void *)i);
+        assert(rc == 0);
+    }
+    return NULL;
+}
+
+void *channel_test_consumer(void *arg) {
+    channel_test_consumer_t *consumer = arg;
+    void *value;
+    while (recv_channel_t(consumer->channel, &value) == 0) {
+        consumer->received += 1;
+        consumer->sum += (uintptr_t)value;
+    }
+    assert(errno == EPIPE);
+    return NULL;
+}
+
+void *channel_test_late_sender(void *arg) {
+    usleep(20000);
+    int rc = send_channel_t(arg, (void *)42);
+    assert(rc == 0);
+    return NULL;
+}
+
+void test_channel(void **state) {
+    channel_t *channel = new_channel_t(5);
+    assert(channel != NULL);
+    assert(channel->mask == 7);
+
+    // fifo, and try_ calls never block
+    void *value = NULL;
+    assert(try_recv_channel_t(channel, &value) == false);
+    for (uintptr_t i = 1; i <= 8; i++) {
+        assert(try_send_channel_t(channel, (void *)i));
+    }
+    assert(try_send_channel_t(channel, (void *)9) == false);
+    assert(len_channel_t(channel) == 8);
+    int rc = timed_send_channel_t(channel, (void *)9, 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+    for (uintptr_t i = 1; i <= 8; i++) {
+        assert(try_recv_channel_t(channel, &value));
+        assert((uintptr_t)value == i);
+    }
+    rc = timed_recv_channel_t(channel, &value, 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+
+    // a blocked receiver is woken by a sender on another thread
+    pthread_t thread;
+    pthread_create(&thread, NULL, channel_test_late_sender, channel);
+    rc = timed_recv_channel_t(channel, &value, 5000);
+    assert(rc == 0 && (uintptr_t)value == 42);
+    pthread_join(thread, NULL);
+
+    // closing fails sends, receives drain what is left first
+    assert(try_send_channel_t(channel, (void *)1));
+    close_channel_t(channel);
+    rc = send_channel_t(channel, (void *)2);
+    assert(rc == -1 && errno == EPIPE);
+    rc = recv_channel_t(channel, &value);
+    assert(rc == 0 && (uintptr_t)value == 1);
+    rc = recv_channel_t(channel, &value);
+    assert(rc == -1 && errno == EPIPE);
+    free_channel_t(channel);
+
+    // many producers and consumers through a small ring so both sides block
+    channel = new_channel_t(16);
+    assert(channel != NULL);
+    pthread_t producers[CHANNEL_TEST_PRODUCERS];
+    pthread_t consumers[CHANNEL_TEST_CONSUMERS];
+    channel_test_consumer_t consumed[CHANNEL_TEST_CONSUMERS];
+    for (int i = 0; i < CHANNEL_TEST_CONSUMERS; i++) {
+        consumed[i] = (channel_test_consumer_t){.channel = channel};
+        pthread_create(&consumers[i], NULL, channel_test_consumer, &consumed[i]);
+    }
+    for (int i = 0; i < CHANNEL_TEST_PRODUCERS; i++) {
+        pthread_create(&producers[i], NULL, channel_test_producer, channel);
+    }
+    for (int i = 0; i < CHANNEL_TEST_PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    close_channel_t(channel);
+    size_t received = 0;
+    uint64_t sum = 0;
+    for (int i = 0; i < CHANNEL_TEST_CONSUMERS; i++) {
+        pthread_join(consumers[i], NULL);
+        received += consumed[i].received;
+        sum += consumed[i].sum;
+    }
+    assert(received == CHANNEL_TEST_PRODUCERS * CHANNEL_TEST_VALUES);
+    assert(sum == (uint64_t)CHANNEL_TEST_PRODUCERS * CHANNEL_TEST_VALUES *
+                      (CHANNEL_TEST_VALUES + 1) / 2);
+    free_channel_t(channel);
+
+    // select over two channels and a socket
+    channel_t *first = new_channel_t(4);
+    channel_t *second = new_channel_t(4);
+    assert(first != NULL && second != NULL);
+    int fds[2];
+    rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(rc == 0);
+    channel_case_t cases[3] = {
+        {.op = CHANNEL_CASE_RECV, .channel = first},
+        {.op = CHANNEL_CASE_RECV, .channel = second},
+        {.op = CHANNEL_CASE_READABLE, .fd = fds[0]},
+    };
+    rc = select_channel_t(cases, 3, 10);
+    assert(rc == -1 && errno == ETIMEDOUT);
+
+    pthread_create(&thread, NULL, channel_test_late_sender, second);
+    rc = select_channel_t(cases, 3, 5000);
+    assert(rc == 1 && (uintptr_t)cases[1].value == 42 && cases[1].closed == false);
+    pthread_join(thread, NULL);
+
+    ssize_t sent = send(fds[1], "x", 1, 0);
+    assert(sent == 1);
+    rc = select_channel_t(cases, 3, 5000);
+    assert(rc == 2);
+    char byte;
+    sent = recv(fds[0], &byte, 1, 0);
+    assert(sent == 1);
+
+    close_channel_t(first);
+    rc = select_channel_t(cases, 3, 5000);
+    assert(rc == 0 && cases[0].closed);
+
+    // a send case completes once there is room
+    channel_case_t send_case = {.op = CHANNEL_CASE_SEND, .channel = second, .value = (void *)7};
+    rc = select_channel_t(&send_case, 1, 0);
+    assert(rc == 0 && send_case.closed == false);
+    assert(try_recv_channel_t(second, &value) && (uintptr_t)value == 7);
+
+    rc = select_channel_t(cases, CHANNEL_SELECT_MAX + 1, 0);
+    assert(rc == -1 && errno == EINVAL);
+
+    close(fds[0]);
+    close(fds[1]);
+    free_channel_t(first);
+    free_channel_t(second);
+}
+
+#define WORK_POOL_TEST_ITEMS 1000
+
+typedef struct work_pool_test_request {
+    work_item_t item;
+    uint64_t input;
+    uint64_t output;
+    bool on_worker;
+} work_pool_test_request_t;
+
+_Atomic size_t work_pool_test_done = 0;
+size_t work_pool_test_completed = 0;
+pthread_t work_pool_test_reactor_thread;
+
+void work_pool_test_square(work_pool_t *pool, void *arg) {
+    work_pool_test_request_t *request = arg;
+    request->on_worker = current_worker_work_pool_t(pool) != NULL;
+    request->output = request->input * request->input;
+}
+
+void work_pool_test_complete(reactor_t *reactor, void *arg) {
+    work_pool_test_request_t *request = arg;
+    assert(pthread_equal(pthread_self(), work_pool_test_reactor_thread));
+    assert(request->on_worker && request->output == request->input * request->input);
+    work_pool_test_completed += 1;
+}
+
+void work_pool_test_busy(work_pool_t *pool, void *arg) {
+    struct timespec began, now;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - began.tv_sec) * 1000000000L + (now.tv_nsec - began.tv_nsec) <
+             1000000L);
+    work_pool_test_done += 1;
+}
+
+void work_pool_test_fork(work_pool_t *pool, void *arg) {
+    // children land on this worker's own deque, the others have to steal them
+    work_item_t *children = arg;
+    for (int i = 0; i < 64; i++) {
+        int rc = submit_work_pool_t(pool, &children[i], work_pool_test_busy, NULL, NULL, NULL);
+        assert(rc == 0);
+    }
+}
+
+void test_work_pool(void **state) {
+    thread_logger *thl = new_thread_logger(true);
+    assert(thl != NULL);
+    reactor_t *reactor = new_reactor_t(thl);
+    assert(reactor != NULL);
+    work_pool_t *pool = new_work_pool_t(thl, 4);
+    assert(pool != NULL);
+    assert(pool->num_workers == 4);
+    assert(current_worker_work_pool_t(pool) == NULL);
+    work_pool_test_reactor_thread = pthread_self();
+
+    // results come back to the reactor that submitted the work, on its thread
+    work_pool_test_request_t *requests =
+        calloc(WORK_POOL_TEST_ITEMS, sizeof(work_pool_test_request_t));
+    assert(requests != NULL);
+    for (size_t i = 0; i < WORK_POOL_TEST_ITEMS; i++) {
+        requests[i].input = i;
+        int rc = submit_work_pool_t(pool, &requests[i].item, work_pool_test_square, reactor,
+                                    work_pool_test_complete, &requests[i]);
+        assert(rc == 0);
+    }
+    while (work_pool_test_completed < WORK_POOL_TEST_ITEMS) {
+        int rc = run_once_reactor_t(reactor, 1000);
+        assert(rc >= 0);
+    }
+    assert(reactor->stats.posts_run == WORK_POOL_TEST_ITEMS);
+
+    // fork join from inside the pool
+    work_item_t parent;
+    work_item_t children[64];
+    int rc = submit_work_pool_t(pool, &parent, work_pool_test_fork, NULL, NULL, children);
+    assert(rc == 0);
+    for (int i = 0; i < 5000 && work_pool_test_done < 64; i++) {
+        usleep(1000);
+    }
+    assert(work_pool_test_done == 64);
+
+    work_pool_stats_t stats;
+    stats_work_pool_t(pool, &stats);
+    assert(stats.submitted == WORK_POOL_TEST_ITEMS + 65);
+    assert(stats.executed == stats.submitted);
+    assert(stats.posted == WORK_POOL_TEST_ITEMS);
+    assert(stats.steals > 0 && stats.workers_used > 1);
+
+    free_work_pool_t(pool);
+    free(requests);
+    free_reactor_t(reactor);
+    clear_thread_logger(thl);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_fd_pool),
         cmocka_unit_test(test_listen_socket),
-        cmocka_unit_test(test_listen_accept)
+        cmocka_unit_test(test_listen_accept),
+        cmocka_unit_test(test_forwarder),
+        cmocka_unit_test(test_iov_queue),
+        cmocka_unit_test(test_zerocopy_rx),
+        cmocka_unit_test(test_unix_socket),
+        cmocka_unit_test(test_shm_ring),
+        cmocka_unit_test(test_shm_ring_handshake),
+        cmocka_unit_test(test_handoff),
+        cmocka_unit_test(test_handover),
+        cmocka_unit_test(test_prefork),
+        cmocka_unit_test(test_buffer_pool),
+        cmocka_unit_test(test_mirror_ring),
+        cmocka_unit_test(test_buf_chain),
+        cmocka_unit_test(test_conn_buffer),
+        cmocka_unit_test(test_mem_budget),
+        cmocka_unit_test(test_timer_wheel),
+        cmocka_unit_test(test_reactor),
+        cmocka_unit_test(test_reactor_priority),
+        cmocka_unit_test(test_conn),
+        cmocka_unit_test(test_coro),
+        cmocka_unit_test(test_coro_pool),
+        cmocka_unit_test(test_channel),
+        cmocka_unit_test(test_work_pool),
+        cmocka_unit_test(test_admission)
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
\ No newline at end of file
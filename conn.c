@@ -0,0 +1,549 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "conn.h"
+#include "buffer_pool.h"
+#include "conn_buffer.h"
+#include "deps/ulog/logger.h"
+#include "iov_queue.h"
+#include "reactor.h"
+#include "sockets.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define NSEC_PER_MSEC 1000000ULL
+
+/*!
+ * @brief writes straight to the fd, without raising SIGPIPE on sockets
+ */
+static ssize_t write_direct(int fd, const void *data, size_t len) {
+    ssize_t rc;
+    do {
+        rc = send(fd, data, len, MSG_NOSIGNAL);
+        if (rc == -1 && errno == ENOTSOCK) {
+            rc = write(fd, data, len);
+        }
+    } while (rc == -1 && errno == EINTR);
+    return rc;
+}
+
+static void resume_reading(conn_t *conn) {
+    if (conn->read_error == 0 && conn->read_paused == false) {
+        want_read_reactor_t(conn->reactor, conn->fd, true);
+    }
+}
+
+/*!
+ * @brief stops the read side and reports why
+ */
+static void fail_read(conn_t *conn, int error) {
+    conn->read_error = error;
+    want_read_reactor_t(conn->reactor, conn->fd, false);
+    if (conn->on_error != NULL) {
+        conn->on_error(conn, error, conn->arg);
+    }
+}
+
+/*!
+ * @brief tells the producer to pause once the queue is over the high watermark
+ */
+static void check_high_watermark(conn_t *conn) {
+    if (conn->above_high ||
+        pending_iov_queue_t(conn->output) <= conn->high_watermark) {
+        return;
+    }
+    conn->above_high = true;
+    if (conn->on_watermark != NULL) {
+        conn->on_watermark(conn, true, conn->arg);
+    }
+}
+
+/*!
+ * @brief tells the producer to resume once the queue drained to the low watermark
+ */
+static void check_low_watermark(conn_t *conn) {
+    if (conn->above_high == false ||
+        pending_iov_queue_t(conn->output) > conn->low_watermark) {
+        return;
+    }
+    conn->above_high = false;
+    if (conn->on_watermark != NULL) {
+        conn->on_watermark(conn, false, conn->arg);
+    }
+}
+
+/*!
+ * @brief returns everything queued for writing to the pool
+ * @details the side is failed or closed by then, so no resume is reported
+ */
+static void drop_output(conn_t *conn) {
+    consume_iov_queue_t(conn->output, pending_iov_queue_t(conn->output));
+    want_write_reactor_t(conn->reactor, conn->fd, false);
+    conn->write_blocked = false;
+    conn->above_high = false;
+    conn->batched = 0;
+}
+
+/*!
+ * @brief stops the write side and reports why
+ */
+static void fail_write(conn_t *conn, int error) {
+    drop_output(conn);
+    conn->write_error = error;
+    if (conn->on_error != NULL) {
+        conn->on_error(conn, error, conn->arg);
+    }
+}
+
+/*!
+ * @brief the histogram bucket a turn that moved bytes falls into
+ */
+static size_t turn_bucket(size_t bytes) {
+    size_t bucket = 0;
+    while (bytes > 0 && bucket < CONN_TURN_BUCKETS - 1) {
+        bytes >>= 1;
+        bucket += 1;
+    }
+    return bucket;
+}
+
+/*!
+ * @brief reads until the socket is drained or the read budget is spent
+ * @details a read that fills the buffer probably left more behind, a shorter one
+ * means the socket is drained so no extra read is spent finding EAGAIN. whatever
+ * is left over after the budget is reported again by the next poll
+ */
+static int conn_readable(reactor_t *reactor, int fd, void *arg) {
+    (void)reactor;
+    conn_t *conn = arg;
+    size_t turn = 0;
+    for (;;) {
+        ssize_t rc = read_conn_buffer_t(conn->input, fd);
+        if (rc > 0) {
+            turn += (size_t)rc;
+            bool filled = conn->input->len == conn->input->capacity;
+            conn->on_data(conn, conn->arg);
+            if (filled == false || conn->closed || conn->read_error != 0 ||
+                conn->read_paused) {
+                break;
+            }
+            if (turn >= conn->read_budget) {
+                conn->stats.read_budget_hits += 1;
+                break;
+            }
+            continue;
+        }
+        if (rc == 0) {
+            fail_read(conn, 0);
+        } else if (errno == ENOBUFS) {
+            // the handler is not consuming, stop reading until it does
+            conn->read_paused = true;
+            want_read_reactor_t(conn->reactor, fd, false);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fail_read(conn, errno);
+        }
+        break;
+    }
+    conn->stats.read_turns[turn_bucket(turn)] += 1;
+    return 0;
+}
+
+/*!
+ * @brief writes out as much of the queue as the socket takes
+ * @details write interest is only kept while something is left over
+ */
+static void flush_output(conn_t *conn) {
+    uint64_t syscalls = conn->output->syscalls;
+    ssize_t rc = flush_max_iov_queue_t(conn->output, conn->fd, conn->write_budget);
+    syscalls = conn->output->syscalls - syscalls;
+    conn->stats.syscalls += syscalls;
+    if (conn->batched > syscalls) {
+        conn->stats.coalesced += conn->batched - syscalls;
+    }
+    conn->batched = 0;
+    if (rc == -1) {
+        fail_write(conn, errno);
+        return;
+    }
+    conn->stats.write_turns[turn_bucket((size_t)rc)] += 1;
+    // over budget the write interest stays set and the next poll resumes it
+    bool blocked = pending_iov_queue_t(conn->output) > 0;
+    if (blocked && (size_t)rc >= conn->write_budget) {
+        conn->stats.write_budget_hits += 1;
+    }
+    if (blocked != conn->write_blocked) {
+        conn->write_blocked = blocked;
+        want_write_reactor_t(conn->reactor, conn->fd, blocked);
+    }
+    check_low_watermark(conn);
+}
+
+/*!
+ * @brief sends the writes queued during this iteration, run as a reactor task
+ * @details a close in the meantime is fine, the conn_t is freed by a task
+ * deferred after this one
+ */
+static void flush_deferred_output(reactor_t *reactor, void *arg) {
+    (void)reactor;
+    conn_t *conn = arg;
+    conn->flush_deferred = false;
+    if (conn->closed || conn->write_error != 0 || conn->write_blocked) {
+        return;
+    }
+    flush_output(conn);
+}
+
+static int conn_writable(reactor_t *reactor, int fd, void *arg) {
+    (void)reactor;
+    (void)fd;
+    flush_output(arg);
+    return 0;
+}
+
+static void conn_failed(reactor_t *reactor, int fd, int error, void *arg) {
+    (void)reactor;
+    (void)fd;
+    conn_t *conn = arg;
+    conn->read_error = error;
+    conn->write_error = error;
+    if (conn->on_error != NULL) {
+        conn->on_error(conn, error, conn->arg);
+    }
+}
+
+static void read_deadline_passed(reactor_t *reactor, reactor_timer_t *timer,
+                                 void *arg) {
+    (void)reactor;
+    (void)timer;
+    conn_t *conn = arg;
+    if (conn->read_error != 0) {
+        return;
+    }
+    // nobody is going to finish parsing a partial message now, give it back
+    consume_conn_buffer_t(conn->input, conn->input->len);
+    fail_read(conn, CONN_ETIMEOUT);
+}
+
+static void write_deadline_passed(reactor_t *reactor, reactor_timer_t *timer,
+                                  void *arg) {
+    (void)reactor;
+    (void)timer;
+    conn_t *conn = arg;
+    if (conn->write_error != 0) {
+        return;
+    }
+    if (pending_iov_queue_t(conn->output) > 0) {
+        fail_write(conn, CONN_ETIMEOUT);
+        return;
+    }
+    // nothing was blocked, later writes fail until the deadline is moved
+    conn->write_error = CONN_ETIMEOUT;
+}
+
+/*!
+ * @brief arms timer for an absolute deadline, or disarms it for 0
+ */
+static void arm_deadline(conn_t *conn, reactor_timer_t *timer, uint64_t deadline,
+                         reactor_timer_fn fn) {
+    stop_timer_reactor_t(conn->reactor, timer);
+    if (deadline == 0) {
+        return;
+    }
+    uint64_t now = now_reactor_t(conn->reactor);
+    uint64_t delay_ms = 0;
+    if (deadline > now) {
+        delay_ms = (deadline - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+    }
+    start_timer_reactor_t(conn->reactor, timer, delay_ms, 0, fn, conn);
+}
+
+static bool in_future(conn_t *conn, uint64_t deadline) {
+    return deadline == 0 || deadline > now_reactor_t(conn->reactor);
+}
+
+static void free_conn(reactor_t *reactor, void *arg) {
+    (void)reactor;
+    conn_t *conn = arg;
+    free_conn_buffer_t(conn->input);
+    free_iov_queue_t(conn->output);
+    free(conn);
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new conn_t object
+ * @details fd is switched to non-blocking mode and registered with the reactor
+ * @return Success: pointer to instance of conn_t
+ * @return Failure: NULL ptr
+ */
+conn_t *new_conn_t(reactor_t *reactor, buffer_pool_t *pool, int fd,
+                   conn_data_fn on_data, conn_error_fn on_error, void *arg) {
+    conn_t *conn = calloc(1, sizeof(conn_t));
+    if (conn == NULL) {
+        LOG_ERROR(reactor->thl, 0, "failed to calloc conn_t");
+        return NULL;
+    }
+    conn->reactor = reactor;
+    conn->pool = pool;
+    conn->fd = fd;
+    conn->on_data = on_data;
+    conn->on_error = on_error;
+    conn->arg = arg;
+    conn->high_watermark = CONN_HIGH_WATERMARK;
+    conn->low_watermark = CONN_LOW_WATERMARK;
+    conn->read_budget = CONN_READ_BUDGET;
+    conn->write_budget = CONN_WRITE_BUDGET;
+    init_timer_reactor_t(&conn->read_timer);
+    init_timer_reactor_t(&conn->write_timer);
+    conn->input = new_conn_buffer_t(pool);
+    conn->output = new_iov_queue_t(0);
+    if (conn->input == NULL || conn->output == NULL) {
+        LOG_ERROR(reactor->thl, 0, "failed to allocate connection buffers");
+        goto ERROR;
+    }
+    if (set_socket_blocking_status(fd, false) == false) {
+        LOG_ERROR(reactor->thl, 0, "failed to set connection non-blocking");
+        goto ERROR;
+    }
+    // only tcp has it, on anything else this fails harmlessly
+    int lowat = CONN_NOTSENT_LOWAT;
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    if (add_fd_reactor_t(reactor, fd, conn_readable, conn_writable, conn_failed,
+                         conn) == -1) {
+        goto ERROR;
+    }
+    // write interest is only wanted while something is queued
+    want_write_reactor_t(reactor, fd, false);
+    return conn;
+
+ERROR:
+    if (conn->input != NULL) {
+        free_conn_buffer_t(conn->input);
+    }
+    if (conn->output != NULL) {
+        free_iov_queue_t(conn->output);
+    }
+    free(conn);
+    return NULL;
+}
+
+/*!
+ * @brief sets both the read and the write deadline
+ * @param deadline monotonic nanoseconds, see now_reactor_t, or 0 for none
+ */
+void set_deadline_conn_t(conn_t *conn, uint64_t deadline) {
+    set_read_deadline_conn_t(conn, deadline);
+    set_write_deadline_conn_t(conn, deadline);
+}
+
+/*!
+ * @brief sets the time after which reading fails with CONN_ETIMEOUT
+ * @details like go the deadline is absolute and is not pushed back by reads, an
+ * idle timeout is a deadline moved forward after every read
+ * @param deadline monotonic nanoseconds, see now_reactor_t, or 0 for none
+ */
+void set_read_deadline_conn_t(conn_t *conn, uint64_t deadline) {
+    if (conn->closed) {
+        return;
+    }
+    conn->read_deadline = deadline;
+    if (conn->read_error == CONN_ETIMEOUT && in_future(conn, deadline)) {
+        conn->read_error = 0;
+        resume_reading(conn);
+    }
+    arm_deadline(conn, &conn->read_timer, deadline, read_deadline_passed);
+}
+
+/*!
+ * @brief sets the time after which writing fails with CONN_ETIMEOUT
+ * @details if data is still queued when the deadline passes it is dropped and
+ * the error callback is invoked
+ * @param deadline monotonic nanoseconds, see now_reactor_t, or 0 for none
+ */
+void set_write_deadline_conn_t(conn_t *conn, uint64_t deadline) {
+    if (conn->closed) {
+        return;
+    }
+    conn->write_deadline = deadline;
+    if (conn->write_error == CONN_ETIMEOUT && in_future(conn, deadline)) {
+        conn->write_error = 0;
+    }
+    arm_deadline(conn, &conn->write_timer, deadline, write_deadline_passed);
+}
+
+/*!
+ * @brief writes len bytes, queueing what the socket does not take right away
+ * @details queued bytes are copied into buffers from the pool. small writes are
+ * flushed at the end of the reactor iteration along with any others made during
+ * it, anything the socket does not take is flushed when the fd becomes writable
+ * @return Success: len
+ * @return Failure: -1 with errno set to the write side's error, or a short count
+ * with errno set to ENOMEM when only the first bytes could be written or queued
+ */
+ssize_t write_conn_t(conn_t *conn, const void *data, size_t len) {
+    if (conn->closed) {
+        errno = EBADF;
+        return -1;
+    }
+    if (conn->write_error != 0) {
+        errno = conn->write_error;
+        return -1;
+    }
+    conn->stats.writes += 1;
+    size_t written = 0;
+    bool queued = pending_iov_queue_t(conn->output) > 0;
+    if (queued == false && len >= CONN_COALESCE_MAX) {
+        // big enough that copying it to coalesce would cost more than a syscall,
+        // past the write budget the rest waits for the next iteration
+        size_t direct = len < conn->write_budget ? len : conn->write_budget;
+        ssize_t rc = write_direct(conn->fd, data, direct);
+        conn->stats.syscalls += 1;
+        if (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            int error = errno;
+            fail_write(conn, error);
+            errno = error;
+            return -1;
+        }
+        written = rc > 0 ? (size_t)rc : 0;
+        if (written < len) {
+            conn->write_blocked = true;
+            want_write_reactor_t(conn->reactor, conn->fd, true);
+        }
+    } else {
+        conn->batched += 1;
+    }
+    while (written < len) {
+        size_t chunk = len - written;
+        if (chunk > BUFFER_POOL_MAX_SIZE) {
+            chunk = BUFFER_POOL_MAX_SIZE;
+        }
+        char *buffer = get_buffer_pool_t(conn->pool, chunk);
+        if (buffer == NULL) {
+            break;
+        }
+        memcpy(buffer, (const char *)data + written, chunk);
+        if (push_iov_queue_t(conn->output, buffer, chunk, put_buffer_pool_t,
+                             buffer) == -1) {
+            put_buffer_pool_t(buffer);
+            break;
+        }
+        written += chunk;
+    }
+    if (pending_iov_queue_t(conn->output) > 0) {
+        if (conn->write_blocked == false && conn->flush_deferred == false) {
+            if (defer_reactor_t(conn->reactor, flush_deferred_output, conn) == 0) {
+                conn->flush_deferred = true;
+            } else {
+                flush_output(conn);
+            }
+        }
+        check_high_watermark(conn);
+    }
+    if (written < len) {
+        // what was written or queued goes out, the caller resends from written
+        errno = ENOMEM;
+        return written > 0 ? (ssize_t)written : -1;
+    }
+    return (ssize_t)len;
+}
+
+/*!
+ * @brief sets the output queue's watermarks and the callback told about them
+ * @details on_watermark may be NULL, then only writable_conn_t reflects them
+ * @param high queued bytes above which producers should pause
+ * @param low queued bytes at or below which they may resume, at most high
+ */
+void set_watermarks_conn_t(conn_t *conn, size_t low, size_t high,
+                           conn_watermark_fn on_watermark) {
+    conn->high_watermark = high;
+    conn->low_watermark = low > high ? high : low;
+    conn->on_watermark = on_watermark;
+    check_high_watermark(conn);
+    check_low_watermark(conn);
+}
+
+/*!
+ * @brief sets how many bytes the connection may read and write per iteration
+ * @details budgets are checked between syscalls so a turn can go over by at
+ * most one read
+ */
+void set_budgets_conn_t(conn_t *conn, size_t read_budget, size_t write_budget) {
+    conn->read_budget = read_budget > 0 ? read_budget : CONN_READ_BUDGET;
+    conn->write_budget = write_budget > 0 ? write_budget : CONN_WRITE_BUDGET;
+}
+
+/*!
+ * @brief bytes queued for writing that the kernel has not taken yet
+ */
+size_t pending_conn_t(conn_t *conn) {
+    return pending_iov_queue_t(conn->output);
+}
+
+/*!
+ * @brief whether producers should keep writing, false while over the high
+ * watermark until the queue drains to the low one
+ */
+bool writable_conn_t(conn_t *conn) {
+    return conn->closed == false && conn->write_error == 0 &&
+           conn->above_high == false;
+}
+
+/*!
+ * @brief drops len bytes from the front of conn->input
+ * @details reading resumes if it was paused because the input was full
+ */
+void consume_conn_t(conn_t *conn, size_t len) {
+    consume_conn_buffer_t(conn->input, len);
+    if (conn->read_paused && conn->closed == false) {
+        conn->read_paused = false;
+        resume_reading(conn);
+    }
+}
+
+/*!
+ * @brief whether error is the one reported for a passed deadline
+ */
+bool is_timeout_conn_t(int error) {
+    return error == CONN_ETIMEOUT;
+}
+
+/*!
+ * @brief unregisters and closes the connection
+ * @details whatever is queued gets one last non-blocking flush. the conn_t is
+ * freed at the end of the reactor iteration so it is safe to close a connection
+ * from inside its own callbacks
+ */
+void close_conn_t(conn_t *conn) {
+    if (conn->closed) {
+        return;
+    }
+    if (conn->write_error == 0 && pending_iov_queue_t(conn->output) > 0) {
+        flush_iov_queue_t(conn->output, conn->fd);
+    }
+    conn->closed = true;
+    remove_fd_reactor_t(conn->reactor, conn->fd);
+    stop_timer_reactor_t(conn->reactor, &conn->read_timer);
+    stop_timer_reactor_t(conn->reactor, &conn->write_timer);
+    close(conn->fd);
+    // give the buffers back now rather than when the task runs
+    drop_output(conn);
+    consume_conn_buffer_t(conn->input, conn->input->len);
+    if (defer_reactor_t(conn->reactor, free_conn, conn) == -1) {
+        free_conn(conn->reactor, conn);
+    }
+}
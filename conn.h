@@ -0,0 +1,247 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file conn.h
+ * @brief non-blocking connections driven by a reactor_t, with go style deadlines
+ * @details a conn_t reads into a conn_buffer_t whenever its fd is readable and
+ * queues whatever the kernel does not take from write_conn_t. like go's net.Conn
+ * a connection has a read deadline and a write deadline, absolute points in time
+ * after which that side fails with CONN_ETIMEOUT. deadlines are reactor timers,
+ * not SO_RCVTIMEO / SO_SNDTIMEO, so they cost nothing until they are armed and
+ * work the same for any fd. when a deadline passes the buffers held for that
+ * side are returned to the pool straight away instead of when the connection
+ * is closed. moving a deadline into the future, or clearing it, makes the side
+ * usable again. the output queue has a high and a low watermark, producers are
+ * told to pause once more than the high watermark is queued and to resume once
+ * it has drained to the low one, and on tcp TCP_NOTSENT_LOWAT keeps the bytes
+ * sitting unsent in the kernel bounded so the queue, not the socket buffer,
+ * absorbs a slow peer. writes smaller than CONN_COALESCE_MAX are not sent right
+ * away but queued and flushed together with a single sendmsg at the end of the
+ * reactor iteration, so a handler writing a header and then a body costs one
+ * syscall and, with TCP_NODELAY, one segment. every turn a connection gets from
+ * the reactor is capped by a read and a write byte budget, a connection with
+ * more to do than its budget is simply picked up again next iteration, so one
+ * busy peer can not starve the others on the loop
+ */
+
+#pragma once
+
+#include "buffer_pool.h"
+#include "conn_buffer.h"
+#include "iov_queue.h"
+#include "reactor.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*!
+ * @brief the error reported once a deadline has passed
+ * @details kept outside the errno range so it can not be confused with the
+ * ETIMEDOUT a socket reports when tcp itself gives up on the peer
+ */
+#define CONN_ETIMEOUT 4096
+
+/*! @brief default queued bytes above which producers are told to pause */
+#ifndef CONN_HIGH_WATERMARK
+#define CONN_HIGH_WATERMARK (256 * 1024)
+#endif
+
+/*! @brief default queued bytes at or below which producers are told to resume */
+#ifndef CONN_LOW_WATERMARK
+#define CONN_LOW_WATERMARK (64 * 1024)
+#endif
+
+/*! @brief writes at least this large go straight to the socket when nothing is
+ * queued */
+#ifndef CONN_COALESCE_MAX
+#define CONN_COALESCE_MAX (16 * 1024)
+#endif
+
+/*! @brief default bytes a connection reads per reactor iteration */
+#ifndef CONN_READ_BUDGET
+#define CONN_READ_BUDGET (64 * 1024)
+#endif
+
+/*! @brief default bytes a connection writes per reactor iteration */
+#ifndef CONN_WRITE_BUDGET
+#define CONN_WRITE_BUDGET (128 * 1024)
+#endif
+
+/*! @brief buckets of the bytes per turn histograms */
+#define CONN_TURN_BUCKETS 24
+
+/*! @brief unsent bytes the kernel may hold for a tcp connection */
+#ifndef CONN_NOTSENT_LOWAT
+#define CONN_NOTSENT_LOWAT (16 * 1024)
+#endif
+
+struct conn;
+
+/*! @typedef conn_data_fn
+ * @brief called after new data has been read into conn->input
+ * @details consume what was handled with consume_conn_t, anything left stays
+ * buffered for the next call
+ */
+typedef void (*conn_data_fn)(struct conn *conn, void *arg);
+
+/*! @typedef conn_error_fn
+ * @brief called when a side of the connection fails
+ * @param error 0 once the peer has closed its side, CONN_ETIMEOUT when a deadline
+ * passed, an errno value otherwise
+ */
+typedef void (*conn_error_fn)(struct conn *conn, int error, void *arg);
+
+/*! @typedef conn_watermark_fn
+ * @brief called when the output queue crosses a watermark
+ * @param above true once more than the high watermark is queued, false once the
+ * queue has drained back down to the low watermark
+ */
+typedef void (*conn_watermark_fn)(struct conn *conn, bool above, void *arg);
+
+/*!
+ * @brief counters kept by a connection
+ * @details bucket 0 of the turn histograms counts turns that moved no bytes and
+ * bucket i those that moved [2^(i-1), 2^i) bytes, the last one is open ended
+ */
+typedef struct conn_stats {
+    uint64_t writes;    /*! @brief write_conn_t calls that were accepted */
+    uint64_t syscalls;  /*! @brief send and sendmsg calls made for them */
+    uint64_t coalesced; /*! @brief writes that shared a syscall with an earlier
+                           one */
+    uint64_t read_budget_hits;  /*! @brief read turns cut short by the budget */
+    uint64_t write_budget_hits; /*! @brief write turns cut short by the budget */
+    uint64_t read_turns[CONN_TURN_BUCKETS];  /*! @brief bytes read per turn */
+    uint64_t write_turns[CONN_TURN_BUCKETS]; /*! @brief bytes written per turn */
+} conn_stats_t;
+
+/*! @typedef conn
+ * @struct conn
+ * @brief a connection registered with a reactor
+ */
+typedef struct conn {
+    reactor_t *reactor;
+    buffer_pool_t *pool;
+    int fd;
+    conn_buffer_t *input;
+    iov_queue_t *output;
+    reactor_timer_t read_timer;
+    reactor_timer_t write_timer;
+    uint64_t read_deadline;  /*! @brief monotonic nanoseconds, 0 for none */
+    uint64_t write_deadline; /*! @brief monotonic nanoseconds, 0 for none */
+    int read_error;  /*! @brief sticky error of the read side, 0 while usable */
+    int write_error; /*! @brief sticky error of the write side, 0 while usable */
+    bool read_paused; /*! @brief input is full, reading resumes on consume */
+    bool above_high;  /*! @brief the output queue went over the high watermark */
+    bool write_blocked;  /*! @brief the socket is full, waiting for write
+                            readiness */
+    bool flush_deferred; /*! @brief a flush is due at the end of the iteration */
+    size_t batched;      /*! @brief writes queued since the last flush */
+    bool closed;
+    size_t high_watermark;
+    size_t low_watermark;
+    size_t read_budget;
+    size_t write_budget;
+    conn_data_fn on_data;
+    conn_error_fn on_error;
+    conn_watermark_fn on_watermark;
+    void *arg;
+    conn_stats_t stats;
+} conn_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new conn_t object
+ * @details fd is switched to non-blocking mode and registered with the reactor
+ * @return Success: pointer to instance of conn_t
+ * @return Failure: NULL ptr
+ */
+conn_t *new_conn_t(reactor_t *reactor, buffer_pool_t *pool, int fd,
+                   conn_data_fn on_data, conn_error_fn on_error, void *arg);
+
+/*!
+ * @brief sets both the read and the write deadline
+ * @param deadline monotonic nanoseconds, see now_reactor_t, or 0 for none
+ */
+void set_deadline_conn_t(conn_t *conn, uint64_t deadline);
+
+/*!
+ * @brief sets the time after which reading fails with CONN_ETIMEOUT
+ * @details like go the deadline is absolute and is not pushed back by reads, an
+ * idle timeout is a deadline moved forward after every read
+ * @param deadline monotonic nanoseconds, see now_reactor_t, or 0 for none
+ */
+void set_read_deadline_conn_t(conn_t *conn, uint64_t deadline);
+
+/*!
+ * @brief sets the time after which writing fails with CONN_ETIMEOUT
+ * @details if data is still queued when the deadline passes it is dropped and
+ * the error callback is invoked
+ * @param deadline monotonic nanoseconds, see now_reactor_t, or 0 for none
+ */
+void set_write_deadline_conn_t(conn_t *conn, uint64_t deadline);
+
+/*!
+ * @brief writes len bytes, queueing what the socket does not take right away
+ * @details queued bytes are copied into buffers from the pool. small writes are
+ * flushed at the end of the reactor iteration along with any others made during
+ * it, anything the socket does not take is flushed when the fd becomes writable
+ * @return Success: len
+ * @return Failure: -1 with errno set to the write side's error, or a short count
+ * with errno set to ENOMEM when only the first bytes could be written or queued
+ */
+ssize_t write_conn_t(conn_t *conn, const void *data, size_t len);
+
+/*!
+ * @brief sets the output queue's watermarks and the callback told about them
+ * @details on_watermark may be NULL, then only writable_conn_t reflects them
+ * @param high queued bytes above which producers should pause
+ * @param low queued bytes at or below which they may resume, at most high
+ */
+void set_watermarks_conn_t(conn_t *conn, size_t low, size_t high,
+                           conn_watermark_fn on_watermark);
+
+/*!
+ * @brief sets how many bytes the connection may read and write per iteration
+ * @details budgets are checked between syscalls so a turn can go over by at
+ * most one read
+ */
+void set_budgets_conn_t(conn_t *conn, size_t read_budget, size_t write_budget);
+
+/*!
+ * @brief bytes queued for writing that the kernel has not taken yet
+ */
+size_t pending_conn_t(conn_t *conn);
+
+/*!
+ * @brief whether producers should keep writing, false while over the high
+ * watermark until the queue drains to the low one
+ */
+bool writable_conn_t(conn_t *conn);
+
+/*!
+ * @brief drops len bytes from the front of conn->input
+ * @details reading resumes if it was paused because the input was full
+ */
+void consume_conn_t(conn_t *conn, size_t len);
+
+/*!
+ * @brief whether error is the one reported for a passed deadline
+ */
+bool is_timeout_conn_t(int error);
+
+/*!
+ * @brief unregisters and closes the connection
+ * @details whatever is queued gets one last non-blocking flush. the conn_t is
+ * freed at the end of the reactor iteration so it is safe to close a connection
+ * from inside its own callbacks
+ */
+void close_conn_t(conn_t *conn);
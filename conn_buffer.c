@@ -0,0 +1,213 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "conn_buffer.h"
+#include "buffer_pool.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*!
+ * @brief makes sure there is free space to read into
+ * @return false if the buffer is full and can not grow
+ */
+static bool reserve_space(conn_buffer_t *buffer) {
+    if (buffer->data == NULL) {
+        buffer->data = get_buffer_pool_t(buffer->pool, buffer->target);
+        if (buffer->data == NULL) {
+            return false;
+        }
+        buffer->capacity = size_buffer_pool_t(buffer->data);
+        buffer->borrows += 1;
+        if (buffer->account != NULL) {
+            charge_mem_account_t(buffer->account, buffer->capacity);
+        }
+        return true;
+    }
+    if (buffer->len < buffer->capacity) {
+        return true;
+    }
+    if (buffer->capacity >= CONN_BUFFER_MAX) {
+        return false;
+    }
+
+    // a message larger than the buffer, move to the next size up
+    char *grown = get_buffer_pool_t(buffer->pool, buffer->capacity * 2);
+    if (grown == NULL) {
+        return false;
+    }
+    memcpy(grown, buffer->data, buffer->len);
+    put_buffer_pool_t(buffer->data);
+    size_t old_capacity = buffer->capacity;
+    buffer->data = grown;
+    buffer->capacity = size_buffer_pool_t(grown);
+    if (buffer->account != NULL) {
+        charge_mem_account_t(buffer->account, buffer->capacity - old_capacity);
+    }
+    if (buffer->target < buffer->capacity) {
+        buffer->target = buffer->capacity;
+    }
+    return true;
+}
+
+/*!
+ * @brief moves the target size towards the reads actually seen
+ */
+static void adapt_target(conn_buffer_t *buffer, size_t got, size_t room) {
+    if (got == room) {
+        // the read was cut short by the buffer, there is probably more
+        size_t grown = buffer->capacity * 2;
+        buffer->target = grown < CONN_BUFFER_MAX ? grown : CONN_BUFFER_MAX;
+        buffer->small_reads = 0;
+        return;
+    }
+    if (got * 4 >= buffer->target) {
+        buffer->small_reads = 0;
+        return;
+    }
+    buffer->small_reads += 1;
+    if (buffer->small_reads >= CONN_BUFFER_SHRINK_READS) {
+        size_t shrunk = buffer->target / 2;
+        buffer->target = shrunk > CONN_BUFFER_MIN ? shrunk : CONN_BUFFER_MIN;
+        buffer->small_reads = 0;
+    }
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new conn_buffer_t object
+ * @details no buffer is borrowed until the first read
+ * @return Success: pointer to instance of conn_buffer_t
+ * @return Failure: NULL ptr
+ */
+conn_buffer_t *new_conn_buffer_t(buffer_pool_t *pool) {
+    conn_buffer_t *buffer = calloc(1, sizeof(conn_buffer_t));
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->pool = pool;
+    buffer->target = CONN_BUFFER_MIN;
+    return buffer;
+}
+
+/*!
+ * @brief reads from fd into the buffer, borrowing or growing it as needed
+ * @details when nothing is buffered and the read returns EOF or would block, the
+ * buffer goes straight back to the pool
+ * @return Success: bytes read, 0 on EOF
+ * @return Failure: -1 with errno from read, or ENOBUFS if the buffer is full at
+ * CONN_BUFFER_MAX
+ */
+ssize_t read_conn_buffer_t(conn_buffer_t *buffer, int fd) {
+    if (reserve_space(buffer) == false) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    size_t room = buffer->capacity - buffer->len;
+    ssize_t rc;
+    do {
+        rc = read(fd, buffer->data + buffer->len, room);
+    } while (rc == -1 && errno == EINTR);
+
+    if (rc > 0) {
+        buffer->len += (size_t)rc;
+        adapt_target(buffer, (size_t)rc, room);
+        return rc;
+    }
+    int saved = errno;
+    release_conn_buffer_t(buffer);
+    errno = saved;
+    return rc;
+}
+
+/*!
+ * @brief the bytes read but not consumed yet
+ */
+char *peek_conn_buffer_t(conn_buffer_t *buffer, size_t *len) {
+    *len = buffer->len;
+    return buffer->data;
+}
+
+/*!
+ * @brief drops len bytes from the front, returning the buffer to the pool once
+ * it is empty
+ */
+void consume_conn_buffer_t(conn_buffer_t *buffer, size_t len) {
+    if (len >= buffer->len) {
+        buffer->len = 0;
+        release_conn_buffer_t(buffer);
+        return;
+    }
+    memmove(buffer->data, buffer->data + len, buffer->len - len);
+    buffer->len -= len;
+}
+
+/*!
+ * @brief returns the buffer to the pool if nothing is buffered
+ * @return true if the connection is idle afterwards
+ */
+bool release_conn_buffer_t(conn_buffer_t *buffer) {
+    if (buffer->len > 0) {
+        return false;
+    }
+    put_buffer_pool_t(buffer->data);
+    if (buffer->account != NULL) {
+        credit_mem_account_t(buffer->account, buffer->capacity);
+    }
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    return true;
+}
+
+/*!
+ * @brief bytes of memory the connection currently holds
+ */
+size_t footprint_conn_buffer_t(conn_buffer_t *buffer) {
+    return sizeof(conn_buffer_t) + buffer->capacity;
+}
+
+/*!
+ * @brief sums up the memory held by count connections
+ */
+void report_conn_buffers(conn_buffer_t **buffers, size_t count,
+                         conn_buffer_report_t *report) {
+    memset(report, 0, sizeof(conn_buffer_report_t));
+    size_t idle_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t footprint = footprint_conn_buffer_t(buffers[i]);
+        report->connections += 1;
+        report->held_bytes += buffers[i]->capacity;
+        report->total_bytes += footprint;
+        if (buffers[i]->data == NULL) {
+            report->idle += 1;
+            idle_bytes += footprint;
+        }
+    }
+    if (report->idle > 0) {
+        report->bytes_per_idle = (double)idle_bytes / (double)report->idle;
+    }
+    if (report->connections > 0) {
+        report->bytes_per_connection =
+            (double)report->total_bytes / (double)report->connections;
+    }
+}
+
+/*!
+ * @brief returns any held buffer and frees the conn_buffer_t
+ */
+void free_conn_buffer_t(conn_buffer_t *buffer) {
+    put_buffer_pool_t(buffer->data);
+    if (buffer->account != NULL) {
+        credit_mem_account_t(buffer->account, buffer->capacity);
+    }
+    free(buffer);
+}
@@ -0,0 +1,122 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file conn_buffer.h
+ * @brief per-connection read buffers that adapt to traffic and go away when idle
+ * @details a connection holds no buffer while it waits for readiness. a buffer
+ * is borrowed from a buffer_pool_t when data arrives and handed back as soon as
+ * everything read has been consumed, so idle connections cost only the small
+ * conn_buffer_t itself. the size borrowed follows the reads actually seen: a read
+ * that fills the buffer doubles it, a run of small reads halves it
+ */
+
+#pragma once
+
+#include "buffer_pool.h"
+#include "mem_budget.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*! @brief smallest buffer a connection borrows */
+#ifndef CONN_BUFFER_MIN
+#define CONN_BUFFER_MIN 1024
+#endif
+
+/*! @brief largest buffer a connection grows to */
+#ifndef CONN_BUFFER_MAX
+#define CONN_BUFFER_MAX BUFFER_POOL_MAX_SIZE
+#endif
+
+/*! @brief consecutive reads using under a quarter of the buffer before it shrinks */
+#ifndef CONN_BUFFER_SHRINK_READS
+#define CONN_BUFFER_SHRINK_READS 8
+#endif
+
+/*! @typedef conn_buffer
+ * @struct conn_buffer
+ * @brief the read buffer of one connection
+ */
+typedef struct conn_buffer {
+    buffer_pool_t *pool;
+    char *data;           /*! @brief NULL while the connection is idle */
+    size_t capacity;
+    size_t len;           /*! @brief bytes read but not consumed yet */
+    size_t target;        /*! @brief size borrowed next time */
+    uint32_t small_reads;
+    uint32_t borrows;     /*! @brief times a buffer was taken from the pool */
+    mem_account_t *account; /*! @brief optional, charged with the held capacity */
+} conn_buffer_t;
+
+/*!
+ * @brief memory held by a set of connections
+ */
+typedef struct conn_buffer_report {
+    size_t connections;
+    size_t idle;          /*! @brief connections holding no buffer */
+    size_t held_bytes;    /*! @brief buffer bytes borrowed by busy connections */
+    size_t total_bytes;   /*! @brief conn_buffer_t structs plus held_bytes */
+    double bytes_per_idle; /*! @brief memory an idle connection costs */
+    double bytes_per_connection;
+} conn_buffer_report_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new conn_buffer_t object
+ * @details no buffer is borrowed until the first read
+ * @return Success: pointer to instance of conn_buffer_t
+ * @return Failure: NULL ptr
+ */
+conn_buffer_t *new_conn_buffer_t(buffer_pool_t *pool);
+
+/*!
+ * @brief reads from fd into the buffer, borrowing or growing it as needed
+ * @details when nothing is buffered and the read returns EOF or would block, the
+ * buffer goes straight back to the pool
+ * @return Success: bytes read, 0 on EOF
+ * @return Failure: -1 with errno from read, or ENOBUFS if the buffer is full at
+ * CONN_BUFFER_MAX
+ */
+ssize_t read_conn_buffer_t(conn_buffer_t *buffer, int fd);
+
+/*!
+ * @brief the bytes read but not consumed yet
+ */
+char *peek_conn_buffer_t(conn_buffer_t *buffer, size_t *len);
+
+/*!
+ * @brief drops len bytes from the front, returning the buffer to the pool once
+ * it is empty
+ */
+void consume_conn_buffer_t(conn_buffer_t *buffer, size_t len);
+
+/*!
+ * @brief returns the buffer to the pool if nothing is buffered
+ * @return true if the connection is idle afterwards
+ */
+bool release_conn_buffer_t(conn_buffer_t *buffer);
+
+/*!
+ * @brief bytes of memory the connection currently holds
+ */
+size_t footprint_conn_buffer_t(conn_buffer_t *buffer);
+
+/*!
+ * @brief sums up the memory held by count connections
+ */
+void report_conn_buffers(conn_buffer_t **buffers, size_t count,
+                         conn_buffer_report_t *report);
+
+/*!
+ * @brief returns any held buffer and frees the conn_buffer_t
+ */
+void free_conn_buffer_t(conn_buffer_t *buffer);
@@ -0,0 +1,568 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "coro.h"
+#include "deps/ulog/logger.h"
+#include "reactor.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void drain_run_queue(reactor_t *reactor, void *arg);
+
+static size_t page_size(void) {
+    long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? (size_t)size : 4096;
+}
+
+static inline bool valid_fd(int fd) {
+    return fd >= 0 && fd < FD_SETSIZE;
+}
+
+/*!
+ * @brief makes sure the run queue is drained at the end of the iteration
+ */
+static void schedule_drain(coro_sched_t *sched) {
+    if (sched->drain_deferred) {
+        return;
+    }
+    if (defer_reactor_t(sched->reactor, drain_run_queue, sched) == -1) {
+        // the queue is drained on the next successful wakeup instead
+        LOG_ERROR(sched->reactor->thl, 0, "failed to defer coroutine run queue");
+        return;
+    }
+    sched->drain_deferred = true;
+}
+
+static void make_runnable(coro_t *coro) {
+    if (coro->queued) {
+        return;
+    }
+    coro_sched_t *sched = coro->sched;
+    coro->queued = true;
+    coro->next = NULL;
+    if (sched->run_tail == NULL) {
+        sched->run_head = coro;
+    } else {
+        sched->run_tail->next = coro;
+    }
+    sched->run_tail = coro;
+    sched->num_runnable += 1;
+    schedule_drain(sched);
+}
+
+static void destroy_coro(coro_t *coro) {
+    munmap(coro->mapping, coro->mapping_size);
+    free(coro);
+}
+
+/*!
+ * @brief called on the scheduler's stack once a coroutine has returned
+ */
+static void retire_coro(coro_sched_t *sched, coro_t *coro) {
+    if (coro->prev_live != NULL) {
+        coro->prev_live->next_live = coro->next_live;
+    } else {
+        sched->live = coro->next_live;
+    }
+    if (coro->next_live != NULL) {
+        coro->next_live->prev_live = coro->prev_live;
+    }
+    stop_timer_reactor_t(sched->reactor, &coro->timer);
+    sched->stats.finished += 1;
+    sched->stats.live -= 1;
+    if (sched->num_cached < CORO_CACHE_SIZE) {
+        coro->next = sched->cache;
+        sched->cache = coro;
+        sched->num_cached += 1;
+        return;
+    }
+    destroy_coro(coro);
+}
+
+static void resume_coro(coro_sched_t *sched, coro_t *coro) {
+    sched->current = coro;
+    sched->stats.switches += 1;
+    swapcontext(&sched->context, &coro->context);
+    sched->current = NULL;
+    if (coro->finished) {
+        retire_coro(sched, coro);
+    }
+}
+
+/*!
+ * @brief switches from the running coroutine back to the scheduler
+ */
+static void suspend_coro(coro_sched_t *sched) {
+    coro_t *coro = sched->current;
+    swapcontext(&coro->context, &sched->context);
+}
+
+/*!
+ * @brief resumes the coroutines that were runnable when the task started
+ * @details coroutines made runnable while draining wait for the next iteration
+ * so a coroutine that keeps yielding can not starve i/o
+ */
+static void drain_run_queue(reactor_t *reactor, void *arg) {
+    (void)reactor;
+    coro_sched_t *sched = arg;
+    sched->drain_deferred = false;
+    size_t count = sched->num_runnable;
+    while (count > 0 && sched->run_head != NULL) {
+        count -= 1;
+        coro_t *coro = sched->run_head;
+        sched->run_head = coro->next;
+        if (sched->run_head == NULL) {
+            sched->run_tail = NULL;
+        }
+        sched->num_runnable -= 1;
+        coro->queued = false;
+        resume_coro(sched, coro);
+    }
+    if (sched->num_runnable > 0) {
+        schedule_drain(sched);
+    }
+}
+
+/*!
+ * @brief first function run on a coroutine's stack
+ * @details makecontext only passes ints, so the pointer is split in two
+ */
+static void coro_entry(unsigned int high, unsigned int low) {
+    coro_t *coro = (coro_t *)(uintptr_t)(((uint64_t)high << 32) | (uint64_t)low);
+    coro->fn(coro->sched, coro->arg);
+    coro->finished = true;
+    setcontext(&coro->sched->context);
+}
+
+static coro_t *alloc_coro(coro_sched_t *sched) {
+    coro_t *coro = calloc(1, sizeof(coro_t));
+    if (coro == NULL) {
+        return NULL;
+    }
+    size_t guard = sched->guard_pages ? page_size() : 0;
+    coro->mapping_size = sched->stack_size + guard;
+    coro->mapping = mmap(NULL, coro->mapping_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (coro->mapping == MAP_FAILED) {
+        free(coro);
+        return NULL;
+    }
+    // stacks grow down, the guard page sits below the lowest usable address
+    if (guard > 0 && mprotect(coro->mapping, guard, PROT_NONE) == -1) {
+        destroy_coro(coro);
+        return NULL;
+    }
+    coro->sched = sched;
+    return coro;
+}
+
+/*!
+ * @brief points the coroutine's context at coro_entry on top of its stack
+ * @details getcontext returns twice, it lives in its own function so the
+ * caller's locals can not be clobbered
+ */
+static void prepare_context(coro_t *const coro) {
+    getcontext(&coro->context);
+    size_t stack_size = coro->sched->stack_size;
+    coro->context.uc_stack.ss_sp = coro->mapping + (coro->mapping_size - stack_size);
+    coro->context.uc_stack.ss_size = stack_size;
+    coro->context.uc_link = NULL;
+    uint64_t ptr = (uint64_t)(uintptr_t)coro;
+    makecontext(&coro->context, (void (*)(void))coro_entry, 2,
+                (unsigned int)(ptr >> 32), (unsigned int)ptr);
+}
+
+static void sleep_done(reactor_t *reactor, reactor_timer_t *timer, void *arg) {
+    (void)reactor;
+    (void)timer;
+    make_runnable(arg);
+}
+
+/*!
+ * @brief wakes a parked coroutine, fd interest is only left on while waiting
+ */
+static void wake_waiter(coro_sched_t *sched, int fd, bool write, int error) {
+    coro_waiters_t *waiters = &sched->waiters[fd];
+    coro_t *coro = write ? waiters->writer : waiters->reader;
+    if (write) {
+        waiters->writer = NULL;
+        want_write_reactor_t(sched->reactor, fd, false);
+    } else {
+        waiters->reader = NULL;
+        want_read_reactor_t(sched->reactor, fd, false);
+    }
+    if (coro == NULL) {
+        return;
+    }
+    stop_timer_reactor_t(sched->reactor, &coro->timer);
+    coro->wait_error = error;
+    make_runnable(coro);
+}
+
+static int fd_readable(reactor_t *reactor, int fd, void *arg) {
+    (void)reactor;
+    wake_waiter(arg, fd, false, 0);
+    return 0;
+}
+
+static int fd_writable(reactor_t *reactor, int fd, void *arg) {
+    (void)reactor;
+    wake_waiter(arg, fd, true, 0);
+    return 0;
+}
+
+static void fd_failed(reactor_t *reactor, int fd, int error, void *arg) {
+    (void)reactor;
+    wake_waiter(arg, fd, false, error);
+    wake_waiter(arg, fd, true, error);
+}
+
+static void wait_timed_out(reactor_t *reactor, reactor_timer_t *timer, void *arg) {
+    (void)timer;
+    coro_t *coro = arg;
+    coro_waiters_t *waiters = &coro->sched->waiters[coro->wait_fd];
+    if (coro->wait_write && waiters->writer == coro) {
+        waiters->writer = NULL;
+        want_write_reactor_t(reactor, coro->wait_fd, false);
+    } else if (coro->wait_write == false && waiters->reader == coro) {
+        waiters->reader = NULL;
+        want_read_reactor_t(reactor, coro->wait_fd, false);
+    }
+    coro->timed_out = true;
+    make_runnable(coro);
+}
+
+static bool registered(coro_sched_t *sched, int fd) {
+    reactor_handler_t *handler = &sched->reactor->handlers[fd];
+    return handler->active && handler->arg == sched &&
+           handler->on_read == fd_readable;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new coro_sched_t object
+ * @param stack_size usable stack size of each coroutine, 0 for CORO_STACK_SIZE
+ * @param guard_pages whether to put a PROT_NONE page below every stack so an
+ * overflow faults instead of corrupting memory
+ * @return Success: pointer to instance of coro_sched_t
+ * @return Failure: NULL ptr
+ */
+coro_sched_t *new_coro_sched_t(reactor_t *reactor, size_t stack_size,
+                               bool guard_pages) {
+    coro_sched_t *sched = calloc(1, sizeof(coro_sched_t));
+    if (sched == NULL) {
+        LOG_ERROR(reactor->thl, 0, "failed to calloc coro_sched_t");
+        return NULL;
+    }
+    if (stack_size == 0) {
+        stack_size = CORO_STACK_SIZE;
+    }
+    size_t page = page_size();
+    sched->stack_size = (stack_size + page - 1) / page * page;
+    sched->guard_pages = guard_pages;
+    sched->reactor = reactor;
+    return sched;
+}
+
+/*!
+ * @brief starts a new coroutine
+ * @details the coroutine first runs at the end of the current, or next, reactor
+ * iteration. can be called from inside and outside of coroutines
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int spawn_coro_sched_t(coro_sched_t *sched, coro_fn fn, void *arg) {
+    coro_t *coro = sched->cache;
+    if (coro != NULL) {
+        sched->cache = coro->next;
+        sched->num_cached -= 1;
+    } else {
+        coro = alloc_coro(sched);
+        if (coro == NULL) {
+            LOGF_ERROR(sched->reactor->thl, 0,
+                       "failed to allocate coroutine stack %s", strerror(errno));
+            return -1;
+        }
+    }
+    coro->fn = fn;
+    coro->arg = arg;
+    coro->next = NULL;
+    coro->wait_fd = -1;
+    coro->wait_write = false;
+    coro->timed_out = false;
+    coro->queued = false;
+    coro->finished = false;
+    coro->wait_error = 0;
+    init_timer_reactor_t(&coro->timer);
+
+    prepare_context(coro);
+
+    coro->prev_live = NULL;
+    coro->next_live = sched->live;
+    if (sched->live != NULL) {
+        sched->live->prev_live = coro;
+    }
+    sched->live = coro;
+    sched->stats.spawned += 1;
+    sched->stats.live += 1;
+    if (sched->stats.live > sched->stats.peak_live) {
+        sched->stats.peak_live = sched->stats.live;
+    }
+    make_runnable(coro);
+    return 0;
+}
+
+/*!
+ * @brief lets the other runnable coroutines and the event loop run
+ */
+void yield_coro_sched_t(coro_sched_t *sched) {
+    if (sched->current == NULL) {
+        return;
+    }
+    make_runnable(sched->current);
+    suspend_coro(sched);
+}
+
+/*!
+ * @brief parks the calling coroutine for ms milliseconds
+ */
+void sleep_coro_sched_t(coro_sched_t *sched, uint64_t ms) {
+    coro_t *coro = sched->current;
+    if (coro == NULL) {
+        return;
+    }
+    start_timer_reactor_t(sched->reactor, &coro->timer, ms, 0, sleep_done, coro);
+    suspend_coro(sched);
+}
+
+/*!
+ * @brief parks the calling coroutine until fd is readable, or writable
+ * @details only one coroutine can wait for each direction of an fd
+ * @param timeout_ms the longest to wait, -1 to wait forever
+ * @return Success: 0
+ * @return Failure: -1 with errno set to ETIMEDOUT, EBUSY if another coroutine is
+ * waiting on the same direction, or the error the fd failed with
+ */
+int wait_fd_coro_sched_t(coro_sched_t *sched, int fd, bool write, int timeout_ms) {
+    coro_t *coro = sched->current;
+    if (coro == NULL) {
+        // outside of a coroutine there is nothing to park
+        errno = EPERM;
+        return -1;
+    }
+    if (valid_fd(fd) == false) {
+        errno = EBADF;
+        return -1;
+    }
+    coro_waiters_t *waiters = &sched->waiters[fd];
+    if ((write ? waiters->writer : waiters->reader) != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (registered(sched, fd) == false) {
+        if (add_fd_reactor_t(sched->reactor, fd, fd_readable, fd_writable,
+                             fd_failed, sched) == -1) {
+            return -1;
+        }
+        want_read_reactor_t(sched->reactor, fd, false);
+        want_write_reactor_t(sched->reactor, fd, false);
+    }
+    if (write) {
+        waiters->writer = coro;
+        want_write_reactor_t(sched->reactor, fd, true);
+    } else {
+        waiters->reader = coro;
+        want_read_reactor_t(sched->reactor, fd, true);
+    }
+    coro->wait_fd = fd;
+    coro->wait_write = write;
+    coro->wait_error = 0;
+    coro->timed_out = false;
+    if (timeout_ms >= 0) {
+        start_timer_reactor_t(sched->reactor, &coro->timer, (uint64_t)timeout_ms, 0,
+                              wait_timed_out, coro);
+    }
+    sched->stats.parks += 1;
+    suspend_coro(sched);
+
+    coro->wait_fd = -1;
+    if (coro->timed_out) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (coro->wait_error != 0) {
+        errno = coro->wait_error;
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief reads up to len bytes, parking until some are available
+ * @return Success: bytes read, 0 at end of file
+ * @return Failure: -1
+ */
+ssize_t read_coro_sched_t(coro_sched_t *sched, int fd, void *buffer, size_t len) {
+    for (;;) {
+        ssize_t rc = recv(fd, buffer, len, MSG_DONTWAIT);
+        if (rc == -1 && errno == ENOTSOCK) {
+            rc = read(fd, buffer, len);
+        }
+        if (rc >= 0) {
+            return rc;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (wait_fd_coro_sched_t(sched, fd, false, -1) == -1) {
+            return -1;
+        }
+    }
+}
+
+/*!
+ * @brief writes all len bytes, parking whenever the socket buffer is full
+ * @details like go's Write a short count is only returned alongside an error
+ * @return Success: len
+ * @return Failure: -1
+ */
+ssize_t write_coro_sched_t(coro_sched_t *sched, int fd, const void *data,
+                           size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        const char *from = (const char *)data + written;
+        ssize_t rc = send(fd, from, len - written, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc == -1 && errno == ENOTSOCK) {
+            rc = write(fd, from, len - written);
+        }
+        if (rc >= 0) {
+            written += (size_t)rc;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (wait_fd_coro_sched_t(sched, fd, true, -1) == -1) {
+            return -1;
+        }
+    }
+    return (ssize_t)len;
+}
+
+/*!
+ * @brief accepts a connection, parking until one arrives
+ * @return Success: the new fd, already non-blocking
+ * @return Failure: -1
+ */
+int accept_coro_sched_t(coro_sched_t *sched, int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd >= 0) {
+            return fd;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (wait_fd_coro_sched_t(sched, listen_fd, false, -1) == -1) {
+            return -1;
+        }
+    }
+}
+
+/*!
+ * @brief connects a non-blocking socket, parking until the handshake finishes
+ * @return Success: 0
+ * @return Failure: -1 with errno set to why the connection failed
+ */
+int connect_coro_sched_t(coro_sched_t *sched, int fd, const struct sockaddr *addr,
+                         socklen_t addr_len) {
+    if (connect(fd, addr, addr_len) == 0) {
+        return 0;
+    }
+    if (errno != EINPROGRESS && errno != EINTR) {
+        return -1;
+    }
+    if (wait_fd_coro_sched_t(sched, fd, true, -1) == -1) {
+        return -1;
+    }
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1) {
+        return -1;
+    }
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief closes an fd used by coroutines
+ * @details the fd is removed from the reactor first and coroutines parked on it
+ * are woken with EBADF
+ */
+void close_coro_sched_t(coro_sched_t *sched, int fd) {
+    if (valid_fd(fd) && registered(sched, fd)) {
+        wake_waiter(sched, fd, false, EBADF);
+        wake_waiter(sched, fd, true, EBADF);
+        remove_fd_reactor_t(sched->reactor, fd);
+    }
+    close(fd);
+}
+
+/*!
+ * @brief the running coroutine, NULL outside of coroutines
+ */
+coro_t *current_coro_sched_t(coro_sched_t *sched) {
+    return sched->current;
+}
+
+/*!
+ * @brief free up all resources allocated for the coro_sched_t struct
+ * @warning coroutines that have not finished are dropped along with their stacks
+ * and must not be resumed, so only free a scheduler whose coroutines are done or
+ * whose reactor is no longer run. the reactor must outlive the scheduler
+ */
+void free_coro_sched_t(coro_sched_t *sched) {
+    for (int fd = 0; fd <= sched->reactor->max_fd; fd++) {
+        if (registered(sched, fd)) {
+            remove_fd_reactor_t(sched->reactor, fd);
+        }
+    }
+    while (sched->live != NULL) {
+        coro_t *coro = sched->live;
+        sched->live = coro->next_live;
+        stop_timer_reactor_t(sched->reactor, &coro->timer);
+        destroy_coro(coro);
+    }
+    while (sched->cache != NULL) {
+        coro_t *coro = sched->cache;
+        sched->cache = coro->next;
+        destroy_coro(coro);
+    }
+    free(sched);
+}
@@ -0,0 +1,209 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file coro.h
+ * @brief stackful coroutines with blocking style socket calls on a reactor_t
+ * @details every coroutine runs on its own small mmap'd stack. the socket calls
+ * in here look blocking to the coroutine, when the fd is not ready the coroutine
+ * parks on the reactor's read or write interest for it and the thread goes back
+ * to the event loop. once the fd is ready, or a timer fires, the coroutine is
+ * put on the run queue which is drained from a reactor task, so handlers are
+ * written as straight-line code while the thread keeps event loop performance.
+ * stacks of finished coroutines are cached and reused
+ * @warning the fds passed in must be non-blocking, a coroutine blocking in a
+ * syscall blocks every coroutine of the scheduler
+ * @note with guard pages every stack is two mappings, so more than ~32k live
+ * coroutines need vm.max_map_count raised or a scheduler without guard pages
+ */
+
+#pragma once
+
+#include "reactor.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <ucontext.h>
+
+/*! @brief default usable stack size of a coroutine */
+#ifndef CORO_STACK_SIZE
+#define CORO_STACK_SIZE 65536
+#endif
+
+/*! @brief finished coroutines kept around for reuse */
+#ifndef CORO_CACHE_SIZE
+#define CORO_CACHE_SIZE 1024
+#endif
+
+struct coro_sched;
+
+/*! @typedef coro_fn
+ * @brief the body of a coroutine, it is finished once this returns
+ */
+typedef void (*coro_fn)(struct coro_sched *sched, void *arg);
+
+/*! @typedef coro
+ * @struct coro
+ * @brief a coroutine and its stack
+ */
+typedef struct coro {
+    ucontext_t context;
+    struct coro_sched *sched;
+    char *mapping; /*! @brief the stack including its guard page */
+    size_t mapping_size;
+    coro_fn fn;
+    void *arg;
+    reactor_timer_t timer;
+    struct coro *next; /*! @brief run queue or cache link */
+    struct coro *prev_live;
+    struct coro *next_live;
+    int wait_fd;       /*! @brief fd parked on, -1 if none */
+    bool wait_write;
+    bool timed_out;
+    bool queued;
+    bool finished;
+    int wait_error; /*! @brief set if the fd failed while parked */
+} coro_t;
+
+/*!
+ * @brief the coroutines parked on a single fd
+ */
+typedef struct coro_waiters {
+    coro_t *reader;
+    coro_t *writer;
+} coro_waiters_t;
+
+/*!
+ * @brief counters kept by a scheduler
+ */
+typedef struct coro_sched_stats {
+    uint64_t spawned;
+    uint64_t finished;
+    uint64_t switches;
+    uint64_t parks; /*! @brief times a coroutine waited on an fd */
+    size_t live;
+    size_t peak_live;
+} coro_sched_stats_t;
+
+/*! @typedef coro_sched
+ * @struct coro_sched
+ * @brief runs coroutines on top of a reactor_t, one per thread
+ */
+typedef struct coro_sched {
+    reactor_t *reactor;
+    ucontext_t context; /*! @brief where coroutines switch back to */
+    coro_t *current;
+    coro_t *run_head;
+    coro_t *run_tail;
+    size_t num_runnable;
+    bool drain_deferred;
+    coro_t *live; /*! @brief every coroutine that has not finished */
+    coro_t *cache;
+    size_t num_cached;
+    size_t stack_size;
+    bool guard_pages;
+    coro_waiters_t waiters[FD_SETSIZE];
+    coro_sched_stats_t stats;
+} coro_sched_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new coro_sched_t object
+ * @param stack_size usable stack size of each coroutine, 0 for CORO_STACK_SIZE
+ * @param guard_pages whether to put a PROT_NONE page below every stack so an
+ * overflow faults instead of corrupting memory
+ * @return Success: pointer to instance of coro_sched_t
+ * @return Failure: NULL ptr
+ */
+coro_sched_t *new_coro_sched_t(reactor_t *reactor, size_t stack_size,
+                               bool guard_pages);
+
+/*!
+ * @brief starts a new coroutine
+ * @details the coroutine first runs at the end of the current, or next, reactor
+ * iteration. can be called from inside and outside of coroutines
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int spawn_coro_sched_t(coro_sched_t *sched, coro_fn fn, void *arg);
+
+/*!
+ * @brief lets the other runnable coroutines and the event loop run
+ */
+void yield_coro_sched_t(coro_sched_t *sched);
+
+/*!
+ * @brief parks the calling coroutine for ms milliseconds
+ */
+void sleep_coro_sched_t(coro_sched_t *sched, uint64_t ms);
+
+/*!
+ * @brief parks the calling coroutine until fd is readable, or writable
+ * @details only one coroutine can wait for each direction of an fd
+ * @param timeout_ms the longest to wait, -1 to wait forever
+ * @return Success: 0
+ * @return Failure: -1 with errno set to ETIMEDOUT, EBUSY if another coroutine is
+ * waiting on the same direction, or the error the fd failed with
+ */
+int wait_fd_coro_sched_t(coro_sched_t *sched, int fd, bool write, int timeout_ms);
+
+/*!
+ * @brief reads up to len bytes, parking until some are available
+ * @return Success: bytes read, 0 at end of file
+ * @return Failure: -1
+ */
+ssize_t read_coro_sched_t(coro_sched_t *sched, int fd, void *buffer, size_t len);
+
+/*!
+ * @brief writes all len bytes, parking whenever the socket buffer is full
+ * @details like go's Write a short count is only returned alongside an error
+ * @return Success: len
+ * @return Failure: -1
+ */
+ssize_t write_coro_sched_t(coro_sched_t *sched, int fd, const void *data,
+                           size_t len);
+
+/*!
+ * @brief accepts a connection, parking until one arrives
+ * @return Success: the new fd, already non-blocking
+ * @return Failure: -1
+ */
+int accept_coro_sched_t(coro_sched_t *sched, int listen_fd);
+
+/*!
+ * @brief connects a non-blocking socket, parking until the handshake finishes
+ * @return Success: 0
+ * @return Failure: -1 with errno set to why the connection failed
+ */
+int connect_coro_sched_t(coro_sched_t *sched, int fd, const struct sockaddr *addr,
+                         socklen_t addr_len);
+
+/*!
+ * @brief closes an fd used by coroutines
+ * @details the fd is removed from the reactor first and coroutines parked on it
+ * are woken with EBADF
+ */
+void close_coro_sched_t(coro_sched_t *sched, int fd);
+
+/*!
+ * @brief the running coroutine, NULL outside of coroutines
+ */
+coro_t *current_coro_sched_t(coro_sched_t *sched);
+
+/*!
+ * @brief free up all resources allocated for the coro_sched_t struct
+ * @warning coroutines that have not finished are dropped along with their stacks
+ * and must not be resumed, so only free a scheduler whose coroutines are done or
+ * whose reactor is no longer run. the reactor must outlive the scheduler
+ */
+void free_coro_sched_t(coro_sched_t *sched);
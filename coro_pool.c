@@ -0,0 +1,1080 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "coro_pool.h"
+#include "coro.h"
+#include "deps/ulog/logger.h"
+#include "fd_pool.h"
+#include "timer_wheel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+static _Thread_local coro_worker_t *thread_worker;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static size_t page_size(void) {
+    long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? (size_t)size : 4096;
+}
+
+static inline bool valid_fd(int fd) {
+    return fd >= 0 && fd < FD_SETSIZE;
+}
+
+static inline void count(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+/*!
+ * @brief the worker of the calling thread
+ * @details a coroutine can resume on another thread, the barrier keeps the
+ * compiler from reusing a thread local address worked out before it parked
+ */
+static __attribute__((noinline)) coro_worker_t *this_worker(void) {
+    __asm__ volatile("" ::: "memory");
+    return thread_worker;
+}
+
+/*!
+ * @brief errno of the calling thread, see this_worker
+ */
+static __attribute__((noinline)) int last_errno(void) {
+    __asm__ volatile("" ::: "memory");
+    return errno;
+}
+
+/*!
+ * @brief records error for the coroutine and in errno of the calling thread
+ * @return -1
+ */
+static __attribute__((noinline)) int fail(pool_coro_t *coro, int error) {
+    __asm__ volatile("" ::: "memory");
+    if (coro != NULL) {
+        coro->error = error;
+    }
+    errno = error;
+    return -1;
+}
+
+static pool_coro_t *current_coro(coro_pool_t *pool) {
+    coro_worker_t *worker = this_worker();
+    if (worker == NULL || worker->pool != pool) {
+        return NULL;
+    }
+    return worker->current;
+}
+
+static void wake_workers(coro_pool_t *pool, size_t n) {
+    if (atomic_load(&pool->idle) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    size_t idle = atomic_load(&pool->idle);
+    if (n >= idle) {
+        pthread_cond_broadcast(&pool->idle_cond);
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            pthread_cond_signal(&pool->idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/*!
+ * @brief appends a list of coroutines to the global queue
+ * @note does not touch pool->runnable, the coroutines are only moving queues
+ */
+static void push_global(coro_pool_t *pool, pool_coro_t *head, pool_coro_t *tail,
+                        size_t n) {
+    tail->next = NULL;
+    pthread_mutex_lock(&pool->global_lock);
+    if (pool->global_tail == NULL) {
+        pool->global_head = head;
+    } else {
+        pool->global_tail->next = head;
+    }
+    pool->global_tail = tail;
+    pool->global_count += n;
+    pthread_mutex_unlock(&pool->global_lock);
+}
+
+/*!
+ * @brief appends to the worker's local queue, spilling the older half of a full
+ * queue onto the global queue
+ */
+static void push_local(coro_worker_t *worker, pool_coro_t *coro) {
+    pthread_mutex_lock(&worker->runq_lock);
+    if (worker->runq_count < CORO_POOL_RUNQ_SIZE) {
+        size_t tail = (worker->runq_head + worker->runq_count) % CORO_POOL_RUNQ_SIZE;
+        worker->runq[tail] = coro;
+        worker->runq_count += 1;
+        pthread_mutex_unlock(&worker->runq_lock);
+        return;
+    }
+    pool_coro_t *head = NULL;
+    pool_coro_t *tail = NULL;
+    for (size_t i = 0; i < CORO_POOL_RUNQ_SIZE / 2; i++) {
+        pool_coro_t *spilled = worker->runq[worker->runq_head];
+        worker->runq_head = (worker->runq_head + 1) % CORO_POOL_RUNQ_SIZE;
+        if (tail == NULL) {
+            head = spilled;
+        } else {
+            tail->next = spilled;
+        }
+        tail = spilled;
+    }
+    worker->runq_count -= CORO_POOL_RUNQ_SIZE / 2;
+    pthread_mutex_unlock(&worker->runq_lock);
+    tail->next = coro;
+    push_global(worker->pool, head, coro, CORO_POOL_RUNQ_SIZE / 2 + 1);
+    wake_workers(worker->pool, 1);
+}
+
+/*!
+ * @brief makes a list of coroutines runnable through the global queue
+ */
+static void ready_global(coro_pool_t *pool, pool_coro_t *head, pool_coro_t *tail,
+                         size_t n) {
+    atomic_fetch_add(&pool->runnable, n);
+    push_global(pool, head, tail, n);
+    wake_workers(pool, n);
+}
+
+/*!
+ * @brief makes a coroutine runnable on the worker's own queue
+ */
+static void ready_local(coro_worker_t *worker, pool_coro_t *coro) {
+    atomic_fetch_add(&worker->pool->runnable, 1);
+    push_local(worker, coro);
+}
+
+static pool_coro_t *pop_local(coro_worker_t *worker) {
+    pthread_mutex_lock(&worker->runq_lock);
+    if (worker->runq_count == 0) {
+        pthread_mutex_unlock(&worker->runq_lock);
+        return NULL;
+    }
+    pool_coro_t *coro = worker->runq[worker->runq_head];
+    worker->runq_head = (worker->runq_head + 1) % CORO_POOL_RUNQ_SIZE;
+    worker->runq_count -= 1;
+    pthread_mutex_unlock(&worker->runq_lock);
+    return coro;
+}
+
+/*!
+ * @brief takes a fair share of the global queue, one to run and the rest onto the
+ * local queue so the global lock is not taken for every coroutine
+ */
+static pool_coro_t *pop_global(coro_worker_t *worker) {
+    coro_pool_t *pool = worker->pool;
+    pthread_mutex_lock(&pool->global_lock);
+    pool_coro_t *coro = pool->global_head;
+    if (coro == NULL) {
+        pthread_mutex_unlock(&pool->global_lock);
+        return NULL;
+    }
+    size_t share = pool->global_count / pool->num_workers + 1;
+    if (share > CORO_POOL_RUNQ_SIZE / 2) {
+        share = CORO_POOL_RUNQ_SIZE / 2;
+    }
+    pool_coro_t *last = coro;
+    size_t taken = 1;
+    for (; taken < share && last->next != NULL; taken++) {
+        last = last->next;
+    }
+    pool->global_head = last->next;
+    if (pool->global_head == NULL) {
+        pool->global_tail = NULL;
+    }
+    pool->global_count -= taken;
+    pthread_mutex_unlock(&pool->global_lock);
+
+    pool_coro_t *extra = coro != last ? coro->next : NULL;
+    last->next = NULL;
+    while (extra != NULL) {
+        pool_coro_t *next = extra->next;
+        push_local(worker, extra);
+        extra = next;
+    }
+    return coro;
+}
+
+/*!
+ * @brief takes half the local queue of another worker
+ * @details victims are tried starting from a random one so idle workers do not
+ * all pile onto the same queue
+ */
+static pool_coro_t *steal(coro_worker_t *thief) {
+    coro_pool_t *pool = thief->pool;
+    if (pool->num_workers < 2) {
+        return NULL;
+    }
+    thief->seed = thief->seed * 1103515245 + 12345;
+    size_t start = (thief->seed >> 16) % pool->num_workers;
+    pool_coro_t *batch[CORO_POOL_RUNQ_SIZE / 2 + 1];
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        coro_worker_t *victim = &pool->workers[(start + i) % pool->num_workers];
+        if (victim == thief) {
+            continue;
+        }
+        pthread_mutex_lock(&victim->runq_lock);
+        size_t take = (victim->runq_count + 1) / 2;
+        for (size_t j = 0; j < take; j++) {
+            batch[j] = victim->runq[victim->runq_head];
+            victim->runq_head = (victim->runq_head + 1) % CORO_POOL_RUNQ_SIZE;
+        }
+        victim->runq_count -= take;
+        pthread_mutex_unlock(&victim->runq_lock);
+        if (take == 0) {
+            continue;
+        }
+        count(&thief->stats.steals, 1);
+        count(&thief->stats.stolen, take);
+        for (size_t j = 1; j < take; j++) {
+            push_local(thief, batch[j]);
+        }
+        return batch[0];
+    }
+    return NULL;
+}
+
+static pool_coro_t *next_runnable(coro_worker_t *worker) {
+    worker->ticks += 1;
+    pool_coro_t *coro = NULL;
+    if (worker->ticks % CORO_POOL_GLOBAL_INTERVAL == 0) {
+        // every so often look at the global queue first, so coroutines woken by
+        // the netpoller are not starved by a busy local queue
+        coro = pop_global(worker);
+    }
+    if (coro == NULL) {
+        coro = pop_local(worker);
+    }
+    if (coro == NULL) {
+        coro = pop_global(worker);
+    }
+    if (coro == NULL) {
+        coro = steal(worker);
+    }
+    if (coro != NULL) {
+        atomic_fetch_sub(&worker->pool->runnable, 1);
+    }
+    return coro;
+}
+
+/*!
+ * @brief sleeps until a coroutine becomes runnable anywhere in the pool
+ * @details idle is raised before runnable is checked and wakers raise runnable
+ * before checking idle, so one of the two always sees the other
+ */
+static void idle_wait(coro_worker_t *worker) {
+    coro_pool_t *pool = worker->pool;
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->idle, 1);
+    if (atomic_load(&pool->runnable) == 0 && atomic_load(&pool->stopping) == false) {
+        count(&worker->stats.sleeps, 1);
+        pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+    }
+    atomic_fetch_sub(&pool->idle, 1);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/*!
+ * @brief interrupts the netpoller's select
+ */
+static void wake_poller(coro_pool_t *pool) {
+    if (atomic_exchange(&pool->poller_woken, true)) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(pool->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        LOGF_ERROR(pool->thl, 0, "failed to wake netpoller %s", strerror(errno));
+    }
+}
+
+/*!
+ * @brief hands a sleeping coroutine's timer to the netpoller
+ */
+static void park_timer(coro_pool_t *pool, pool_coro_t *coro) {
+    pthread_mutex_lock(&pool->poll_lock);
+    add_timer_wheel_t(&pool->timers, &coro->timer, coro->wake_at);
+    bool kick = atomic_load(&pool->poller_sleeping) &&
+                coro->wake_at < pool->poll_deadline;
+    pthread_mutex_unlock(&pool->poll_lock);
+    if (kick) {
+        wake_poller(pool);
+    }
+}
+
+/*!
+ * @brief registers a parked coroutine's interest in its fd with the netpoller
+ */
+static void park_fd(coro_worker_t *worker, pool_coro_t *coro) {
+    coro_pool_t *pool = worker->pool;
+    int fd = coro->wait_fd;
+    pthread_mutex_lock(&pool->poll_lock);
+    pool_coro_t **slot =
+        coro->wait_write ? &pool->waiters[fd].writer : &pool->waiters[fd].reader;
+    if (*slot != NULL) {
+        pthread_mutex_unlock(&pool->poll_lock);
+        coro->wait_error = EBUSY;
+        ready_local(worker, coro);
+        return;
+    }
+    *slot = coro;
+    set_fd_pool_t(coro->wait_write ? pool->write_pool : pool->read_pool, fd, true);
+    if (coro->wake_at != 0) {
+        add_timer_wheel_t(&pool->timers, &coro->timer, coro->wake_at);
+    }
+    // the select in progress does not include fd yet
+    bool kick = atomic_load(&pool->poller_sleeping);
+    pthread_mutex_unlock(&pool->poll_lock);
+    if (kick) {
+        wake_poller(pool);
+    }
+}
+
+static void destroy_coro(pool_coro_t *coro) {
+    munmap(coro->mapping, coro->mapping_size);
+    free(coro);
+}
+
+static void retire_coro(coro_pool_t *pool, pool_coro_t *coro) {
+    pthread_mutex_lock(&pool->coro_lock);
+    if (coro->prev_live != NULL) {
+        coro->prev_live->next_live = coro->next_live;
+    } else {
+        pool->live_list = coro->next_live;
+    }
+    if (coro->next_live != NULL) {
+        coro->next_live->prev_live = coro->prev_live;
+    }
+    bool cached = false;
+    if (pool->num_cached < CORO_POOL_CACHE_SIZE) {
+        coro->next = pool->cache;
+        pool->cache = coro;
+        pool->num_cached += 1;
+        cached = true;
+    }
+    count(&pool->finished, 1);
+    if (atomic_fetch_sub(&pool->live, 1) == 1) {
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->coro_lock);
+    if (cached == false) {
+        destroy_coro(coro);
+    }
+}
+
+static void run_coro(coro_worker_t *worker, pool_coro_t *coro) {
+    if (coro->worker != NULL && coro->worker != worker) {
+        count(&worker->stats.migrations, 1);
+    }
+    coro->worker = worker;
+    coro->state = CORO_POOL_RAN;
+    worker->current = coro;
+    count(&worker->stats.runs, 1);
+    swapcontext(&worker->context, &coro->context);
+    worker->current = NULL;
+    // the coroutine's context is saved, now it is safe to let others resume it
+    switch (coro->state) {
+        case CORO_POOL_YIELDED:
+            ready_local(worker, coro);
+            break;
+        case CORO_POOL_SLEEPING:
+            park_timer(worker->pool, coro);
+            break;
+        case CORO_POOL_WAITING:
+            park_fd(worker, coro);
+            break;
+        case CORO_POOL_FINISHED:
+            retire_coro(worker->pool, coro);
+            break;
+        default:
+            break;
+    }
+}
+
+/*!
+ * @brief switches from the coroutine back to the worker running it
+ */
+static void suspend_coro(pool_coro_t *coro, CORO_POOL_STATE state) {
+    coro->state = state;
+    swapcontext(&coro->context, &coro->worker->context);
+}
+
+static void coro_entry(unsigned int high, unsigned int low) {
+    pool_coro_t *coro =
+        (pool_coro_t *)(uintptr_t)(((uint64_t)high << 32) | (uint64_t)low);
+    coro->fn(coro->pool, coro->arg);
+    coro->state = CORO_POOL_FINISHED;
+    setcontext(&coro->worker->context);
+}
+
+/*!
+ * @brief points the coroutine's context at coro_entry on top of its stack
+ * @details getcontext returns twice, it lives in its own function so the
+ * caller's locals can not be clobbered
+ */
+static void prepare_context(pool_coro_t *const coro) {
+    getcontext(&coro->context);
+    size_t stack_size = coro->pool->stack_size;
+    coro->context.uc_stack.ss_sp = coro->mapping + (coro->mapping_size - stack_size);
+    coro->context.uc_stack.ss_size = stack_size;
+    coro->context.uc_link = NULL;
+    uint64_t ptr = (uint64_t)(uintptr_t)coro;
+    makecontext(&coro->context, (void (*)(void))coro_entry, 2,
+                (unsigned int)(ptr >> 32), (unsigned int)ptr);
+}
+
+static pool_coro_t *alloc_coro(coro_pool_t *pool) {
+    pool_coro_t *coro = calloc(1, sizeof(pool_coro_t));
+    if (coro == NULL) {
+        return NULL;
+    }
+    size_t guard = pool->guard_pages ? page_size() : 0;
+    coro->mapping_size = pool->stack_size + guard;
+    coro->mapping = mmap(NULL, coro->mapping_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (coro->mapping == MAP_FAILED) {
+        free(coro);
+        return NULL;
+    }
+    if (guard > 0 && mprotect(coro->mapping, guard, PROT_NONE) == -1) {
+        destroy_coro(coro);
+        return NULL;
+    }
+    coro->pool = pool;
+    return coro;
+}
+
+/*!
+ * @brief takes a coroutine parked on fd off its slot, with poll_lock held
+ */
+static pool_coro_t *take_waiter(coro_pool_t *pool, int fd, bool write) {
+    pool_coro_t **slot =
+        write ? &pool->waiters[fd].writer : &pool->waiters[fd].reader;
+    pool_coro_t *coro = *slot;
+    if (coro == NULL) {
+        return NULL;
+    }
+    *slot = NULL;
+    clear_fd_pool_t(write ? pool->write_pool : pool->read_pool, fd, true);
+    remove_timer_wheel_t(&pool->timers, &coro->timer);
+    return coro;
+}
+
+typedef struct ready_list {
+    pool_coro_t *head;
+    pool_coro_t *tail;
+    size_t count;
+} ready_list_t;
+
+static void append_ready(ready_list_t *list, pool_coro_t *coro) {
+    if (coro == NULL) {
+        return;
+    }
+    coro->next = NULL;
+    if (list->tail == NULL) {
+        list->head = coro;
+    } else {
+        list->tail->next = coro;
+    }
+    list->tail = coro;
+    list->count += 1;
+}
+
+/*!
+ * @brief wakes the waiters of fds that were closed without close_coro_pool_t
+ */
+static void fail_closed_fds(coro_pool_t *pool, ready_list_t *ready) {
+    for (int fd = 0; fd < FD_SETSIZE; fd++) {
+        coro_pool_waiters_t *waiters = &pool->waiters[fd];
+        if ((waiters->reader == NULL && waiters->writer == NULL) ||
+            fcntl(fd, F_GETFD) != -1) {
+            continue;
+        }
+        for (int write = 0; write < 2; write++) {
+            pool_coro_t *coro = take_waiter(pool, fd, write == 1);
+            if (coro != NULL) {
+                coro->wait_error = EBADF;
+                append_ready(ready, coro);
+            }
+        }
+    }
+}
+
+/*!
+ * @brief the netpoller, one select over every parked fd plus the timer wheel
+ */
+static void *poller_main(void *data) {
+    coro_pool_t *pool = data;
+    fd_set read_set, write_set;
+    for (;;) {
+        pthread_mutex_lock(&pool->poll_lock);
+        if (atomic_load(&pool->stopping)) {
+            pthread_mutex_unlock(&pool->poll_lock);
+            break;
+        }
+        struct timeval tv;
+        struct timeval *timeout = NULL;
+        uint64_t next = next_timer_wheel_t(&pool->timers);
+        pool->poll_deadline = next;
+        if (next != UINT64_MAX) {
+            uint64_t now = monotonic_ns();
+            uint64_t wait = next > now ? next - now : 0;
+            tv.tv_sec = (time_t)(wait / NSEC_PER_SEC);
+            tv.tv_usec = (suseconds_t)((wait % NSEC_PER_SEC + 999) / 1000);
+            timeout = &tv;
+        }
+        atomic_store(&pool->poller_sleeping, true);
+        pthread_mutex_unlock(&pool->poll_lock);
+
+        int num_active = poll_fd_pool_t(pool->read_pool, pool->write_pool, &read_set,
+                                        &write_set, true, timeout);
+        int poll_error = num_active < 0 ? errno : 0;
+        count(&pool->polls, 1);
+
+        ready_list_t ready = {0};
+        pthread_mutex_lock(&pool->poll_lock);
+        atomic_store(&pool->poller_sleeping, false);
+        atomic_store(&pool->poller_woken, false);
+        if (num_active < 0) {
+            if (poll_error == EBADF) {
+                fail_closed_fds(pool, &ready);
+            }
+            num_active = 0;
+        }
+        if (num_active > 0 && FD_ISSET(pool->wake_fd, &read_set)) {
+            uint64_t value;
+            if (read(pool->wake_fd, &value, sizeof(value)) == -1 &&
+                errno != EAGAIN) {
+                LOGF_ERROR(pool->thl, 0, "failed to drain netpoller eventfd %s",
+                           strerror(errno));
+            }
+            num_active -= 1;
+        }
+        for (int fd = 0; fd < FD_SETSIZE && num_active > 0; fd++) {
+            if (fd == pool->wake_fd) {
+                continue;
+            }
+            if (FD_ISSET(fd, &read_set)) {
+                num_active -= 1;
+                append_ready(&ready, take_waiter(pool, fd, false));
+            }
+            if (FD_ISSET(fd, &write_set)) {
+                num_active -= 1;
+                append_ready(&ready, take_waiter(pool, fd, true));
+            }
+        }
+        advance_timer_wheel_t(&pool->timers, monotonic_ns());
+        wheel_timer_t *timer;
+        while ((timer = pop_expired_timer_wheel_t(&pool->timers)) != NULL) {
+            pool_coro_t *coro = (pool_coro_t *)timer;
+            if (coro->state == CORO_POOL_WAITING) {
+                // a timeout, the coroutine stops waiting on its fd
+                take_waiter(pool, coro->wait_fd, coro->wait_write);
+                coro->timed_out = true;
+            }
+            append_ready(&ready, coro);
+        }
+        pthread_mutex_unlock(&pool->poll_lock);
+        if (ready.count > 0) {
+            ready_global(pool, ready.head, ready.tail, ready.count);
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * @brief stops and joins the netpoller and the first num_workers workers
+ */
+static void stop_threads(coro_pool_t *pool, size_t num_workers) {
+    atomic_store(&pool->stopping, true);
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    atomic_store(&pool->poller_woken, false);
+    wake_poller(pool);
+    for (size_t i = 0; i < num_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_join(pool->poller, NULL);
+}
+
+static void destroy_locks(coro_pool_t *pool) {
+    pthread_mutex_destroy(&pool->global_lock);
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->coro_lock);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->poll_lock);
+}
+
+static void *worker_main(void *data) {
+    coro_worker_t *worker = data;
+    thread_worker = worker;
+    while (atomic_load(&worker->pool->stopping) == false) {
+        pool_coro_t *coro = next_runnable(worker);
+        if (coro == NULL) {
+            idle_wait(worker);
+            continue;
+        }
+        run_coro(worker, coro);
+    }
+    return NULL;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new coro_pool_t object
+ * @details starts the worker threads and the netpoller thread
+ * @param num_workers worker threads to run, 0 for one per online cpu
+ * @param stack_size usable stack size of each coroutine, 0 for CORO_STACK_SIZE
+ * @param guard_pages whether to put a PROT_NONE page below every stack
+ * @return Success: pointer to instance of coro_pool_t
+ * @return Failure: NULL ptr
+ */
+coro_pool_t *new_coro_pool_t(thread_logger *thl, size_t num_workers,
+                             size_t stack_size, bool guard_pages) {
+    if (num_workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (num_workers > CORO_POOL_MAX_WORKERS) {
+        num_workers = CORO_POOL_MAX_WORKERS;
+    }
+    if (stack_size == 0) {
+        stack_size = CORO_STACK_SIZE;
+    }
+    coro_pool_t *pool = calloc(1, sizeof(coro_pool_t));
+    if (pool == NULL) {
+        LOG_ERROR(thl, 0, "failed to calloc coro_pool_t");
+        return NULL;
+    }
+    size_t page = page_size();
+    pool->stack_size = (stack_size + page - 1) / page * page;
+    pool->guard_pages = guard_pages;
+    pool->thl = thl;
+    pool->wake_fd = -1;
+    pthread_mutex_init(&pool->global_lock, NULL);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pthread_mutex_init(&pool->coro_lock, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pthread_mutex_init(&pool->poll_lock, NULL);
+    init_timer_wheel_t(&pool->timers, monotonic_ns());
+    pool->poll_deadline = UINT64_MAX;
+
+    pool->workers = calloc(num_workers, sizeof(coro_worker_t));
+    pool->read_pool = new_fd_pool_t();
+    pool->write_pool = new_fd_pool_t();
+    pool->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->workers == NULL || pool->read_pool == NULL ||
+        pool->write_pool == NULL || pool->wake_fd == -1) {
+        LOG_ERROR(thl, 0, "failed to allocate coro_pool_t resources");
+        goto ERROR;
+    }
+    set_fd_pool_t(pool->read_pool, pool->wake_fd, true);
+    for (size_t i = 0; i < num_workers; i++) {
+        coro_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        worker->seed = (uint32_t)(i * 2654435761u + 1);
+        pthread_mutex_init(&worker->runq_lock, NULL);
+    }
+
+    pool->num_workers = num_workers;
+    if (pthread_create(&pool->poller, NULL, poller_main, pool) != 0) {
+        LOG_ERROR(thl, 0, "failed to start netpoller thread");
+        goto ERROR;
+    }
+    for (size_t i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main,
+                           &pool->workers[i]) != 0) {
+            LOG_ERROR(thl, 0, "failed to start worker thread");
+            stop_threads(pool, i);
+            goto ERROR;
+        }
+    }
+    return pool;
+
+ERROR:
+    for (size_t i = 0; i < num_workers && pool->workers != NULL; i++) {
+        pthread_mutex_destroy(&pool->workers[i].runq_lock);
+    }
+    if (pool->read_pool != NULL) {
+        free_fd_pool_t(pool->read_pool);
+    }
+    if (pool->write_pool != NULL) {
+        free_fd_pool_t(pool->write_pool);
+    }
+    if (pool->wake_fd != -1) {
+        close(pool->wake_fd);
+    }
+    destroy_locks(pool);
+    free(pool->workers);
+    free(pool);
+    return NULL;
+}
+
+/*!
+ * @brief starts a new coroutine
+ * @details from a coroutine the new one goes onto the local queue of the worker,
+ * from any other thread onto the global queue
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int spawn_coro_pool_t(coro_pool_t *pool, coro_pool_fn fn, void *arg) {
+    pthread_mutex_lock(&pool->coro_lock);
+    pool_coro_t *coro = pool->cache;
+    if (coro != NULL) {
+        pool->cache = coro->next;
+        pool->num_cached -= 1;
+    }
+    pthread_mutex_unlock(&pool->coro_lock);
+    if (coro == NULL) {
+        coro = alloc_coro(pool);
+        if (coro == NULL) {
+            LOGF_ERROR(pool->thl, 0, "failed to allocate coroutine stack %s",
+                       strerror(errno));
+            return -1;
+        }
+    }
+    coro->fn = fn;
+    coro->arg = arg;
+    coro->worker = NULL;
+    coro->next = NULL;
+    coro->state = CORO_POOL_RAN;
+    coro->wake_at = 0;
+    coro->wait_fd = -1;
+    coro->wait_write = false;
+    coro->timed_out = false;
+    coro->wait_error = 0;
+    coro->error = 0;
+    prepare_context(coro);
+
+    pthread_mutex_lock(&pool->coro_lock);
+    coro->prev_live = NULL;
+    coro->next_live = pool->live_list;
+    if (pool->live_list != NULL) {
+        pool->live_list->prev_live = coro;
+    }
+    pool->live_list = coro;
+    atomic_fetch_add(&pool->live, 1);
+    count(&pool->spawned, 1);
+    pthread_mutex_unlock(&pool->coro_lock);
+
+    coro_worker_t *worker = this_worker();
+    if (worker != NULL && worker->pool == pool) {
+        ready_local(worker, coro);
+        // let an idle worker come and steal it
+        wake_workers(pool, 1);
+    } else {
+        ready_global(pool, coro, coro, 1);
+    }
+    return 0;
+}
+
+/*!
+ * @brief lets the other runnable coroutines of the worker run
+ */
+void yield_coro_pool_t(coro_pool_t *pool) {
+    pool_coro_t *coro = current_coro(pool);
+    if (coro == NULL) {
+        return;
+    }
+    suspend_coro(coro, CORO_POOL_YIELDED);
+}
+
+/*!
+ * @brief parks the calling coroutine for ms milliseconds
+ */
+void sleep_coro_pool_t(coro_pool_t *pool, uint64_t ms) {
+    pool_coro_t *coro = current_coro(pool);
+    if (coro == NULL) {
+        return;
+    }
+    coro->wake_at = monotonic_ns() + ms * NSEC_PER_MSEC;
+    suspend_coro(coro, CORO_POOL_SLEEPING);
+}
+
+/*!
+ * @brief parks the calling coroutine until fd is readable, or writable
+ * @details only one coroutine can wait for each direction of an fd
+ * @param timeout_ms the longest to wait, -1 to wait forever
+ * @return Success: 0
+ * @return Failure: -1 with errno set to ETIMEDOUT, EBUSY if another coroutine is
+ * waiting on the same direction, EBADF if the fd was closed, or EPERM outside of
+ * a coroutine
+ */
+int wait_fd_coro_pool_t(coro_pool_t *pool, int fd, bool write, int timeout_ms) {
+    pool_coro_t *coro = current_coro(pool);
+    if (coro == NULL) {
+        return fail(NULL, EPERM);
+    }
+    if (valid_fd(fd) == false) {
+        return fail(coro, EBADF);
+    }
+    coro->wait_fd = fd;
+    coro->wait_write = write;
+    coro->timed_out = false;
+    coro->wait_error = 0;
+    coro->wake_at = 0;
+    if (timeout_ms >= 0) {
+        coro->wake_at = monotonic_ns() + (uint64_t)timeout_ms * NSEC_PER_MSEC;
+    }
+    suspend_coro(coro, CORO_POOL_WAITING);
+
+    coro->wait_fd = -1;
+    if (coro->timed_out) {
+        return fail(coro, ETIMEDOUT);
+    }
+    if (coro->wait_error != 0) {
+        return fail(coro, coro->wait_error);
+    }
+    return 0;
+}
+
+/*!
+ * @brief reads up to len bytes, parking until some are available
+ * @return Success: bytes read, 0 at end of file
+ * @return Failure: -1
+ */
+ssize_t read_coro_pool_t(coro_pool_t *pool, int fd, void *buffer, size_t len) {
+    for (;;) {
+        ssize_t rc = recv(fd, buffer, len, MSG_DONTWAIT);
+        int error = rc == -1 ? last_errno() : 0;
+        if (error == ENOTSOCK) {
+            rc = read(fd, buffer, len);
+            error = rc == -1 ? last_errno() : 0;
+        }
+        if (rc >= 0) {
+            return rc;
+        }
+        if (error == EINTR) {
+            continue;
+        }
+        if (error != EAGAIN && error != EWOULDBLOCK) {
+            return fail(current_coro(pool), error);
+        }
+        if (wait_fd_coro_pool_t(pool, fd, false, -1) == -1) {
+            return -1;
+        }
+    }
+}
+
+/*!
+ * @brief writes all len bytes, parking whenever the socket buffer is full
+ * @return Success: len
+ * @return Failure: -1
+ */
+ssize_t write_coro_pool_t(coro_pool_t *pool, int fd, const void *data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        const char *from = (const char *)data + written;
+        ssize_t rc = send(fd, from, len - written, MSG_DONTWAIT | MSG_NOSIGNAL);
+        int error = rc == -1 ? last_errno() : 0;
+        if (error == ENOTSOCK) {
+            rc = write(fd, from, len - written);
+            error = rc == -1 ? last_errno() : 0;
+        }
+        if (rc >= 0) {
+            written += (size_t)rc;
+            continue;
+        }
+        if (error == EINTR) {
+            continue;
+        }
+        if (error != EAGAIN && error != EWOULDBLOCK) {
+            return fail(current_coro(pool), error);
+        }
+        if (wait_fd_coro_pool_t(pool, fd, true, -1) == -1) {
+            return -1;
+        }
+    }
+    return (ssize_t)len;
+}
+
+/*!
+ * @brief accepts a connection, parking until one arrives
+ * @return Success: the new fd, already non-blocking
+ * @return Failure: -1
+ */
+int accept_coro_pool_t(coro_pool_t *pool, int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd >= 0) {
+            return fd;
+        }
+        int error = last_errno();
+        if (error == EINTR || error == ECONNABORTED) {
+            continue;
+        }
+        if (error != EAGAIN && error != EWOULDBLOCK) {
+            return fail(current_coro(pool), error);
+        }
+        if (wait_fd_coro_pool_t(pool, listen_fd, false, -1) == -1) {
+            return -1;
+        }
+    }
+}
+
+/*!
+ * @brief connects a non-blocking socket, parking until the handshake finishes
+ * @return Success: 0
+ * @return Failure: -1 with errno set to why the connection failed
+ */
+int connect_coro_pool_t(coro_pool_t *pool, int fd, const struct sockaddr *addr,
+                        socklen_t addr_len) {
+    if (connect(fd, addr, addr_len) == 0) {
+        return 0;
+    }
+    int error = last_errno();
+    if (error != EINPROGRESS && error != EINTR) {
+        return fail(current_coro(pool), error);
+    }
+    if (wait_fd_coro_pool_t(pool, fd, true, -1) == -1) {
+        return -1;
+    }
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1) {
+        return fail(current_coro(pool), last_errno());
+    }
+    if (error != 0) {
+        return fail(current_coro(pool), error);
+    }
+    return 0;
+}
+
+/*!
+ * @brief closes an fd used by coroutines
+ * @details coroutines parked on it are woken with EBADF
+ */
+void close_coro_pool_t(coro_pool_t *pool, int fd) {
+    if (valid_fd(fd)) {
+        ready_list_t ready = {0};
+        pthread_mutex_lock(&pool->poll_lock);
+        for (int write = 0; write < 2; write++) {
+            pool_coro_t *coro = take_waiter(pool, fd, write == 1);
+            if (coro != NULL) {
+                coro->wait_error = EBADF;
+                append_ready(&ready, coro);
+            }
+        }
+        bool kick = ready.count > 0 && atomic_load(&pool->poller_sleeping);
+        pthread_mutex_unlock(&pool->poll_lock);
+        if (ready.count > 0) {
+            ready_global(pool, ready.head, ready.tail, ready.count);
+        }
+        if (kick) {
+            // stop the netpoller selecting on an fd that is about to go away
+            wake_poller(pool);
+        }
+    }
+    close(fd);
+}
+
+/*!
+ * @brief the errno of the last call made by the calling coroutine that failed
+ * @details unlike errno this follows the coroutine from worker to worker
+ */
+int error_coro_pool_t(coro_pool_t *pool) {
+    pool_coro_t *coro = current_coro(pool);
+    return coro != NULL ? coro->error : 0;
+}
+
+/*!
+ * @brief the worker running the calling coroutine, NULL outside of coroutines
+ */
+coro_worker_t *current_worker_coro_pool_t(coro_pool_t *pool) {
+    coro_worker_t *worker = this_worker();
+    return worker != NULL && worker->pool == pool ? worker : NULL;
+}
+
+/*!
+ * @brief blocks the calling thread until every coroutine has finished
+ * @warning must not be called from a coroutine
+ */
+void wait_coro_pool_t(coro_pool_t *pool) {
+    pthread_mutex_lock(&pool->coro_lock);
+    while (atomic_load(&pool->live) > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->coro_lock);
+    }
+    pthread_mutex_unlock(&pool->coro_lock);
+}
+
+/*!
+ * @brief fills stats with the pool's counters
+ */
+void stats_coro_pool_t(coro_pool_t *pool, coro_pool_stats_t *stats) {
+    memset(stats, 0, sizeof(coro_pool_stats_t));
+    stats->spawned = atomic_load(&pool->spawned);
+    stats->finished = atomic_load(&pool->finished);
+    stats->live = atomic_load(&pool->live);
+    stats->polls = atomic_load(&pool->polls);
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        coro_worker_stats_t *worker = &pool->workers[i].stats;
+        uint64_t runs = atomic_load(&worker->runs);
+        stats->runs += runs;
+        stats->steals += atomic_load(&worker->steals);
+        stats->stolen += atomic_load(&worker->stolen);
+        stats->migrations += atomic_load(&worker->migrations);
+        stats->sleeps += atomic_load(&worker->sleeps);
+        if (runs > 0) {
+            stats->workers_used += 1;
+        }
+    }
+}
+
+/*!
+ * @brief stops the threads and frees up all resources allocated for the
+ * coro_pool_t struct
+ * @note coroutines that have not finished are dropped along with their stacks
+ */
+void free_coro_pool_t(coro_pool_t *pool) {
+    stop_threads(pool, pool->num_workers);
+    while (pool->live_list != NULL) {
+        pool_coro_t *coro = pool->live_list;
+        pool->live_list = coro->next_live;
+        destroy_coro(coro);
+    }
+    while (pool->cache != NULL) {
+        pool_coro_t *coro = pool->cache;
+        pool->cache = coro->next;
+        destroy_coro(coro);
+    }
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        pthread_mutex_destroy(&pool->workers[i].runq_lock);
+    }
+    free_fd_pool_t(pool->read_pool);
+    free_fd_pool_t(pool->write_pool);
+    close(pool->wake_fd);
+    destroy_locks(pool);
+    free(pool->workers);
+    free(pool);
+}
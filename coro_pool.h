@@ -0,0 +1,313 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file coro_pool.h
+ * @brief M:N coroutine scheduler with per worker run queues and work stealing
+ * @details where coro_sched_t runs every coroutine on the thread of its reactor,
+ * a coro_pool_t runs them on a worker thread per core. every worker has a
+ * bounded local run queue, spawning from a coroutine pushes onto the local queue
+ * of its worker and a worker that runs out of work takes from the global queue
+ * or steals half the queue of another worker, so coroutines move between cores
+ * when load is uneven. a single netpoller thread selects on a read interest and
+ * a write interest fd_pool_t for the whole pool and keeps the sleep and timeout
+ * timers in a timer_wheel_t. coroutines it wakes go onto the global queue
+ * @warning a coroutine may resume on a different thread than the one it parked
+ * on, and errno is thread local. read errno straight after the call that failed
+ * or use error_coro_pool_t, and never keep thread local state across a call that
+ * can park
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include "fd_pool.h"
+#include "timer_wheel.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <ucontext.h>
+
+/*! @brief coroutines a worker's local run queue holds before spilling */
+#ifndef CORO_POOL_RUNQ_SIZE
+#define CORO_POOL_RUNQ_SIZE 256
+#endif
+
+/*! @brief how often a worker checks the global queue before its own */
+#ifndef CORO_POOL_GLOBAL_INTERVAL
+#define CORO_POOL_GLOBAL_INTERVAL 61
+#endif
+
+/*! @brief most workers a pool runs */
+#ifndef CORO_POOL_MAX_WORKERS
+#define CORO_POOL_MAX_WORKERS 64
+#endif
+
+/*! @brief finished coroutines kept around for reuse */
+#ifndef CORO_POOL_CACHE_SIZE
+#define CORO_POOL_CACHE_SIZE 4096
+#endif
+
+struct coro_pool;
+struct coro_worker;
+
+/*! @typedef coro_pool_fn
+ * @brief the body of a coroutine, it is finished once this returns
+ */
+typedef void (*coro_pool_fn)(struct coro_pool *pool, void *arg);
+
+/*!
+ * @brief what a worker does with the coroutine that just switched back to it
+ * @details parking is only published once the coroutine's context is saved, so
+ * the netpoller can not resume it while it is still running
+ */
+typedef enum {
+    CORO_POOL_RAN = 0,
+    CORO_POOL_YIELDED,
+    CORO_POOL_SLEEPING,
+    CORO_POOL_WAITING,
+    CORO_POOL_FINISHED,
+} CORO_POOL_STATE;
+
+/*! @typedef pool_coro
+ * @struct pool_coro
+ * @brief a coroutine run by a coro_pool_t
+ */
+typedef struct pool_coro {
+    wheel_timer_t timer; /*! @brief must stay the first member */
+    ucontext_t context;
+    struct coro_pool *pool;
+    struct coro_worker *worker; /*! @brief the worker that last ran it */
+    char *mapping;
+    size_t mapping_size;
+    coro_pool_fn fn;
+    void *arg;
+    struct pool_coro *next; /*! @brief run queue or cache link */
+    struct pool_coro *prev_live;
+    struct pool_coro *next_live;
+    CORO_POOL_STATE state;
+    uint64_t wake_at; /*! @brief monotonic nanoseconds, for sleeps and timeouts */
+    int wait_fd;
+    bool wait_write;
+    bool timed_out;
+    int wait_error;
+    int error; /*! @brief errno of the last call that failed */
+} pool_coro_t;
+
+/*!
+ * @brief counters kept by a worker
+ */
+typedef struct coro_worker_stats {
+    _Atomic uint64_t runs;
+    _Atomic uint64_t steals;     /*! @brief successful steals from other workers */
+    _Atomic uint64_t stolen;     /*! @brief coroutines taken by those steals */
+    _Atomic uint64_t migrations; /*! @brief coroutines resumed on another worker */
+    _Atomic uint64_t sleeps;     /*! @brief times the worker went idle */
+} coro_worker_stats_t;
+
+/*! @typedef coro_worker
+ * @struct coro_worker
+ * @brief a thread running coroutines
+ */
+typedef struct coro_worker {
+    struct coro_pool *pool;
+    size_t id;
+    pthread_t thread;
+    ucontext_t context; /*! @brief where coroutines switch back to */
+    pool_coro_t *current;
+    pthread_mutex_t runq_lock;
+    pool_coro_t *runq[CORO_POOL_RUNQ_SIZE]; /*! @brief ring of runnable coroutines */
+    size_t runq_head;
+    size_t runq_count;
+    uint64_t ticks;
+    uint32_t seed; /*! @brief picks where stealing starts */
+    coro_worker_stats_t stats;
+} coro_worker_t;
+
+/*!
+ * @brief the coroutines parked on a single fd
+ */
+typedef struct coro_pool_waiters {
+    pool_coro_t *reader;
+    pool_coro_t *writer;
+} coro_pool_waiters_t;
+
+/*!
+ * @brief a snapshot of the pool's counters, summed over its workers
+ */
+typedef struct coro_pool_stats {
+    uint64_t spawned;
+    uint64_t finished;
+    size_t live;
+    uint64_t runs;
+    uint64_t steals;
+    uint64_t stolen;
+    uint64_t migrations;
+    uint64_t sleeps;
+    uint64_t polls; /*! @brief netpoller wakeups */
+    size_t workers_used; /*! @brief workers that ran at least one coroutine */
+} coro_pool_stats_t;
+
+/*! @typedef coro_pool
+ * @struct coro_pool
+ * @brief the M:N scheduler
+ */
+typedef struct coro_pool {
+    coro_worker_t *workers;
+    size_t num_workers;
+    size_t stack_size;
+    bool guard_pages;
+
+    pthread_mutex_t global_lock; /*! @brief guards the global run queue */
+    pool_coro_t *global_head;
+    pool_coro_t *global_tail;
+    size_t global_count;
+    _Atomic size_t runnable; /*! @brief coroutines in any run queue */
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    _Atomic size_t idle;
+
+    pthread_mutex_t coro_lock; /*! @brief guards the live list and the cache */
+    pool_coro_t *live_list;
+    pool_coro_t *cache;
+    size_t num_cached;
+    pthread_cond_t done_cond;
+    _Atomic size_t live;
+    _Atomic uint64_t spawned;
+    _Atomic uint64_t finished;
+
+    pthread_t poller;
+    pthread_mutex_t poll_lock; /*! @brief guards the waiters, interest and timers */
+    fd_pool_t *read_pool;
+    fd_pool_t *write_pool;
+    coro_pool_waiters_t waiters[FD_SETSIZE];
+    timer_wheel_t timers;
+    uint64_t poll_deadline; /*! @brief when the sleeping poller wakes on its own */
+    int wake_fd;
+    _Atomic bool poller_sleeping;
+    _Atomic bool poller_woken;
+    _Atomic uint64_t polls;
+
+    _Atomic bool stopping;
+    thread_logger *thl;
+} coro_pool_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new coro_pool_t object
+ * @details starts the worker threads and the netpoller thread
+ * @param num_workers worker threads to run, 0 for one per online cpu
+ * @param stack_size usable stack size of each coroutine, 0 for CORO_STACK_SIZE
+ * @param guard_pages whether to put a PROT_NONE page below every stack
+ * @return Success: pointer to instance of coro_pool_t
+ * @return Failure: NULL ptr
+ */
+coro_pool_t *new_coro_pool_t(thread_logger *thl, size_t num_workers,
+                             size_t stack_size, bool guard_pages);
+
+/*!
+ * @brief starts a new coroutine
+ * @details from a coroutine the new one goes onto the local queue of the worker,
+ * from any other thread onto the global queue
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int spawn_coro_pool_t(coro_pool_t *pool, coro_pool_fn fn, void *arg);
+
+/*!
+ * @brief lets the other runnable coroutines of the worker run
+ */
+void yield_coro_pool_t(coro_pool_t *pool);
+
+/*!
+ * @brief parks the calling coroutine for ms milliseconds
+ */
+void sleep_coro_pool_t(coro_pool_t *pool, uint64_t ms);
+
+/*!
+ * @brief parks the calling coroutine until fd is readable, or writable
+ * @details only one coroutine can wait for each direction of an fd
+ * @param timeout_ms the longest to wait, -1 to wait forever
+ * @return Success: 0
+ * @return Failure: -1 with errno set to ETIMEDOUT, EBUSY if another coroutine is
+ * waiting on the same direction, EBADF if the fd was closed, or EPERM outside of
+ * a coroutine
+ */
+int wait_fd_coro_pool_t(coro_pool_t *pool, int fd, bool write, int timeout_ms);
+
+/*!
+ * @brief reads up to len bytes, parking until some are available
+ * @return Success: bytes read, 0 at end of file
+ * @return Failure: -1
+ */
+ssize_t read_coro_pool_t(coro_pool_t *pool, int fd, void *buffer, size_t len);
+
+/*!
+ * @brief writes all len bytes, parking whenever the socket buffer is full
+ * @return Success: len
+ * @return Failure: -1
+ */
+ssize_t write_coro_pool_t(coro_pool_t *pool, int fd, const void *data, size_t len);
+
+/*!
+ * @brief accepts a connection, parking until one arrives
+ * @return Success: the new fd, already non-blocking
+ * @return Failure: -1
+ */
+int accept_coro_pool_t(coro_pool_t *pool, int listen_fd);
+
+/*!
+ * @brief connects a non-blocking socket, parking until the handshake finishes
+ * @return Success: 0
+ * @return Failure: -1 with errno set to why the connection failed
+ */
+int connect_coro_pool_t(coro_pool_t *pool, int fd, const struct sockaddr *addr,
+                        socklen_t addr_len);
+
+/*!
+ * @brief closes an fd used by coroutines
+ * @details coroutines parked on it are woken with EBADF
+ */
+void close_coro_pool_t(coro_pool_t *pool, int fd);
+
+/*!
+ * @brief the errno of the last call made by the calling coroutine that failed
+ * @details unlike errno this follows the coroutine from worker to worker
+ */
+int error_coro_pool_t(coro_pool_t *pool);
+
+/*!
+ * @brief the worker running the calling coroutine, NULL outside of coroutines
+ */
+coro_worker_t *current_worker_coro_pool_t(coro_pool_t *pool);
+
+/*!
+ * @brief blocks the calling thread until every coroutine has finished
+ * @warning must not be called from a coroutine
+ */
+void wait_coro_pool_t(coro_pool_t *pool);
+
+/*!
+ * @brief fills stats with the pool's counters
+ */
+void stats_coro_pool_t(coro_pool_t *pool, coro_pool_stats_t *stats);
+
+/*!
+ * @brief stops the threads and frees up all resources allocated for the
+ * coro_pool_t struct
+ * @note coroutines that have not finished are dropped along with their stacks
+ */
+void free_coro_pool_t(coro_pool_t *pool);
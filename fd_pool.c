@@ -90,6 +90,47 @@ int get_active_fd_pool_t(fd_pool_t *fpool, fd_set *check_set, bool tcp, bool rea
     return num_active;
 }
 
+/*!
+ * @brief polls a read interest pool and a write interest pool with a single
+ * select call
+ * @details either pool may be NULL, in which case its set is not checked. this
+ * lets callers that need both read and write readiness (forwarders, event loops)
+ * use one syscall instead of two get_active_fd_pool_t calls
+ * @param read_set written with the fds from read_pool that are readable
+ * @param write_set written with the fds from write_pool that are writable
+ * @param tcp if true check tcp_set, if false check udp_set
+ * @param timeout how long to wait, NULL blocks until an fd is ready
+ * @return number of fds, -1 on error
+ */
+int poll_fd_pool_t(fd_pool_t *read_pool, fd_pool_t *write_pool, fd_set *read_set,
+                   fd_set *write_set, bool tcp, struct timeval *timeout) {
+    fd_pool_t *pools[2] = {read_pool, write_pool};
+    fd_set *sets[2] = {read_set, write_set};
+    int max_fds = 0;
+
+    for (int i = 0; i < 2; i++) {
+        if (pools[i] == NULL) {
+            sets[i] = NULL;
+            continue;
+        }
+        pthread_rwlock_t *lock = tcp ? &pools[i]->tcp_lock : &pools[i]->udp_lock;
+        pthread_rwlock_rdlock(lock);
+        unsafe_copy_fd_pool_t(pools[i], sets[i], tcp);
+        int max = unsafe_max_socket_fd_pool_t(pools[i], tcp);
+        pthread_rwlock_unlock(lock);
+        if (max > max_fds) {
+            max_fds = max;
+        }
+    }
+
+    int num_active = select(max_fds + 1, sets[0], sets[1], NULL, timeout);
+    if (num_active < 0 && errno != EINTR) {
+        printf("socket select failed with error %s\n", strerror(errno));
+    }
+
+    return num_active;
+}
+
 /*!
  * @brief returns the file descriptors from tcp_set or udp_set, without checking
  * to see if any are available for read/write
@@ -207,13 +248,41 @@ void unsafe_copy_fd_pool_t(fd_pool_t *fpool, fd_set *dst, bool tcp) {
 void set_fd_pool_t(fd_pool_t *fpool, int fd, bool is_tcp) {
     if (is_tcp == true) {
         pthread_rwlock_wrlock(&fpool->tcp_lock);
-        FD_SET(fd, &fpool->tcp_set);
-        fpool->num_tcp_fds += 1;
+        if (!FD_ISSET(fd, &fpool->tcp_set)) {
+            FD_SET(fd, &fpool->tcp_set);
+            fpool->num_tcp_fds += 1;
+        }
         pthread_rwlock_unlock(&fpool->tcp_lock);
     } else {
         pthread_rwlock_wrlock(&fpool->udp_lock);
-        FD_SET(fd, &fpool->udp_set);
-        fpool->num_udp_fds += 1;
+        if (!FD_ISSET(fd, &fpool->udp_set)) {
+            FD_SET(fd, &fpool->udp_set);
+            fpool->num_udp_fds += 1;
+        }
+        pthread_rwlock_unlock(&fpool->udp_lock);
+    }
+}
+
+/*!
+ * @brief removes the file descriptor from the pool
+ * @param fd the file descriptor to clear from the pool
+ * @param is_tcp if true check tcp_set, if false check udp_set
+ * @note this does not close the file descriptor
+ */
+void clear_fd_pool_t(fd_pool_t *fpool, int fd, bool is_tcp) {
+    if (is_tcp == true) {
+        pthread_rwlock_wrlock(&fpool->tcp_lock);
+        if (FD_ISSET(fd, &fpool->tcp_set)) {
+            FD_CLR(fd, &fpool->tcp_set);
+            fpool->num_tcp_fds -= 1;
+        }
+        pthread_rwlock_unlock(&fpool->tcp_lock);
+    } else {
+        pthread_rwlock_wrlock(&fpool->udp_lock);
+        if (FD_ISSET(fd, &fpool->udp_set)) {
+            FD_CLR(fd, &fpool->udp_set);
+            fpool->num_udp_fds -= 1;
+        }
         pthread_rwlock_unlock(&fpool->udp_lock);
     }
 }
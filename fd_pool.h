@@ -60,6 +60,21 @@ fd_pool_t *new_fd_pool_t(void);
  */
 int get_active_fd_pool_t(fd_pool_t *fpool, fd_set *check_set, bool tcp, bool read);
 
+/*!
+ * @brief polls a read interest pool and a write interest pool with a single
+ * select call
+ * @details either pool may be NULL, in which case its set is not checked. this
+ * lets callers that need both read and write readiness (forwarders, event loops)
+ * use one syscall instead of two get_active_fd_pool_t calls
+ * @param read_set written with the fds from read_pool that are readable
+ * @param write_set written with the fds from write_pool that are writable
+ * @param tcp if true check tcp_set, if false check udp_set
+ * @param timeout how long to wait, NULL blocks until an fd is ready
+ * @return number of fds, -1 on error
+ */
+int poll_fd_pool_t(fd_pool_t *read_pool, fd_pool_t *write_pool, fd_set *read_set,
+                   fd_set *write_set, bool tcp, struct timeval *timeout);
+
 /*!
  * @brief returns the file descriptors from tcp_set or udp_set, without checking
  * to see if any are available for read/write
@@ -96,6 +111,14 @@ void unsafe_copy_fd_pool_t(fd_pool_t *fpool, fd_set *dst, bool tcp);
  */
 void set_fd_pool_t(fd_pool_t *fpool, int fd, bool is_tcp);
 
+/*!
+ * @brief removes the file descriptor from the pool
+ * @param fd the file descriptor to clear from the pool
+ * @param is_tcp if true check tcp_set, if false check udp_set
+ * @note this does not close the file descriptor
+ */
+void clear_fd_pool_t(fd_pool_t *fpool, int fd, bool is_tcp);
+
 /*!
  * @brief free up all resources allocated for the fd_pool_t struct
  * @note this does not close the file resources associated with any file
@@ -0,0 +1,271 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "forward.h"
+#include "deps/ulog/logger.h"
+#include "fd_pool.h"
+#include "sockets.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*!
+ * @brief fills the pipe from the source socket
+ * @return number of bytes moved, 0 on EOF or would block, -1 on error
+ */
+static ssize_t fill_forward_pipe(forwarder_t *fwd, forward_pipe_t *fp, int src) {
+    ssize_t n = splice(src, NULL, fp->pipe_fds[1], NULL,
+                       fwd->pipe_size - fp->pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        fp->pending += (size_t)n;
+        return n;
+    }
+    if (n == 0) {
+        fp->eof = true;
+        return 0;
+    }
+    if (errno == EAGAIN) {
+        // the source was readable, so with bytes already queued this is most
+        // likely the pipe running out of buffers rather than the socket being
+        // empty. either way reading again before a drain would just spin
+        fp->full = fp->pending > 0;
+        return 0;
+    }
+    if (errno == EINTR) {
+        return 0;
+    }
+    LOGF_ERROR(fwd->thl, 0, "splice from socket %i failed %s", src, strerror(errno));
+    return -1;
+}
+
+/*!
+ * @brief drains the pipe into the destination socket
+ * @return number of bytes moved, 0 if would block, -1 on error
+ */
+static ssize_t drain_forward_pipe(forwarder_t *fwd, forward_pipe_t *fp, int dst) {
+    ssize_t n = splice(fp->pipe_fds[0], NULL, dst, NULL, fp->pending,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        fp->pending -= (size_t)n;
+        fp->total += (size_t)n;
+        fp->full = false;
+        return n;
+    }
+    if (n == 0 || errno == EAGAIN || errno == EINTR) {
+        return 0;
+    }
+    LOGF_ERROR(fwd->thl, 0, "splice to socket %i failed %s", dst, strerror(errno));
+    return -1;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new forwarder_t object
+ * @details both sockets are switched to non-blocking mode
+ * @param client_fd the first socket, typically one returned by accept_socket
+ * @param backend_fd the second socket, typically from new_client_socket
+ * @return Success: pointer to instance of forwarder_t
+ * @return Failure: NULL ptr
+ */
+forwarder_t *new_forwarder_t(thread_logger *thl, int client_fd, int backend_fd) {
+    forwarder_t *fwd = calloc(1, sizeof(forwarder_t));
+    if (fwd == NULL) {
+        LOG_ERROR(thl, 0, "failed to calloc forwarder_t");
+        return NULL;
+    }
+
+    fwd->thl = thl;
+    fwd->fds[0] = client_fd;
+    fwd->fds[1] = backend_fd;
+    fwd->pipe_size = FORWARD_PIPE_SIZE;
+
+    for (int i = 0; i < 2; i++) {
+        fwd->pipes[i].pipe_fds[0] = -1;
+        fwd->pipes[i].pipe_fds[1] = -1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (set_socket_blocking_status(fwd->fds[i], false) == false) {
+            LOG_ERROR(thl, 0, "failed to set forwarded socket non-blocking");
+            goto ERROR;
+        }
+        if (pipe2(fwd->pipes[i].pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            LOGF_ERROR(thl, 0, "failed to create pipe %s", strerror(errno));
+            goto ERROR;
+        }
+        // a larger pipe means fewer wakeups per byte, but the kernel caps it at
+        // fs.pipe-max-size so use whatever we actually get
+        fcntl(fwd->pipes[i].pipe_fds[1], F_SETPIPE_SZ, FORWARD_PIPE_SIZE);
+        int size = fcntl(fwd->pipes[i].pipe_fds[1], F_GETPIPE_SZ);
+        if (size > 0 && (size_t)size < fwd->pipe_size) {
+            fwd->pipe_size = (size_t)size;
+        }
+    }
+
+    return fwd;
+
+ERROR:
+    free_forwarder_t(fwd);
+    return NULL;
+}
+
+/*!
+ * @brief updates read and write interest for both sockets
+ * @details a socket is in read_pool while its pipe has room and it has not hit
+ * EOF, and in write_pool while there are pending bytes destined for it. a pipe
+ * that stopped taking bytes before reaching pipe_size counts as full until a
+ * drain makes progress
+ * @param read_pool the pool used for read readiness, must be tcp
+ * @param write_pool the pool used for write readiness, must be tcp
+ */
+void interest_forwarder_t(forwarder_t *fwd, fd_pool_t *read_pool,
+                          fd_pool_t *write_pool) {
+    for (int i = 0; i < 2; i++) {
+        forward_pipe_t *fp = &fwd->pipes[i];
+        int src = fwd->fds[i];
+        int dst = fwd->fds[1 - i];
+        if (fp->eof == false && fp->full == false && fp->pending < fwd->pipe_size) {
+            set_fd_pool_t(read_pool, src, true);
+        } else {
+            clear_fd_pool_t(read_pool, src, true);
+        }
+        if (fp->pending > 0) {
+            set_fd_pool_t(write_pool, dst, true);
+        } else {
+            clear_fd_pool_t(write_pool, dst, true);
+        }
+    }
+}
+
+/*!
+ * @brief moves as many bytes as readiness allows in both directions
+ * @param read_set readable fds as returned by poll_fd_pool_t
+ * @param write_set writable fds as returned by poll_fd_pool_t
+ * @return 0 if still forwarding, 1 once both directions are closed, -1 on error
+ */
+int step_forwarder_t(forwarder_t *fwd, fd_set *read_set, fd_set *write_set) {
+    for (int i = 0; i < 2; i++) {
+        forward_pipe_t *fp = &fwd->pipes[i];
+        int src = fwd->fds[i];
+        int dst = fwd->fds[1 - i];
+        bool filled = false;
+
+        if (fp->eof == false && fp->full == false && fp->pending < fwd->pipe_size &&
+            FD_ISSET(src, read_set)) {
+            ssize_t n = fill_forward_pipe(fwd, fp, src);
+            if (n == -1) {
+                return -1;
+            }
+            filled = n > 0;
+        }
+
+        // try to drain right away if we just filled, the destination is usually
+        // writable and this saves a trip through select
+        if (fp->pending > 0 && (filled || FD_ISSET(dst, write_set))) {
+            if (drain_forward_pipe(fwd, fp, dst) == -1) {
+                return -1;
+            }
+        }
+
+        // propagate half-close once everything the source sent has been flushed
+        if (fp->eof && fp->pending == 0 && fp->shutdown == false) {
+            if (shutdown(dst, SHUT_WR) == -1 && errno != ENOTCONN) {
+                LOGF_ERROR(fwd->thl, 0, "failed to shutdown socket %i %s", dst,
+                           strerror(errno));
+                return -1;
+            }
+            fp->shutdown = true;
+        }
+    }
+    return done_forwarder_t(fwd) ? 1 : 0;
+}
+
+/*!
+ * @brief returns true once both directions have been closed
+ */
+bool done_forwarder_t(forwarder_t *fwd) {
+    return fwd->pipes[0].shutdown && fwd->pipes[1].shutdown;
+}
+
+/*!
+ * @brief forwards between the two sockets until both directions are closed
+ * @details convenience wrapper around a forwarder_t and a pair of fd_pool_t, for
+ * proxies that dedicate a thread to each connection
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int run_forwarder_t(thread_logger *thl, int client_fd, int backend_fd) {
+    int rc = -1;
+    fd_pool_t *read_pool = new_fd_pool_t();
+    fd_pool_t *write_pool = new_fd_pool_t();
+    forwarder_t *fwd = new_forwarder_t(thl, client_fd, backend_fd);
+    if (read_pool == NULL || write_pool == NULL || fwd == NULL) {
+        LOG_ERROR(thl, 0, "failed to setup forwarder");
+        goto EXIT;
+    }
+
+    for (;;) {
+        fd_set read_set, write_set;
+        interest_forwarder_t(fwd, read_pool, write_pool);
+        int num_active =
+            poll_fd_pool_t(read_pool, write_pool, &read_set, &write_set, true, NULL);
+        if (num_active < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto EXIT;
+        }
+        int status = step_forwarder_t(fwd, &read_set, &write_set);
+        if (status == -1) {
+            goto EXIT;
+        }
+        if (status == 1) {
+            break;
+        }
+    }
+
+    LOGF_DEBUG(thl, 0, "forwarder finished. sent %zu bytes, received %zu bytes",
+               fwd->pipes[0].total, fwd->pipes[1].total);
+    rc = 0;
+
+EXIT:
+    if (fwd != NULL) {
+        free_forwarder_t(fwd);
+    }
+    if (read_pool != NULL) {
+        free_fd_pool_t(read_pool);
+    }
+    if (write_pool != NULL) {
+        free_fd_pool_t(write_pool);
+    }
+    return rc;
+}
+
+/*!
+ * @brief free up all resources allocated for the forwarder_t struct
+ * @note this closes the pipes but not the forwarded sockets
+ */
+void free_forwarder_t(forwarder_t *fwd) {
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (fwd->pipes[i].pipe_fds[j] != -1) {
+                close(fwd->pipes[i].pipe_fds[j]);
+            }
+        }
+    }
+    free(fwd);
+}
@@ -0,0 +1,112 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file forward.h
+ * @brief zero-copy bidirectional forwarding between two sockets
+ * @details bytes are moved with splice(2) through a pipe per direction so the
+ * payload never enters userspace. readiness of both sockets is tracked with
+ * fd_pool_t, and half-close is propagated: when one side stops sending, the
+ * other side sees a shutdown(SHUT_WR) once the pipe has drained
+ * @warning splicing into a socket whose peer has gone away raises SIGPIPE, so
+ * processes using a forwarder should ignore that signal
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include "fd_pool.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/select.h>
+
+/*!
+ * @brief the pipe size we ask the kernel for, the kernel may give us less
+ */
+#ifndef FORWARD_PIPE_SIZE
+#define FORWARD_PIPE_SIZE 262144
+#endif
+
+/*!
+ * @brief a single direction of a forwarder
+ */
+typedef struct forward_pipe {
+    int pipe_fds[2]; /*! @brief [0] is the read end, [1] is the write end */
+    size_t pending;  /*! @brief bytes sitting in the pipe waiting to be written */
+    size_t total;    /*! @brief total bytes forwarded in this direction */
+    bool eof;        /*! @brief the source socket has returned EOF */
+    /*! @brief a fill would block with bytes still in the pipe, the pipe may be
+     * out of slots before it is out of bytes, so reads wait for a drain */
+    bool full;
+    bool shutdown;   /*! @brief the destination socket has been shutdown for
+                        writing */
+} forward_pipe_t;
+
+/*!
+ * @brief forwards bytes in both directions between two sockets
+ * @details pipes[0] carries fds[0] -> fds[1], pipes[1] carries fds[1] -> fds[0]
+ */
+typedef struct forwarder {
+    int fds[2];
+    size_t pipe_size;
+    forward_pipe_t pipes[2];
+    thread_logger *thl;
+} forwarder_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new forwarder_t object
+ * @details both sockets are switched to non-blocking mode
+ * @param client_fd the first socket, typically one returned by accept_socket
+ * @param backend_fd the second socket, typically from new_client_socket
+ * @return Success: pointer to instance of forwarder_t
+ * @return Failure: NULL ptr
+ */
+forwarder_t *new_forwarder_t(thread_logger *thl, int client_fd, int backend_fd);
+
+/*!
+ * @brief updates read and write interest for both sockets
+ * @details a socket is in read_pool while its pipe has room and it has not hit
+ * EOF, and in write_pool while there are pending bytes destined for it. a pipe
+ * that stopped taking bytes before reaching pipe_size counts as full until a
+ * drain makes progress
+ * @param read_pool the pool used for read readiness, must be tcp
+ * @param write_pool the pool used for write readiness, must be tcp
+ */
+void interest_forwarder_t(forwarder_t *fwd, fd_pool_t *read_pool,
+                          fd_pool_t *write_pool);
+
+/*!
+ * @brief moves as many bytes as readiness allows in both directions
+ * @param read_set readable fds as returned by poll_fd_pool_t
+ * @param write_set writable fds as returned by poll_fd_pool_t
+ * @return 0 if still forwarding, 1 once both directions are closed, -1 on error
+ */
+int step_forwarder_t(forwarder_t *fwd, fd_set *read_set, fd_set *write_set);
+
+/*!
+ * @brief returns true once both directions have been closed
+ */
+bool done_forwarder_t(forwarder_t *fwd);
+
+/*!
+ * @brief forwards between the two sockets until both directions are closed
+ * @details convenience wrapper around a forwarder_t and a pair of fd_pool_t, for
+ * proxies that dedicate a thread to each connection
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int run_forwarder_t(thread_logger *thl, int client_fd, int backend_fd);
+
+/*!
+ * @brief free up all resources allocated for the forwarder_t struct
+ * @note this closes the pipes but not the forwarded sockets
+ */
+void free_forwarder_t(forwarder_t *fwd);
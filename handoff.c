@@ -0,0 +1,271 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "handoff.h"
+#include "deps/ulog/logger.h"
+#include "fd_pool.h"
+#include "sockets.h"
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*! @brief "hoff" in ascii, identifies a handoff message */
+#define HANDOFF_MAGIC 0x686f6666
+
+/*!
+ * @brief the payload sent alongside a batch of fds
+ */
+typedef struct handoff_message {
+    uint32_t magic;
+    uint32_t count;
+    handoff_meta_t meta[HANDOFF_MAX_BATCH];
+} handoff_message_t;
+
+/*!
+ * @brief creates a connected SOCK_SEQPACKET pair for passing connections
+ * @details call before fork, the acceptor keeps channel[0] and the worker keeps
+ * channel[1]
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int new_handoff_channel(int channel[2]) {
+    // seqpacket keeps each batch a single message, a stream socket could split
+    // the metadata across reads
+    return socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel);
+}
+
+/*!
+ * @brief accepts up to max queued connections without blocking after the first
+ * @details the first accept follows the blocking mode of listen_fd, later ones
+ * only happen while the listen queue has connections waiting
+ * @param meta optional, filled in for each accepted connection
+ * @return number of accepted connections, -1 if the first accept failed
+ */
+int accept_batch_socket(thread_logger *thl, int listen_fd, int *fds,
+                        handoff_meta_t *meta, int max) {
+    int count = 0;
+    while (count < max) {
+        if (count > 0) {
+            struct pollfd pfd;
+            pfd.fd = listen_fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 0) != 1) {
+                break;
+            }
+        }
+
+        sock_addr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int fd = accept(listen_fd, (sock_addr *)&peer, &peer_len);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (count == 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGF_ERROR(thl, 0, "failed to accept connection %s",
+                           strerror(errno));
+                return -1;
+            }
+            break;
+        }
+
+        fds[count] = fd;
+        if (meta != NULL) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            memset(&meta[count], 0, sizeof(handoff_meta_t));
+            meta[count].accepted_at =
+                (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+            meta[count].peer_len = peer_len;
+            memcpy(&meta[count].peer, &peer, sizeof(peer));
+        }
+        count += 1;
+    }
+    return count;
+}
+
+/*!
+ * @brief passes connections over a handoff channel
+ * @details batches larger than HANDOFF_MAX_BATCH are split into several
+ * messages. each fd is closed in this process once it has been sent
+ * @param meta optional, one record per fd
+ * @return Success: number of connections sent
+ * @return Failure: -1, fds that were not sent are left open
+ */
+int send_handoff(thread_logger *thl, int channel, int *fds, handoff_meta_t *meta,
+                 int count) {
+    handoff_message_t msg;
+    int sent = 0;
+    while (sent < count) {
+        int batch = count - sent;
+        if (batch > HANDOFF_MAX_BATCH) {
+            batch = HANDOFF_MAX_BATCH;
+        }
+
+        msg.magic = HANDOFF_MAGIC;
+        msg.count = (uint32_t)batch;
+        if (meta != NULL) {
+            memcpy(msg.meta, &meta[sent], sizeof(handoff_meta_t) * (size_t)batch);
+        } else {
+            memset(msg.meta, 0, sizeof(handoff_meta_t) * (size_t)batch);
+        }
+
+        // only send the metadata records that are actually in use
+        size_t len = offsetof(handoff_message_t, meta) +
+                     sizeof(handoff_meta_t) * (size_t)batch;
+        int rc = send_fds_socket(channel, &fds[sent], batch, &msg, len);
+        if (rc != (int)len) {
+            LOGF_ERROR(thl, 0, "failed to send handoff %s", strerror(errno));
+            return sent > 0 ? sent : -1;
+        }
+
+        for (int i = 0; i < batch; i++) {
+            close(fds[sent + i]);
+        }
+        sent += batch;
+    }
+    return sent;
+}
+
+/*!
+ * @brief receives one batch of connections from a handoff channel
+ * @param fpool optional, every received fd is set in its tcp set
+ * @param fds written with the received fds, must hold HANDOFF_MAX_BATCH entries
+ * @param meta optional, must hold HANDOFF_MAX_BATCH entries
+ * @return Success: number of connections received, 0 once the acceptor has gone
+ * @return Failure: -1
+ */
+int recv_handoff(thread_logger *thl, int channel, fd_pool_t *fpool, int *fds,
+                 handoff_meta_t *meta) {
+    handoff_message_t msg;
+    size_t len = sizeof(msg);
+    int num_fds = recv_fds_socket(channel, fds, HANDOFF_MAX_BATCH, &msg, &len);
+    if (num_fds == -1) {
+        LOGF_ERROR(thl, 0, "failed to receive handoff %s", strerror(errno));
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (len < offsetof(handoff_message_t, meta) || msg.magic != HANDOFF_MAGIC ||
+        msg.count != (uint32_t)num_fds ||
+        len != offsetof(handoff_message_t, meta) +
+                   sizeof(handoff_meta_t) * (size_t)num_fds) {
+        LOG_ERROR(thl, 0, "invalid handoff message");
+        for (int i = 0; i < num_fds; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < num_fds; i++) {
+        if (fpool != NULL) {
+            set_fd_pool_t(fpool, fds[i], true);
+        }
+        if (meta != NULL) {
+            meta[i] = msg.meta[i];
+        }
+    }
+    return num_fds;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new handoff_dispatcher_t object
+ * @param channels the acceptor side of each worker's handoff channel
+ * @return Success: pointer to instance of handoff_dispatcher_t
+ * @return Failure: NULL ptr
+ */
+handoff_dispatcher_t *new_handoff_dispatcher_t(int *channels, size_t num_channels) {
+    if (num_channels == 0) {
+        return NULL;
+    }
+    handoff_dispatcher_t *dispatcher = calloc(1, sizeof(handoff_dispatcher_t));
+    if (dispatcher == NULL) {
+        return NULL;
+    }
+    dispatcher->channels = calloc(num_channels, sizeof(int));
+    dispatcher->handed_off = calloc(num_channels, sizeof(uint64_t));
+    if (dispatcher->channels == NULL || dispatcher->handed_off == NULL) {
+        free_handoff_dispatcher_t(dispatcher);
+        return NULL;
+    }
+    memcpy(dispatcher->channels, channels, sizeof(int) * num_channels);
+    dispatcher->num_channels = num_channels;
+    return dispatcher;
+}
+
+/*!
+ * @brief accepts a batch of connections and spreads it across the workers
+ * @details the batch is split into equal shares handed to the workers round
+ * robin, one message each, so a burst accepted in one wakeup is spread out. if
+ * a worker's channel fails its share is offered to the remaining workers before
+ * being dropped
+ * @return number of connections handed off, -1 on failure
+ */
+int dispatch_handoff_dispatcher_t(handoff_dispatcher_t *dispatcher,
+                                  thread_logger *thl, int listen_fd) {
+    int fds[HANDOFF_MAX_BATCH];
+    handoff_meta_t meta[HANDOFF_MAX_BATCH];
+    int count = accept_batch_socket(thl, listen_fd, fds, meta, HANDOFF_MAX_BATCH);
+    if (count <= 0) {
+        return count;
+    }
+
+    // a burst is split evenly so it does not all land on one worker, each
+    // worker still gets its share with a single message. the first pass offers
+    // every worker its share, the second offers whatever a failing worker left
+    // to the others
+    size_t share =
+        ((size_t)count + dispatcher->num_channels - 1) / dispatcher->num_channels;
+    int handed = 0;
+    for (size_t attempt = 0;
+         attempt < 2 * dispatcher->num_channels && handed < count; attempt++) {
+        size_t index = dispatcher->next;
+        dispatcher->next = (dispatcher->next + 1) % dispatcher->num_channels;
+        int chunk = count - handed;
+        if (attempt < dispatcher->num_channels && (size_t)chunk > share) {
+            chunk = (int)share;
+        }
+        int sent = send_handoff(thl, dispatcher->channels[index], &fds[handed],
+                                &meta[handed], chunk);
+        if (sent > 0) {
+            dispatcher->handed_off[index] += (uint64_t)sent;
+            handed += sent;
+        }
+    }
+
+    if (handed < count) {
+        LOGF_ERROR(thl, 0, "no worker accepted %i connections, dropping them",
+                   count - handed);
+        for (int i = handed; i < count; i++) {
+            close(fds[i]);
+        }
+        return handed > 0 ? handed : -1;
+    }
+    return handed;
+}
+
+/*!
+ * @brief free up all resources allocated for the handoff_dispatcher_t struct
+ * @note this does not close the channels
+ */
+void free_handoff_dispatcher_t(handoff_dispatcher_t *dispatcher) {
+    free(dispatcher->channels);
+    free(dispatcher->handed_off);
+    free(dispatcher);
+}
@@ -0,0 +1,117 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file handoff.h
+ * @brief hands accepted connections from an acceptor process to workers
+ * @details the acceptor drains its listen queue in batches and passes the
+ * accepted fds to worker processes over SOCK_SEQPACKET unix sockets with
+ * SCM_RIGHTS. every fd travels with a small metadata record, and a whole batch
+ * is a single message, so workers never contend on the listen queue
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include "fd_pool.h"
+#include "sockets.h"
+#include <stdint.h>
+
+/*!
+ * @brief the most connections passed in a single handoff message
+ */
+#define HANDOFF_MAX_BATCH SOCKET_MAX_FDS
+
+/*!
+ * @brief information about an accepted connection that travels with its fd
+ */
+typedef struct handoff_meta {
+    uint64_t accepted_at; /*! @brief CLOCK_MONOTONIC nanoseconds at accept */
+    uint32_t flags;       /*! @brief free for the application to use */
+    uint32_t peer_len;    /*! @brief length of the peer address */
+    sock_addr_storage peer;
+} handoff_meta_t;
+
+/*!
+ * @brief spreads batches of accepted connections across worker channels
+ */
+typedef struct handoff_dispatcher {
+    int *channels;
+    size_t num_channels;
+    size_t next;
+    uint64_t *handed_off; /*! @brief connections sent to each channel */
+} handoff_dispatcher_t;
+
+/*!
+ * @brief creates a connected SOCK_SEQPACKET pair for passing connections
+ * @details call before fork, the acceptor keeps channel[0] and the worker keeps
+ * channel[1]
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int new_handoff_channel(int channel[2]);
+
+/*!
+ * @brief accepts up to max queued connections without blocking after the first
+ * @details the first accept follows the blocking mode of listen_fd, later ones
+ * only happen while the listen queue has connections waiting
+ * @param meta optional, filled in for each accepted connection
+ * @return number of accepted connections, -1 if the first accept failed
+ */
+int accept_batch_socket(thread_logger *thl, int listen_fd, int *fds,
+                        handoff_meta_t *meta, int max);
+
+/*!
+ * @brief passes connections over a handoff channel
+ * @details batches larger than HANDOFF_MAX_BATCH are split into several
+ * messages. each fd is closed in this process once it has been sent
+ * @param meta optional, one record per fd
+ * @return Success: number of connections sent
+ * @return Failure: -1, fds that were not sent are left open
+ */
+int send_handoff(thread_logger *thl, int channel, int *fds, handoff_meta_t *meta,
+                 int count);
+
+/*!
+ * @brief receives one batch of connections from a handoff channel
+ * @param fpool optional, every received fd is set in its tcp set
+ * @param fds written with the received fds, must hold HANDOFF_MAX_BATCH entries
+ * @param meta optional, must hold HANDOFF_MAX_BATCH entries
+ * @return Success: number of connections received, 0 once the acceptor has gone
+ * @return Failure: -1
+ */
+int recv_handoff(thread_logger *thl, int channel, fd_pool_t *fpool, int *fds,
+                 handoff_meta_t *meta);
+
+/*!
+ * @brief allocates memory for, and initializes a new handoff_dispatcher_t object
+ * @param channels the acceptor side of each worker's handoff channel
+ * @return Success: pointer to instance of handoff_dispatcher_t
+ * @return Failure: NULL ptr
+ */
+handoff_dispatcher_t *new_handoff_dispatcher_t(int *channels, size_t num_channels);
+
+/*!
+ * @brief accepts a batch of connections and spreads it across the workers
+ * @details the batch is split into equal shares handed to the workers round
+ * robin, one message each, so a burst accepted in one wakeup is spread out. if
+ * a worker's channel fails its share is offered to the remaining workers before
+ * being dropped
+ * @return number of connections handed off, -1 on failure
+ */
+int dispatch_handoff_dispatcher_t(handoff_dispatcher_t *dispatcher,
+                                  thread_logger *thl, int listen_fd);
+
+/*!
+ * @brief free up all resources allocated for the handoff_dispatcher_t struct
+ * @note this does not close the channels
+ */
+void free_handoff_dispatcher_t(handoff_dispatcher_t *dispatcher);
@@ -0,0 +1,301 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "handover.h"
+#include "deps/ulog/logger.h"
+#include "sockets.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*! @brief "hovr" in ascii, identifies a handover message */
+#define HANDOVER_MAGIC 0x686f7672
+
+/*!
+ * @brief the payload sent alongside the listening sockets
+ */
+typedef struct handover_message {
+    uint32_t magic;
+    uint32_t count;
+} handover_message_t;
+
+/*!
+ * @brief parses a non-negative integer environment variable
+ * @return the value, or -1 if unset or invalid
+ */
+static long env_number(const char *name) {
+    char *value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return -1;
+    }
+    char *end = NULL;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno != 0 || *end != '\0' || number < 0 || number > INT_MAX) {
+        return -1;
+    }
+    return number;
+}
+
+/*!
+ * @brief picks up listening sockets passed down with LISTEN_FDS
+ * @details the environment variables are removed and the fds are marked
+ * FD_CLOEXEC, so they are not passed on by accident
+ * @param ready_fd set to the fd confirm_handover writes to, or -1 if the parent
+ * did not ask for confirmation
+ * @return Success: number of inherited fds, 0 if none were passed to us
+ * @return Failure: -1
+ */
+int inherit_listen_fds(thread_logger *thl, int *fds, int max, int *ready_fd) {
+    *ready_fd = -1;
+    long count = env_number("LISTEN_FDS");
+    long pid = env_number("LISTEN_PID");
+    long ready = env_number("LISTEN_READY_FD");
+    if (count <= 0 || pid != (long)getpid()) {
+        // nothing was passed down, or it was meant for another process
+        return 0;
+    }
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_READY_FD");
+
+    if (count > max) {
+        LOGF_ERROR(thl, 0, "inherited %li listening sockets, can only use %i", count,
+                   max);
+        return -1;
+    }
+
+    for (int i = 0; i < (int)count; i++) {
+        int fd = LISTEN_FDS_START + i;
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+            LOGF_ERROR(thl, 0, "inherited fd %i is not open %s", fd,
+                       strerror(errno));
+            return -1;
+        }
+        fds[i] = fd;
+    }
+
+    if (ready == LISTEN_FDS_START + count &&
+        fcntl((int)ready, F_SETFD, FD_CLOEXEC) == 0) {
+        *ready_fd = (int)ready;
+    }
+
+    LOGF_INFO(thl, 0, "inherited %li listening sockets", count);
+    return (int)count;
+}
+
+/*!
+ * @brief moves fds into place and describes them with LISTEN_FDS
+ * @details only call this in a freshly forked child right before exec
+ * @param ready_fd passed after the listening sockets, -1 for none
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int export_listen_fds(int *fds, int count, int ready_fd) {
+    if (count <= 0 || count > HANDOVER_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    int total = count + (ready_fd >= 0 ? 1 : 0);
+    int moved[HANDOVER_MAX_FDS + 1];
+
+    // copy everything above the target range first, so a source fd that happens
+    // to sit in the range is never overwritten before it has been moved
+    for (int i = 0; i < total; i++) {
+        int fd = i < count ? fds[i] : ready_fd;
+        moved[i] = fcntl(fd, F_DUPFD, LISTEN_FDS_START + total);
+        if (moved[i] == -1) {
+            return -1;
+        }
+        if (fd < LISTEN_FDS_START || fd >= LISTEN_FDS_START + total) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    // dup2 clears FD_CLOEXEC, so the fds in the range survive exec
+    for (int i = 0; i < total; i++) {
+        if (dup2(moved[i], LISTEN_FDS_START + i) == -1) {
+            return -1;
+        }
+        close(moved[i]);
+    }
+
+    char value[32];
+    snprintf(value, sizeof(value), "%i", count);
+    setenv("LISTEN_FDS", value, 1);
+    snprintf(value, sizeof(value), "%li", (long)getpid());
+    setenv("LISTEN_PID", value, 1);
+    if (ready_fd >= 0) {
+        snprintf(value, sizeof(value), "%i", LISTEN_FDS_START + count);
+        setenv("LISTEN_READY_FD", value, 1);
+    } else {
+        unsetenv("LISTEN_READY_FD");
+    }
+    return 0;
+}
+
+/*!
+ * @brief starts a new process that inherits our listening sockets
+ * @param path executable to run, typically "/proc/self/exe"
+ * @param argv NULL terminated argument list of the new process
+ * @param ready_fd set to the fd to pass to wait_handover
+ * @return Success: pid of the new process
+ * @return Failure: -1
+ */
+pid_t spawn_listen_fds(thread_logger *thl, char *path, char *const argv[],
+                       int *fds, int count, int *ready_fd) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+        LOGF_ERROR(thl, 0, "failed to create handover socketpair %s",
+                   strerror(errno));
+        return -1;
+    }
+    fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        LOGF_ERROR(thl, 0, "failed to fork %s", strerror(errno));
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(pair[0]);
+        if (export_listen_fds(fds, count, pair[1]) == 0) {
+            execv(path, argv);
+        }
+        _exit(127);
+    }
+
+    close(pair[1]);
+    *ready_fd = pair[0];
+    LOGF_INFO(thl, 0, "started process %li with %i listening sockets", (long)pid,
+              count);
+    return pid;
+}
+
+/*!
+ * @brief sends our listening sockets to a new process over a control connection
+ * @param control_fd a connection accepted on a listen_unix_socket control socket,
+ * pass it to wait_handover afterwards
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int send_handover(thread_logger *thl, int control_fd, int *fds, int count) {
+    if (count <= 0 || count > HANDOVER_MAX_FDS) {
+        LOGF_ERROR(thl, 0, "can not hand over %i listening sockets", count);
+        return -1;
+    }
+    handover_message_t msg;
+    msg.magic = HANDOVER_MAGIC;
+    msg.count = (uint32_t)count;
+    int rc = send_fds_socket(control_fd, fds, count, &msg, sizeof(msg));
+    if (rc != (int)sizeof(msg)) {
+        LOGF_ERROR(thl, 0, "failed to send listening sockets %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * @brief takes over the listening sockets of the process serving the control
+ * socket at path
+ * @param ready_fd set to the connection to pass to confirm_handover
+ * @return Success: number of fds received
+ * @return Failure: -1
+ */
+int recv_handover(thread_logger *thl, char *path, int *fds, int max, int *ready_fd) {
+    struct sockaddr_un storage;
+    addr_info control_address = new_unix_addr_info(path, false, &storage);
+    if (control_address.ai_family != AF_UNIX) {
+        LOG_ERROR(thl, 0, "invalid control socket path");
+        return -1;
+    }
+    int control_fd = get_new_socket(thl, &control_address, NULL, 0, true, true);
+    if (control_fd == -1) {
+        LOG_ERROR(thl, 0, "failed to connect to control socket");
+        return -1;
+    }
+
+    int received[HANDOVER_MAX_FDS];
+    handover_message_t msg;
+    size_t len = sizeof(msg);
+    int num_fds =
+        recv_fds_socket(control_fd, received, HANDOVER_MAX_FDS, &msg, &len);
+    if (num_fds == -1 || len != sizeof(msg) || msg.magic != HANDOVER_MAGIC ||
+        msg.count != (uint32_t)num_fds || num_fds == 0 || num_fds > max) {
+        LOG_ERROR(thl, 0, "invalid handover message");
+        for (int i = 0; i < num_fds; i++) {
+            close(received[i]);
+        }
+        close(control_fd);
+        return -1;
+    }
+
+    memcpy(fds, received, sizeof(int) * (size_t)num_fds);
+    *ready_fd = control_fd;
+    LOGF_INFO(thl, 0, "took over %i listening sockets", num_fds);
+    return num_fds;
+}
+
+/*!
+ * @brief tells the old process we are accepting, and closes ready_fd
+ * @details a ready_fd of -1 is ignored
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int confirm_handover(int ready_fd) {
+    if (ready_fd < 0) {
+        return 0;
+    }
+    char ready = 1;
+    ssize_t rc;
+    do {
+        rc = send(ready_fd, &ready, 1, MSG_NOSIGNAL);
+    } while (rc == -1 && errno == EINTR);
+    close(ready_fd);
+    return rc == 1 ? 0 : -1;
+}
+
+/*!
+ * @brief waits for the new process to confirm it is accepting, closes ready_fd
+ * @param timeout_ms how long to wait, -1 blocks
+ * @return Success: 0, the listening sockets can be closed
+ * @return Failure: -1, the new process exited or timed out, keep serving
+ */
+int wait_handover(thread_logger *thl, int ready_fd, int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = ready_fd;
+    pfd.events = POLLIN;
+    int rc;
+    do {
+        rc = poll(&pfd, 1, timeout_ms);
+    } while (rc == -1 && errno == EINTR);
+
+    char ready = 0;
+    if (rc == 1 && read(ready_fd, &ready, 1) == 1 && ready == 1) {
+        close(ready_fd);
+        LOG_INFO(thl, 0, "new process is accepting");
+        return 0;
+    }
+    close(ready_fd);
+    LOG_ERROR(thl, 0, "new process did not confirm the handover");
+    return -1;
+}
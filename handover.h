@@ -0,0 +1,109 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file handover.h
+ * @brief passes listening sockets from a running process to its replacement
+ * @details a restart never re-binds, the new process receives the very same
+ * listening sockets so the kernel keeps queueing connections the whole time.
+ * the sockets travel either as inherited fds described by LISTEN_FDS and
+ * LISTEN_PID (the systemd socket activation convention) or over a unix domain
+ * control socket with SCM_RIGHTS. in both cases the new process confirms once it
+ * is accepting, and only then does the old process stop accepting and drain
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include "sockets.h"
+#include <sys/types.h>
+
+/*!
+ * @brief first inherited listening fd, as with systemd socket activation
+ */
+#define LISTEN_FDS_START 3
+
+/*!
+ * @brief the most listening sockets handed over at once
+ */
+#define HANDOVER_MAX_FDS SOCKET_MAX_FDS
+
+/*!
+ * @brief how long the old process waits for its replacement to confirm
+ */
+#ifndef HANDOVER_TIMEOUT_MS
+#define HANDOVER_TIMEOUT_MS 10000
+#endif
+
+/*!
+ * @brief picks up listening sockets passed down with LISTEN_FDS
+ * @details the environment variables are removed and the fds are marked
+ * FD_CLOEXEC, so they are not passed on by accident
+ * @param ready_fd set to the fd confirm_handover writes to, or -1 if the parent
+ * did not ask for confirmation
+ * @return Success: number of inherited fds, 0 if none were passed to us
+ * @return Failure: -1
+ */
+int inherit_listen_fds(thread_logger *thl, int *fds, int max, int *ready_fd);
+
+/*!
+ * @brief moves fds into place and describes them with LISTEN_FDS
+ * @details only call this in a freshly forked child right before exec
+ * @param ready_fd passed after the listening sockets, -1 for none
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int export_listen_fds(int *fds, int count, int ready_fd);
+
+/*!
+ * @brief starts a new process that inherits our listening sockets
+ * @param path executable to run, typically "/proc/self/exe"
+ * @param argv NULL terminated argument list of the new process
+ * @param ready_fd set to the fd to pass to wait_handover
+ * @return Success: pid of the new process
+ * @return Failure: -1
+ */
+pid_t spawn_listen_fds(thread_logger *thl, char *path, char *const argv[],
+                       int *fds, int count, int *ready_fd);
+
+/*!
+ * @brief sends our listening sockets to a new process over a control connection
+ * @param control_fd a connection accepted on a listen_unix_socket control socket,
+ * pass it to wait_handover afterwards
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int send_handover(thread_logger *thl, int control_fd, int *fds, int count);
+
+/*!
+ * @brief takes over the listening sockets of the process serving the control
+ * socket at path
+ * @param ready_fd set to the connection to pass to confirm_handover
+ * @return Success: number of fds received
+ * @return Failure: -1
+ */
+int recv_handover(thread_logger *thl, char *path, int *fds, int max, int *ready_fd);
+
+/*!
+ * @brief tells the old process we are accepting, and closes ready_fd
+ * @details a ready_fd of -1 is ignored
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int confirm_handover(int ready_fd);
+
+/*!
+ * @brief waits for the new process to confirm it is accepting, closes ready_fd
+ * @param timeout_ms how long to wait, -1 blocks
+ * @return Success: 0, the listening sockets can be closed
+ * @return Failure: -1, the new process exited or timed out, keep serving
+ */
+int wait_handover(thread_logger *thl, int ready_fd, int timeout_ms);
@@ -0,0 +1,244 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "iov_queue.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*!
+ * @brief doubles the ring, unwrapping it so head is at index 0
+ */
+static int grow_iov_queue_t(iov_queue_t *queue) {
+    size_t capacity = queue->capacity * 2;
+    iov_segment_t *segments = calloc(capacity, sizeof(iov_segment_t));
+    if (segments == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < queue->count; i++) {
+        segments[i] = queue->segments[(queue->head + i) % queue->capacity];
+    }
+    free(queue->segments);
+    queue->segments = segments;
+    queue->capacity = capacity;
+    queue->head = 0;
+    return 0;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new iov_queue_t object
+ * @param capacity initial number of segments, the queue grows as needed
+ * @return Success: pointer to instance of iov_queue_t
+ * @return Failure: NULL ptr
+ */
+iov_queue_t *new_iov_queue_t(size_t capacity) {
+    if (capacity == 0) {
+        capacity = IOV_QUEUE_BATCH;
+    }
+    iov_queue_t *queue = calloc(1, sizeof(iov_queue_t));
+    if (queue == NULL) {
+        return NULL;
+    }
+    queue->segments = calloc(capacity, sizeof(iov_segment_t));
+    if (queue->segments == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->capacity = capacity;
+    return queue;
+}
+
+/*!
+ * @brief queues a segment by reference
+ * @warning data must stay valid until release is called
+ * @param release optional callback invoked once the segment is fully written
+ * @param release_arg argument passed to release
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int push_iov_queue_t(iov_queue_t *queue, void *data, size_t len,
+                     iov_release_fn release, void *release_arg) {
+    if (queue->count == queue->capacity) {
+        if (grow_iov_queue_t(queue) == -1) {
+            return -1;
+        }
+    }
+    iov_segment_t *seg =
+        &queue->segments[(queue->head + queue->count) % queue->capacity];
+    seg->iov.iov_base = data;
+    seg->iov.iov_len = len;
+    seg->release = release;
+    seg->release_arg = release_arg;
+    queue->count += 1;
+    queue->pending += len;
+    if (queue->account != NULL) {
+        charge_mem_account_t(queue->account, len);
+    }
+    return 0;
+}
+
+/*!
+ * @brief copies up to max_iovs pending iovecs into iovs without consuming them
+ * @return number of iovecs written into iovs
+ */
+int fill_iov_queue_t(iov_queue_t *queue, struct iovec *iovs, int max_iovs) {
+    int num = 0;
+    for (size_t i = 0; i < queue->count && num < max_iovs; i++) {
+        iovs[num] = queue->segments[(queue->head + i) % queue->capacity].iov;
+        num += 1;
+    }
+    return num;
+}
+
+/*!
+ * @brief marks bytes as sent, releasing any segments that are now complete
+ * @details flush_iov_queue_t calls this itself, it is exposed for callers that
+ * hand the iovecs from fill_iov_queue_t to their own syscall
+ */
+void consume_iov_queue_t(iov_queue_t *queue, size_t bytes) {
+    queue->pending -= bytes;
+    if (queue->account != NULL) {
+        credit_mem_account_t(queue->account, bytes);
+    }
+    while (queue->count > 0) {
+        iov_segment_t *seg = &queue->segments[queue->head];
+        if (bytes < seg->iov.iov_len) {
+            // partial write, resume from the first unsent byte next time
+            seg->iov.iov_base = (char *)seg->iov.iov_base + bytes;
+            seg->iov.iov_len -= bytes;
+            return;
+        }
+        bytes -= seg->iov.iov_len;
+        if (seg->release != NULL) {
+            seg->release(seg->release_arg);
+        }
+        memset(seg, 0, sizeof(iov_segment_t));
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count -= 1;
+    }
+}
+
+/*!
+ * @brief writes as much of the queue as the fd will accept
+ * @details keeps submitting batches until the queue is empty, the kernel takes
+ * less than it was offered, or the fd would block
+ * @return Success: number of bytes written, 0 if the fd would block
+ * @return Failure: -1 with errno set
+ */
+ssize_t flush_iov_queue_t(iov_queue_t *queue, int fd) {
+    return flush_max_iov_queue_t(queue, fd, SIZE_MAX);
+}
+
+/*!
+ * @brief writes at most max_bytes of the queue
+ * @details like flush_iov_queue_t but stops once max_bytes have been written, for
+ * callers that share a thread fairly between many queues
+ * @return Success: number of bytes written, 0 if the fd would block
+ * @return Failure: -1 with errno set
+ */
+ssize_t flush_max_iov_queue_t(iov_queue_t *queue, int fd, size_t max_bytes) {
+    ssize_t total = 0;
+    bool is_socket = true;
+    while (queue->count > 0 && (size_t)total < max_bytes) {
+        struct iovec iovs[IOV_QUEUE_BATCH];
+        int num_iovs = fill_iov_queue_t(queue, iovs, IOV_QUEUE_BATCH);
+        size_t offered = 0;
+        size_t allowed = max_bytes - (size_t)total;
+        for (int i = 0; i < num_iovs; i++) {
+            if (iovs[i].iov_len >= allowed - offered) {
+                // trim the batch to what is left of the limit
+                iovs[i].iov_len = allowed - offered;
+                num_iovs = i + 1;
+            }
+            offered += iovs[i].iov_len;
+        }
+
+        ssize_t n;
+        queue->syscalls += 1;
+        if (is_socket) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iovs;
+            msg.msg_iovlen = (size_t)num_iovs;
+            // MSG_NOSIGNAL so a peer that went away is an EPIPE, not a SIGPIPE
+            n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (n == -1 && errno == ENOTSOCK) {
+                is_socket = false;
+                continue;
+            }
+        } else {
+            n = writev(fd, iovs, num_iovs);
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+
+        consume_iov_queue_t(queue, (size_t)n);
+        total += n;
+        if ((size_t)n < offered) {
+            break;
+        }
+    }
+    return total;
+}
+
+/*!
+ * @brief returns the number of unsent bytes
+ */
+size_t pending_iov_queue_t(iov_queue_t *queue) {
+    return queue->pending;
+}
+
+/*!
+ * @brief free up all resources allocated for the iov_queue_t struct
+ * @note release is called for every segment still queued
+ */
+void free_iov_queue_t(iov_queue_t *queue) {
+    for (size_t i = 0; i < queue->count; i++) {
+        iov_segment_t *seg = &queue->segments[(queue->head + i) % queue->capacity];
+        if (seg->release != NULL) {
+            seg->release(seg->release_arg);
+        }
+    }
+    if (queue->account != NULL) {
+        credit_mem_account_t(queue->account, queue->pending);
+    }
+    free(queue->segments);
+    free(queue);
+}
+
+/*!
+ * @brief reads into a header slab and a body buffer with a single readv
+ * @details lets framing protocols receive a fixed size header and the start of
+ * the payload without reading the header into a scratch buffer first
+ * @return the result of readv
+ */
+ssize_t readv_header_body(int fd, void *header, size_t header_len, void *body,
+                          size_t body_len) {
+    struct iovec iovs[2];
+    iovs[0].iov_base = header;
+    iovs[0].iov_len = header_len;
+    iovs[1].iov_base = body;
+    iovs[1].iov_len = body_len;
+    return readv(fd, iovs, 2);
+}
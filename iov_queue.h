@@ -0,0 +1,134 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file iov_queue.h
+ * @brief scatter/gather write queue with partial write resumption
+ * @details segments are queued by reference, nothing is copied. a flush submits
+ * as many segments as possible with a single sendmsg (or writev for non-socket
+ * fds), and a short write leaves the queue pointing at the first unsent byte so
+ * the next flush resumes exactly where the kernel stopped
+ */
+
+#pragma once
+
+#include "mem_budget.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*!
+ * @brief the most segments submitted to the kernel in one call
+ */
+#ifndef IOV_QUEUE_BATCH
+#define IOV_QUEUE_BATCH 64
+#endif
+
+/*! @typedef iov_release_fn
+ * @brief called once a segment has been fully written, or when the queue is freed
+ * with the segment still pending. used to return buffers to their owner
+ */
+typedef void (*iov_release_fn)(void *arg);
+
+/*!
+ * @brief a single queued segment
+ * @details iov always describes the part of the segment that is still unsent
+ */
+typedef struct iov_segment {
+    struct iovec iov;
+    iov_release_fn release;
+    void *release_arg;
+} iov_segment_t;
+
+/*!
+ * @brief a growable ring of segments waiting to be written
+ */
+typedef struct iov_queue {
+    iov_segment_t *segments;
+    size_t capacity;
+    size_t head;    /*! @brief index of the oldest segment */
+    size_t count;   /*! @brief number of queued segments */
+    size_t pending; /*! @brief number of unsent bytes across all segments */
+    mem_account_t *account; /*! @brief optional, charged with the pending bytes */
+    uint64_t syscalls; /*! @brief sendmsg / writev calls made by flush_iov_queue_t */
+} iov_queue_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new iov_queue_t object
+ * @param capacity initial number of segments, the queue grows as needed
+ * @return Success: pointer to instance of iov_queue_t
+ * @return Failure: NULL ptr
+ */
+iov_queue_t *new_iov_queue_t(size_t capacity);
+
+/*!
+ * @brief queues a segment by reference
+ * @warning data must stay valid until release is called
+ * @param release optional callback invoked once the segment is fully written
+ * @param release_arg argument passed to release
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int push_iov_queue_t(iov_queue_t *queue, void *data, size_t len,
+                     iov_release_fn release, void *release_arg);
+
+/*!
+ * @brief writes as much of the queue as the fd will accept
+ * @details keeps submitting batches until the queue is empty, the kernel takes
+ * less than it was offered, or the fd would block
+ * @return Success: number of bytes written, 0 if the fd would block
+ * @return Failure: -1 with errno set
+ */
+ssize_t flush_iov_queue_t(iov_queue_t *queue, int fd);
+
+/*!
+ * @brief writes at most max_bytes of the queue
+ * @details like flush_iov_queue_t but stops once max_bytes have been written, for
+ * callers that share a thread fairly between many queues
+ * @return Success: number of bytes written, 0 if the fd would block
+ * @return Failure: -1 with errno set
+ */
+ssize_t flush_max_iov_queue_t(iov_queue_t *queue, int fd, size_t max_bytes);
+
+/*!
+ * @brief marks bytes as sent, releasing any segments that are now complete
+ * @details flush_iov_queue_t calls this itself, it is exposed for callers that
+ * hand the iovecs from fill_iov_queue_t to their own syscall
+ */
+void consume_iov_queue_t(iov_queue_t *queue, size_t bytes);
+
+/*!
+ * @brief copies up to max_iovs pending iovecs into iovs without consuming them
+ * @return number of iovecs written into iovs
+ */
+int fill_iov_queue_t(iov_queue_t *queue, struct iovec *iovs, int max_iovs);
+
+/*!
+ * @brief returns the number of unsent bytes
+ */
+size_t pending_iov_queue_t(iov_queue_t *queue);
+
+/*!
+ * @brief free up all resources allocated for the iov_queue_t struct
+ * @note release is called for every segment still queued
+ */
+void free_iov_queue_t(iov_queue_t *queue);
+
+/*!
+ * @brief reads into a header slab and a body buffer with a single readv
+ * @details lets framing protocols receive a fixed size header and the start of
+ * the payload without reading the header into a scratch buffer first
+ * @return the result of readv
+ */
+ssize_t readv_header_body(int fd, void *header, size_t header_len, void *body,
+                          size_t body_len);
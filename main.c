@@ -2,6 +2,12 @@
 #include "deps/ulog/logger.h"
 #include "sockets.h"
 #include "fd_pool.h"
+#include "buffer_pool.h"
+#include "handover.h"
+#include "prefork.h"
+#include "reactor.h"
+#include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
 
 #define COMMAND_VERSION_STRING "v0.0.1"
@@ -10,6 +16,168 @@ struct arg_str *ip_address;
 struct arg_str *port;
 struct arg_str *mode;
 struct arg_str *proto;
+struct arg_str *control;
+struct arg_str *takeover;
+struct arg_int *workers;
+
+/*! @brief set by SIGHUP, asks the server to start its replacement */
+static volatile sig_atomic_t restart_requested = 0;
+
+static void handle_restart_signal(int sig) {
+    (void)sig;
+    restart_requested = 1;
+}
+
+/*!
+ * @brief starts a copy of this process that inherits the listening socket
+ * @return the fd to wait for the confirmation on, or -1
+ */
+static int spawn_replacement(thread_logger *thl, int argc, char *argv[], int fd) {
+    char *args[MAX_COMMAND_ARGS + 1];
+    for (int i = 0; i < argc && i < MAX_COMMAND_ARGS; i++) {
+        args[i] = argv[i];
+    }
+    args[argc < MAX_COMMAND_ARGS ? argc : MAX_COMMAND_ARGS] = NULL;
+
+    // resolve the link so the new process keeps our name
+    char path[4096];
+    ssize_t path_len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (path_len <= 0) {
+        LOGF_ERROR(thl, 0, "failed to find our executable %s", strerror(errno));
+        return -1;
+    }
+    path[path_len] = '\0';
+
+    int ready_fd = -1;
+    if (spawn_listen_fds(thl, path, args, &fd, 1, &ready_fd) == -1) {
+        return -1;
+    }
+    return ready_fd;
+}
+
+/*! @brief set by SIGINT/SIGTERM in the prefork master */
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+/*! @brief size of the buffer each connection is read into */
+#define READ_BUFFER_SIZE 1024
+
+/*!
+ * @brief accepts a connection on fd and logs the message it sends
+ * @details the read buffer comes from the pool so serving a connection does not
+ * malloc. errors only concern the one connection, a client resetting it must
+ * not take the server down, so they are logged and the server keeps going
+ */
+static void serve_connection(thread_logger *thl, buffer_pool_t *buffers, int fd) {
+    int new_fd = accept_socket(thl, fd);
+    if (new_fd == -1) {
+        return;
+    }
+    char *buffer = get_buffer_pool_t(buffers, READ_BUFFER_SIZE);
+    if (buffer == NULL) {
+        LOG_ERROR(thl, 0, "failed to get a read buffer");
+        close(new_fd);
+        return;
+    }
+    // leave room for a terminator so the message can be logged
+    int rc = read(new_fd, buffer, READ_BUFFER_SIZE - 1);
+    if (rc == -1) {
+        LOGF_ERROR(thl, 0, "read error encountered %s", strerror(errno));
+    } else if (rc > 0) {
+        buffer[rc] = '\0';
+        LOGF_INFO(thl, 0, "received message %s", buffer);
+    }
+    put_buffer_pool_t(buffer);
+    close(new_fd);
+}
+
+/*!
+ * @brief state shared by the callbacks of a prefork worker
+ */
+typedef struct worker_state {
+    thread_logger *thl;
+    buffer_pool_t *buffers;
+} worker_state_t;
+
+/*!
+ * @brief reactor read callback for the worker's listening socket
+ */
+static int worker_accept(reactor_t *reactor, int fd, void *arg) {
+    (void)reactor;
+    worker_state_t *state = arg;
+    serve_connection(state->thl, state->buffers, fd);
+    return 0;
+}
+
+/*!
+ * @brief body of a prefork worker, listens with its own REUSEPORT socket and
+ * reactor_t
+ */
+static void socket_server_worker(prefork_t *prefork, size_t worker_id, void *arg) {
+    (void)prefork;
+    bool tcp = *(bool *)arg;
+    thread_logger *thl = new_thread_logger(true);
+    if (thl == NULL) {
+        _exit(1);
+    }
+
+    SOCKET_OPTS opts[] = {REUSEADDR, REUSEPORT, BLOCK};
+    int fd = listen_socket(thl, (char *)*ip_address->sval, (char *)*port->sval, tcp,
+                           true, opts, 3);
+    if (fd == -1) {
+        LOG_ERROR(thl, 0, "failed to get a socket to listen on");
+        // a non zero exit gets the worker restarted
+        _exit(1);
+    }
+    LOGF_INFO(thl, 0, "worker %zu using socket %i", worker_id, fd);
+
+    worker_state_t state = {.thl = thl, .buffers = new_buffer_pool_t(false)};
+    reactor_t *reactor = new_reactor_t(thl);
+    if (reactor == NULL || state.buffers == NULL ||
+        add_fd_reactor_t(reactor, fd, worker_accept, NULL, NULL, &state) == -1) {
+        LOG_ERROR(thl, 0, "failed to set up worker");
+        _exit(1);
+    }
+    run_reactor_t(reactor);
+
+    close(fd);
+    free_reactor_t(reactor);
+    free_buffer_pool_t(state.buffers);
+    clear_thread_logger(thl);
+}
+
+/*!
+ * @brief runs the server as num_workers supervised processes until SIGINT or
+ * SIGTERM
+ */
+static void run_prefork(thread_logger *thl, bool tcp, size_t num_workers) {
+    // no SA_RESTART, the signal has to interrupt waitpid in the supervisor
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    prefork_t *prefork = new_prefork_t(thl, num_workers, socket_server_worker, &tcp);
+    if (prefork == NULL) {
+        LOG_ERROR(thl, 0, "failed to create prefork master");
+        return;
+    }
+    if (start_prefork_t(prefork) == 0) {
+        supervise_prefork_t(prefork, &stop_requested);
+    }
+    stop_prefork_t(prefork);
+    for (size_t i = 0; i < prefork->num_workers; i++) {
+        LOGF_INFO(thl, 0, "worker %zu was restarted %lu times", i,
+                  (unsigned long)prefork->restarts[i]);
+    }
+    free_prefork_t(prefork);
+}
 
 void socket_server_callback(int argc, char *argv[]) {
     thread_logger *thl = new_thread_logger(true);
@@ -27,39 +195,125 @@ void socket_server_callback(int argc, char *argv[]) {
         LOG_INFO(thl, 0, "using udp");
     }
 
-    int fd = listen_socket(thl, (char *)*ip_address->sval, (char *)*port->sval, tcp, true, default_sock_opts, default_socket_opts_count);
-    if (fd == -1) {
-        LOG_ERROR(thl, 0, "failed to get a socket to listen on");
+    if (workers->count > 0) {
+        if (*workers->ival < 1) {
+            LOG_ERROR(thl, 0, "workers must be at least 1");
+            free_fd_pool_t(fpool);
+            clear_thread_logger(thl);
+            return;
+        }
+        free_fd_pool_t(fpool);
+        run_prefork(thl, tcp, (size_t)*workers->ival);
+        clear_thread_logger(thl);
         return;
     }
 
+    // a restarted server reuses the listening socket of the process it replaces
+    // instead of binding again, so no connection is refused in between
+    int fd = -1;
+    int ready_fd = -1;
+    int inherited = inherit_listen_fds(thl, &fd, 1, &ready_fd);
+    if (inherited == 0 && takeover->count > 0) {
+        inherited = recv_handover(thl, (char *)*takeover->sval, &fd, 1, &ready_fd);
+    }
+    if (inherited == 0) {
+        fd = listen_socket(thl, (char *)*ip_address->sval, (char *)*port->sval, tcp,
+                           true, default_sock_opts, default_socket_opts_count);
+    }
+    int control_fd = -1;
+    buffer_pool_t *buffers = NULL;
+    if (inherited == -1 || fd == -1) {
+        LOG_ERROR(thl, 0, "failed to get a socket to listen on");
+        goto EXIT;
+    }
+
     LOGF_INFO(thl, 0, "using socket %i", fd);
     set_fd_pool_t(fpool, fd, tcp);
-    
+    // we are accepting from here on, the old process can stop
+    confirm_handover(ready_fd);
+
+    if (control->count > 0) {
+        control_fd =
+            listen_unix_socket(thl, (char *)*control->sval, false,
+                               default_sock_opts, default_socket_opts_count);
+        if (control_fd == -1) {
+            LOG_ERROR(thl, 0, "failed to listen on control socket");
+        } else {
+            // a replacement started by SIGHUP binds the path itself, it must not
+            // inherit ours
+            fcntl(control_fd, F_SETFD, FD_CLOEXEC);
+            set_fd_pool_t(fpool, control_fd, tcp);
+        }
+    }
+    signal(SIGHUP, handle_restart_signal);
+    buffers = new_buffer_pool_t(false);
+    if (buffers == NULL) {
+        LOG_ERROR(thl, 0, "failed to create buffer pool");
+        goto EXIT;
+    }
+
+    // the connection to a replacement that has our listening socket but has not
+    // confirmed it is accepting yet
+    int handover_fd = -1;
     for (;;) {
+        if (restart_requested) {
+            restart_requested = 0;
+            if (handover_fd == -1) {
+                handover_fd = spawn_replacement(thl, argc, argv, fd);
+                if (handover_fd != -1) {
+                    set_fd_pool_t(fpool, handover_fd, tcp);
+                }
+            }
+        }
+
         fd_set check_set;
         int num_active = get_active_fd_pool_t(fpool, &check_set, tcp, true);
         if (num_active <= 0) {
-            sleep(0.01);
             continue;
         }
-        int new_fd = accept_socket(thl, fd);
-        char buffer[1024];
-        int rc = read(new_fd, buffer, 1024);
-        if (rc == -1) {
-            LOGF_ERROR(thl, 0, "read error encountered %s", strerror(errno));
-            close(new_fd);
-            break;
+
+        if (control_fd != -1 && FD_ISSET(control_fd, &check_set)) {
+            int conn = accept_socket(thl, control_fd);
+            if (conn != -1 && handover_fd == -1 &&
+                send_handover(thl, conn, &fd, 1) == 0) {
+                handover_fd = conn;
+                set_fd_pool_t(fpool, handover_fd, tcp);
+            } else if (conn != -1) {
+                close(conn);
+            }
         }
-        if (rc == 0) {
-            sleep(0.01);
+
+        if (handover_fd != -1 && FD_ISSET(handover_fd, &check_set)) {
+            clear_fd_pool_t(fpool, handover_fd, tcp);
+            int rc = wait_handover(thl, handover_fd, 0);
+            handover_fd = -1;
+            if (rc == 0) {
+                // connections are served one at a time so nothing is in flight,
+                // anything still queued is accepted by the new process
+                LOG_INFO(thl, 0, "handed over listening socket, exiting");
+                break;
+            }
+        }
+
+        if (!FD_ISSET(fd, &check_set)) {
             continue;
         }
-        LOGF_INFO(thl, 0, "received message %s", buffer);
-        close(new_fd);
+        serve_connection(thl, buffers, fd);
     }
 
-    close(fd);
+EXIT:
+    if (buffers != NULL) {
+        free_buffer_pool_t(buffers);
+    }
+    if (control_fd != -1) {
+        // the path now belongs to the new process, so it is not unlinked
+        close(control_fd);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free_fd_pool_t(fpool);
+    clear_thread_logger(thl);
 }
 
 command_handler *new_socket_server_command() {
@@ -80,11 +334,23 @@ int main(int argc, char *argv[]) {
     port = arg_strn(NULL, "port", "<port>", 1, 1, "port of host");
     mode = arg_strn(NULL, "mode", "<mode>", 1, 1, "must be 'server' or 'client'");
     proto = arg_strn(NULL, "proto", "<proto>", 1, 1, "network protocol (tcp, udp)");
+    control = arg_strn(NULL, "control", "<path>", 0, 1,
+                       "unix socket a replacement process can take the listening "
+                       "socket from");
+    takeover = arg_strn(NULL, "takeover", "<path>", 0, 1,
+                        "take the listening socket from the server at this control "
+                        "socket");
+    workers = arg_intn(NULL, "workers", "<n>", 0, 1,
+                       "run n worker processes, each with its own SO_REUSEPORT "
+                       "listener");
     // declare artable
     void *argtable[] = {ip_address,
                         port,
                         mode,
                         proto,
+                        control,
+                        takeover,
+                        workers,
                         help,
                         version,
                         file,
@@ -0,0 +1,310 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mem_budget.h"
+#include "fd_pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+static inline bool over_limit(size_t used, size_t limit) {
+    return limit != 0 && used > limit;
+}
+
+static inline bool under_resume(size_t used, size_t limit) {
+    return limit == 0 || used <= limit / 100 * MEM_BUDGET_RESUME_PERCENT;
+}
+
+/*!
+ * @brief removes read interest for an account
+ * @param global whether the global cap is one of the reasons
+ * @note budget->mutex must be held
+ */
+static void pause_account(mem_budget_t *budget, mem_account_t *account,
+                          bool global) {
+    if (account->paused) {
+        account->global = account->global || global;
+        return;
+    }
+    account->paused = true;
+    account->global = global;
+    account->prev = NULL;
+    account->next = budget->paused;
+    if (budget->paused != NULL) {
+        budget->paused->prev = account;
+    }
+    budget->paused = account;
+    budget->num_paused += 1;
+    atomic_fetch_add_explicit(&budget->pauses, 1, memory_order_relaxed);
+    if (budget->read_pool != NULL) {
+        clear_fd_pool_t(budget->read_pool, account->fd, budget->tcp);
+    }
+}
+
+/*!
+ * @brief restores read interest for an account
+ * @note budget->mutex must be held
+ */
+static void resume_account(mem_budget_t *budget, mem_account_t *account) {
+    if (account->paused == false) {
+        return;
+    }
+    account->paused = false;
+    account->global = false;
+    if (account->prev != NULL) {
+        account->prev->next = account->next;
+    } else {
+        budget->paused = account->next;
+    }
+    if (account->next != NULL) {
+        account->next->prev = account->prev;
+    }
+    account->prev = NULL;
+    account->next = NULL;
+    budget->num_paused -= 1;
+    if (budget->read_pool != NULL) {
+        set_fd_pool_t(budget->read_pool, account->fd, budget->tcp);
+    }
+}
+
+/*!
+ * @brief whether a paused account is under every cap that paused it
+ * @note budget->mutex must be held
+ */
+static bool can_resume(mem_budget_t *budget, mem_account_t *account,
+                       bool global_ok) {
+    size_t mine = atomic_load_explicit(&account->used, memory_order_relaxed);
+    return under_resume(mine, budget->conn_limit) &&
+           (account->global == false || global_ok);
+}
+
+/*!
+ * @brief pauses or resumes the listeners to match the global usage
+ * @note budget->mutex must be held
+ */
+static void update_listeners(mem_budget_t *budget, size_t used) {
+    bool pause = over_limit(used, budget->limit);
+    bool resume = under_resume(used, budget->limit);
+    if (pause && budget->accept_paused == false) {
+        budget->accept_paused = true;
+        for (size_t i = 0; budget->read_pool != NULL && i < budget->num_listeners;
+             i++) {
+            clear_fd_pool_t(budget->read_pool, budget->listeners[i], budget->tcp);
+        }
+    } else if (resume && budget->accept_paused) {
+        budget->accept_paused = false;
+        for (size_t i = 0; budget->read_pool != NULL && i < budget->num_listeners;
+             i++) {
+            set_fd_pool_t(budget->read_pool, budget->listeners[i], budget->tcp);
+        }
+    }
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new mem_budget_t object
+ * @param read_pool optional, connections and listeners are paused by clearing
+ * them from this pool and resumed by setting them again
+ * @return Success: pointer to instance of mem_budget_t
+ * @return Failure: NULL ptr
+ */
+mem_budget_t *new_mem_budget_t(size_t limit, size_t conn_limit, fd_pool_t *read_pool,
+                               bool tcp) {
+    mem_budget_t *budget = calloc(1, sizeof(mem_budget_t));
+    if (budget == NULL) {
+        return NULL;
+    }
+    budget->limit = limit;
+    budget->conn_limit = conn_limit;
+    budget->read_pool = read_pool;
+    budget->tcp = tcp;
+    pthread_mutex_init(&budget->mutex, NULL);
+    return budget;
+}
+
+/*!
+ * @brief registers a listening socket to pause while the global cap is exceeded
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int watch_listener_mem_budget_t(mem_budget_t *budget, int listen_fd) {
+    pthread_mutex_lock(&budget->mutex);
+    if (budget->num_listeners == MEM_BUDGET_MAX_LISTENERS) {
+        pthread_mutex_unlock(&budget->mutex);
+        return -1;
+    }
+    budget->listeners[budget->num_listeners++] = listen_fd;
+    if (budget->accept_paused && budget->read_pool != NULL) {
+        clear_fd_pool_t(budget->read_pool, listen_fd, budget->tcp);
+    }
+    pthread_mutex_unlock(&budget->mutex);
+    return 0;
+}
+
+/*!
+ * @brief checks whether a new connection may be accepted
+ * @return false, counting a refusal, while the global cap is exceeded
+ */
+bool admit_mem_budget_t(mem_budget_t *budget) {
+    size_t used = atomic_load_explicit(&budget->used, memory_order_relaxed);
+    if (over_limit(used, budget->limit)) {
+        atomic_fetch_add_explicit(&budget->refused, 1, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * @brief takes a snapshot of the budget's gauges
+ */
+void gauges_mem_budget_t(mem_budget_t *budget, mem_budget_gauges_t *gauges) {
+    memset(gauges, 0, sizeof(mem_budget_gauges_t));
+    gauges->used = atomic_load(&budget->used);
+    gauges->peak = atomic_load(&budget->peak);
+    gauges->limit = budget->limit;
+    gauges->conn_limit = budget->conn_limit;
+    gauges->pauses = atomic_load(&budget->pauses);
+    gauges->refused = atomic_load(&budget->refused);
+    pthread_mutex_lock(&budget->mutex);
+    gauges->paused_connections = budget->num_paused;
+    gauges->accept_paused = budget->accept_paused;
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+/*!
+ * @brief free up all resources allocated for the mem_budget_t struct
+ * @note every account must be freed first
+ */
+void free_mem_budget_t(mem_budget_t *budget) {
+    pthread_mutex_destroy(&budget->mutex);
+    free(budget);
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new mem_account_t object
+ * @param fd the connection paused when the account goes over budget
+ * @return Success: pointer to instance of mem_account_t
+ * @return Failure: NULL ptr
+ */
+mem_account_t *new_mem_account_t(mem_budget_t *budget, int fd) {
+    mem_account_t *account = calloc(1, sizeof(mem_account_t));
+    if (account == NULL) {
+        return NULL;
+    }
+    account->budget = budget;
+    account->fd = fd;
+    return account;
+}
+
+/*!
+ * @brief records bytes the connection now holds
+ * @details the memory is already in use so the charge always goes through, but
+ * the connection is paused if it takes its account or the budget over a cap
+ * @return false if the connection is paused
+ */
+bool charge_mem_account_t(mem_account_t *account, size_t bytes) {
+    mem_budget_t *budget = account->budget;
+    size_t mine =
+        atomic_fetch_add_explicit(&account->used, bytes, memory_order_relaxed) +
+        bytes;
+    size_t used =
+        atomic_fetch_add_explicit(&budget->used, bytes, memory_order_relaxed) +
+        bytes;
+
+    size_t peak = atomic_load_explicit(&budget->peak, memory_order_relaxed);
+    while (used > peak && !atomic_compare_exchange_weak_explicit(
+                              &budget->peak, &peak, used, memory_order_relaxed,
+                              memory_order_relaxed)) {
+    }
+
+    bool over_conn = over_limit(mine, budget->conn_limit);
+    bool over_global = over_limit(used, budget->limit);
+    if (over_conn == false && over_global == false && account->paused == false) {
+        // the common case takes no lock
+        return true;
+    }
+    pthread_mutex_lock(&budget->mutex);
+    if (over_conn || over_global) {
+        pause_account(budget, account, over_global);
+    }
+    update_listeners(budget, used);
+    bool paused = account->paused;
+    pthread_mutex_unlock(&budget->mutex);
+    return paused == false;
+}
+
+/*!
+ * @brief records bytes the connection no longer holds, resuming reads once
+ * usage is low enough
+ */
+void credit_mem_account_t(mem_account_t *account, size_t bytes) {
+    mem_budget_t *budget = account->budget;
+    size_t mine =
+        atomic_fetch_sub_explicit(&account->used, bytes, memory_order_relaxed) -
+        bytes;
+    size_t used =
+        atomic_fetch_sub_explicit(&budget->used, bytes, memory_order_relaxed) -
+        bytes;
+    if (budget->num_paused == 0 && budget->accept_paused == false) {
+        return;
+    }
+    // a connection paused for its own cap resumes on its own usage, only the
+    // globally paused ones and the listeners wait for the global usage
+    bool global_ok = under_resume(used, budget->limit);
+    if (global_ok == false && (account->paused == false ||
+                               under_resume(mine, budget->conn_limit) == false)) {
+        return;
+    }
+
+    pthread_mutex_lock(&budget->mutex);
+    update_listeners(budget, used);
+    if (account->paused && can_resume(budget, account, global_ok)) {
+        resume_account(budget, account);
+    }
+    if (global_ok) {
+        // connections paused by the global cap can go again too
+        mem_account_t *next;
+        for (mem_account_t *paused = budget->paused; paused != NULL; paused = next) {
+            next = paused->next;
+            if (can_resume(budget, paused, global_ok)) {
+                resume_account(budget, paused);
+            }
+        }
+    }
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+/*!
+ * @brief whether reads on the connection are paused
+ */
+bool paused_mem_account_t(mem_account_t *account) {
+    pthread_mutex_lock(&account->budget->mutex);
+    bool paused = account->paused;
+    pthread_mutex_unlock(&account->budget->mutex);
+    return paused;
+}
+
+/*!
+ * @brief credits whatever is still charged and frees the mem_account_t
+ */
+void free_mem_account_t(mem_account_t *account) {
+    mem_budget_t *budget = account->budget;
+    pthread_mutex_lock(&budget->mutex);
+    if (account->paused) {
+        // the connection is going away, do not put it back in the pool
+        fd_pool_t *read_pool = budget->read_pool;
+        budget->read_pool = NULL;
+        resume_account(budget, account);
+        budget->read_pool = read_pool;
+    }
+    pthread_mutex_unlock(&budget->mutex);
+    credit_mem_account_t(account, atomic_load(&account->used));
+    free(account);
+}
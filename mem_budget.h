@@ -0,0 +1,161 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file mem_budget.h
+ * @brief memory accounting with per-connection and process wide caps
+ * @details every connection charges the memory its buffers and queues hold to
+ * a mem_account_t, which rolls up into a shared mem_budget_t. a connection that
+ * goes over its own cap, or charges while the process is over the global cap,
+ * has its read interest removed from the fd_pool_t so it stops producing work.
+ * while the global cap is exceeded the listening sockets are removed too, so
+ * no new connections are accepted. everything is resumed once usage falls back
+ * under MEM_BUDGET_RESUME_PERCENT of the caps that paused it, a connection
+ * paused only for its own cap resumes once it has drained whatever the global
+ * usage
+ */
+
+#pragma once
+
+#include "fd_pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+ * @brief usage, as a percentage of a cap, below which paused reads resume
+ */
+#ifndef MEM_BUDGET_RESUME_PERCENT
+#define MEM_BUDGET_RESUME_PERCENT 75
+#endif
+
+/*! @brief the most listening sockets a budget pauses */
+#define MEM_BUDGET_MAX_LISTENERS 8
+
+struct mem_account;
+
+/*! @typedef mem_budget
+ * @struct mem_budget
+ * @brief the process wide budget shared by every connection's account
+ */
+typedef struct mem_budget {
+    size_t limit;      /*! @brief global cap in bytes, 0 for none */
+    size_t conn_limit; /*! @brief per-connection cap in bytes, 0 for none */
+    fd_pool_t *read_pool; /*! @brief optional, where read interest is paused */
+    bool tcp;
+    _Atomic size_t used;
+    _Atomic size_t peak;
+    _Atomic uint64_t pauses;  /*! @brief times a connection was paused */
+    _Atomic uint64_t refused; /*! @brief connections refused by admit_mem_budget_t */
+    pthread_mutex_t mutex;    /*! @brief guards the fields below */
+    struct mem_account *paused; /*! @brief paused accounts */
+    _Atomic size_t num_paused;
+    int listeners[MEM_BUDGET_MAX_LISTENERS];
+    size_t num_listeners;
+    _Atomic bool accept_paused;
+} mem_budget_t;
+
+/*! @typedef mem_account
+ * @struct mem_account
+ * @brief the memory charged by a single connection
+ */
+typedef struct mem_account {
+    mem_budget_t *budget;
+    int fd;
+    _Atomic size_t used;
+    _Atomic bool paused; /*! @brief changed under budget->mutex */
+    bool global; /*! @brief paused at least partly by the global cap, under
+                    budget->mutex */
+    struct mem_account *prev;
+    struct mem_account *next;
+} mem_account_t;
+
+/*!
+ * @brief a snapshot of a budget's gauges
+ */
+typedef struct mem_budget_gauges {
+    size_t used;
+    size_t peak;
+    size_t limit;
+    size_t conn_limit;
+    size_t paused_connections;
+    bool accept_paused;
+    uint64_t pauses;
+    uint64_t refused;
+} mem_budget_gauges_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new mem_budget_t object
+ * @param read_pool optional, connections and listeners are paused by clearing
+ * them from this pool and resumed by setting them again
+ * @return Success: pointer to instance of mem_budget_t
+ * @return Failure: NULL ptr
+ */
+mem_budget_t *new_mem_budget_t(size_t limit, size_t conn_limit, fd_pool_t *read_pool,
+                               bool tcp);
+
+/*!
+ * @brief registers a listening socket to pause while the global cap is exceeded
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int watch_listener_mem_budget_t(mem_budget_t *budget, int listen_fd);
+
+/*!
+ * @brief checks whether a new connection may be accepted
+ * @return false, counting a refusal, while the global cap is exceeded
+ */
+bool admit_mem_budget_t(mem_budget_t *budget);
+
+/*!
+ * @brief takes a snapshot of the budget's gauges
+ */
+void gauges_mem_budget_t(mem_budget_t *budget, mem_budget_gauges_t *gauges);
+
+/*!
+ * @brief free up all resources allocated for the mem_budget_t struct
+ * @note every account must be freed first
+ */
+void free_mem_budget_t(mem_budget_t *budget);
+
+/*!
+ * @brief allocates memory for, and initializes a new mem_account_t object
+ * @param fd the connection paused when the account goes over budget
+ * @return Success: pointer to instance of mem_account_t
+ * @return Failure: NULL ptr
+ */
+mem_account_t *new_mem_account_t(mem_budget_t *budget, int fd);
+
+/*!
+ * @brief records bytes the connection now holds
+ * @details the memory is already in use so the charge always goes through, but
+ * the connection is paused if it takes its account or the budget over a cap
+ * @return false if the connection is paused
+ */
+bool charge_mem_account_t(mem_account_t *account, size_t bytes);
+
+/*!
+ * @brief records bytes the connection no longer holds, resuming reads once
+ * usage is low enough
+ */
+void credit_mem_account_t(mem_account_t *account, size_t bytes);
+
+/*!
+ * @brief whether reads on the connection are paused
+ */
+bool paused_mem_account_t(mem_account_t *account);
+
+/*!
+ * @brief credits whatever is still charged and frees the mem_account_t
+ */
+void free_mem_account_t(mem_account_t *account);
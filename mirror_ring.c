@@ -0,0 +1,161 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "mirror_ring.h"
+#include "deps/ulog/logger.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*!
+ * @brief allocates memory for, and initializes a new mirror_ring_t object
+ * @param capacity rounded up to a multiple of the page size
+ * @return Success: pointer to instance of mirror_ring_t
+ * @return Failure: NULL ptr
+ */
+mirror_ring_t *new_mirror_ring_t(thread_logger *thl, size_t capacity) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if (capacity == 0) {
+        capacity = page_size;
+    }
+    capacity = (capacity + page_size - 1) / page_size * page_size;
+
+    mirror_ring_t *ring = calloc(1, sizeof(mirror_ring_t));
+    if (ring == NULL) {
+        LOG_ERROR(thl, 0, "failed to calloc mirror_ring_t");
+        return NULL;
+    }
+
+    int fd = memfd_create("cnet-mirror", MFD_CLOEXEC);
+    if (fd == -1 || ftruncate(fd, (off_t)capacity) == -1) {
+        LOGF_ERROR(thl, 0, "failed to create ring memory %s", strerror(errno));
+        goto ERROR;
+    }
+
+    // reserve room for both copies first so nothing else can land in between
+    char *base =
+        mmap(NULL, capacity * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        LOGF_ERROR(thl, 0, "failed to reserve ring address space %s",
+                   strerror(errno));
+        goto ERROR;
+    }
+    for (int i = 0; i < 2; i++) {
+        void *half = mmap(base + capacity * (size_t)i, capacity,
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+        if (half == MAP_FAILED) {
+            LOGF_ERROR(thl, 0, "failed to map ring %s", strerror(errno));
+            munmap(base, capacity * 2);
+            goto ERROR;
+        }
+    }
+    // the mappings keep the memory alive
+    close(fd);
+
+    ring->base = base;
+    ring->capacity = capacity;
+    return ring;
+
+ERROR:
+    if (fd != -1) {
+        close(fd);
+    }
+    free(ring);
+    return NULL;
+}
+
+/*!
+ * @brief the contiguous span of bytes waiting to be consumed
+ * @param len set to the number of readable bytes
+ */
+char *read_span_mirror_ring_t(mirror_ring_t *ring, size_t *len) {
+    *len = (size_t)(ring->tail - ring->head);
+    return ring->base + (ring->head % ring->capacity);
+}
+
+/*!
+ * @brief the contiguous span of free space
+ * @param len set to the number of writable bytes
+ */
+char *write_span_mirror_ring_t(mirror_ring_t *ring, size_t *len) {
+    *len = ring->capacity - (size_t)(ring->tail - ring->head);
+    return ring->base + (ring->tail % ring->capacity);
+}
+
+/*!
+ * @brief marks len bytes of the read span as consumed
+ */
+void consume_mirror_ring_t(mirror_ring_t *ring, size_t len) {
+    ring->head += len;
+}
+
+/*!
+ * @brief marks len bytes of the write span as filled
+ */
+void produce_mirror_ring_t(mirror_ring_t *ring, size_t len) {
+    ring->tail += len;
+}
+
+/*!
+ * @brief reads from fd straight into the free space with a single read
+ * @return Success: bytes read, 0 on EOF
+ * @return Failure: -1 with errno from read, or ENOBUFS if the ring is full
+ */
+ssize_t fill_mirror_ring_t(mirror_ring_t *ring, int fd) {
+    size_t len;
+    char *span = write_span_mirror_ring_t(ring, &len);
+    if (len == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    ssize_t rc;
+    do {
+        rc = read(fd, span, len);
+    } while (rc == -1 && errno == EINTR);
+    if (rc > 0) {
+        produce_mirror_ring_t(ring, (size_t)rc);
+    }
+    return rc;
+}
+
+/*!
+ * @brief writes the readable bytes to fd with a single write and consumes them
+ * @return Success: bytes written
+ * @return Failure: -1 with errno from write
+ */
+ssize_t drain_mirror_ring_t(mirror_ring_t *ring, int fd) {
+    size_t len;
+    char *span = read_span_mirror_ring_t(ring, &len);
+    if (len == 0) {
+        return 0;
+    }
+    ssize_t rc;
+    do {
+        rc = write(fd, span, len);
+    } while (rc == -1 && errno == EINTR);
+    if (rc > 0) {
+        consume_mirror_ring_t(ring, (size_t)rc);
+    }
+    return rc;
+}
+
+/*!
+ * @brief unmaps the ring and frees all resources of the mirror_ring_t
+ */
+void free_mirror_ring_t(mirror_ring_t *ring) {
+    munmap(ring->base, ring->capacity * 2);
+    free(ring);
+}
@@ -0,0 +1,87 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file mirror_ring.h
+ * @brief a byte ring buffer whose spans never wrap
+ * @details the ring's memfd is mapped twice, back to back, so the byte after the
+ * end of the ring is the first byte of the ring again. every readable and every
+ * writable region is therefore one contiguous span: a socket read lands in the
+ * ring with a single read(2), and a parser can look at a message that straddles
+ * the end of the ring without copying it out first
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*! @typedef mirror_ring
+ * @struct mirror_ring
+ * @brief a mirrored ring buffer, head and tail are free running byte counters
+ */
+typedef struct mirror_ring {
+    char *base;      /*! @brief start of the first of the two mappings */
+    size_t capacity; /*! @brief size of the ring, a multiple of the page size */
+    uint64_t head;   /*! @brief bytes consumed */
+    uint64_t tail;   /*! @brief bytes produced */
+} mirror_ring_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new mirror_ring_t object
+ * @param capacity rounded up to a multiple of the page size
+ * @return Success: pointer to instance of mirror_ring_t
+ * @return Failure: NULL ptr
+ */
+mirror_ring_t *new_mirror_ring_t(thread_logger *thl, size_t capacity);
+
+/*!
+ * @brief the contiguous span of bytes waiting to be consumed
+ * @param len set to the number of readable bytes
+ */
+char *read_span_mirror_ring_t(mirror_ring_t *ring, size_t *len);
+
+/*!
+ * @brief the contiguous span of free space
+ * @param len set to the number of writable bytes
+ */
+char *write_span_mirror_ring_t(mirror_ring_t *ring, size_t *len);
+
+/*!
+ * @brief marks len bytes of the read span as consumed
+ */
+void consume_mirror_ring_t(mirror_ring_t *ring, size_t len);
+
+/*!
+ * @brief marks len bytes of the write span as filled
+ */
+void produce_mirror_ring_t(mirror_ring_t *ring, size_t len);
+
+/*!
+ * @brief reads from fd straight into the free space with a single read
+ * @return Success: bytes read, 0 on EOF
+ * @return Failure: -1 with errno from read, or ENOBUFS if the ring is full
+ */
+ssize_t fill_mirror_ring_t(mirror_ring_t *ring, int fd);
+
+/*!
+ * @brief writes the readable bytes to fd with a single write and consumes them
+ * @return Success: bytes written
+ * @return Failure: -1 with errno from write
+ */
+ssize_t drain_mirror_ring_t(mirror_ring_t *ring, int fd);
+
+/*!
+ * @brief unmaps the ring and frees all resources of the mirror_ring_t
+ */
+void free_mirror_ring_t(mirror_ring_t *ring);
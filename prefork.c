@@ -0,0 +1,218 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "prefork.h"
+#include "deps/ulog/logger.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new prefork_t object
+ * @return Success: pointer to instance of prefork_t
+ * @return Failure: NULL ptr
+ */
+prefork_t *new_prefork_t(thread_logger *thl, size_t num_workers,
+                         prefork_worker_fn fn, void *arg) {
+    if (num_workers == 0 || fn == NULL) {
+        return NULL;
+    }
+    prefork_t *prefork = calloc(1, sizeof(prefork_t));
+    if (prefork == NULL) {
+        return NULL;
+    }
+    prefork->pids = calloc(num_workers, sizeof(pid_t));
+    prefork->restarts = calloc(num_workers, sizeof(uint64_t));
+    prefork->started_at = calloc(num_workers, sizeof(uint64_t));
+    if (prefork->pids == NULL || prefork->restarts == NULL ||
+        prefork->started_at == NULL) {
+        free_prefork_t(prefork);
+        return NULL;
+    }
+    for (size_t i = 0; i < num_workers; i++) {
+        prefork->pids[i] = -1;
+    }
+    prefork->num_workers = num_workers;
+    prefork->fn = fn;
+    prefork->arg = arg;
+    prefork->thl = thl;
+    return prefork;
+}
+
+/*!
+ * @brief forks a single worker
+ * @return Success: 0
+ * @return Failure: -1
+ */
+static int spawn_worker(prefork_t *prefork, size_t worker_id) {
+    // throttle workers that die straight away
+    uint64_t since = now_ms() - prefork->started_at[worker_id];
+    if (prefork->started_at[worker_id] != 0 && since < PREFORK_RESTART_DELAY_MS) {
+        uint64_t delay = PREFORK_RESTART_DELAY_MS - since;
+        struct timespec ts;
+        ts.tv_sec = (time_t)(delay / 1000);
+        ts.tv_nsec = (long)(delay % 1000) * 1000000;
+        nanosleep(&ts, NULL);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        LOGF_ERROR(prefork->thl, 0, "failed to fork worker %zu %s", worker_id,
+                   strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        // the master's handlers make no sense in a worker
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        prefork->fn(prefork, worker_id, prefork->arg);
+        _exit(0);
+    }
+
+    prefork->pids[worker_id] = pid;
+    prefork->started_at[worker_id] = now_ms();
+    LOGF_INFO(prefork->thl, 0, "started worker %zu with pid %li", worker_id,
+              (long)pid);
+    return 0;
+}
+
+/*!
+ * @brief forks every worker that is not running
+ * @return Success: 0
+ * @return Failure: -1, workers that did start keep running
+ */
+int start_prefork_t(prefork_t *prefork) {
+    for (size_t i = 0; i < prefork->num_workers; i++) {
+        if (prefork->pids[i] == -1 && spawn_worker(prefork, i) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief collects exited workers and restarts the ones that crashed
+ * @param block wait for at least one worker to exit
+ * @return number of workers collected, -1 on failure (EINTR included)
+ */
+int reap_prefork_t(prefork_t *prefork, bool block) {
+    int reaped = 0;
+    for (;;) {
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, (block && reaped == 0) ? 0 : WNOHANG);
+        if (pid == 0 || (pid == -1 && errno == ECHILD && reaped > 0)) {
+            return reaped;
+        }
+        if (pid == -1) {
+            return -1;
+        }
+
+        size_t worker_id = prefork->num_workers;
+        for (size_t i = 0; i < prefork->num_workers; i++) {
+            if (prefork->pids[i] == pid) {
+                worker_id = i;
+                break;
+            }
+        }
+        if (worker_id == prefork->num_workers) {
+            // not one of ours
+            continue;
+        }
+        prefork->pids[worker_id] = -1;
+        reaped += 1;
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            LOGF_INFO(prefork->thl, 0, "worker %zu exited", worker_id);
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            LOGF_ERROR(prefork->thl, 0, "worker %zu killed by signal %i", worker_id,
+                       WTERMSIG(status));
+        } else {
+            LOGF_ERROR(prefork->thl, 0, "worker %zu exited with status %i",
+                       worker_id, WEXITSTATUS(status));
+        }
+        if (prefork->stopping == false && spawn_worker(prefork, worker_id) == 0) {
+            prefork->restarts[worker_id] += 1;
+        }
+    }
+}
+
+/*!
+ * @brief number of workers currently running
+ */
+size_t running_prefork_t(prefork_t *prefork) {
+    size_t running = 0;
+    for (size_t i = 0; i < prefork->num_workers; i++) {
+        if (prefork->pids[i] != -1) {
+            running += 1;
+        }
+    }
+    return running;
+}
+
+/*!
+ * @brief keeps the workers running until stop is set or every worker exits
+ * cleanly
+ * @param stop typically set from a SIGINT/SIGTERM handler
+ */
+void supervise_prefork_t(prefork_t *prefork, volatile sig_atomic_t *stop) {
+    while (*stop == 0 && running_prefork_t(prefork) > 0) {
+        if (reap_prefork_t(prefork, true) == -1 && errno != EINTR) {
+            LOGF_ERROR(prefork->thl, 0, "failed to wait for workers %s",
+                       strerror(errno));
+            return;
+        }
+    }
+}
+
+/*!
+ * @brief sends SIGTERM to every worker and waits for them to exit
+ */
+void stop_prefork_t(prefork_t *prefork) {
+    prefork->stopping = true;
+    for (size_t i = 0; i < prefork->num_workers; i++) {
+        if (prefork->pids[i] != -1) {
+            kill(prefork->pids[i], SIGTERM);
+        }
+    }
+    for (size_t i = 0; i < prefork->num_workers; i++) {
+        if (prefork->pids[i] == -1) {
+            continue;
+        }
+        while (waitpid(prefork->pids[i], NULL, 0) == -1 && errno == EINTR) {
+        }
+        prefork->pids[i] = -1;
+    }
+}
+
+/*!
+ * @brief free up all resources allocated for the prefork_t struct
+ * @note does not stop the workers, call stop_prefork_t first
+ */
+void free_prefork_t(prefork_t *prefork) {
+    free(prefork->pids);
+    free(prefork->restarts);
+    free(prefork->started_at);
+    free(prefork);
+}
@@ -0,0 +1,109 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file prefork.h
+ * @brief runs a server as a supervised group of worker processes
+ * @details the master forks N workers and does nothing but watch them. each
+ * worker sets up its own listener (typically with the REUSEPORT socket option, so
+ * the kernel balances connections across workers) and its own fd_pool_t. workers
+ * share no memory, a crash takes down one worker and the master starts a new one
+ * in its place
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*!
+ * @brief minimum time between two starts of the same worker, stops a worker
+ * that fails on startup from spinning the master
+ */
+#ifndef PREFORK_RESTART_DELAY_MS
+#define PREFORK_RESTART_DELAY_MS 100
+#endif
+
+struct prefork;
+
+/*!
+ * @brief the body of a worker process
+ * @details runs in the child, returning exits the worker with status 0. a worker
+ * that exits with status 0 is not restarted, any other exit or a signal is
+ * treated as a crash
+ */
+typedef void (*prefork_worker_fn)(struct prefork *prefork, size_t worker_id,
+                                  void *arg);
+
+/*! @typedef prefork
+ * @struct prefork
+ * @brief a master's view of its worker processes
+ */
+typedef struct prefork {
+    pid_t *pids;         /*! @brief pid of each worker, -1 if not running */
+    uint64_t *restarts;  /*! @brief times each worker has been restarted */
+    uint64_t *started_at; /*! @brief CLOCK_MONOTONIC ms of each worker's last
+                             start */
+    size_t num_workers;
+    bool stopping;
+    prefork_worker_fn fn;
+    void *arg;
+    thread_logger *thl;
+} prefork_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new prefork_t object
+ * @return Success: pointer to instance of prefork_t
+ * @return Failure: NULL ptr
+ */
+prefork_t *new_prefork_t(thread_logger *thl, size_t num_workers,
+                         prefork_worker_fn fn, void *arg);
+
+/*!
+ * @brief forks every worker that is not running
+ * @return Success: 0
+ * @return Failure: -1, workers that did start keep running
+ */
+int start_prefork_t(prefork_t *prefork);
+
+/*!
+ * @brief collects exited workers and restarts the ones that crashed
+ * @param block wait for at least one worker to exit
+ * @return number of workers collected, -1 on failure (EINTR included)
+ */
+int reap_prefork_t(prefork_t *prefork, bool block);
+
+/*!
+ * @brief number of workers currently running
+ */
+size_t running_prefork_t(prefork_t *prefork);
+
+/*!
+ * @brief keeps the workers running until stop is set or every worker exits
+ * cleanly
+ * @param stop typically set from a SIGINT/SIGTERM handler
+ */
+void supervise_prefork_t(prefork_t *prefork, volatile sig_atomic_t *stop);
+
+/*!
+ * @brief sends SIGTERM to every worker and waits for them to exit
+ */
+void stop_prefork_t(prefork_t *prefork);
+
+/*!
+ * @brief free up all resources allocated for the prefork_t struct
+ * @note does not stop the workers, call stop_prefork_t first
+ */
+void free_prefork_t(prefork_t *prefork);
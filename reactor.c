@@ -0,0 +1,661 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "reactor.h"
+#include "deps/ulog/logger.h"
+#include "fd_pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static inline bool valid_fd(int fd) {
+    return fd >= 0 && fd < FD_SETSIZE;
+}
+
+static int drain_wakeup(reactor_t *reactor, int fd, void *arg) {
+    (void)reactor;
+    (void)arg;
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) == sizeof(count)) {
+    }
+    return 0;
+}
+
+/*!
+ * @brief removes a failed fd and hands the error to its error callback
+ */
+static void fail_fd(reactor_t *reactor, int fd, int error) {
+    reactor_handler_t handler = reactor->handlers[fd];
+    remove_fd_reactor_t(reactor, fd);
+    reactor->stats.errors += 1;
+    if (handler.on_error != NULL) {
+        handler.on_error(reactor, fd, error, handler.arg);
+    }
+}
+
+/*!
+ * @brief fires every timer whose deadline has passed
+ * @return number of timers fired
+ */
+static int fire_timers(reactor_t *reactor) {
+    int fired = 0;
+    advance_timer_wheel_t(&reactor->timers, reactor->now);
+    wheel_timer_t *node;
+    while ((node = pop_expired_timer_wheel_t(&reactor->timers)) != NULL) {
+        reactor_timer_t *timer = (reactor_timer_t *)node;
+        if (timer->interval > 0) {
+            timer->deadline += timer->interval;
+            if (timer->deadline <= reactor->now) {
+                // the loop fell behind, skip the missed expiries instead of bursting
+                timer->deadline = reactor->now + timer->interval;
+            }
+            add_timer_wheel_t(&reactor->timers, &timer->node, timer->deadline);
+        }
+        reactor->stats.timers_fired += 1;
+        fired += 1;
+        timer->fn(reactor, timer, timer->arg);
+    }
+    return fired;
+}
+
+/*!
+ * @brief takes the oldest task of a class off its queue
+ */
+static reactor_task_t pop_task(reactor_t *reactor, REACTOR_PRIORITY priority) {
+    reactor_task_queue_t *queue = &reactor->task_queues[priority];
+    reactor_task_t task = queue->tasks[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count -= 1;
+    reactor->num_tasks -= 1;
+    return task;
+}
+
+/*!
+ * @brief runs the tasks that were deferred before this call
+ * @details the classes take turns, each running up to its weight per round
+ * @return number of tasks run
+ */
+static int run_tasks(reactor_t *reactor) {
+    size_t left[REACTOR_PRIORITIES];
+    size_t total = 0;
+    for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+        left[p] = reactor->task_queues[p].count;
+        total += left[p];
+    }
+    int count = 0;
+    while ((size_t)count < total) {
+        for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+            for (unsigned i = 0; i < reactor->weights[p] && left[p] > 0; i++) {
+                reactor_task_t task = pop_task(reactor, (REACTOR_PRIORITY)p);
+                left[p] -= 1;
+                count += 1;
+                reactor->stats.tasks_run += 1;
+                task.fn(reactor, task.arg);
+            }
+        }
+    }
+    return count;
+}
+
+/*!
+ * @brief runs everything posted from other threads so far, oldest first
+ * @return number of posts run
+ */
+static int run_posts(reactor_t *reactor) {
+    reactor_post_t *stack = atomic_exchange(&reactor->posted, NULL);
+    reactor_post_t *queue = NULL;
+    while (stack != NULL) {
+        reactor_post_t *next = stack->next;
+        stack->next = queue;
+        queue = stack;
+        stack = next;
+    }
+    int count = 0;
+    while (queue != NULL) {
+        // the post may be freed by its own task
+        reactor_post_t *post = queue;
+        queue = post->next;
+        reactor->stats.posts_run += 1;
+        count += 1;
+        post->fn(reactor, post->arg);
+    }
+    return count;
+}
+
+/*!
+ * @brief works out how long the poll may sleep
+ * @return NULL to block, otherwise tv filled in
+ */
+static struct timeval *poll_timeout(reactor_t *reactor, int timeout_ms,
+                                     struct timeval *tv) {
+    uint64_t wait = UINT64_MAX;
+    if (timeout_ms >= 0) {
+        wait = (uint64_t)timeout_ms * NSEC_PER_MSEC;
+    }
+    if (reactor->num_tasks > 0 ||
+        atomic_load_explicit(&reactor->posted, memory_order_relaxed) != NULL) {
+        wait = 0;
+    }
+    uint64_t deadline = next_timer_wheel_t(&reactor->timers);
+    if (deadline != UINT64_MAX) {
+        uint64_t until = deadline > reactor->now ? deadline - reactor->now : 0;
+        if (until < wait) {
+            wait = until;
+        }
+    }
+    if (wait == UINT64_MAX) {
+        return NULL;
+    }
+    // round up so a timer is never polled for a moment too early
+    uint64_t usec = (wait + 999) / 1000;
+    tv->tv_sec = (time_t)(usec / 1000000);
+    tv->tv_usec = (suseconds_t)(usec % 1000000);
+    return tv;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new reactor_t object
+ * @return Success: pointer to instance of reactor_t
+ * @return Failure: NULL ptr
+ */
+reactor_t *new_reactor_t(thread_logger *thl) {
+    reactor_t *reactor = calloc(1, sizeof(reactor_t));
+    if (reactor == NULL) {
+        LOG_ERROR(thl, 0, "failed to calloc reactor_t");
+        return NULL;
+    }
+    reactor->thl = thl;
+    reactor->wake_fd = -1;
+    reactor->max_fd = -1;
+    reactor->read_pool = new_fd_pool_t();
+    reactor->write_pool = new_fd_pool_t();
+    if (reactor->read_pool == NULL || reactor->write_pool == NULL) {
+        LOG_ERROR(thl, 0, "failed to allocate reactor state");
+        goto ERROR;
+    }
+    for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+        reactor->task_queues[p].capacity = 64;
+        reactor->task_queues[p].tasks = calloc(64, sizeof(reactor_task_t));
+        if (reactor->task_queues[p].tasks == NULL) {
+            LOG_ERROR(thl, 0, "failed to allocate reactor state");
+            goto ERROR;
+        }
+        reactor->resume_fd[p] = -1;
+    }
+    reactor->weights[REACTOR_PRIORITY_HIGH] = REACTOR_WEIGHT_HIGH;
+    reactor->weights[REACTOR_PRIORITY_NORMAL] = REACTOR_WEIGHT_NORMAL;
+    reactor->weights[REACTOR_PRIORITY_LOW] = REACTOR_WEIGHT_LOW;
+
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wake_fd == -1) {
+        LOGF_ERROR(thl, 0, "failed to create wakeup eventfd %s", strerror(errno));
+        goto ERROR;
+    }
+    if (add_fd_reactor_t(reactor, reactor->wake_fd, drain_wakeup, NULL, NULL,
+                         NULL) == -1) {
+        goto ERROR;
+    }
+    // posts and stops must never wait behind a dispatch limit
+    set_priority_reactor_t(reactor, reactor->wake_fd, REACTOR_PRIORITY_HIGH);
+    reactor->now = monotonic_ns();
+    reactor->polled = reactor->now;
+    init_timer_wheel_t(&reactor->timers, reactor->now);
+    return reactor;
+
+ERROR:
+    free_reactor_t(reactor);
+    return NULL;
+}
+
+/*!
+ * @brief registers fd with the reactor
+ * @details read interest is enabled if on_read is set and write interest if
+ * on_write is set, either can be toggled afterwards. adding an fd that is
+ * already registered replaces its callbacks
+ * @param on_error optional, called if a callback fails or the fd goes bad
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int add_fd_reactor_t(reactor_t *reactor, int fd, reactor_io_fn on_read,
+                     reactor_io_fn on_write, reactor_error_fn on_error, void *arg) {
+    if (valid_fd(fd) == false) {
+        LOGF_ERROR(reactor->thl, 0, "fd %i can not be used with select", fd);
+        return -1;
+    }
+    reactor_handler_t *handler = &reactor->handlers[fd];
+    if (handler->active == false) {
+        handler->priority = REACTOR_PRIORITY_NORMAL;
+    }
+    handler->on_read = on_read;
+    handler->on_write = on_write;
+    handler->on_error = on_error;
+    handler->arg = arg;
+    handler->generation += 1;
+    handler->active = true;
+    want_read_reactor_t(reactor, fd, on_read != NULL);
+    want_write_reactor_t(reactor, fd, on_write != NULL);
+    if (fd > reactor->max_fd) {
+        reactor->max_fd = fd;
+    }
+    return 0;
+}
+
+/*!
+ * @brief turns read interest for a registered fd on or off
+ */
+void want_read_reactor_t(reactor_t *reactor, int fd, bool enable) {
+    if (valid_fd(fd) == false) {
+        return;
+    }
+    if (enable && reactor->handlers[fd].active) {
+        set_fd_pool_t(reactor->read_pool, fd, true);
+    } else {
+        clear_fd_pool_t(reactor->read_pool, fd, true);
+    }
+}
+
+/*!
+ * @brief turns write interest for a registered fd on or off
+ */
+void want_write_reactor_t(reactor_t *reactor, int fd, bool enable) {
+    if (valid_fd(fd) == false) {
+        return;
+    }
+    if (enable && reactor->handlers[fd].active) {
+        set_fd_pool_t(reactor->write_pool, fd, true);
+    } else {
+        clear_fd_pool_t(reactor->write_pool, fd, true);
+    }
+}
+
+/*!
+ * @brief unregisters fd, events for it still in the current batch are dropped
+ * @note this does not close the file descriptor
+ */
+void remove_fd_reactor_t(reactor_t *reactor, int fd) {
+    if (valid_fd(fd) == false || reactor->handlers[fd].active == false) {
+        return;
+    }
+    clear_fd_pool_t(reactor->read_pool, fd, true);
+    clear_fd_pool_t(reactor->write_pool, fd, true);
+    reactor_handler_t *handler = &reactor->handlers[fd];
+    uint32_t generation = handler->generation + 1;
+    memset(handler, 0, sizeof(reactor_handler_t));
+    handler->generation = generation;
+    while (reactor->max_fd >= 0 &&
+           reactor->handlers[reactor->max_fd].active == false) {
+        reactor->max_fd -= 1;
+    }
+}
+
+/*!
+ * @brief moves a registered fd to another priority class
+ * @details fds start out in REACTOR_PRIORITY_NORMAL
+ */
+void set_priority_reactor_t(reactor_t *reactor, int fd, REACTOR_PRIORITY priority) {
+    if (valid_fd(fd) == false || reactor->handlers[fd].active == false ||
+        priority < REACTOR_PRIORITY_HIGH || priority > REACTOR_PRIORITY_LOW) {
+        return;
+    }
+    reactor->handlers[fd].priority = priority;
+}
+
+/*!
+ * @brief caps the ready fds dispatched per iteration
+ * @details the cap is raised to at least the sum of the weights so every class
+ * is served in each iteration
+ * @param limit 0 to dispatch every ready fd
+ */
+void set_dispatch_limit_reactor_t(reactor_t *reactor, size_t limit) {
+    size_t round = 0;
+    for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+        round += reactor->weights[p];
+    }
+    if (limit != 0 && limit < round) {
+        limit = round;
+    }
+    reactor->dispatch_limit = limit;
+}
+
+/*!
+ * @brief prepares a timer so that stop_timer_reactor_t can be called on it
+ * before it is ever started
+ */
+void init_timer_reactor_t(reactor_timer_t *timer) {
+    memset(timer, 0, sizeof(reactor_timer_t));
+}
+
+/*!
+ * @brief whether the timer is armed
+ */
+bool armed_timer_reactor_t(reactor_timer_t *timer) {
+    return timer->node.armed;
+}
+
+/*!
+ * @brief arms a timer, re-arming it if it is already armed
+ * @param delay_ms time until the first expiry
+ * @param interval_ms time between expiries afterwards, 0 for a one-shot timer
+ * @return 0, arming a timer can not fail
+ */
+int start_timer_reactor_t(reactor_t *reactor, reactor_timer_t *timer,
+                          uint64_t delay_ms, uint64_t interval_ms,
+                          reactor_timer_fn fn, void *arg) {
+    timer->deadline = reactor->now + delay_ms * NSEC_PER_MSEC;
+    timer->interval = interval_ms * NSEC_PER_MSEC;
+    timer->fn = fn;
+    timer->arg = arg;
+    add_timer_wheel_t(&reactor->timers, &timer->node, timer->deadline);
+    return 0;
+}
+
+/*!
+ * @brief disarms a timer, does nothing if it is not armed
+ */
+void stop_timer_reactor_t(reactor_t *reactor, reactor_timer_t *timer) {
+    remove_timer_wheel_t(&reactor->timers, &timer->node);
+}
+
+/*!
+ * @brief runs fn at the end of the next iteration
+ * @details tasks deferred while tasks are running wait for the following
+ * iteration so a task that defers itself can not starve i/o
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int defer_reactor_t(reactor_t *reactor, reactor_task_fn fn, void *arg) {
+    return defer_priority_reactor_t(reactor, REACTOR_PRIORITY_NORMAL, fn, arg);
+}
+
+/*!
+ * @brief like defer_reactor_t but in the given priority class
+ * @details tasks of every class deferred before the iteration still run in it,
+ * higher classes first in the same weighted rounds as fds
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int defer_priority_reactor_t(reactor_t *reactor, REACTOR_PRIORITY priority,
+                             reactor_task_fn fn, void *arg) {
+    if (priority < REACTOR_PRIORITY_HIGH || priority > REACTOR_PRIORITY_LOW) {
+        LOG_ERROR(reactor->thl, 0, "invalid task priority");
+        return -1;
+    }
+    reactor_task_queue_t *queue = &reactor->task_queues[priority];
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity * 2;
+        reactor_task_t *tasks = calloc(capacity, sizeof(reactor_task_t));
+        if (tasks == NULL) {
+            LOG_ERROR(reactor->thl, 0, "failed to grow task queue");
+            return -1;
+        }
+        // unroll the ring so the oldest task is at the front
+        for (size_t i = 0; i < queue->count; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        }
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+    size_t tail = (queue->head + queue->count) % queue->capacity;
+    queue->tasks[tail].fn = fn;
+    queue->tasks[tail].arg = arg;
+    queue->count += 1;
+    reactor->num_tasks += 1;
+    return 0;
+}
+
+/*!
+ * @brief runs fn on the reactor's thread, from any thread
+ * @details posts run after the timers of the next iteration, in the order they
+ * were posted. only the post that finds the queue empty wakes the reactor
+ * @warning post must stay valid until fn has started running
+ */
+void post_reactor_t(reactor_t *reactor, reactor_post_t *post, reactor_task_fn fn,
+                    void *arg) {
+    post->fn = fn;
+    post->arg = arg;
+    post->next = atomic_load_explicit(&reactor->posted, memory_order_relaxed);
+    while (atomic_compare_exchange_weak_explicit(&reactor->posted, &post->next, post,
+                                                 memory_order_release,
+                                                 memory_order_relaxed) == false) {
+    }
+    // a non-empty queue means the reactor is already due to wake up for it
+    if (post->next == NULL) {
+        wake_reactor_t(reactor);
+    }
+}
+
+/*!
+ * @brief invokes the callbacks of a single ready fd
+ * @return number of callbacks invoked
+ */
+static int dispatch_event(reactor_t *reactor, reactor_event_t *event) {
+    reactor_handler_t *handler = &reactor->handlers[event->fd];
+    int dispatched = 0;
+    if (event->readable && handler->generation == event->generation &&
+        handler->on_read != NULL) {
+        dispatched += 1;
+        if (handler->on_read(reactor, event->fd, handler->arg) == -1) {
+            fail_fd(reactor, event->fd, errno);
+            return dispatched;
+        }
+    }
+    if (event->writable && handler->generation == event->generation &&
+        handler->on_write != NULL) {
+        dispatched += 1;
+        if (handler->on_write(reactor, event->fd, handler->arg) == -1) {
+            fail_fd(reactor, event->fd, errno);
+        }
+    }
+    return dispatched;
+}
+
+/*!
+ * @brief dispatches the batch in weighted rounds across the priority classes
+ * @details within a class fds are served in fd order, starting after the last fd
+ * served when the previous iteration hit the dispatch limit so the fds past it
+ * are not always the ones left over
+ * @return number of callbacks invoked
+ */
+static int dispatch_batch(reactor_t *reactor, size_t batch) {
+    size_t count[REACTOR_PRIORITIES] = {0};
+    for (size_t i = 0; i < batch; i++) {
+        REACTOR_PRIORITY p = reactor->handlers[reactor->batch[i].fd].priority;
+        reactor->classes[p][count[p]++] = (uint16_t)i;
+    }
+    size_t start[REACTOR_PRIORITIES] = {0};
+    for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+        while (start[p] < count[p] &&
+               reactor->batch[reactor->classes[p][start[p]]].fd <=
+                   reactor->resume_fd[p]) {
+            start[p] += 1;
+        }
+    }
+    size_t limit = reactor->dispatch_limit == 0 ? batch : reactor->dispatch_limit;
+    size_t served[REACTOR_PRIORITIES] = {0};
+    size_t total = 0;
+    int dispatched = 0;
+    while (total < batch && total < limit) {
+        for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+            for (unsigned i = 0;
+                 i < reactor->weights[p] && served[p] < count[p] && total < limit;
+                 i++) {
+                size_t index =
+                    reactor->classes[p][(start[p] + served[p]) % count[p]];
+                reactor_event_t *event = &reactor->batch[index];
+                served[p] += 1;
+                total += 1;
+                reactor->stats.dispatched[p] += 1;
+                reactor->resume_fd[p] = event->fd;
+                dispatched += dispatch_event(reactor, event);
+            }
+        }
+    }
+    for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+        if (served[p] == count[p]) {
+            reactor->resume_fd[p] = -1;
+        }
+    }
+    reactor->stats.left_over += batch - total;
+    return dispatched;
+}
+
+/*!
+ * @brief runs a single iteration of the loop
+ * @param timeout_ms the longest to wait for an fd, -1 to wait until an fd, timer
+ * or wakeup
+ * @return Success: number of callbacks invoked
+ * @return Failure: -1
+ */
+int run_once_reactor_t(reactor_t *reactor, int timeout_ms) {
+    reactor->now = monotonic_ns();
+    reactor->stats.iterations += 1;
+
+    struct timeval tv;
+    struct timeval *timeout = poll_timeout(reactor, timeout_ms, &tv);
+    fd_set read_set, write_set;
+    int num_active = poll_fd_pool_t(reactor->read_pool, reactor->write_pool,
+                                    &read_set, &write_set, true, timeout);
+    if (num_active < 0) {
+        if (errno == EBADF) {
+            // something was closed without being removed, find and drop it
+            for (int fd = 0; fd <= reactor->max_fd; fd++) {
+                if (reactor->handlers[fd].active && fcntl(fd, F_GETFD) == -1) {
+                    fail_fd(reactor, fd, EBADF);
+                }
+            }
+        } else if (errno != EINTR) {
+            LOGF_ERROR(reactor->thl, 0, "reactor poll failed %s", strerror(errno));
+            return -1;
+        }
+        num_active = 0;
+    }
+    reactor->polled = monotonic_ns();
+
+    // collect the whole batch first so callbacks see a consistent view of what
+    // was ready and removals made by earlier callbacks are honoured
+    size_t batch = 0;
+    for (int fd = 0; fd <= reactor->max_fd && (int)batch < num_active; fd++) {
+        bool readable = FD_ISSET(fd, &read_set);
+        bool writable = FD_ISSET(fd, &write_set);
+        if (readable == false && writable == false) {
+            continue;
+        }
+        reactor_event_t *event = &reactor->batch[batch++];
+        event->fd = fd;
+        event->generation = reactor->handlers[fd].generation;
+        event->readable = readable;
+        event->writable = writable;
+    }
+    if (batch > reactor->stats.max_batch) {
+        reactor->stats.max_batch = batch;
+    }
+
+    int dispatched = dispatch_batch(reactor, batch);
+    reactor->stats.io_callbacks += (uint64_t)dispatched;
+
+    reactor->now = monotonic_ns();
+    dispatched += fire_timers(reactor);
+    dispatched += run_posts(reactor);
+    dispatched += run_tasks(reactor);
+    return dispatched;
+}
+
+/*!
+ * @brief runs the loop until stop_reactor_t is called
+ * @return Success: 0
+ * @return Failure: -1 if polling failed
+ */
+int run_reactor_t(reactor_t *reactor) {
+    while (atomic_exchange(&reactor->stopping, false) == false) {
+        if (run_once_reactor_t(reactor, -1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * @brief makes run_reactor_t return after the current iteration
+ * @note safe to call from any thread or a signal handler
+ */
+void stop_reactor_t(reactor_t *reactor) {
+    atomic_store(&reactor->stopping, true);
+    wake_reactor_t(reactor);
+}
+
+/*!
+ * @brief interrupts a poll in progress
+ * @note safe to call from any thread or a signal handler
+ */
+void wake_reactor_t(reactor_t *reactor) {
+    uint64_t one = 1;
+    int saved = errno;
+    // a full counter already means a wakeup is pending, so failing is fine
+    if (write(reactor->wake_fd, &one, sizeof(one)) == -1) {
+    }
+    errno = saved;
+}
+
+/*!
+ * @brief the reactor's cached monotonic time in nanoseconds
+ */
+uint64_t now_reactor_t(reactor_t *reactor) {
+    return reactor->now;
+}
+
+/*!
+ * @brief when the fds of the current batch were found ready
+ * @details the time a callback runs minus this is how long its fd waited behind
+ * the callbacks dispatched before it
+ */
+uint64_t polled_reactor_t(reactor_t *reactor) {
+    return reactor->polled;
+}
+
+/*!
+ * @brief free up all resources allocated for the reactor_t struct
+ * @note registered fds are not closed and pending tasks and posts are dropped
+ */
+void free_reactor_t(reactor_t *reactor) {
+    clear_timer_wheel_t(&reactor->timers);
+    if (reactor->wake_fd != -1) {
+        close(reactor->wake_fd);
+    }
+    if (reactor->read_pool != NULL) {
+        free_fd_pool_t(reactor->read_pool);
+    }
+    if (reactor->write_pool != NULL) {
+        free_fd_pool_t(reactor->write_pool);
+    }
+    for (int p = 0; p < REACTOR_PRIORITIES; p++) {
+        free(reactor->task_queues[p].tasks);
+    }
+    free(reactor);
+}
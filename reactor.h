@@ -0,0 +1,356 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file reactor.h
+ * @brief callback driven event loop on top of fd_pool_t
+ * @details fds are registered with read, write and error callbacks and the
+ * reactor keeps a read interest and a write interest fd_pool_t for them. each
+ * iteration makes a single poll_fd_pool_t call, collects every ready fd into a
+ * batch and dispatches the batch, then fires expired timers and runs the tasks
+ * deferred before the iteration started. timers live in a timer_wheel_t and the
+ * poll sleeps until the wheel next needs advancing, not at all while tasks are
+ * waiting. fds and tasks belong to one of REACTOR_PRIORITIES classes, the batch
+ * is dispatched in weighted rounds so higher classes go first while every round
+ * still serves lower classes their weight. with a dispatch limit the ready fds
+ * past it are left to the next poll, which reports them again
+ * @warning apart from post_reactor_t, wake_reactor_t and stop_reactor_t a reactor
+ * must only be used from the thread running it
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include "fd_pool.h"
+#include "timer_wheel.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/select.h>
+
+/*! @brief number of priority classes */
+#define REACTOR_PRIORITIES 3
+
+/*! @brief dispatches per round for the high class */
+#ifndef REACTOR_WEIGHT_HIGH
+#define REACTOR_WEIGHT_HIGH 8
+#endif
+
+/*! @brief dispatches per round for the normal class */
+#ifndef REACTOR_WEIGHT_NORMAL
+#define REACTOR_WEIGHT_NORMAL 4
+#endif
+
+/*! @brief dispatches per round for the low class */
+#ifndef REACTOR_WEIGHT_LOW
+#define REACTOR_WEIGHT_LOW 1
+#endif
+
+/*!
+ * @brief priority classes of fds and tasks, control traffic like health checks
+ * goes in the high class and bulk transfers in the low one
+ */
+typedef enum {
+    REACTOR_PRIORITY_HIGH = 0,
+    REACTOR_PRIORITY_NORMAL,
+    REACTOR_PRIORITY_LOW,
+} REACTOR_PRIORITY;
+
+struct reactor;
+struct reactor_timer;
+
+/*! @typedef reactor_io_fn
+ * @brief called when a registered fd is readable or writable
+ * @return 0 to keep going, -1 with errno set to have the error callback invoked
+ * and the fd removed from the reactor
+ */
+typedef int (*reactor_io_fn)(struct reactor *reactor, int fd, void *arg);
+
+/*! @typedef reactor_error_fn
+ * @brief called once the fd has failed, it is no longer registered by then
+ * @note the fd is not closed by the reactor
+ */
+typedef void (*reactor_error_fn)(struct reactor *reactor, int fd, int error,
+                                 void *arg);
+
+/*! @typedef reactor_timer_fn
+ * @brief called when a timer expires
+ */
+typedef void (*reactor_timer_fn)(struct reactor *reactor,
+                                 struct reactor_timer *timer, void *arg);
+
+/*! @typedef reactor_task_fn
+ * @brief a deferred task
+ */
+typedef void (*reactor_task_fn)(struct reactor *reactor, void *arg);
+
+/*!
+ * @brief the callbacks registered for a single fd
+ */
+typedef struct reactor_handler {
+    reactor_io_fn on_read;
+    reactor_io_fn on_write;
+    reactor_error_fn on_error;
+    void *arg;
+    uint32_t generation; /*! @brief bumped whenever the fd is added or removed */
+    REACTOR_PRIORITY priority;
+    bool active;
+} reactor_handler_t;
+
+/*! @typedef reactor_timer
+ * @struct reactor_timer
+ * @brief a one-shot or periodic timer
+ * @details timers are owned by the caller, usually embedded in a connection, so
+ * arming one never allocates and arming or stopping one is O(1)
+ */
+typedef struct reactor_timer {
+    wheel_timer_t node; /*! @brief must stay the first member */
+    uint64_t deadline;  /*! @brief monotonic nanoseconds */
+    uint64_t interval;  /*! @brief nanoseconds, 0 for a one-shot timer */
+    reactor_timer_fn fn;
+    void *arg;
+} reactor_timer_t;
+
+/*!
+ * @brief a deferred task
+ */
+typedef struct reactor_task {
+    reactor_task_fn fn;
+    void *arg;
+} reactor_task_t;
+
+/*!
+ * @brief a growable ring of deferred tasks, one per priority class
+ */
+typedef struct reactor_task_queue {
+    reactor_task_t *tasks;
+    size_t head;
+    size_t count;
+    size_t capacity;
+} reactor_task_queue_t;
+
+/*! @typedef reactor_post
+ * @struct reactor_post
+ * @brief a task handed to a reactor from another thread
+ * @details owned by the caller like reactor_timer_t, so posting never allocates
+ * or takes a lock
+ */
+typedef struct reactor_post {
+    reactor_task_fn fn;
+    void *arg;
+    struct reactor_post *next;
+} reactor_post_t;
+
+/*!
+ * @brief counters kept by a reactor
+ */
+typedef struct reactor_stats {
+    uint64_t iterations;
+    uint64_t io_callbacks;
+    uint64_t errors;
+    uint64_t timers_fired;
+    uint64_t tasks_run;
+    uint64_t posts_run;
+    size_t max_batch; /*! @brief most fds dispatched from a single poll */
+    /*! @brief ready fds dispatched per class */
+    uint64_t dispatched[REACTOR_PRIORITIES];
+    /*! @brief ready fds left to the next poll by the dispatch limit */
+    uint64_t left_over;
+} reactor_stats_t;
+
+/*!
+ * @brief an fd that was ready in the current iteration
+ */
+typedef struct reactor_event {
+    int fd;
+    uint32_t generation;
+    bool readable;
+    bool writable;
+} reactor_event_t;
+
+/*! @typedef reactor
+ * @struct reactor
+ * @brief an event loop
+ */
+typedef struct reactor {
+    fd_pool_t *read_pool;
+    fd_pool_t *write_pool;
+    reactor_handler_t handlers[FD_SETSIZE];
+    reactor_event_t batch[FD_SETSIZE];
+    /*! @brief batch indexes per class */
+    uint16_t classes[REACTOR_PRIORITIES][FD_SETSIZE];
+    int max_fd;
+    timer_wheel_t timers;
+    reactor_task_queue_t task_queues[REACTOR_PRIORITIES];
+    size_t num_tasks; /*! @brief tasks waiting across every class */
+    unsigned weights[REACTOR_PRIORITIES];
+    /*! @brief where each class resumes after the limit */
+    int resume_fd[REACTOR_PRIORITIES];
+    /*! @brief most ready fds dispatched per iteration, 0 for all */
+    size_t dispatch_limit;
+    _Atomic(reactor_post_t *) posted; /*! @brief stack of posts from other threads */
+    uint64_t now; /*! @brief monotonic nanoseconds, refreshed every iteration */
+    uint64_t polled; /*! @brief when the poll of the current iteration returned */
+    int wake_fd;
+    _Atomic bool stopping;
+    reactor_stats_t stats;
+    thread_logger *thl;
+} reactor_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new reactor_t object
+ * @return Success: pointer to instance of reactor_t
+ * @return Failure: NULL ptr
+ */
+reactor_t *new_reactor_t(thread_logger *thl);
+
+/*!
+ * @brief registers fd with the reactor
+ * @details read interest is enabled if on_read is set and write interest if
+ * on_write is set, either can be toggled afterwards. adding an fd that is
+ * already registered replaces its callbacks
+ * @param on_error optional, called if a callback fails or the fd goes bad
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int add_fd_reactor_t(reactor_t *reactor, int fd, reactor_io_fn on_read,
+                     reactor_io_fn on_write, reactor_error_fn on_error, void *arg);
+
+/*!
+ * @brief turns read interest for a registered fd on or off
+ */
+void want_read_reactor_t(reactor_t *reactor, int fd, bool enable);
+
+/*!
+ * @brief turns write interest for a registered fd on or off
+ */
+void want_write_reactor_t(reactor_t *reactor, int fd, bool enable);
+
+/*!
+ * @brief unregisters fd, events for it still in the current batch are dropped
+ * @note this does not close the file descriptor
+ */
+void remove_fd_reactor_t(reactor_t *reactor, int fd);
+
+/*!
+ * @brief moves a registered fd to another priority class
+ * @details fds start out in REACTOR_PRIORITY_NORMAL
+ */
+void set_priority_reactor_t(reactor_t *reactor, int fd, REACTOR_PRIORITY priority);
+
+/*!
+ * @brief caps the ready fds dispatched per iteration
+ * @details the cap is raised to at least the sum of the weights so every class
+ * is served in each iteration
+ * @param limit 0 to dispatch every ready fd
+ */
+void set_dispatch_limit_reactor_t(reactor_t *reactor, size_t limit);
+
+/*!
+ * @brief arms a timer, re-arming it if it is already armed
+ * @param delay_ms time until the first expiry
+ * @param interval_ms time between expiries afterwards, 0 for a one-shot timer
+ * @return 0, arming a timer can not fail
+ */
+int start_timer_reactor_t(reactor_t *reactor, reactor_timer_t *timer,
+                          uint64_t delay_ms, uint64_t interval_ms,
+                          reactor_timer_fn fn, void *arg);
+
+/*!
+ * @brief disarms a timer, does nothing if it is not armed
+ */
+void stop_timer_reactor_t(reactor_t *reactor, reactor_timer_t *timer);
+
+/*!
+ * @brief prepares a timer so that stop_timer_reactor_t can be called on it
+ * before it is ever started
+ */
+void init_timer_reactor_t(reactor_timer_t *timer);
+
+/*!
+ * @brief whether the timer is armed
+ */
+bool armed_timer_reactor_t(reactor_timer_t *timer);
+
+/*!
+ * @brief runs fn at the end of the next iteration
+ * @details tasks deferred while tasks are running wait for the following
+ * iteration so a task that defers itself can not starve i/o
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int defer_reactor_t(reactor_t *reactor, reactor_task_fn fn, void *arg);
+
+/*!
+ * @brief like defer_reactor_t but in the given priority class
+ * @details tasks of every class deferred before the iteration still run in it,
+ * higher classes first in the same weighted rounds as fds
+ * @return Success: 0
+ * @return Failure: -1
+ */
+int defer_priority_reactor_t(reactor_t *reactor, REACTOR_PRIORITY priority,
+                             reactor_task_fn fn, void *arg);
+
+/*!
+ * @brief runs fn on the reactor's thread, from any thread
+ * @details posts run after the timers of the next iteration, in the order they
+ * were posted. only the post that finds the queue empty wakes the reactor
+ * @warning post must stay valid until fn has started running
+ */
+void post_reactor_t(reactor_t *reactor, reactor_post_t *post, reactor_task_fn fn,
+                    void *arg);
+
+/*!
+ * @brief runs a single iteration of the loop
+ * @param timeout_ms the longest to wait for an fd, -1 to wait until an fd, timer
+ * or wakeup
+ * @return Success: number of callbacks invoked
+ * @return Failure: -1
+ */
+int run_once_reactor_t(reactor_t *reactor, int timeout_ms);
+
+/*!
+ * @brief runs the loop until stop_reactor_t is called
+ * @return Success: 0
+ * @return Failure: -1 if polling failed
+ */
+int run_reactor_t(reactor_t *reactor);
+
+/*!
+ * @brief makes run_reactor_t return after the current iteration
+ * @note safe to call from any thread or a signal handler
+ */
+void stop_reactor_t(reactor_t *reactor);
+
+/*!
+ * @brief interrupts a poll in progress
+ * @note safe to call from any thread or a signal handler
+ */
+void wake_reactor_t(reactor_t *reactor);
+
+/*!
+ * @brief the reactor's cached monotonic time in nanoseconds
+ */
+uint64_t now_reactor_t(reactor_t *reactor);
+
+/*!
+ * @brief when the fds of the current batch were found ready
+ * @details the time a callback runs minus this is how long its fd waited behind
+ * the callbacks dispatched before it
+ */
+uint64_t polled_reactor_t(reactor_t *reactor);
+
+/*!
+ * @brief free up all resources allocated for the reactor_t struct
+ * @note registered fds are not closed and pending tasks and posts are dropped
+ */
+void free_reactor_t(reactor_t *reactor);
@@ -0,0 +1,442 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "shm_ring.h"
+#include "deps/ulog/logger.h"
+#include "sockets.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*! @brief "cnet" in ascii, identifies a shared memory handshake */
+#define SHM_HANDSHAKE_MAGIC 0x636e6574
+#define SHM_HANDSHAKE_VERSION 1
+/*! @brief memfd, then data/space eventfds for ring 0 and ring 1 */
+#define SHM_HANDSHAKE_FDS 5
+
+/*!
+ * @brief sent by the server alongside the memfd and eventfds
+ */
+typedef struct shm_handshake {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+} shm_handshake_t;
+
+/*!
+ * @brief size of the mapping that holds both rings
+ */
+static size_t shm_map_len(size_t capacity) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = 2 * (sizeof(shm_ring_hdr_t) + capacity);
+    return (len + page_size - 1) & ~(page_size - 1);
+}
+
+/*!
+ * @brief points the rings of a client at the shared mapping
+ * @details ring 0 carries server -> client, ring 1 carries client -> server
+ */
+static void setup_shm_rings(shm_client_t *client, int *fds, bool server) {
+    char *base = client->map;
+    size_t region = sizeof(shm_ring_hdr_t) + client->capacity;
+    shm_ring_t rings[2];
+    for (int i = 0; i < 2; i++) {
+        rings[i].hdr = (shm_ring_hdr_t *)(base + region * (size_t)i);
+        rings[i].data = base + region * (size_t)i + sizeof(shm_ring_hdr_t);
+        rings[i].data_fd = fds[1 + i * 2];
+        rings[i].space_fd = fds[2 + i * 2];
+    }
+    client->tx = server ? rings[0] : rings[1];
+    client->rx = server ? rings[1] : rings[0];
+    client->event_fd = client->rx.data_fd;
+}
+
+/*!
+ * @brief wakes whoever sleeps on an eventfd
+ */
+static void notify_shm_ring(int fd) {
+    uint64_t one = 1;
+    ssize_t rc = write(fd, &one, sizeof(one));
+    (void)rc;
+}
+
+/*!
+ * @brief sleeps until the eventfd fires or the peer's socket goes away
+ * @return 0 when woken, -1 if the peer is gone
+ */
+static int wait_shm_ring(shm_client_t *client, int fd) {
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = client->socket_number;
+    fds[1].events = POLLIN;
+    int rc = poll(fds, 2, -1);
+    if (rc == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (fds[0].revents & POLLIN) {
+        uint64_t count;
+        rc = (int)read(fd, &count, sizeof(count));
+        (void)rc;
+        return 0;
+    }
+    // nothing is ever sent on the socket after the handshake, so readable means
+    // EOF or an error: the peer process has exited without closing cleanly
+    return -1;
+}
+
+/*!
+ * @brief creates a unix domain socket that shared memory clients connect to
+ * @param path filesystem path of the socket, or '@name' for the abstract namespace
+ * @return Success: listening socket
+ * @return Failure: -1
+ */
+int listen_shm_socket(thread_logger *thl, char *path) {
+    return listen_unix_socket(thl, path, false, default_sock_opts,
+                              default_socket_opts_count);
+}
+
+/*!
+ * @brief accepts a connection and sets up the shared memory rings for it
+ * @param capacity bytes per ring, 0 uses SHM_RING_CAPACITY
+ * @return Success: pointer to instance of shm_client_t
+ * @return Failure: NULL ptr
+ */
+shm_client_t *accept_shm_socket(thread_logger *thl, int listen_fd, size_t capacity) {
+    if (capacity == 0) {
+        capacity = SHM_RING_CAPACITY;
+    }
+    // power of two so positions can be masked instead of divided
+    size_t rounded = 4096;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+    capacity = rounded;
+
+    int fds[SHM_HANDSHAKE_FDS];
+    for (int i = 0; i < SHM_HANDSHAKE_FDS; i++) {
+        fds[i] = -1;
+    }
+
+    shm_client_t *client = calloc(1, sizeof(shm_client_t));
+    if (client == NULL) {
+        LOG_ERROR(thl, 0, "failed to calloc shm_client_t");
+        return NULL;
+    }
+    client->capacity = capacity;
+    client->map_len = shm_map_len(capacity);
+    client->map = MAP_FAILED;
+
+    client->socket_number = accept_socket(thl, listen_fd);
+    if (client->socket_number == -1) {
+        free(client);
+        return NULL;
+    }
+
+    fds[0] = memfd_create("cnet-shm", MFD_CLOEXEC);
+    if (fds[0] == -1 || ftruncate(fds[0], (off_t)client->map_len) == -1) {
+        LOGF_ERROR(thl, 0, "failed to create shared memory %s", strerror(errno));
+        goto ERROR;
+    }
+    for (int i = 1; i < SHM_HANDSHAKE_FDS; i++) {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fds[i] == -1) {
+            LOGF_ERROR(thl, 0, "failed to create eventfd %s", strerror(errno));
+            goto ERROR;
+        }
+    }
+
+    client->map =
+        mmap(NULL, client->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (client->map == MAP_FAILED) {
+        LOGF_ERROR(thl, 0, "failed to map shared memory %s", strerror(errno));
+        goto ERROR;
+    }
+
+    shm_handshake_t handshake = {SHM_HANDSHAKE_MAGIC, SHM_HANDSHAKE_VERSION,
+                                 capacity};
+    int rc = send_fds_socket(client->socket_number, fds, SHM_HANDSHAKE_FDS,
+                             &handshake, sizeof(handshake));
+    if (rc != sizeof(handshake)) {
+        LOGF_ERROR(thl, 0, "failed to send shared memory handshake %s",
+                   strerror(errno));
+        goto ERROR;
+    }
+
+    // the mapping keeps the memory alive, the memfd itself is no longer needed
+    close(fds[0]);
+    setup_shm_rings(client, fds, true);
+    return client;
+
+ERROR:
+    for (int i = 0; i < SHM_HANDSHAKE_FDS; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    if (client->map != MAP_FAILED) {
+        munmap(client->map, client->map_len);
+    }
+    close(client->socket_number);
+    free(client);
+    return NULL;
+}
+
+/*!
+ * @brief connects to a shared memory listener and maps the rings it sends us
+ * @param path filesystem path of the socket, or '@name' for the abstract namespace
+ * @return Success: pointer to instance of shm_client_t
+ * @return Failure: NULL ptr
+ */
+shm_client_t *new_shm_client_socket(thread_logger *thl, char *path) {
+    socket_client_t *sock_client = new_unix_client_socket(thl, path, false);
+    if (sock_client == NULL) {
+        return NULL;
+    }
+    int socket_number = sock_client->socket_number;
+    // we only want the fd, the unix client has no address to free
+    free(sock_client);
+
+    shm_handshake_t handshake;
+    size_t handshake_len = sizeof(handshake);
+    int fds[SHM_HANDSHAKE_FDS];
+    int num_fds = recv_fds_socket(socket_number, fds, SHM_HANDSHAKE_FDS,
+                                  &handshake, &handshake_len);
+    if (num_fds != SHM_HANDSHAKE_FDS || handshake_len != sizeof(handshake) ||
+        handshake.magic != SHM_HANDSHAKE_MAGIC ||
+        handshake.version != SHM_HANDSHAKE_VERSION) {
+        LOG_ERROR(thl, 0, "invalid shared memory handshake");
+        for (int i = 0; i < num_fds; i++) {
+            close(fds[i]);
+        }
+        close(socket_number);
+        return NULL;
+    }
+
+    // the ring indexes are masked with capacity - 1, and a mapping past the end
+    // of the memfd faults on first access, so the peer's word is not enough
+    uint64_t capacity = handshake.capacity;
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        capacity > SIZE_MAX / 4) {
+        LOGF_ERROR(thl, 0, "invalid shared memory capacity %llu",
+                   (unsigned long long)capacity);
+        goto ERROR;
+    }
+    struct stat st;
+    if (fstat(fds[0], &st) == -1) {
+        LOGF_ERROR(thl, 0, "failed to stat shared memory %s", strerror(errno));
+        goto ERROR;
+    }
+    if (st.st_size < 0 || (uint64_t)st.st_size < shm_map_len((size_t)capacity)) {
+        LOG_ERROR(thl, 0, "shared memory is smaller than its rings");
+        goto ERROR;
+    }
+
+    shm_client_t *client = calloc(1, sizeof(shm_client_t));
+    if (client == NULL) {
+        LOG_ERROR(thl, 0, "failed to calloc shm_client_t");
+        goto ERROR;
+    }
+    client->socket_number = socket_number;
+    client->capacity = (size_t)capacity;
+    client->map_len = shm_map_len(client->capacity);
+    client->map =
+        mmap(NULL, client->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (client->map == MAP_FAILED) {
+        LOGF_ERROR(thl, 0, "failed to map shared memory %s", strerror(errno));
+        free(client);
+        goto ERROR;
+    }
+
+    close(fds[0]);
+    setup_shm_rings(client, fds, false);
+    LOG_INFO(thl, 0, "shared memory client successfully created");
+    return client;
+
+ERROR:
+    for (int i = 0; i < SHM_HANDSHAKE_FDS; i++) {
+        close(fds[i]);
+    }
+    close(socket_number);
+    return NULL;
+}
+
+/*!
+ * @brief writes len bytes into the outgoing ring
+ * @details blocks while the ring is full unless flags contains MSG_DONTWAIT, in
+ * which case as many bytes as fit are written
+ * @return Success: number of bytes written
+ * @return Failure: -1 with errno set to EAGAIN (nothing fit) or EPIPE (peer gone)
+ */
+ssize_t send_shm_client_t(shm_client_t *client, const void *buf, size_t len,
+                          int flags) {
+    shm_ring_t *ring = &client->tx;
+    size_t mask = client->capacity - 1;
+    size_t sent = 0;
+
+    while (sent < len) {
+        // the peer closes its own tx ring when it goes away
+        if (atomic_load(&client->rx.hdr->closed)) {
+            errno = EPIPE;
+            return sent > 0 ? (ssize_t)sent : -1;
+        }
+
+        uint64_t tail = atomic_load_explicit(&ring->hdr->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->hdr->head, memory_order_acquire);
+        size_t space = client->capacity - (size_t)(tail - head);
+        if (space > 0) {
+            size_t n = len - sent < space ? len - sent : space;
+            size_t offset = (size_t)tail & mask;
+            size_t first =
+                n < client->capacity - offset ? n : client->capacity - offset;
+            memcpy(ring->data + offset, (const char *)buf + sent, first);
+            memcpy(ring->data, (const char *)buf + sent + first, n - first);
+            atomic_store_explicit(&ring->hdr->tail, tail + n, memory_order_release);
+            // pairs with the fence in the consumer: either it sees the new tail
+            // or we see that it is waiting
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load_explicit(&ring->hdr->consumer_waiting,
+                                     memory_order_relaxed)) {
+                notify_shm_ring(ring->data_fd);
+            }
+            sent += n;
+            continue;
+        }
+
+        if (flags & MSG_DONTWAIT) {
+            if (sent > 0) {
+                break;
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+
+        atomic_store(&ring->hdr->producer_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        int rc = 0;
+        if (atomic_load(&ring->hdr->head) == head &&
+            atomic_load(&client->rx.hdr->closed) == 0) {
+            rc = wait_shm_ring(client, ring->space_fd);
+        }
+        atomic_store(&ring->hdr->producer_waiting, 0);
+        if (rc == -1) {
+            errno = EPIPE;
+            return sent > 0 ? (ssize_t)sent : -1;
+        }
+    }
+
+    return (ssize_t)sent;
+}
+
+/*!
+ * @brief reads up to len bytes from the incoming ring
+ * @details blocks while the ring is empty unless flags contains MSG_DONTWAIT
+ * @return Success: number of bytes read, 0 once the peer has closed
+ * @return Failure: -1 with errno set to EAGAIN
+ */
+ssize_t recv_shm_client_t(shm_client_t *client, void *buf, size_t len, int flags) {
+    shm_ring_t *ring = &client->rx;
+    size_t mask = client->capacity - 1;
+    bool peer_gone = false;
+
+    for (;;) {
+        uint64_t head = atomic_load_explicit(&ring->hdr->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->hdr->tail, memory_order_acquire);
+        size_t avail = (size_t)(tail - head);
+        if (avail > 0) {
+            size_t n = len < avail ? len : avail;
+            size_t offset = (size_t)head & mask;
+            size_t first =
+                n < client->capacity - offset ? n : client->capacity - offset;
+            memcpy(buf, ring->data + offset, first);
+            memcpy((char *)buf + first, ring->data, n - first);
+            // an arm lasts for one wakeup, once we are draining the producer
+            // has no reason to write the eventfd
+            atomic_store_explicit(&ring->hdr->consumer_waiting, 0,
+                                  memory_order_relaxed);
+            atomic_store_explicit(&ring->hdr->head, head + n, memory_order_release);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load_explicit(&ring->hdr->producer_waiting,
+                                     memory_order_relaxed)) {
+                notify_shm_ring(ring->space_fd);
+            }
+            return (ssize_t)n;
+        }
+
+        if (peer_gone || atomic_load(&ring->hdr->closed)) {
+            return 0;
+        }
+        if (flags & MSG_DONTWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        // only sleep once the producer is guaranteed to see that we are waiting
+        atomic_store(&ring->hdr->consumer_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&ring->hdr->tail) == tail &&
+            atomic_load(&ring->hdr->closed) == 0) {
+            peer_gone = wait_shm_ring(client, ring->data_fd) == -1;
+        }
+        atomic_store(&ring->hdr->consumer_waiting, 0);
+    }
+}
+
+/*!
+ * @brief tells the peer we are about to wait on event_fd
+ * @details call this before polling event_fd with fd_pool_t, otherwise the peer
+ * has no reason to write the eventfd. the arm lasts until recv_shm_client_t
+ * next takes data
+ * @return false if data is already available and waiting would be wrong
+ */
+bool arm_shm_client_t(shm_client_t *client) {
+    shm_ring_hdr_t *hdr = client->rx.hdr;
+    uint64_t count;
+    // clear any stale wakeup so the eventfd only fires for new data
+    ssize_t rc = read(client->rx.data_fd, &count, sizeof(count));
+    (void)rc;
+    atomic_store(&hdr->consumer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&hdr->tail) != atomic_load(&hdr->head) ||
+        atomic_load(&hdr->closed)) {
+        atomic_store(&hdr->consumer_waiting, 0);
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * @brief closes the connection and frees all resources for the shm_client_t
+ * @details the peer sees EOF once it has drained the ring
+ */
+void free_shm_client_t(shm_client_t *client) {
+    atomic_store(&client->tx.hdr->closed, 1);
+    // wake the peer whichever way it might be sleeping
+    notify_shm_ring(client->tx.data_fd);
+    notify_shm_ring(client->rx.space_fd);
+
+    munmap(client->map, client->map_len);
+    close(client->tx.data_fd);
+    close(client->tx.space_fd);
+    close(client->rx.data_fd);
+    close(client->rx.space_fd);
+    close(client->socket_number);
+    free(client);
+}
@@ -0,0 +1,137 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file shm_ring.h
+ * @brief shared memory transport for peers on the same host
+ * @details each connection is a memfd holding two single-producer
+ * single-consumer byte rings, one per direction. the server creates the memfd
+ * and the wakeup eventfds, and hands them to the client over a unix domain
+ * socket with SCM_RIGHTS. after that the unix socket is only used to notice the
+ * peer going away. an eventfd is written only when the other side has said it
+ * is about to sleep, so a busy connection moves data without any syscalls
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*!
+ * @brief default capacity of each ring, rounded up to a power of two
+ */
+#ifndef SHM_RING_CAPACITY
+#define SHM_RING_CAPACITY 1048576
+#endif
+
+/*!
+ * @brief the control block at the start of each ring
+ * @details head and tail are free running byte counters, kept on separate cache
+ * lines so the producer and consumer do not contend on them
+ */
+typedef struct shm_ring_hdr {
+    _Atomic uint64_t head; /*! @brief bytes consumed, written by the consumer */
+    char head_pad[56];
+    _Atomic uint64_t tail; /*! @brief bytes produced, written by the producer */
+    char tail_pad[56];
+    _Atomic uint32_t consumer_waiting; /*! @brief consumer is about to sleep */
+    _Atomic uint32_t producer_waiting; /*! @brief producer is about to sleep */
+    _Atomic uint32_t closed;           /*! @brief producer has closed */
+    char flag_pad[52];
+} shm_ring_hdr_t;
+
+/*!
+ * @brief one direction of a shared memory connection
+ */
+typedef struct shm_ring {
+    shm_ring_hdr_t *hdr;
+    char *data;
+    int data_fd;  /*! @brief eventfd the consumer sleeps on */
+    int space_fd; /*! @brief eventfd the producer sleeps on */
+} shm_ring_t;
+
+/*! @typedef shm_client
+ * @struct shm_client
+ * @brief a shared memory connection, the counterpart of socket_client_t
+ * @details socket_number is the unix socket used for the handshake. event_fd
+ * becomes readable when data arrives after arm_shm_client_t, so it can be put in
+ * the read side of an fd_pool_t
+ */
+typedef struct shm_client {
+    int socket_number;
+    int event_fd;
+    size_t capacity;
+    shm_ring_t tx;
+    shm_ring_t rx;
+    void *map;
+    size_t map_len;
+} shm_client_t;
+
+/*!
+ * @brief creates a unix domain socket that shared memory clients connect to
+ * @param path filesystem path of the socket, or '@name' for the abstract namespace
+ * @return Success: listening socket
+ * @return Failure: -1
+ */
+int listen_shm_socket(thread_logger *thl, char *path);
+
+/*!
+ * @brief accepts a connection and sets up the shared memory rings for it
+ * @param capacity bytes per ring, 0 uses SHM_RING_CAPACITY
+ * @return Success: pointer to instance of shm_client_t
+ * @return Failure: NULL ptr
+ */
+shm_client_t *accept_shm_socket(thread_logger *thl, int listen_fd, size_t capacity);
+
+/*!
+ * @brief connects to a shared memory listener and maps the rings it sends us
+ * @param path filesystem path of the socket, or '@name' for the abstract namespace
+ * @return Success: pointer to instance of shm_client_t
+ * @return Failure: NULL ptr
+ */
+shm_client_t *new_shm_client_socket(thread_logger *thl, char *path);
+
+/*!
+ * @brief writes len bytes into the outgoing ring
+ * @details blocks while the ring is full unless flags contains MSG_DONTWAIT, in
+ * which case as many bytes as fit are written
+ * @return Success: number of bytes written
+ * @return Failure: -1 with errno set to EAGAIN (nothing fit) or EPIPE (peer gone)
+ */
+ssize_t send_shm_client_t(shm_client_t *client, const void *buf, size_t len,
+                          int flags);
+
+/*!
+ * @brief reads up to len bytes from the incoming ring
+ * @details blocks while the ring is empty unless flags contains MSG_DONTWAIT
+ * @return Success: number of bytes read, 0 once the peer has closed
+ * @return Failure: -1 with errno set to EAGAIN
+ */
+ssize_t recv_shm_client_t(shm_client_t *client, void *buf, size_t len, int flags);
+
+/*!
+ * @brief tells the peer we are about to wait on event_fd
+ * @details call this before polling event_fd with fd_pool_t, otherwise the peer
+ * has no reason to write the eventfd. the arm lasts until recv_shm_client_t
+ * next takes data
+ * @return false if data is already available and waiting would be wrong
+ */
+bool arm_shm_client_t(shm_client_t *client);
+
+/*!
+ * @brief closes the connection and frees all resources for the shm_client_t
+ * @details the peer sees EOF once it has drained the ring
+ */
+void free_shm_client_t(shm_client_t *client);
@@ -10,16 +10,24 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define _GNU_SOURCE
+
 #include "sockets.h"
 #include "deps/ulog/logger.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <stddef.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+SOCKET_OPTS default_sock_opts[] = {REUSEADDR, BLOCK};
+int default_socket_opts_count = 2;
+
 /*!
  * @brief creates a new client socket
  * @todo should we enable usage of socket options
@@ -108,10 +116,12 @@ int listen_socket(thread_logger *thl, char *ip, char *port, bool tcp, bool ipv4,
         return -1;
     }
 
-    int socket_num = get_new_socket(thl, bind_address, sock_opts, 2, false, tcp);
+    int socket_num =
+        get_new_socket(thl, bind_address, sock_opts, num_opts, false, tcp);
     freeaddrinfo(bind_address);
     if (socket_num == -1) {
         LOG_ERROR(thl, 0, "failed to get new socket");
+        return -1;
     }
 
     // if this is is a udp sockets, no need to start the listener
@@ -161,6 +171,18 @@ int get_new_socket(thread_logger *thl, addr_info *bind_address,
                 }
                 LOG_INFO(thl, 0, "set socket opt REUSEADDR");
                 break;
+            case REUSEPORT:
+                one = 1;
+                // every socket sharing the port needs this before bind, the
+                // kernel then spreads incoming connections across them
+                rc = setsockopt(listen_socket_num, SOL_SOCKET, SO_REUSEPORT, &one,
+                                sizeof(int));
+                if (rc != 0) {
+                    LOG_ERROR(thl, 0, "failed to set socket reuse port");
+                    return -1;
+                }
+                LOG_INFO(thl, 0, "set socket opt REUSEPORT");
+                break;
             case BLOCK:
                 passed = set_socket_blocking_status(listen_socket_num, true);
                 if (passed == false) {
@@ -195,9 +217,10 @@ int get_new_socket(thread_logger *thl, addr_info *bind_address,
         return listen_socket_num;
     }
     // binds the address to the socket
-    bind(listen_socket_num, bind_address->ai_addr, bind_address->ai_addrlen);
-    if (errno != 0) {
+    rc = bind(listen_socket_num, bind_address->ai_addr, bind_address->ai_addrlen);
+    if (rc != 0) {
         LOGF_ERROR(thl, 0, "socket bind failed with error %s", strerror(errno));
+        close(listen_socket_num);
         return -1;
     }
     return listen_socket_num;
@@ -266,8 +289,245 @@ addr_info new_addr_info_hints(bool ipv4, bool tcp, bool client) {
     return hints;
 }
 
+/*!
+ * @brief generates an addr_info struct for a unix domain socket
+ * @details getaddrinfo has no notion of AF_UNIX, so this builds the equivalent of
+ * its output by hand which lets get_new_socket be used for unix sockets too
+ * @param path filesystem path of the socket, a leading '@' selects the abstract
+ * namespace (the '@' is replaced by a NUL byte and nothing touches the filesystem)
+ * @param seqpacket if true use SOCK_SEQPACKET, otherwise SOCK_STREAM
+ * @param storage backing storage for ai_addr, must outlive the returned struct
+ * @return an addr_info with ai_family set to AF_UNIX, or AF_UNSPEC if the path is
+ * too long
+ */
+addr_info new_unix_addr_info(char *path, bool seqpacket,
+                             struct sockaddr_un *storage) {
+    addr_info info;
+    memset(&info, 0, sizeof(info));
+    memset(storage, 0, sizeof(*storage));
+
+    size_t path_len = strlen(path);
+    if (path_len == 0 || path_len >= sizeof(storage->sun_path)) {
+        info.ai_family = AF_UNSPEC;
+        return info;
+    }
+
+    storage->sun_family = AF_UNIX;
+    memcpy(storage->sun_path, path, path_len);
+    if (path[0] == '@') {
+        // abstract namespace addresses are length delimited, not NUL terminated
+        storage->sun_path[0] = '\0';
+        info.ai_addrlen =
+            (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len);
+    } else {
+        info.ai_addrlen = (socklen_t)sizeof(*storage);
+    }
+
+    info.ai_family = AF_UNIX;
+    info.ai_socktype = seqpacket ? SOCK_SEQPACKET : SOCK_STREAM;
+    info.ai_addr = (sock_addr *)storage;
+    return info;
+}
+
+/*!
+ * @brief creates a new client socket connected to a unix domain socket
+ * @param path filesystem path of the socket, or '@name' for the abstract namespace
+ * @param seqpacket if true use SOCK_SEQPACKET, otherwise SOCK_STREAM
+ */
+socket_client_t *new_unix_client_socket(thread_logger *thl, char *path,
+                                        bool seqpacket) {
+    struct sockaddr_un storage;
+    addr_info peer_address = new_unix_addr_info(path, seqpacket, &storage);
+    if (peer_address.ai_family != AF_UNIX) {
+        LOG_ERROR(thl, 0, "invalid unix socket path");
+        return NULL;
+    }
+
+    int client_socket_num = get_new_socket(thl, &peer_address, NULL, 0, true, true);
+    if (client_socket_num == -1) {
+        LOG_ERROR(thl, 0, "failed to get new socket");
+        return NULL;
+    }
+
+    socket_client_t *sock_client = calloc(1, sizeof(socket_client_t));
+    if (sock_client == NULL) {
+        LOG_ERROR(thl, 0, "failed to calloc socket_client_t");
+        close(client_socket_num);
+        return NULL;
+    }
+
+    sock_client->socket_number = client_socket_num;
+    sock_client->peer_address = NULL;
+
+    LOG_INFO(thl, 0, "unix client successfully created");
+
+    return sock_client;
+}
+
+/*!
+ * @brief attempts to create a unix domain socket listening on the given path
+ * @details a stale socket file left behind at path is removed first. the
+ * returned fd works with accept_socket and with the tcp side of fd_pool_t
+ * @param path filesystem path of the socket, or '@name' for the abstract namespace
+ * @param seqpacket if true use SOCK_SEQPACKET, otherwise SOCK_STREAM
+ */
+int listen_unix_socket(thread_logger *thl, char *path, bool seqpacket,
+                       SOCKET_OPTS sock_opts[], int num_opts) {
+    if (sock_opts == NULL || num_opts == 0) {
+        LOG_ERROR(thl, 0, "empty socket opts");
+        return -1;
+    }
+
+    struct sockaddr_un storage;
+    addr_info bind_address = new_unix_addr_info(path, seqpacket, &storage);
+    if (bind_address.ai_family != AF_UNIX) {
+        LOG_ERROR(thl, 0, "invalid unix socket path");
+        return -1;
+    }
+
+    if (path[0] != '@') {
+        unlink(path);
+    }
+
+    int socket_num =
+        get_new_socket(thl, &bind_address, sock_opts, num_opts, false, true);
+    if (socket_num == -1) {
+        LOG_ERROR(thl, 0, "failed to get new socket");
+        return -1;
+    }
+
+    int rc = listen(socket_num, 10); // todo: enable customizable connection count
+    if (rc == -1) {
+        LOGF_ERROR(thl, 0, "failed to listen on unix socket %s", strerror(errno));
+        close(socket_num);
+        return -1;
+    }
+
+    return socket_num;
+}
+
+/*!
+ * @brief sends file descriptors and a data payload over a unix domain socket
+ * @details the fds are passed with SCM_RIGHTS, the receiving process gets its
+ * own duplicates. at least one byte of data must be sent alongside them
+ * @param socket a connected unix domain socket
+ * @param fds the file descriptors to pass, at most SOCKET_MAX_FDS
+ * @return Success: number of data bytes sent
+ * @return Failure: -1
+ */
+int send_fds_socket(int socket, int *fds, int num_fds, void *data, size_t data_len) {
+    if (num_fds < 0 || num_fds > SOCKET_MAX_FDS || data_len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = data_len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (num_fds > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)num_fds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)num_fds);
+    }
+
+    ssize_t rc;
+    do {
+        rc = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    } while (rc == -1 && errno == EINTR);
+    return (int)rc;
+}
+
+/*!
+ * @brief receives file descriptors and a data payload from a unix domain socket
+ * @details received fds have FD_CLOEXEC set. any fds beyond max_fds are closed
+ * @param socket a connected unix domain socket
+ * @param fds written with the received file descriptors
+ * @param data_len in: size of data, out: number of data bytes received (0 on EOF)
+ * @return Success: number of fds received
+ * @return Failure: -1
+ */
+int recv_fds_socket(int socket, int *fds, int max_fds, void *data,
+                    size_t *data_len) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = *data_len;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t rc;
+    do {
+        rc = recvmsg(socket, &msg, 0);
+    } while (rc == -1 && errno == EINTR);
+    if (rc == -1) {
+        return -1;
+    }
+    *data_len = (size_t)rc;
+
+    int num_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *)CMSG_DATA(cmsg);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, &received[i], sizeof(int));
+            if (num_fds == max_fds) {
+                close(fd);
+                continue;
+            }
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fds[num_fds] = fd;
+            num_fds += 1;
+        }
+    }
+
+    if (msg.msg_flags & MSG_CTRUNC) {
+        // the kernel dropped fds we had no room for, the caller can't trust the
+        // message so treat it as an error
+        for (int i = 0; i < num_fds; i++) {
+            close(fds[i]);
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return num_fds;
+}
+
 void free_socket_client_t(socket_client_t *sock_client) {
     close(sock_client->socket_number);
-    freeaddrinfo(sock_client->peer_address);
+    if (sock_client->peer_address != NULL) {
+        freeaddrinfo(sock_client->peer_address);
+    }
     free(sock_client);
 }
\ No newline at end of file
@@ -26,6 +26,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /*! @typedef addr_info
@@ -48,7 +49,8 @@ typedef struct sockaddr_storage sock_addr_storage;
 
 /*! @typedef socket_client
  * @struct socket_client
- * a generic tcp/udp socket client
+ * a generic tcp/udp/unix socket client
+ * @note peer_address is NULL for unix domain sockets
  */
 typedef struct socket_client {
     int socket_number;
@@ -65,10 +67,22 @@ typedef enum {
     NOBLOCK,
     /*! sets socket to blocking mode */
     BLOCK,
+    /*! sets socket with SO_REUSEPORT, lets several processes listen on one port */
+    REUSEPORT,
 } SOCKET_OPTS;
 
-SOCKET_OPTS default_sock_opts[] = {REUSEADDR, BLOCK};
-int default_socket_opts_count = 2;
+/*!
+ * @brief the most file descriptors send_fds_socket and recv_fds_socket will pass
+ * in a single message
+ */
+#ifndef SOCKET_MAX_FDS
+#define SOCKET_MAX_FDS 64
+#endif
+
+/*! @brief default socket options, enables SO_REUSEADDR and blocking mode */
+extern SOCKET_OPTS default_sock_opts[];
+/*! @brief number of entries in default_sock_opts */
+extern int default_socket_opts_count;
 
 /*!
  * @brief creates a new client socket
@@ -119,4 +133,58 @@ char *get_name_info(sock_addr *client_address);
  */
 addr_info new_addr_info_hints(bool ipv4, bool tcp, bool client);
 
+/*!
+ * @brief generates an addr_info struct for a unix domain socket
+ * @details getaddrinfo has no notion of AF_UNIX, so this builds the equivalent of
+ * its output by hand which lets get_new_socket be used for unix sockets too
+ * @param path filesystem path of the socket, a leading '@' selects the abstract
+ * namespace (the '@' is replaced by a NUL byte and nothing touches the filesystem)
+ * @param seqpacket if true use SOCK_SEQPACKET, otherwise SOCK_STREAM
+ * @param storage backing storage for ai_addr, must outlive the returned struct
+ * @return an addr_info with ai_family set to AF_UNIX, or AF_UNSPEC if the path is
+ * too long
+ */
+addr_info new_unix_addr_info(char *path, bool seqpacket,
+                             struct sockaddr_un *storage);
+
+/*!
+ * @brief creates a new client socket connected to a unix domain socket
+ * @param path filesystem path of the socket, or '@name' for the abstract namespace
+ * @param seqpacket if true use SOCK_SEQPACKET, otherwise SOCK_STREAM
+ */
+socket_client_t *new_unix_client_socket(thread_logger *thl, char *path,
+                                        bool seqpacket);
+
+/*!
+ * @brief attempts to create a unix domain socket listening on the given path
+ * @details a stale socket file left behind at path is removed first. the
+ * returned fd works with accept_socket and with the tcp side of fd_pool_t
+ * @param path filesystem path of the socket, or '@name' for the abstract namespace
+ * @param seqpacket if true use SOCK_SEQPACKET, otherwise SOCK_STREAM
+ */
+int listen_unix_socket(thread_logger *thl, char *path, bool seqpacket,
+                       SOCKET_OPTS sock_opts[], int num_opts);
+
+/*!
+ * @brief sends file descriptors and a data payload over a unix domain socket
+ * @details the fds are passed with SCM_RIGHTS, the receiving process gets its
+ * own duplicates. at least one byte of data must be sent alongside them
+ * @param socket a connected unix domain socket
+ * @param fds the file descriptors to pass, at most SOCKET_MAX_FDS
+ * @return Success: number of data bytes sent
+ * @return Failure: -1
+ */
+int send_fds_socket(int socket, int *fds, int num_fds, void *data, size_t data_len);
+
+/*!
+ * @brief receives file descriptors and a data payload from a unix domain socket
+ * @details received fds have FD_CLOEXEC set. any fds beyond max_fds are closed
+ * @param socket a connected unix domain socket
+ * @param fds written with the received file descriptors
+ * @param data_len in: size of data, out: number of data bytes received (0 on EOF)
+ * @return Success: number of fds received
+ * @return Failure: -1
+ */
+int recv_fds_socket(int socket, int *fds, int max_fds, void *data, size_t *data_len);
+
 void free_socket_client_t(socket_client_t *sock_client);
\ No newline at end of file
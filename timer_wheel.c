@@ -0,0 +1,308 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "timer_wheel.h"
+#include <string.h>
+
+/*! @brief the last tick of the rotation of the top level containing tick */
+#define TIMER_WHEEL_RANGE_END(tick) \
+    ((tick) | ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1))
+
+static inline void init_list(wheel_timer_t *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static inline bool empty_list(wheel_timer_t *head) {
+    return head->next == head;
+}
+
+static inline void link_timer(wheel_timer_t *head, wheel_timer_t *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static inline void unlink_timer(wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/*!
+ * @brief moves every timer in head onto list so head can be refilled
+ */
+static void take_list(wheel_timer_t *head, wheel_timer_t *list) {
+    init_list(list);
+    if (empty_list(head)) {
+        return;
+    }
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    init_list(head);
+}
+
+/*!
+ * @brief links an armed timer into the slot it belongs in relative to base
+ * @details the level is the lowest one whose rotation contains the expiry, so the
+ * slot is always ahead of base and is reached, or cascaded, exactly on time
+ */
+static void place_timer(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t base) {
+    uint64_t key = timer->expires;
+    if (key < base) {
+        key = base;
+    }
+    if (key > TIMER_WHEEL_RANGE_END(base)) {
+        // too far out, park it at the end of the range and place it again later
+        key = TIMER_WHEEL_RANGE_END(base);
+    }
+    unsigned level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           (key >> (TIMER_WHEEL_BITS * (level + 1))) !=
+               (base >> (TIMER_WHEEL_BITS * (level + 1)))) {
+        level += 1;
+    }
+    unsigned slot = (unsigned)(key >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer->level = (uint8_t)level;
+    timer->slot = (uint8_t)slot;
+    link_timer(&wheel->slots[level][slot], timer);
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/*!
+ * @brief expires the level 0 slot of the current tick
+ */
+static size_t expire_slot(timer_wheel_t *wheel, unsigned slot) {
+    wheel_timer_t list;
+    take_list(&wheel->slots[0][slot], &list);
+    wheel->occupied[0] &= ~(1ULL << slot);
+    size_t expired = 0;
+    while (empty_list(&list) == false) {
+        wheel_timer_t *timer = list.next;
+        unlink_timer(timer);
+        if (timer->expires > wheel->current) {
+            // parked beyond the range of the wheel, not due yet
+            place_timer(wheel, timer, wheel->current + 1);
+            continue;
+        }
+        timer->level = TIMER_WHEEL_EXPIRED;
+        link_timer(&wheel->expired, timer);
+        expired += 1;
+    }
+    return expired;
+}
+
+/*!
+ * @brief cascades the higher levels after level 0 wrapped around
+ */
+static void cascade(timer_wheel_t *wheel) {
+    for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned slot = (unsigned)(wheel->current >> (TIMER_WHEEL_BITS * level)) &
+                        TIMER_WHEEL_MASK;
+        wheel_timer_t list;
+        take_list(&wheel->slots[level][slot], &list);
+        wheel->occupied[level] &= ~(1ULL << slot);
+        while (empty_list(&list) == false) {
+            wheel_timer_t *timer = list.next;
+            unlink_timer(timer);
+            place_timer(wheel, timer, wheel->current);
+        }
+        if (slot != 0) {
+            // this level did not wrap, so the ones above did not either
+            return;
+        }
+    }
+}
+
+/*!
+ * @brief the tick of the first occupied slot ahead of the wheel, looking at
+ * first_level and up
+ * @details a level 0 slot is reached at its tick, a higher level slot is cascaded
+ * at the first tick it covers
+ * @return UINT64_MAX if those levels are empty
+ */
+static uint64_t next_occupied(timer_wheel_t *wheel, unsigned first_level) {
+    for (unsigned level = first_level; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned shift = TIMER_WHEEL_BITS * level;
+        unsigned digit = (unsigned)(wheel->current >> shift) & TIMER_WHEEL_MASK;
+        // level 0 includes the current tick, higher levels only what is ahead of it
+        uint64_t ahead;
+        if (level == 0) {
+            ahead = ~0ULL << digit;
+        } else {
+            ahead = digit == TIMER_WHEEL_MASK ? 0 : ~0ULL << (digit + 1);
+        }
+        uint64_t bits = wheel->occupied[level] & ahead;
+        if (bits == 0) {
+            continue;
+        }
+        uint64_t rotation = (wheel->current >> (shift + TIMER_WHEEL_BITS))
+                            << (shift + TIMER_WHEEL_BITS);
+        return rotation | ((uint64_t)__builtin_ctzll(bits) << shift);
+    }
+    return UINT64_MAX;
+}
+
+/*!
+ * @brief prepares an empty wheel
+ * @param now_ns the current monotonic time, becomes tick 0
+ */
+void init_timer_wheel_t(timer_wheel_t *wheel, uint64_t now_ns) {
+    memset(wheel, 0, sizeof(timer_wheel_t));
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (unsigned slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            init_list(&wheel->slots[level][slot]);
+        }
+    }
+    init_list(&wheel->expired);
+    wheel->start_ns = now_ns;
+}
+
+/*!
+ * @brief arms a timer to expire at deadline_ns, re-arming it if it is armed
+ * @details deadlines are rounded up to the next tick so a timer never fires
+ * early, a deadline in the past expires on the next advance
+ */
+void add_timer_wheel_t(timer_wheel_t *wheel, wheel_timer_t *timer,
+                       uint64_t deadline_ns) {
+    remove_timer_wheel_t(wheel, timer);
+    uint64_t expires = 0;
+    if (deadline_ns > wheel->start_ns) {
+        expires = (deadline_ns - wheel->start_ns + TIMER_WHEEL_TICK_NS - 1) /
+                  TIMER_WHEEL_TICK_NS;
+    }
+    timer->expires = expires;
+    timer->armed = true;
+    place_timer(wheel, timer, wheel->current);
+    wheel->count += 1;
+}
+
+/*!
+ * @brief disarms a timer, does nothing if it is not armed
+ */
+void remove_timer_wheel_t(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->armed == false) {
+        return;
+    }
+    unlink_timer(timer);
+    if (timer->level != TIMER_WHEEL_EXPIRED &&
+        empty_list(&wheel->slots[timer->level][timer->slot])) {
+        wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+    timer->armed = false;
+    wheel->count -= 1;
+}
+
+/*!
+ * @brief moves the wheel forward to now_ns
+ * @details expired timers are moved to an expired list to be taken off with
+ * pop_expired_timer_wheel_t. they count as armed until popped, so removing or
+ * re-arming one that has not been popped yet still works
+ * @return number of timers expired
+ */
+size_t advance_timer_wheel_t(timer_wheel_t *wheel, uint64_t now_ns) {
+    if (now_ns < wheel->start_ns) {
+        return 0;
+    }
+    uint64_t now = (now_ns - wheel->start_ns) / TIMER_WHEEL_TICK_NS;
+    if (wheel->count == 0) {
+        // nothing to expire or cascade, skip the idle stretch in one go
+        if (wheel->current <= now) {
+            wheel->current = now + 1;
+        }
+        return 0;
+    }
+    size_t expired = 0;
+    while (wheel->current <= now) {
+        unsigned slot = (unsigned)wheel->current & TIMER_WHEEL_MASK;
+        if (wheel->occupied[0] & (1ULL << slot)) {
+            expired += expire_slot(wheel, slot);
+        }
+        uint64_t next;
+        if (wheel->occupied[0] != 0) {
+            // jump straight to the next occupied slot or the end of the rotation
+            uint64_t later = slot == TIMER_WHEEL_MASK
+                                 ? 0
+                                 : wheel->occupied[0] & (~0ULL << (slot + 1));
+            next = later != 0 ? (wheel->current & ~(uint64_t)TIMER_WHEEL_MASK) |
+                                    (uint64_t)__builtin_ctzll(later)
+                              : (wheel->current | TIMER_WHEEL_MASK) + 1;
+        } else {
+            // level 0 is empty, nothing happens until a higher level cascades
+            next = next_occupied(wheel, 1);
+        }
+        if (next > now + 1) {
+            next = now + 1;
+        }
+        wheel->current = next;
+        if ((next & TIMER_WHEEL_MASK) == 0) {
+            cascade(wheel);
+        }
+    }
+    return expired;
+}
+
+/*!
+ * @brief when the wheel next needs advancing
+ * @details either the deadline of the earliest timer in level 0 or the time the
+ * next occupied slot of a higher level cascades down
+ * @return monotonic nanoseconds, 0 if expired timers are waiting to be popped,
+ * UINT64_MAX if no timer is armed
+ */
+uint64_t next_timer_wheel_t(timer_wheel_t *wheel) {
+    if (empty_list(&wheel->expired) == false) {
+        return 0;
+    }
+    if (wheel->count == 0) {
+        return UINT64_MAX;
+    }
+    uint64_t tick = next_occupied(wheel, 0);
+    if (tick == UINT64_MAX) {
+        // a timer parked in the next rotation of level 0, advance right away
+        tick = wheel->current;
+    }
+    return wheel->start_ns + tick * TIMER_WHEEL_TICK_NS;
+}
+
+/*!
+ * @brief disarms and returns the next expired timer, NULL once there are none
+ */
+wheel_timer_t *pop_expired_timer_wheel_t(timer_wheel_t *wheel) {
+    if (empty_list(&wheel->expired)) {
+        return NULL;
+    }
+    wheel_timer_t *timer = wheel->expired.next;
+    unlink_timer(timer);
+    timer->armed = false;
+    wheel->count -= 1;
+    return timer;
+}
+
+/*!
+ * @brief disarms every timer in the wheel
+ */
+void clear_timer_wheel_t(timer_wheel_t *wheel) {
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (unsigned slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            wheel_timer_t *head = &wheel->slots[level][slot];
+            while (empty_list(head) == false) {
+                remove_timer_wheel_t(wheel, head->next);
+            }
+        }
+    }
+    while (pop_expired_timer_wheel_t(wheel) != NULL) {
+    }
+}
@@ -0,0 +1,122 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file timer_wheel.h
+ * @brief hierarchical timing wheel with O(1) arm and cancel
+ * @details time is counted in ticks of TIMER_WHEEL_TICK_NS. the wheel has
+ * TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots, each slot a circular
+ * list, so arming links a timer into one slot and cancelling unlinks it. level 0
+ * holds timers due within the current rotation of 64 ticks, level n those due
+ * within the current rotation of level n + 1. when a level wraps around the next
+ * slot of the level above is cascaded down. a bitmap of occupied slots per level
+ * lets advancing skip empty stretches and tells the caller when the next timer,
+ * or the next cascade, is due so it can sleep exactly until then
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*! @brief length of a tick in nanoseconds */
+#ifndef TIMER_WHEEL_TICK_NS
+#define TIMER_WHEEL_TICK_NS 1000000ULL
+#endif
+
+/*! @brief levels in the wheel, 4 levels of 1ms ticks cover 4.6 hours */
+#ifndef TIMER_WHEEL_LEVELS
+#define TIMER_WHEEL_LEVELS 4
+#endif
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+/*! @brief the level recorded for timers sitting in the expired list */
+#define TIMER_WHEEL_EXPIRED TIMER_WHEEL_LEVELS
+
+/*! @typedef wheel_timer
+ * @struct wheel_timer
+ * @brief a timer linked into a wheel, embedded in the caller's own struct
+ * @details timers further out than the wheel covers are parked at the end of its
+ * range and placed again once the wheel gets there
+ */
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    uint64_t expires; /*! @brief tick the timer is due at */
+    uint8_t level;
+    uint8_t slot;
+    bool armed;
+} wheel_timer_t;
+
+/*! @typedef timer_wheel
+ * @struct timer_wheel
+ * @brief the wheel
+ */
+typedef struct timer_wheel {
+    /*! @brief list heads */
+    wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    /*! @brief bit n set if slot n is not empty */
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    wheel_timer_t expired; /*! @brief timers due but not popped yet */
+    uint64_t current; /*! @brief next tick to be processed */
+    uint64_t start_ns; /*! @brief time of tick 0 */
+    size_t count;
+} timer_wheel_t;
+
+/*!
+ * @brief prepares an empty wheel
+ * @param now_ns the current monotonic time, becomes tick 0
+ */
+void init_timer_wheel_t(timer_wheel_t *wheel, uint64_t now_ns);
+
+/*!
+ * @brief arms a timer to expire at deadline_ns, re-arming it if it is armed
+ * @details deadlines are rounded up to the next tick so a timer never fires
+ * early, a deadline in the past expires on the next advance
+ */
+void add_timer_wheel_t(timer_wheel_t *wheel, wheel_timer_t *timer,
+                       uint64_t deadline_ns);
+
+/*!
+ * @brief disarms a timer, does nothing if it is not armed
+ */
+void remove_timer_wheel_t(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+/*!
+ * @brief moves the wheel forward to now_ns
+ * @details expired timers are moved to an expired list to be taken off with
+ * pop_expired_timer_wheel_t. they count as armed until popped, so removing or
+ * re-arming one that has not been popped yet still works
+ * @return number of timers expired
+ */
+size_t advance_timer_wheel_t(timer_wheel_t *wheel, uint64_t now_ns);
+
+/*!
+ * @brief when the wheel next needs advancing
+ * @details either the deadline of the earliest timer in level 0 or the time the
+ * next occupied slot of a higher level cascades down
+ * @return monotonic nanoseconds, 0 if expired timers are waiting to be popped,
+ * UINT64_MAX if no timer is armed
+ */
+uint64_t next_timer_wheel_t(timer_wheel_t *wheel);
+
+/*!
+ * @brief disarms and returns the next expired timer, NULL once there are none
+ */
+wheel_timer_t *pop_expired_timer_wheel_t(timer_wheel_t *wheel);
+
+/*!
+ * @brief disarms every timer in the wheel
+ */
+void clear_timer_wheel_t(timer_wheel_t *wheel);
@@ -0,0 +1,345 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "work_pool.h"
+#include "deps/ulog/logger.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*! @brief the worker running on this thread, if any */
+static _Thread_local work_worker_t *thread_worker;
+
+/*!
+ * @brief pushes item onto the bottom of the deque, only called by its owner
+ * @return false if the deque is full
+ */
+static bool push_deque(work_deque_t *deque, work_item_t *item) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= WORK_POOL_DEQUE_SIZE) {
+        return false;
+    }
+    atomic_store_explicit(&deque->items[bottom & (WORK_POOL_DEQUE_SIZE - 1)], item,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return true;
+}
+
+/*!
+ * @brief pops the newest item off the bottom of the deque, only called by its owner
+ * @details races thieves with a compare and swap on top only for the last item
+ */
+static work_item_t *take_deque(work_deque_t *deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    work_item_t *item = atomic_load_explicit(
+        &deque->items[bottom & (WORK_POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        if (atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                    memory_order_seq_cst,
+                                                    memory_order_relaxed) == false) {
+            item = NULL; // a thief got it
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+/*!
+ * @brief takes the oldest item off the top of another worker's deque
+ * @return NULL if the deque is empty or another thread won the race for the item
+ */
+static work_item_t *steal_deque(work_deque_t *deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    work_item_t *item = atomic_load_explicit(
+        &deque->items[top & (WORK_POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                memory_order_seq_cst,
+                                                memory_order_relaxed) == false) {
+        return NULL;
+    }
+    return item;
+}
+
+/*!
+ * @brief the worker whose inbox work from reactor goes to
+ * @details the same reactor always maps to the same worker so the data its
+ * handlers hand over stays warm in one worker's cache
+ */
+static size_t home_worker(work_pool_t *pool, reactor_t *reactor) {
+    if (reactor == NULL) {
+        return atomic_fetch_add_explicit(&pool->next_home, 1, memory_order_relaxed) %
+               pool->num_workers;
+    }
+    uint64_t hash = (uint64_t)(uintptr_t)reactor * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(hash >> 32) % pool->num_workers;
+}
+
+/*!
+ * @brief finds the next item for worker, its own deque first, then its inbox,
+ * then the deques and inboxes of the others starting at a random one
+ */
+static work_item_t *find_work(work_worker_t *worker) {
+    work_pool_t *pool = worker->pool;
+    work_item_t *item = take_deque(&worker->deque);
+    if (item != NULL) {
+        return item;
+    }
+    void *value;
+    if (try_recv_channel_t(worker->inbox, &value)) {
+        return value;
+    }
+
+    worker->seed = worker->seed * 1103515245 + 12345;
+    size_t start = (worker->seed >> 16) % pool->num_workers;
+    for (size_t n = 0; n < pool->num_workers; n++) {
+        work_worker_t *victim = &pool->workers[(start + n) % pool->num_workers];
+        if (victim == worker) {
+            continue;
+        }
+        item = steal_deque(&victim->deque);
+        if (item == NULL && try_recv_channel_t(victim->inbox, &value)) {
+            item = value;
+        }
+        if (item != NULL) {
+            atomic_fetch_add_explicit(&worker->stats.steals, 1,
+                                      memory_order_relaxed);
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * @brief runs the item and posts its completion back to its reactor
+ */
+static void run_item(work_worker_t *worker, work_item_t *item) {
+    work_pool_t *pool = worker->pool;
+    item->fn(pool, item->arg);
+    atomic_fetch_add_explicit(&worker->stats.executed, 1, memory_order_relaxed);
+    if (item->reactor != NULL && item->done != NULL) {
+        atomic_fetch_add_explicit(&pool->posted, 1, memory_order_relaxed);
+        // the item belongs to the reactor from here on
+        post_reactor_t(item->reactor, &item->post, item->done, item->arg);
+    }
+}
+
+/*!
+ * @brief parks the worker until something is submitted
+ * @details idle is raised before pending is checked, and submitters raise pending
+ * before checking idle, so one of the two always sees the other
+ */
+static void idle_wait(work_worker_t *worker) {
+    work_pool_t *pool = worker->pool;
+    atomic_fetch_add(&pool->idle, 1);
+    pthread_mutex_lock(&pool->idle_lock);
+    while (atomic_load(&pool->pending) == 0 &&
+           atomic_load(&pool->stopping) == false) {
+        atomic_fetch_add_explicit(&worker->stats.sleeps, 1, memory_order_relaxed);
+        pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+    atomic_fetch_sub(&pool->idle, 1);
+}
+
+static void *worker_main(void *data) {
+    work_worker_t *worker = data;
+    thread_worker = worker;
+    while (atomic_load(&worker->pool->stopping) == false) {
+        work_item_t *item = find_work(worker);
+        if (item == NULL) {
+            idle_wait(worker);
+            continue;
+        }
+        atomic_fetch_sub(&worker->pool->pending, 1);
+        run_item(worker, item);
+    }
+    return NULL;
+}
+
+/*!
+ * @brief stops and joins the first num_workers workers
+ */
+static void stop_threads(work_pool_t *pool, size_t num_workers) {
+    atomic_store(&pool->stopping, true);
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for (size_t i = 0; i < num_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new work_pool_t object
+ * @details starts the worker threads
+ * @param num_workers worker threads to run, 0 for one per online cpu
+ * @return Success: pointer to instance of work_pool_t
+ * @return Failure: NULL ptr
+ */
+work_pool_t *new_work_pool_t(thread_logger *thl, size_t num_workers) {
+    if (num_workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (num_workers > WORK_POOL_MAX_WORKERS) {
+        num_workers = WORK_POOL_MAX_WORKERS;
+    }
+    work_pool_t *pool = calloc(1, sizeof(work_pool_t));
+    if (pool == NULL) {
+        LOG_ERROR(thl, 0, "failed to calloc work_pool_t");
+        return NULL;
+    }
+    pool->thl = thl;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    // the deques are cache line aligned so the workers need to be as well
+    pool->workers =
+        aligned_alloc(CHANNEL_CACHE_LINE, num_workers * sizeof(work_worker_t));
+    if (pool->workers == NULL) {
+        LOG_ERROR(thl, 0, "failed to allocate workers");
+        goto ERROR;
+    }
+    memset(pool->workers, 0, num_workers * sizeof(work_worker_t));
+    for (size_t i = 0; i < num_workers; i++) {
+        work_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        worker->seed = (uint32_t)(i * 2654435761u + 1);
+        worker->inbox = new_channel_t(WORK_POOL_INBOX_SIZE);
+        if (worker->inbox == NULL) {
+            LOG_ERROR(thl, 0, "failed to create worker inbox");
+            goto ERROR;
+        }
+    }
+
+    pool->num_workers = num_workers;
+    for (size_t i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main,
+                           &pool->workers[i]) != 0) {
+            LOG_ERROR(thl, 0, "failed to start worker thread");
+            stop_threads(pool, i);
+            goto ERROR;
+        }
+    }
+    return pool;
+
+ERROR:
+    for (size_t i = 0; i < num_workers && pool->workers != NULL; i++) {
+        free_channel_t(pool->workers[i].inbox);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool->workers);
+    free(pool);
+    return NULL;
+}
+
+/*!
+ * @brief runs fn(pool, arg) on a worker, then done(reactor, arg) on the reactor
+ * @details from a worker the item goes onto that worker's own deque, from any
+ * other thread into the inbox of the reactor's home worker
+ * @param reactor the reactor to post the completion to, NULL for none
+ * @return Success: 0
+ * @return Failure: -1 with errno set to EAGAIN if every queue is full
+ */
+int submit_work_pool_t(work_pool_t *pool, work_item_t *item, work_fn fn,
+                       reactor_t *reactor, reactor_task_fn done, void *arg) {
+    item->fn = fn;
+    item->arg = arg;
+    item->reactor = reactor;
+    item->done = done;
+
+    // raised first so a worker that finds nothing yet does not go to sleep on it
+    atomic_fetch_add(&pool->pending, 1);
+    work_worker_t *worker = current_worker_work_pool_t(pool);
+    bool queued = worker != NULL && push_deque(&worker->deque, item);
+    if (queued == false) {
+        size_t home = home_worker(pool, reactor);
+        for (size_t n = 0; n < pool->num_workers && queued == false; n++) {
+            queued = try_send_channel_t(
+                pool->workers[(home + n) % pool->num_workers].inbox, item);
+        }
+    }
+    if (queued == false) {
+        atomic_fetch_sub(&pool->pending, 1);
+        LOG_ERROR(pool->thl, 0, "work pool queues are full");
+        errno = EAGAIN;
+        return -1;
+    }
+    atomic_fetch_add_explicit(&pool->submitted, 1, memory_order_relaxed);
+
+    if (atomic_load(&pool->idle) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return 0;
+}
+
+/*!
+ * @brief the worker running the calling thread, NULL outside of the pool
+ */
+work_worker_t *current_worker_work_pool_t(work_pool_t *pool) {
+    work_worker_t *worker = thread_worker;
+    return worker != NULL && worker->pool == pool ? worker : NULL;
+}
+
+/*!
+ * @brief fills stats with the pool's counters
+ */
+void stats_work_pool_t(work_pool_t *pool, work_pool_stats_t *stats) {
+    memset(stats, 0, sizeof(work_pool_stats_t));
+    stats->submitted = atomic_load(&pool->submitted);
+    stats->posted = atomic_load(&pool->posted);
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        work_worker_stats_t *worker = &pool->workers[i].stats;
+        uint64_t executed = atomic_load(&worker->executed);
+        stats->executed += executed;
+        stats->steals += atomic_load(&worker->steals);
+        stats->sleeps += atomic_load(&worker->sleeps);
+        if (executed > 0) {
+            stats->workers_used += 1;
+        }
+    }
+}
+
+/*!
+ * @brief stops the workers and frees up all resources allocated for the
+ * work_pool_t struct
+ * @note items that have not run yet are dropped, their completions never run
+ */
+void free_work_pool_t(work_pool_t *pool) {
+    stop_threads(pool, pool->num_workers);
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        free_channel_t(pool->workers[i].inbox);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,168 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file work_pool.h
+ * @brief work stealing thread pool for taking cpu heavy work off reactors
+ * @details every worker owns a Chase-Lev deque it pushes and pops at the bottom
+ * while idle workers steal from the top, and a channel_t inbox for work submitted
+ * from outside the pool. a reactor submitting work never takes a lock unless a
+ * worker is asleep: the inbox is lock-free and the work of one reactor always
+ * goes to the same home worker, other workers only steal it when that one is
+ * busy. once a work item has run its completion is posted back to the reactor
+ * it came from with post_reactor_t and runs on that reactor's thread
+ */
+
+#pragma once
+
+#include "channel.h"
+#include "deps/ulog/logger.h"
+#include "reactor.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*! @brief work items a worker's deque holds, must be a power of two */
+#ifndef WORK_POOL_DEQUE_SIZE
+#define WORK_POOL_DEQUE_SIZE 1024
+#endif
+
+/*! @brief work items a worker's inbox holds */
+#ifndef WORK_POOL_INBOX_SIZE
+#define WORK_POOL_INBOX_SIZE 1024
+#endif
+
+/*! @brief most workers a pool runs */
+#ifndef WORK_POOL_MAX_WORKERS
+#define WORK_POOL_MAX_WORKERS 64
+#endif
+
+struct work_pool;
+
+/*! @typedef work_fn
+ * @brief the work itself, runs on a worker thread
+ */
+typedef void (*work_fn)(struct work_pool *pool, void *arg);
+
+/*! @typedef work_item
+ * @struct work_item
+ * @brief a unit of work
+ * @details owned by the caller, usually embedded in the request it belongs to,
+ * and must stay valid until its completion has run
+ */
+typedef struct work_item {
+    work_fn fn;
+    void *arg;
+    reactor_t *reactor;   /*! @brief where done runs, NULL for no completion */
+    reactor_task_fn done; /*! @brief called with arg on the reactor's thread */
+    reactor_post_t post;
+} work_item_t;
+
+/*!
+ * @brief a Chase-Lev work stealing deque with a fixed capacity
+ */
+typedef struct work_deque {
+    _Alignas(CHANNEL_CACHE_LINE) _Atomic int64_t top;
+    _Alignas(CHANNEL_CACHE_LINE) _Atomic int64_t bottom;
+    _Atomic(work_item_t *) items[WORK_POOL_DEQUE_SIZE];
+} work_deque_t;
+
+/*!
+ * @brief counters kept by a worker
+ */
+typedef struct work_worker_stats {
+    _Atomic uint64_t executed;
+    _Atomic uint64_t steals; /*! @brief items taken from another worker */
+    _Atomic uint64_t sleeps; /*! @brief times the worker went idle */
+} work_worker_stats_t;
+
+/*! @typedef work_worker
+ * @struct work_worker
+ * @brief a thread running work items
+ */
+typedef struct work_worker {
+    work_deque_t deque;
+    struct work_pool *pool;
+    size_t id;
+    pthread_t thread;
+    channel_t *inbox; /*! @brief work submitted from outside the pool */
+    uint32_t seed;    /*! @brief picks where stealing starts */
+    work_worker_stats_t stats;
+} work_worker_t;
+
+/*!
+ * @brief a snapshot of the pool's counters, summed over its workers
+ */
+typedef struct work_pool_stats {
+    uint64_t submitted;
+    uint64_t executed;
+    uint64_t steals;
+    uint64_t sleeps;
+    uint64_t posted; /*! @brief completions posted back to reactors */
+    size_t workers_used; /*! @brief workers that ran at least one item */
+} work_pool_stats_t;
+
+/*! @typedef work_pool
+ * @struct work_pool
+ * @brief the thread pool
+ */
+typedef struct work_pool {
+    work_worker_t *workers;
+    size_t num_workers;
+    _Atomic size_t pending; /*! @brief submitted items no worker has taken yet */
+    _Atomic size_t next_home; /*! @brief spreads submissions without a reactor */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    _Atomic size_t idle;
+    _Atomic uint64_t submitted;
+    _Atomic uint64_t posted;
+    _Atomic bool stopping;
+    thread_logger *thl;
+} work_pool_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new work_pool_t object
+ * @details starts the worker threads
+ * @param num_workers worker threads to run, 0 for one per online cpu
+ * @return Success: pointer to instance of work_pool_t
+ * @return Failure: NULL ptr
+ */
+work_pool_t *new_work_pool_t(thread_logger *thl, size_t num_workers);
+
+/*!
+ * @brief runs fn(pool, arg) on a worker, then done(reactor, arg) on the reactor
+ * @details from a worker the item goes onto that worker's own deque, from any
+ * other thread into the inbox of the reactor's home worker
+ * @param reactor the reactor to post the completion to, NULL for none
+ * @return Success: 0
+ * @return Failure: -1 with errno set to EAGAIN if every queue is full
+ */
+int submit_work_pool_t(work_pool_t *pool, work_item_t *item, work_fn fn,
+                       reactor_t *reactor, reactor_task_fn done, void *arg);
+
+/*!
+ * @brief the worker running the calling thread, NULL outside of the pool
+ */
+work_worker_t *current_worker_work_pool_t(work_pool_t *pool);
+
+/*!
+ * @brief fills stats with the pool's counters
+ */
+void stats_work_pool_t(work_pool_t *pool, work_pool_stats_t *stats);
+
+/*!
+ * @brief stops the workers and frees up all resources allocated for the
+ * work_pool_t struct
+ * @note items that have not run yet are dropped, their completions never run
+ */
+void free_work_pool_t(work_pool_t *pool);
@@ -0,0 +1,157 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include "zerocopy.h"
+#include "deps/ulog/logger.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*!
+ * @brief reads up to len bytes into the copy buffer
+ */
+static ssize_t copy_zerocopy_rx_t(zerocopy_rx_t *zrx, size_t len,
+                                  zerocopy_view_t *view) {
+    if (len > zrx->copy_len) {
+        len = zrx->copy_len;
+    }
+    ssize_t n;
+    do {
+        n = recv(zrx->fd, zrx->copy_buf, len, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0) {
+        view->copied = zrx->copy_buf;
+        view->copied_len = (size_t)n;
+        zrx->copied_bytes += (size_t)n;
+    }
+    return n;
+}
+
+/*!
+ * @brief allocates memory for, and initializes a new zerocopy_rx_t object
+ * @param fd a connected tcp socket, typically returned by accept_socket
+ * @param window_len size of the mmap window, 0 uses ZEROCOPY_WINDOW_SIZE
+ * @return Success: pointer to instance of zerocopy_rx_t
+ * @return Failure: NULL ptr
+ */
+zerocopy_rx_t *new_zerocopy_rx_t(thread_logger *thl, int fd, size_t window_len) {
+    zerocopy_rx_t *zrx = calloc(1, sizeof(zerocopy_rx_t));
+    if (zrx == NULL) {
+        LOG_ERROR(thl, 0, "failed to calloc zerocopy_rx_t");
+        return NULL;
+    }
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    if (window_len == 0) {
+        window_len = ZEROCOPY_WINDOW_SIZE;
+    }
+    window_len = (window_len + page_size - 1) & ~(page_size - 1);
+
+    zrx->fd = fd;
+    zrx->thl = thl;
+    zrx->copy_len = ZEROCOPY_COPY_SIZE;
+    zrx->copy_buf = malloc(zrx->copy_len);
+    if (zrx->copy_buf == NULL) {
+        LOG_ERROR(thl, 0, "failed to malloc zerocopy copy buffer");
+        free(zrx);
+        return NULL;
+    }
+
+    // the window is a mapping of the socket itself, the kernel installs received
+    // pages into it on every TCP_ZEROCOPY_RECEIVE call
+    zrx->window = mmap(NULL, window_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (zrx->window == MAP_FAILED) {
+        LOGF_DEBUG(thl, 0, "zerocopy receive unavailable, using recv: %s",
+                   strerror(errno));
+        zrx->window = NULL;
+        zrx->fallback = true;
+    } else {
+        zrx->window_len = window_len;
+    }
+
+    return zrx;
+}
+
+/*!
+ * @brief receives the next chunk of the stream
+ * @details maps as many whole pages as the kernel allows, then reads any bytes
+ * it asked us to skip with recv. if nothing could be mapped this waits with recv
+ * according to the blocking mode of the socket
+ * @param view filled in with the received data
+ * @return Success: number of bytes in view, 0 on EOF
+ * @return Failure: -1 with errno set (EAGAIN on an empty non-blocking socket)
+ */
+ssize_t recv_zerocopy_rx_t(zerocopy_rx_t *zrx, zerocopy_view_t *view) {
+    memset(view, 0, sizeof(zerocopy_view_t));
+
+    if (zrx->fallback) {
+        return copy_zerocopy_rx_t(zrx, zrx->copy_len, view);
+    }
+
+    struct tcp_zerocopy_receive zc;
+    memset(&zc, 0, sizeof(zc));
+    zc.address = (uint64_t)(uintptr_t)zrx->window;
+    zc.length = (uint32_t)zrx->window_len;
+    socklen_t zc_len = sizeof(zc);
+
+    int rc = getsockopt(zrx->fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zc_len);
+    if (rc == -1) {
+        if (errno == EINTR) {
+            return copy_zerocopy_rx_t(zrx, zrx->copy_len, view);
+        }
+        // anything else means this kernel/socket can't do it, stop trying
+        LOGF_DEBUG(zrx->thl, 0, "zerocopy receive failed, using recv: %s",
+                   strerror(errno));
+        zrx->fallback = true;
+        munmap(zrx->window, zrx->window_len);
+        zrx->window = NULL;
+        zrx->window_len = 0;
+        return copy_zerocopy_rx_t(zrx, zrx->copy_len, view);
+    }
+
+    if (zc.length > 0) {
+        view->mapped = zrx->window;
+        view->mapped_len = zc.length;
+        zrx->mapped_bytes += zc.length;
+    }
+
+    // the unaligned remainder the kernel could not map. when nothing at all was
+    // mapped we also go through recv, which blocks or reports EOF/EAGAIN for us
+    if (zc.recv_skip_hint > 0 || zc.length == 0) {
+        size_t want = zc.recv_skip_hint > 0 ? zc.recv_skip_hint : zrx->copy_len;
+        ssize_t n = copy_zerocopy_rx_t(zrx, want, view);
+        if (n <= 0 && zc.length == 0) {
+            return n;
+        }
+    }
+
+    return (ssize_t)(view->mapped_len + view->copied_len);
+}
+
+/*!
+ * @brief free up all resources allocated for the zerocopy_rx_t struct
+ * @note this unmaps the window but does not close the socket
+ */
+void free_zerocopy_rx_t(zerocopy_rx_t *zrx) {
+    if (zrx->window != NULL) {
+        munmap(zrx->window, zrx->window_len);
+    }
+    free(zrx->copy_buf);
+    free(zrx);
+}
@@ -0,0 +1,95 @@
+// Copyright 2020 Bonedaddy (Alexandre Trottier)
+//
+// licensed under GNU AFFERO GENERAL PUBLIC LICENSE;
+// you may not use this file except in compliance with the License;
+// You may obtain the license via the LICENSE file in the repository root;
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*! @file zerocopy.h
+ * @brief mmap based receive path for tcp sockets
+ * @details uses getsockopt(TCP_ZEROCOPY_RECEIVE) to map received payload pages
+ * straight into a window of our address space. whatever the kernel cannot map
+ * (partial pages, headers it told us to skip) is read with recv into a copy
+ * buffer. if the kernel or socket does not support zerocopy receive at all, the
+ * receiver quietly falls back to recv for everything
+ */
+
+#pragma once
+
+#include "deps/ulog/logger.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*!
+ * @brief default size of the mmap receive window, must be a multiple of the page
+ * size
+ */
+#ifndef ZEROCOPY_WINDOW_SIZE
+#define ZEROCOPY_WINDOW_SIZE 2097152
+#endif
+
+/*!
+ * @brief size of the buffer used for bytes that could not be mapped
+ */
+#ifndef ZEROCOPY_COPY_SIZE
+#define ZEROCOPY_COPY_SIZE 65536
+#endif
+
+/*!
+ * @brief the data made available by a single recv_zerocopy_rx_t call
+ * @details mapped bytes precede copied bytes in the stream. both pointers are
+ * only valid until the next call to recv_zerocopy_rx_t
+ */
+typedef struct zerocopy_view {
+    void *mapped;
+    size_t mapped_len;
+    void *copied;
+    size_t copied_len;
+} zerocopy_view_t;
+
+/*!
+ * @brief receive state for a tcp socket using zerocopy receive
+ */
+typedef struct zerocopy_rx {
+    int fd;
+    void *window;
+    size_t window_len;
+    char *copy_buf;
+    size_t copy_len;
+    bool fallback;       /*! @brief true once the kernel has refused zerocopy */
+    size_t mapped_bytes; /*! @brief total bytes received through the mapping */
+    size_t copied_bytes; /*! @brief total bytes received through recv */
+    thread_logger *thl;
+} zerocopy_rx_t;
+
+/*!
+ * @brief allocates memory for, and initializes a new zerocopy_rx_t object
+ * @param fd a connected tcp socket, typically returned by accept_socket
+ * @param window_len size of the mmap window, 0 uses ZEROCOPY_WINDOW_SIZE
+ * @return Success: pointer to instance of zerocopy_rx_t
+ * @return Failure: NULL ptr
+ */
+zerocopy_rx_t *new_zerocopy_rx_t(thread_logger *thl, int fd, size_t window_len);
+
+/*!
+ * @brief receives the next chunk of the stream
+ * @details maps as many whole pages as the kernel allows, then reads any bytes
+ * it asked us to skip with recv. if nothing could be mapped this waits with recv
+ * according to the blocking mode of the socket
+ * @param view filled in with the received data
+ * @return Success: number of bytes in view, 0 on EOF
+ * @return Failure: -1 with errno set (EAGAIN on an empty non-blocking socket)
+ */
+ssize_t recv_zerocopy_rx_t(zerocopy_rx_t *zrx, zerocopy_view_t *view);
+
+/*!
+ * @brief free up all resources allocated for the zerocopy_rx_t struct
+ * @note this unmaps the window but does not close the socket
+ */
+void free_zerocopy_rx_t(zerocopy_rx_t *zrx);